@@ -103,7 +103,25 @@ OPTIMIZATIONS="
 -fversion-loops-for-strides
 "
 
-COMMON_ARGS="-std=gnu++17 callstack.cpp $OPTIMIZATIONS peggml.cpp -static-libgcc -static-libstdc++ -pthread -Wl,-Bstatic -lpthread -Wl,-Bdynamic"
+COMMON_ARGS="-std=gnu++17 -I. callstack.cpp $OPTIMIZATIONS peggml.cpp -static-libgcc -static-libstdc++ -pthread -Wl,-Bstatic -lpthread -Wl,-Bdynamic"
+
+# grammar code generator; compiles grammars/*.peg into static_grammars.h
+if command -v g++ && [ "$PEGGML_BUILD_CODEGEN" != "0" ]
+then
+    echo "building peggml_codegen..."
+    g++ -std=gnu++17 -O2 peggml_codegen.cpp -o peggml_codegen
+    if ls grammars/*.peg > /dev/null 2>&1
+    then
+        echo "generating static grammars..."
+        echo "// Generated by build.sh -- do not edit." > static_grammars.h
+        for peg in grammars/*.peg
+        do
+            name=$(basename "$peg" .peg)
+            ./peggml_codegen "$peg" "$name" "grammars/$name.h"
+            echo "#include \"grammars/$name.h\"" >> static_grammars.h
+        done
+    fi
+fi
 
 # build linux
 if command -v g++ && [ "$PEGGML_BUILD_GCC" != "0" ]
@@ -19,6 +19,7 @@ void callstack::begin(std::function<void()> fn)
     }
 
     m_state = CS_SUSPENDED;
+    m_segment_count = 0;
 
     // run _begin, which will do all of the following:
     // - set stack pointers to the member stack.
@@ -72,11 +73,69 @@ void callstack::yield()
     }
 }
 
+void callstack::ensure_stack(const std::function<void()>& fn, size_t reserve, size_t segment_size)
+{
+    volatile char sp = 0;
+    if (stack_remaining(&sp) >= reserve)
+    {
+        fn();
+        return;
+    }
+
+    if (m_segment_count == m_segments.size())
+    {
+        m_segments.emplace_back(new segment());
+    }
+    segment& seg = *m_segments[m_segment_count];
+    if (seg.memory.size() < segment_size)
+    {
+        seg.memory.resize(segment_size);
+    }
+    seg.fn = &fn;
+    seg.error = nullptr;
+    ++m_segment_count;
+
+    // run _run_segment on the new segment, which longjmps back here when done.
+    if (!setjmp(seg.env))
+    {
+        static callstack* volatile s_cs;
+        s_cs = this;
+        _switch_stack(aligned_stack_base(seg.memory), [](){ s_cs->_run_segment(); });
+    }
+
+    --m_segment_count;
+
+    // exceptions cannot unwind across the stack switch, so they are carried over.
+    if (seg.error)
+    {
+        std::exception_ptr error = seg.error;
+        seg.error = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+size_t callstack::stack_remaining(const volatile void* sp) const
+{
+    const std::vector<char>& memory = m_segment_count
+        ? m_segments[m_segment_count - 1]->memory
+        : m_array;
+    uintptr_t p = reinterpret_cast<uintptr_t>(sp);
+    uintptr_t begin = reinterpret_cast<uintptr_t>(memory.data());
+    uintptr_t end = begin + memory.size();
+    if (p < begin || p >= end)
+    {
+        // not running on this callstack at all.
+        return SIZE_MAX;
+    }
+    return stack_direction() ? p - begin : end - p;
+}
+
 _CALLSTACK_H_NOINLINE
-void callstack::_begin() noexcept
+void callstack::_switch_stack(volatile void* base, void (*entry)()) noexcept
 {
-    static callstack* volatile s_cs{ this };
-    // step 1: set stack pointer registers to secondary stack ------------------------
+    // locals are unreachable once the stack pointer moves.
+    static void (* volatile s_entry)();
+    s_entry = entry;
 
     // macros: see https://sourceforge.net/p/predef/wiki/Architectures/
     #if defined(__GNUC__) || defined(__clang__)
@@ -87,7 +146,7 @@ void callstack::_begin() noexcept
                 "movl %0, %%esp\n\t"
                 "movl %%esp, %%ebp"
                 : /* No outputs. */
-                : "rm" (m_stack_base)
+                : "rm" (base)
             );
         #elif defined(__x86_64__)
             #define PEGGML_ARCH_DEFINED
@@ -96,7 +155,7 @@ void callstack::_begin() noexcept
                 "movq %0, %%rsp\n\t"
                 "movq %%rsp, %%rbp"
                 : /* No outputs. */
-                : "rm" (m_stack_base)
+                : "rm" (base)
             );
         #endif
     #elif defined(_MSC_VER)
@@ -104,8 +163,8 @@ void callstack::_begin() noexcept
         #define PEGGML_ARCH_DEFINED
         // MSVC doesn't support X64 inline asm
         __asm{
-            mov m_stack_base, esp
-            mov esp, ebp
+            mov esp, base
+            mov ebp, esp
         };
         #endif
     #endif
@@ -115,11 +174,24 @@ void callstack::_begin() noexcept
     #else
         #undef PEGGML_ARCH_DEFINED
 
-        // step 2: begin function execution on secondary stack ------------------------
-        s_cs->__begin();
+        s_entry();
+
+        // entry never returns.
+        std::terminate();
     #endif
 }
 
+_CALLSTACK_H_NOINLINE
+void callstack::_begin() noexcept
+{
+    static callstack* volatile s_cs;
+    s_cs = this;
+
+    // set stack pointer registers to secondary stack, then
+    // begin function execution on it.
+    _switch_stack(m_stack_base, [](){ s_cs->__begin(); });
+}
+
 _CALLSTACK_H_NOINLINE
 void callstack::__begin()
 {
@@ -147,4 +219,18 @@ void callstack::__begin()
         longjmp(m_env_external, error ? CS_CATCH : CS_TERMINATE);
     }
 }
+_CALLSTACK_H_NOINLINE
+void callstack::_run_segment() noexcept
+{
+    segment& seg = *m_segments[m_segment_count - 1];
+    try
+    {
+        (*seg.fn)();
+    }
+    catch (...)
+    {
+        seg.error = std::current_exception();
+    }
+    longjmp(seg.env, 1);
+}
 #endif
\ No newline at end of file
@@ -4,7 +4,11 @@
 #include <array>
 #include <vector>
 #include <csetjmp>
+#include <exception>
 #include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
 
 #ifdef EMSCRIPTEN
 #include "emscripten/fiber.h"
@@ -136,11 +140,22 @@ class callstack : public callstack_base
     jmp_buf m_env_internal;
     std::function<void()> m_main;
     volatile void* m_stack_base;
+
+    // heap segments that deep recursion spills onto; see ensure_stack().
+    struct segment
+    {
+        std::vector<char> memory;
+        jmp_buf env;
+        const std::function<void()>* fn;
+        std::exception_ptr error;
+    };
+    std::vector<std::unique_ptr<segment>> m_segments; // kept for reuse
+    size_t m_segment_count = 0; // segments currently in use
     
 public:
     callstack(size_t size = 8000000)
         : callstack_base(size)
-        , m_stack_base(stack_direction() ? (m_array.data() + m_array.size() - 1) : m_array.data())
+        , m_stack_base(aligned_stack_base(m_array))
     { }
 
     // start execution; pass a std::function in to execute.
@@ -153,6 +168,22 @@ public:
     
     void yield();
 
+    // runs fn, first moving onto a new heap segment of segment_size bytes
+    // if fewer than reserve bytes of the current stack remain.
+    // this lets recursion go as deep as memory allows.
+    void ensure_stack(const std::function<void()>& fn, size_t reserve = 256000, size_t segment_size = 1000000);
+
+    // bytes of the heap segments allocated by ensure_stack(), kept for reuse.
+    size_t get_segment_bytes() const
+    {
+        size_t bytes = 0;
+        for (const auto& seg : m_segments)
+        {
+            bytes += seg->memory.size();
+        }
+        return bytes;
+    }
+
 private:
     // returns 0 if stack grows toward higher addresses, 1 if reversed.
     static bool stack_direction()
@@ -161,12 +192,35 @@ private:
         return stack_direction_helper(&a);
     }
 
+    // the stack pointer must be 16-byte aligned (SSE spills fault otherwise.)
+    static void* aligned_stack_base(std::vector<char>& memory)
+    {
+        constexpr uintptr_t alignment = 16;
+        uintptr_t begin = reinterpret_cast<uintptr_t>(memory.data());
+        uintptr_t end = begin + memory.size();
+        if (stack_direction())
+        {
+            return reinterpret_cast<void*>((end - alignment) & ~(alignment - 1));
+        }
+        else
+        {
+            return reinterpret_cast<void*>((begin + alignment) & ~(alignment - 1));
+        }
+    }
+
     static bool stack_direction_helper(volatile int* a)
     {
         volatile int b;
         return (reinterpret_cast<uintptr_t>(&b) < reinterpret_cast<uintptr_t>(a));
     }
 
+    // bytes left on the stack region currently in use.
+    size_t stack_remaining(const volatile void* sp) const;
+
+    // sets the stack pointer to base and calls entry, never returning.
+    [[noreturn]]
+    static void _switch_stack(volatile void* base, void (*entry)()) noexcept;
+
     // helper function for begin()
     // These attributes are likely not actually necessary.
     
@@ -176,6 +230,10 @@ private:
     [[noreturn]]
 
     void __begin();
+
+    // helper function for ensure_stack(); runs on the new segment.
+    [[noreturn]]
+    void _run_segment() noexcept;
 };
 
 #else
@@ -240,6 +298,17 @@ public:
         emscripten_fiber_swap(&m_fiber, &m_fiber_main);
     }
 
+    // fibers cannot be given more stack here, so this just runs fn.
+    void ensure_stack(const std::function<void()>& fn, size_t = 0, size_t = 0)
+    {
+        fn();
+    }
+
+    size_t get_segment_bytes() const
+    {
+        return 0;
+    }
+
 private:
     [[noreturn]]
     void _begin()
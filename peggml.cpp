@@ -9,6 +9,7 @@ std::mutex m;
 #include <memory>
 #include <vector>
 #include <map>
+#include <fstream>
 #include <cassert>
 
 #include "peggml.h"
@@ -42,6 +43,61 @@ namespace
 {
 	std::vector<std::unique_ptr<parser>> g_parsers;
 
+	// hashes of the parsers' grammars, by handle (see peggml_parse_cached.)
+	std::vector<uint64_t> g_parser_hashes;
+
+	// results of recent parses, by parser handle (see peggml_parser_enable_parse_cache.)
+	std::vector<std::unique_ptr<ParseCache>> g_parse_caches;
+
+	// rule counts and times of the parses, by parser handle (see peggml_parser_enable_profile.)
+	std::vector<std::unique_ptr<Profile>> g_profiles;
+
+	// latest rule invocations of the parses, by parser handle (see peggml_parser_enable_trace.)
+	std::vector<std::unique_ptr<Trace>> g_traces;
+
+	// state of the last parse that matched a grammar, measured as it ended.
+	ParseMemory g_parse_memory;
+
+	// a text edited between parses, and the rule results kept from them.
+	struct session
+	{
+		size_t parser_handle;
+		const parser* p; // (nullptr once the parser is destroyed)
+		std::string text;
+		Memo memo;
+	};
+
+	std::vector<std::unique_ptr<session>> g_sessions;
+
+	// input parsed element by element as it arrives.
+	struct stream
+	{
+		size_t parser_handle;
+		const parser* p; // (nullptr once the parser is destroyed)
+		std::unique_ptr<Stream> s;
+		size_t offset; // of the input buffered for the last feed
+		std::vector<uuid_t> elements; // completed by the last feed
+	};
+
+	std::vector<std::unique_ptr<stream>> g_streams;
+
+	// text split into records that are parsed on several threads.
+	struct parallel
+	{
+		size_t parser_handle;
+		const parser* p; // (nullptr once the parser is destroyed)
+		std::unique_ptr<ParallelParser> pp;
+		std::vector<uuid_t> elements; // records of the last parse
+	};
+
+	std::vector<std::unique_ptr<parallel>> g_parallels;
+
+	// tree and text of the last peggml_parse_flat_ast, whose rule names
+	// belong to the parser's grammar.
+	FlatAst g_ast;
+	std::string g_ast_text;
+	const parser* g_ast_parser = nullptr;
+
 	parser* _get_parser(ty_real _handle)
 	{
 		size_t handle = _handle;
@@ -54,25 +110,65 @@ namespace
 	}
 
 	#define get_parser(lvar, handle, errval) parser* lvar = _get_parser(handle); if (!lvar) return error(errval, "invalid handle idx: %d", handle)
-}
 
-handle_t
-peggml_parser_create(ty_string grammar)
-{
-	// find index for new parser
-	size_t index = g_parsers.size();
-	for (size_t i = 0; i < g_parsers.size(); ++i)
+	// stores p in a free slot of slots, returning its handle.
+	template<typename T>
+	size_t _add_handle(std::vector<std::unique_ptr<T>>& slots, std::unique_ptr<T> p)
 	{
-		if (!g_parsers[i])
+		// find index for new entry
+		size_t index = slots.size();
+		for (size_t i = 0; i < slots.size(); ++i)
 		{
-			index = i;
-			break;
+			if (!slots[i])
+			{
+				index = i;
+				break;
+			}
+		}
+		if (index == slots.size())
+		{
+			slots.emplace_back();
 		}
+		slots[index] = std::move(p);
+		return index;
+	}
+
+	size_t _add_parser(std::unique_ptr<parser> p, uint64_t grammar_hash)
+	{
+		size_t index = _add_handle(g_parsers, std::move(p));
+		g_parsers[index]->set_parse_memory(&g_parse_memory);
+		g_parser_hashes.resize(g_parsers.size());
+		g_parser_hashes[index] = grammar_hash;
+		g_parse_caches.resize(g_parsers.size());
+		g_profiles.resize(g_parsers.size());
+		g_traces.resize(g_parsers.size());
+		return index;
 	}
-	if (index == g_parsers.size())
+
+	// grammars compiled ahead of time by peggml_codegen, by name.
+	struct static_grammar_t
+	{
+		std::unique_ptr<parser> (*make_parser)();
+		uint64_t grammar_hash;
+		const char* source;
+	};
+	std::map<std::string, static_grammar_t>& static_grammars()
 	{
-		g_parsers.emplace_back();
+		static std::map<std::string, static_grammar_t> grammars;
+		return grammars;
 	}
+}
+
+// static_grammars.h (optional) should include the headers generated by peggml_codegen.
+#define PEGGML_REGISTER_STATIC_GRAMMAR(id) \
+	namespace { const bool glue(_peggml_static_grammar_, id) = (static_grammars()[peggml_grammar_##id::name] = static_grammar_t{ peggml_grammar_##id::make_parser, peggml_grammar_##id::grammar_hash, peggml_grammar_##id::source }, true); }
+#if __has_include("static_grammars.h")
+	#include "static_grammars.h"
+#endif
+
+handle_t
+peggml_parser_create(ty_string grammar)
+{
 	std::unique_ptr<parser> p(new parser());
 
 	std::stringstream errlog;
@@ -83,6 +179,10 @@ peggml_parser_create(ty_string grammar)
 
 	auto ok = p->load_grammar(grammar);
 
+	// errlog goes out of scope, and parse errors are not reported through
+	// the log anyway (this also lets the parser skip error bookkeeping.)
+	p->log = nullptr;
+
 	if (!ok || !*p)
 	{
 		std::string errstr = errlog.str();
@@ -97,264 +197,3262 @@ peggml_parser_create(ty_string grammar)
 	}
 	else
 	{
-		g_parsers[index] = std::move(p);
-		return index;
+		return _add_parser(std::move(p), fnv1a(grammar, strlen(grammar)));
 	}
 }
 
-ty_real
-peggml_parser_enable_packrat(handle_t handle)
+handle_t
+peggml_parser_create_static(ty_string name)
 {
-	get_parser(p, handle, 1);
+	if (name == nullptr)
+	{
+		return error(-3, "argument string is nullptr");
+	}
 
-	p->enable_packrat_parsing();
+	auto iter = static_grammars().find(name);
+	if (iter == static_grammars().end())
+	{
+		return error(-1, "no static grammar named \"%s\"", name);
+	}
 
-	return 0;
+	return _add_parser(iter->second.make_parser(), iter->second.grammar_hash);
 }
 
-// Destroy grammar syntax
-// (returns 0 on success)
 ty_real
-peggml_parser_destroy(handle_t _handle)
+peggml_parser_enable_packrat(handle_t handle)
 {
-	size_t handle = handle;
-	if (g_parsers.size() <= handle || !g_parsers[handle])
-	{
-		return error(1, "invalid handle %d", _handle);
-	}
+	get_parser(p, handle, 1);
 
-	g_parsers[handle].reset();
+	p->enable_packrat_parsing();
 
 	return 0;
 }
 
-namespace
+ty_real
+peggml_parser_enable_parse_cache(handle_t handle, ty_real budget)
 {
-	bool g_parse_in_progress = false;
-	std::string g_parse_text;
-	std::unique_ptr<callstack> _g_parse_cs_ptr;
-
-	// return callstack, allocating one if none exists.
-	callstack& get_parse_cs()
+	if (budget < 0)
 	{
-		if (!_g_parse_cs_ptr)
-		{
-			_g_parse_cs_ptr.reset(new callstack());
-		}
-
-		return *_g_parse_cs_ptr.get();
+		return error(2, "cache budget cannot be negative");
 	}
 
-	#define g_parse_cs get_parse_cs()
-
-	// suspended parse context
-	const SemanticValues* g_sv;
-	symbol_id_t g_symbol_id;
-	uint32_t g_uuid = 0;
-	uuid_t g_root_uuid = -1;
-}
+	get_parser(p, handle, 1);
 
-// sets secondary callstack/fiber size
-ty_real
-peggml_set_stack_size(ty_real size)
-{
-	if (g_parse_in_progress) return error(1, "cannot set peggml stack size -- parse in progress.");
-	if (size <= 0) return error(2, "peggml stack size must be positive");
-	try
+	auto& cache = g_parse_caches[static_cast<size_t>(handle)];
+	if (budget == 0)
 	{
-		_g_parse_cs_ptr.reset(new callstack(static_cast<size_t>(size)));
-		if (!_g_parse_cs_ptr)
-		{
-			return error(3, "error allocating stack");
-		}
+		cache.reset();
 	}
-	catch (...)
+	else
 	{
-		return error(4, "error allocating stack");
+		cache.reset(new ParseCache(*p, static_cast<size_t>(budget)));
 	}
+
 	return 0;
 }
 
-ty_real peggml_set_stack_size()
+ty_real
+peggml_parser_get_cache_hits(handle_t handle)
 {
-	return get_parse_cs().get_stack_size();
-}
+	get_parser(p, handle, -1);
 
-external ty_real
-peggml_stack_current_depth()
-{
-	return g_parse_cs.current_stack_depth();
+	auto& cache = g_parse_caches[static_cast<size_t>(handle)];
+	return cache ? cache->hits() : 0;
 }
 
-external ty_real
-peggml_estimate_stack_usage()
+ty_real
+peggml_parser_get_cache_misses(handle_t handle)
 {
-	return g_parse_cs.estimate_stack_depth();
+	get_parser(p, handle, -1);
+
+	auto& cache = g_parse_caches[static_cast<size_t>(handle)];
+	return cache ? cache->misses() : 0;
 }
 
-ty_real
-peggml_parser_set_symbol_id(handle_t handle, ty_string symbol, symbol_id_t symbol_id)
+ty_string
+peggml_parser_analyze(handle_t handle)
 {
-	if (symbol_id == 0)
-	{
-		return error(2, "cannot set symbol id to 0.");
-	}
+	get_parser(p, handle, "");
 
-	if (symbol == nullptr)
+	std::string report;
+	for (const GrammarHazard& hazard : p->analyze())
 	{
-		return error(3, "argument string is nullptr");
+		report += hazard.rule + ": " + hazard.kind_name() + ": " + hazard.message + "\n";
 	}
 
-	get_parser(p, handle, 1);
-
-	(*p)[symbol] = [symbol_id](const SemanticValues& sv) -> uuid_t {
-		g_sv = &sv;
-		// we could store 'symbol', but lazy...
-		g_symbol_id = symbol_id;
-		g_parse_cs.yield();
-		return g_uuid++;
-	};
-
-	return 0;
+	return STORE_STRING(report);
 }
 
 ty_real
-peggml_parse_begin(handle_t handle, ty_string _text)
+peggml_parser_enable_profile(handle_t handle, ty_real mode)
 {
-	if (g_parse_in_progress)
+	if (mode != 0 && mode != 1 && mode != 2)
 	{
-		return error(-1, "parse already in progress.");
+		return error(2, "invalid profile mode %d", mode);
 	}
 
-	// copy to static location for permanent access even after setjmp/longjmp
-	g_parse_text = _text;
+	get_parser(p, handle, 1);
 
-	get_parser(p, handle, -2);
+	auto& profile = g_profiles[static_cast<size_t>(handle)];
+	p->set_profile(nullptr);
+	if (mode == 0)
+	{
+		profile.reset();
+		return 0;
+	}
+
+	profile.reset(new Profile());
+	if (mode == 2)
+	{
+		p->set_instrumentation(p->instrumentation() | Instrumentation::counters);
+	}
+	p->set_profile(profile.get());
 
-	g_parse_cs.begin([p, text=g_parse_text.c_str()](){
-		p->parse(text, g_root_uuid, nullptr);
-		g_parse_in_progress = false;
-	});
-	
 	return 0;
 }
 
-ty_real
-peggml_parse_next()
+namespace
 {
-	if (g_parse_cs.resume())
-	{
-		return g_symbol_id;
-	}
-	else
+	const Profile::Stats* _get_profile_stats(handle_t _handle, ty_real _index)
 	{
-		if (g_parse_cs.is_error())
+		size_t handle = _handle;
+		if (g_parsers.size() <= handle || !g_parsers[handle])
 		{
-			return error(-1, "exception during parse: %s", g_parse_cs.error_what());
+			return error(nullptr, "invalid handle %d", _handle);
 		}
-		return 0;
+
+		const Profile* profile = g_profiles[handle].get();
+		if (!profile)
+		{
+			return error(nullptr, "profiling is not enabled for parser %d", _handle);
+		}
+
+		size_t index = _index;
+		if (_index < 0 || profile->rules().size() <= index)
+		{
+			return error(nullptr, "invalid profile index %d", _index);
+		}
+
+		return &profile->rules()[index];
+	}
+
+	double _microseconds(std::chrono::nanoseconds t)
+	{
+		return std::chrono::duration<double, std::micro>(t).count();
 	}
 }
 
+#define get_profile_stats(lvar, handle, index, errval) const Profile::Stats* lvar = _get_profile_stats(handle, index); if (!lvar) return errval
+
 ty_real
-peggml_parse_elt_get_uuid()
+peggml_profile_get_rule_count(handle_t handle)
 {
-	return static_cast<uuid_t>(g_uuid);
+	get_parser(p, handle, -1);
+
+	const Profile* profile = g_profiles[static_cast<size_t>(handle)].get();
+	return profile ? profile->rules().size() : 0;
 }
 
 ty_string
-peggml_parse_elt_get_string()
+peggml_profile_get_name(handle_t handle, ty_real index)
 {
-	return STORE_STRING(g_sv->sv());
+	get_profile_stats(stats, handle, index, "");
+	return stats->rule->name.c_str();
 }
 
 ty_real
-peggml_parse_elt_get_string_offset()
+peggml_profile_get_invocations(handle_t handle, ty_real index)
 {
-	return g_sv->sv().data() - g_sv->ss;
+	get_profile_stats(stats, handle, index, -1);
+	return stats->invocations;
 }
 
 ty_real
-peggml_parse_elt_get_string_line()
+peggml_profile_get_successes(handle_t handle, ty_real index)
 {
-	return g_sv->line_info().first;
+	get_profile_stats(stats, handle, index, -1);
+	return stats->successes;
 }
 
 ty_real
-peggml_parse_elt_get_string_column()
+peggml_profile_get_failures(handle_t handle, ty_real index)
 {
-	return g_sv->line_info().second;
+	get_profile_stats(stats, handle, index, -1);
+	return stats->failures;
 }
 
 ty_real
-peggml_parse_elt_get_choice()
+peggml_profile_get_memo_hits(handle_t handle, ty_real index)
 {
-	return g_sv->choice();
+	get_profile_stats(stats, handle, index, -1);
+	return stats->memo_hits;
 }
 
-#define RANGE_CHECK(i, container, rvalue) \
-	if (i < 0 || i >= (container).size()) \
-		{ return error(rvalue, "index out of bounds"); }
-
-index_t
-peggml_parse_elt_get_child_count()
+ty_real
+peggml_profile_get_memo_misses(handle_t handle, ty_real index)
 {
-	return g_sv->size();
+	get_profile_stats(stats, handle, index, -1);
+	return stats->memo_misses;
 }
 
 ty_real
-peggml_parse_elt_get_child_uuid(index_t _i)
+peggml_profile_get_bytes(handle_t handle, ty_real index)
 {
-	size_t i = _i;
-	RANGE_CHECK(i, *g_sv, -1);
-	return std::any_cast<uuid_t>(g_sv->at(i));
+	get_profile_stats(stats, handle, index, -1);
+	return stats->bytes;
 }
 
-index_t
-peggml_parse_elt_get_token_count()
+ty_real
+peggml_profile_get_inclusive_time(handle_t handle, ty_real index)
 {
-	return g_sv->tokens.size();
+	get_profile_stats(stats, handle, index, -1);
+	return _microseconds(stats->inclusive);
 }
 
 ty_real
-peggml_parse_elt_get_token_offset(index_t _i)
+peggml_profile_get_exclusive_time(handle_t handle, ty_real index)
 {
-	size_t i = _i;
-	RANGE_CHECK(i, g_sv->tokens, 0);
-	return g_sv->token(i).data() - g_sv->ss;
+	get_profile_stats(stats, handle, index, -1);
+	return _microseconds(stats->exclusive);
 }
 
 ty_string
-peggml_parse_elt_get_token_string(index_t _i)
+peggml_profile_dump_csv(handle_t handle)
 {
-	size_t i = _i;
-	RANGE_CHECK(i, g_sv->tokens, "");
-	return STORE_STRING(g_sv->token(i));
+	get_parser(p, handle, "");
+
+	std::string dump = "rule,invocations,successes,failures,memo_hits,memo_misses,bytes,inclusive_us,exclusive_us\n";
+	if (const Profile* profile = g_profiles[static_cast<size_t>(handle)].get())
+	{
+		for (const Profile::Stats& stats : profile->rules())
+		{
+			dump += stats.rule->name + strprintf(
+				",%zu,%zu,%zu,%zu,%zu,%zu,%.3f,%.3f\n",
+				stats.invocations, stats.successes, stats.failures, stats.memo_hits,
+				stats.memo_misses, stats.bytes, _microseconds(stats.inclusive),
+				_microseconds(stats.exclusive)
+			);
+		}
+	}
+
+	return STORE_STRING(dump);
+}
+
+ty_string
+peggml_profile_dump_json(handle_t handle)
+{
+	get_parser(p, handle, "");
+
+	std::string dump = "[";
+	if (const Profile* profile = g_profiles[static_cast<size_t>(handle)].get())
+	{
+		for (const Profile::Stats& stats : profile->rules())
+		{
+			// (rule names are identifiers, so they need no escaping.)
+			dump += std::string(dump.size() > 1 ? "," : "") + "{\"rule\":\"" + stats.rule->name + strprintf(
+				"\",\"invocations\":%zu,\"successes\":%zu,\"failures\":%zu,"
+				"\"memo_hits\":%zu,\"memo_misses\":%zu,\"bytes\":%zu,"
+				"\"inclusive_us\":%.3f,\"exclusive_us\":%.3f}",
+				stats.invocations, stats.successes, stats.failures, stats.memo_hits,
+				stats.memo_misses, stats.bytes, _microseconds(stats.inclusive),
+				_microseconds(stats.exclusive)
+			);
+		}
+	}
+	dump += "]";
+
+	return STORE_STRING(dump);
 }
 
 ty_real
-peggml_parse_elt_get_token_number()
+peggml_parser_enable_trace(handle_t handle, ty_real capacity)
 {
-	try
+	if (capacity < 0)
 	{
-		return g_sv->token_to_number<ty_real>();
+		return error(2, "trace capacity cannot be negative");
 	}
-	catch(...)
+
+	get_parser(p, handle, 1);
+
+	auto& trace = g_traces[static_cast<size_t>(handle)];
+	if (capacity == 0)
 	{
-		return error(0, "error occurred parsing number from token");
+		trace.reset();
 	}
+	else
+	{
+		trace.reset(new Trace(static_cast<size_t>(capacity)));
+	}
+	p->set_trace(trace.get());
+
+	return 0;
 }
 
-external uuid_t
-peggml_get_root_uuid()
+ty_real
+peggml_trace_get_event_count(handle_t handle)
 {
-	return g_root_uuid;
+	get_parser(p, handle, -1);
+
+	const Trace* trace = g_traces[static_cast<size_t>(handle)].get();
+	return trace ? trace->size() : 0;
 }
 
-#ifndef PEGGML_IS_DLL
+ty_real
+peggml_trace_get_dropped(handle_t handle)
+{
+	get_parser(p, handle, -1);
 
-int main(int argc, char** argv)
+	const Trace* trace = g_traces[static_cast<size_t>(handle)].get();
+	return trace ? trace->dropped() : 0;
+}
+
+ty_real
+peggml_trace_clear(handle_t handle)
 {
+	get_parser(p, handle, 1);
+
+	if (Trace* trace = g_traces[static_cast<size_t>(handle)].get())
+	{
+		trace->clear();
+	}
+
+	return 0;
+}
+
+ty_real
+peggml_trace_save(handle_t handle, ty_string path)
+{
+	if (path == nullptr)
+	{
+		return error(3, "argument string is nullptr");
+	}
+
+	get_parser(p, handle, 1);
+
+	const Trace* trace = g_traces[static_cast<size_t>(handle)].get();
+	if (!trace)
+	{
+		return error(2, "tracing is not enabled for parser %d", handle);
+	}
+
+	std::ofstream out(path, std::ios::binary);
+	trace->write_chrome_json(out);
+	out.close();
+	if (!out)
+	{
+		return error(4, "could not write trace to %s", path);
+	}
+
+	return 0;
+}
+
+ty_real
+peggml_parser_set_max_depth(handle_t handle, ty_real depth)
+{
+	if (depth < 0)
+	{
+		return error(2, "max depth cannot be negative");
+	}
+
+	get_parser(p, handle, 1);
+
+	p->set_max_depth(static_cast<size_t>(depth));
+
+	return 0;
+}
+
+// Destroy grammar syntax
+// (returns 0 on success)
+ty_real
+peggml_parser_destroy(handle_t _handle)
+{
+	size_t handle = _handle;
+	if (g_parsers.size() <= handle || !g_parsers[handle])
+	{
+		return error(1, "invalid handle %d", _handle);
+	}
+
+	for (auto& s : g_sessions)
+	{
+		if (s && s->p == g_parsers[handle].get())
+		{
+			s->p = nullptr;
+		}
+	}
+
+	for (auto& s : g_streams)
+	{
+		if (s && s->p == g_parsers[handle].get())
+		{
+			s->p = nullptr;
+		}
+	}
+
+	for (auto& pl : g_parallels)
+	{
+		if (pl && pl->p == g_parsers[handle].get())
+		{
+			pl->p = nullptr;
+		}
+	}
+
+	if (g_ast_parser == g_parsers[handle].get())
+	{
+		g_ast = FlatAst();
+		g_ast_parser = nullptr;
+	}
+
+	g_parse_caches[handle].reset();
+	g_profiles[handle].reset();
+	g_traces[handle].reset();
+	g_parsers[handle].reset();
+
+	return 0;
+}
+
+namespace
+{
+	bool g_parse_in_progress = false;
+	std::string g_parse_text;
+	std::unique_ptr<callstack> _g_parse_cs_ptr;
+
+	// return callstack, allocating one if none exists.
+	callstack& get_parse_cs()
+	{
+		if (!_g_parse_cs_ptr)
+		{
+			_g_parse_cs_ptr.reset(new callstack());
+		}
+
+		return *_g_parse_cs_ptr.get();
+	}
+
+	#define g_parse_cs get_parse_cs()
+
+	// suspended parse context
+	const SemanticValues* g_sv;
+	symbol_id_t g_symbol_id;
+	uint32_t g_uuid = 0;
+	uuid_t g_root_uuid = -1;
+
+	session* _get_session(ty_real _handle)
+	{
+		size_t handle = _handle;
+		if (g_sessions.size() <= handle || !g_sessions[handle])
+		{
+			return error(nullptr, "invalid session handle %d", _handle);
+		}
+
+		return g_sessions[handle].get();
+	}
+
+	stream* _get_stream(ty_real _handle)
+	{
+		size_t handle = _handle;
+		if (g_streams.size() <= handle || !g_streams[handle])
+		{
+			return error(nullptr, "invalid stream handle %d", _handle);
+		}
+
+		return g_streams[handle].get();
+	}
+
+	parallel* _get_parallel(ty_real _handle)
+	{
+		size_t handle = _handle;
+		if (g_parallels.size() <= handle || !g_parallels[handle])
+		{
+			return error(nullptr, "invalid parallel parser handle %d", _handle);
+		}
+
+		return g_parallels[handle].get();
+	}
+
+	// deep nesting continues on fresh heap segments rather than overflowing.
+	void _set_stack_guard(parser* p)
+	{
+		p->set_stack_guard([](const std::function<void()>& fn){
+			g_parse_cs.ensure_stack(fn);
+		});
+	}
+
+	// parses g_parse_text on the callstack, reusing results from memo if given.
+	void _parse_begin(parser* p, Memo* memo)
+	{
+		_set_stack_guard(p);
+		p->set_memo(memo);
+
+		g_parse_cs.begin([p, text=g_parse_text.c_str()](){
+			p->parse(text, g_root_uuid, nullptr);
+			g_parse_in_progress = false;
+		});
+	}
+}
+
+// sets secondary callstack/fiber size
+ty_real
+peggml_set_stack_size(ty_real size)
+{
+	if (g_parse_in_progress) return error(1, "cannot set peggml stack size -- parse in progress.");
+	if (size <= 0) return error(2, "peggml stack size must be positive");
+	try
+	{
+		_g_parse_cs_ptr.reset(new callstack(static_cast<size_t>(size)));
+		if (!_g_parse_cs_ptr)
+		{
+			return error(3, "error allocating stack");
+		}
+	}
+	catch (...)
+	{
+		return error(4, "error allocating stack");
+	}
+	return 0;
+}
+
+ty_real
+peggml_get_stack_size()
+{
+	return get_parse_cs().get_stack_size();
+}
+
+external ty_real
+peggml_stack_current_depth()
+{
+	return g_parse_cs.current_stack_depth();
+}
+
+external ty_real
+peggml_estimate_stack_usage()
+{
+	return g_parse_cs.estimate_stack_depth();
+}
+
+external ty_real
+peggml_memory_get_callstack_reserved()
+{
+	// (the callstack is allocated by the first parse.)
+	if (!_g_parse_cs_ptr)
+	{
+		return 0;
+	}
+	return _g_parse_cs_ptr->get_stack_size() + _g_parse_cs_ptr->get_segment_bytes();
+}
+
+external ty_real
+peggml_memory_get_callstack_committed()
+{
+	if (!_g_parse_cs_ptr)
+	{
+		return 0;
+	}
+	return _g_parse_cs_ptr->estimate_stack_depth() + _g_parse_cs_ptr->get_segment_bytes();
+}
+
+external ty_real
+peggml_memory_get_packrat_bytes()
+{
+	return g_parse_memory.packrat_bytes;
+}
+
+external ty_real
+peggml_memory_get_memo_bytes()
+{
+	size_t bytes = 0;
+	for (const auto& s : g_sessions)
+	{
+		if (s)
+		{
+			bytes += s->memo.bytes();
+		}
+	}
+	return bytes;
+}
+
+external ty_real
+peggml_memory_get_parse_cache_bytes()
+{
+	size_t bytes = 0;
+	for (const auto& cache : g_parse_caches)
+	{
+		if (cache)
+		{
+			bytes += cache->bytes();
+		}
+	}
+	return bytes;
+}
+
+external ty_real
+peggml_memory_get_value_stack_frames()
+{
+	return g_parse_memory.value_stack_frames;
+}
+
+external ty_real
+peggml_memory_get_value_stack_bytes()
+{
+	return g_parse_memory.value_stack_bytes;
+}
+
+external ty_real
+peggml_memory_get_capture_scope_bytes()
+{
+	return g_parse_memory.capture_scope_bytes;
+}
+
+ty_real
+peggml_memory_get_grammar_bytes(handle_t handle)
+{
+	get_parser(p, handle, -1);
+
+	return p->grammar_bytes();
+}
+
+external ty_real
+peggml_memory_get_string_buffer_bytes()
+{
+	return g_str_return.capacity();
+}
+
+external ty_string
+peggml_get_memory_stats()
+{
+	size_t grammar_bytes = 0;
+	for (const auto& p : g_parsers)
+	{
+		if (p)
+		{
+			grammar_bytes += p->grammar_bytes();
+		}
+	}
+
+	std::string stats = strprintf(
+		"{\"callstack_reserved\":%.0f,\"callstack_committed\":%.0f,"
+		"\"packrat_bytes\":%zu,\"memo_bytes\":%.0f,\"parse_cache_bytes\":%.0f,"
+		"\"value_stack_frames\":%zu,\"value_stack_bytes\":%zu,"
+		"\"capture_scope_bytes\":%zu,\"grammar_bytes\":%zu,\"string_buffer_bytes\":%zu}",
+		peggml_memory_get_callstack_reserved(), peggml_memory_get_callstack_committed(),
+		g_parse_memory.packrat_bytes, peggml_memory_get_memo_bytes(), peggml_memory_get_parse_cache_bytes(),
+		g_parse_memory.value_stack_frames, g_parse_memory.value_stack_bytes,
+		g_parse_memory.capture_scope_bytes, grammar_bytes, g_str_return.capacity()
+	);
+	return STORE_STRING(stats);
+}
+
+ty_real
+peggml_parser_set_symbol_id(handle_t handle, ty_string symbol, symbol_id_t symbol_id)
+{
+	if (symbol_id == 0)
+	{
+		return error(2, "cannot set symbol id to 0.");
+	}
+
+	if (symbol == nullptr)
+	{
+		return error(3, "argument string is nullptr");
+	}
+
+	get_parser(p, handle, 1);
+
+	// (cached parses did not put off the actions of rules that had none.)
+	if (auto& cache = g_parse_caches[static_cast<size_t>(handle)])
+	{
+		cache->clear();
+	}
+
+	(*p)[symbol] = [symbol_id](const SemanticValues& sv) -> uuid_t {
+		g_sv = &sv;
+		// we could store 'symbol', but lazy...
+		g_symbol_id = symbol_id;
+		g_parse_cs.yield();
+		return g_uuid++;
+	};
+
+	return 0;
+}
+
+ty_real
+peggml_parse_begin(handle_t handle, ty_string _text)
+{
+	if (g_parse_in_progress)
+	{
+		return error(-1, "parse already in progress.");
+	}
+
+	// copy to static location for permanent access even after setjmp/longjmp
+	g_parse_text = _text;
+
+	get_parser(p, handle, -2);
+
+	if (ParseCache* cache = g_parse_caches[static_cast<size_t>(handle)].get())
+	{
+		// a text parsed recently has its handlers run again without being matched.
+		_set_stack_guard(p);
+		g_parse_cs.begin([cache](){
+			cache->parse(g_parse_text, g_root_uuid);
+			g_parse_in_progress = false;
+		});
+		return 0;
+	}
+
+	_parse_begin(p, nullptr);
+	
+	return 0;
+}
+
+handle_t
+peggml_session_create(handle_t handle)
+{
+	get_parser(p, handle, -1);
+
+	if (p->uses_captures())
+	{
+		return error(-2, "grammar cannot be edited incrementally; it has captures or back references");
+	}
+
+	std::unique_ptr<session> s(new session());
+	s->parser_handle = handle;
+	s->p = p;
+	return _add_handle(g_sessions, std::move(s));
+}
+
+ty_real
+peggml_session_destroy(handle_t handle)
+{
+	if (!_get_session(handle))
+	{
+		return error(1, "invalid session handle %d", handle);
+	}
+
+	g_sessions[static_cast<size_t>(handle)].reset();
+
+	return 0;
+}
+
+ty_real
+peggml_parse_edit(handle_t handle, ty_real _offset, ty_real _removed_len, ty_string inserted_text)
+{
+	if (g_parse_in_progress)
+	{
+		return error(-1, "parse already in progress.");
+	}
+
+	session* s = _get_session(handle);
+	if (!s)
+	{
+		return error(-2, "invalid session handle %d", handle);
+	}
+
+	if (!s->p)
+	{
+		return error(-3, "session's parser was destroyed");
+	}
+	parser* p = g_parsers[s->parser_handle].get();
+
+	if (_offset < 0 || _removed_len < 0 || _offset + _removed_len > s->text.size())
+	{
+		return error(-4, "edit out of range");
+	}
+
+	if (inserted_text == nullptr)
+	{
+		return error(-5, "argument string is nullptr");
+	}
+
+	size_t offset = _offset;
+	size_t removed_len = _removed_len;
+	size_t inserted_len = strlen(inserted_text);
+	s->text.replace(offset, removed_len, inserted_text, inserted_len);
+	s->memo.edit(offset, removed_len, inserted_len);
+
+	g_parse_text = s->text;
+
+	_parse_begin(p, &s->memo);
+
+	return 0;
+}
+
+handle_t
+peggml_stream_create(handle_t handle, ty_real max_buffer)
+{
+	get_parser(p, handle, -1);
+
+	if (max_buffer <= 0)
+	{
+		return error(-2, "stream buffer size must be positive");
+	}
+
+	std::unique_ptr<stream> st(new stream());
+	st->parser_handle = handle;
+	st->p = p;
+	st->offset = 0;
+	st->s.reset(new Stream(*p, [s=st.get()](Value& val, size_t, size_t) {
+		s->elements.push_back(val.has_value() ? val.get<uuid_t>() : -1);
+	}, static_cast<size_t>(max_buffer)));
+	if (!*st->s)
+	{
+		return error(-3, "grammar cannot be streamed; its start rule must be of the form Element* (or Element* !.), without back references");
+	}
+
+	return _add_handle(g_streams, std::move(st));
+}
+
+ty_real
+peggml_stream_destroy(handle_t handle)
+{
+	if (!_get_stream(handle))
+	{
+		return error(1, "invalid stream handle %d", handle);
+	}
+
+	g_streams[static_cast<size_t>(handle)].reset();
+
+	return 0;
+}
+
+namespace
+{
+	// parses input given to the stream on the callstack (the rest of it if final.)
+	ty_real _stream_begin(handle_t handle, ty_string chunk, bool final)
+	{
+		if (g_parse_in_progress)
+		{
+			return error(-1, "parse already in progress.");
+		}
+
+		stream* st = _get_stream(handle);
+		if (!st)
+		{
+			return error(-2, "invalid stream handle %d", handle);
+		}
+
+		if (!st->p)
+		{
+			return error(-3, "stream's parser was destroyed");
+		}
+
+		if (chunk == nullptr)
+		{
+			return error(-4, "argument string is nullptr");
+		}
+
+		g_parse_text = chunk;
+		st->elements.clear();
+		st->offset = st->s->offset();
+
+		_set_stack_guard(g_parsers[st->parser_handle].get());
+
+		g_parse_cs.begin([st, final](){
+			bool ok = final
+				? st->s->finish()
+				: st->s->feed(g_parse_text.data(), g_parse_text.size());
+			if (!ok)
+			{
+				error(0, "stream parse failed after offset %d", static_cast<int>(st->s->offset()));
+			}
+			g_parse_in_progress = false;
+		});
+
+		return 0;
+	}
+}
+
+ty_real
+peggml_stream_feed(handle_t handle, ty_string chunk)
+{
+	return _stream_begin(handle, chunk, false);
+}
+
+ty_real
+peggml_stream_finish(handle_t handle)
+{
+	return _stream_begin(handle, "", true);
+}
+
+index_t
+peggml_stream_get_element_count(handle_t handle)
+{
+	stream* st = _get_stream(handle);
+	if (!st)
+	{
+		return error(0, "invalid stream handle %d", handle);
+	}
+
+	return st->elements.size();
+}
+
+uuid_t
+peggml_stream_get_element_uuid(handle_t handle, index_t _i)
+{
+	stream* st = _get_stream(handle);
+	if (!st)
+	{
+		return error(-1, "invalid stream handle %d", handle);
+	}
+
+	size_t i = _i;
+	if (_i < 0 || i >= st->elements.size())
+	{
+		return error(-1, "index out of bounds");
+	}
+
+	return st->elements[i];
+}
+
+ty_real
+peggml_stream_get_offset(handle_t handle)
+{
+	stream* st = _get_stream(handle);
+	if (!st)
+	{
+		return error(-1, "invalid stream handle %d", handle);
+	}
+
+	return st->offset;
+}
+
+handle_t
+peggml_parallel_create(handle_t handle, ty_string split_rule, ty_string resync, ty_real threads)
+{
+	get_parser(p, handle, -1);
+
+	if (split_rule == nullptr || resync == nullptr)
+	{
+		return error(-2, "argument string is nullptr");
+	}
+
+	if (threads < 0)
+	{
+		return error(-3, "thread count cannot be negative");
+	}
+
+	std::unique_ptr<parallel> pl(new parallel());
+	pl->parser_handle = handle;
+	pl->p = p;
+	pl->pp.reset(new ParallelParser(*p, split_rule, resync, [pl=pl.get()](Value& val, size_t, size_t) {
+		pl->elements.push_back(val.has_value() ? val.get<uuid_t>() : -1);
+	}, static_cast<size_t>(threads)));
+	if (!*pl->pp)
+	{
+		return error(-4, "grammar cannot be split; its start rule must be of the form %s* (or %s* !.), without back references, and the resync string must not be empty", split_rule, split_rule);
+	}
+
+	return _add_handle(g_parallels, std::move(pl));
+}
+
+ty_real
+peggml_parallel_destroy(handle_t handle)
+{
+	if (!_get_parallel(handle))
+	{
+		return error(1, "invalid parallel parser handle %d", handle);
+	}
+
+	g_parallels[static_cast<size_t>(handle)].reset();
+
+	return 0;
+}
+
+ty_real
+peggml_parallel_parse_begin(handle_t handle, ty_string _text)
+{
+	if (g_parse_in_progress)
+	{
+		return error(-1, "parse already in progress.");
+	}
+
+	parallel* pl = _get_parallel(handle);
+	if (!pl)
+	{
+		return error(-2, "invalid parallel parser handle %d", handle);
+	}
+
+	if (!pl->p)
+	{
+		return error(-3, "parallel parser's parser was destroyed");
+	}
+
+	if (_text == nullptr)
+	{
+		return error(-4, "argument string is nullptr");
+	}
+
+	g_parse_text = _text;
+	pl->elements.clear();
+
+	_set_stack_guard(g_parsers[pl->parser_handle].get());
+
+	// (the records are parsed on other threads, but their handlers run here.)
+	g_parse_cs.begin([pl](){
+		if (!pl->pp->parse(g_parse_text.data(), g_parse_text.size()))
+		{
+			error(0, "parallel parse failed");
+		}
+		g_parse_in_progress = false;
+	});
+
+	return 0;
+}
+
+index_t
+peggml_parallel_get_element_count(handle_t handle)
+{
+	parallel* pl = _get_parallel(handle);
+	if (!pl)
+	{
+		return error(0, "invalid parallel parser handle %d", handle);
+	}
+
+	return pl->elements.size();
+}
+
+uuid_t
+peggml_parallel_get_element_uuid(handle_t handle, index_t _i)
+{
+	parallel* pl = _get_parallel(handle);
+	if (!pl)
+	{
+		return error(-1, "invalid parallel parser handle %d", handle);
+	}
+
+	size_t i = _i;
+	if (_i < 0 || i >= pl->elements.size())
+	{
+		return error(-1, "index out of bounds");
+	}
+
+	return pl->elements[i];
+}
+
+ty_real
+peggml_parallel_get_reparsed(handle_t handle)
+{
+	parallel* pl = _get_parallel(handle);
+	if (!pl)
+	{
+		return error(-1, "invalid parallel parser handle %d", handle);
+	}
+
+	return pl->pp->reparsed();
+}
+
+ty_real
+peggml_parse_next()
+{
+	if (g_parse_cs.resume())
+	{
+		return g_symbol_id;
+	}
+	else
+	{
+		if (g_parse_cs.is_error())
+		{
+			return error(-1, "exception during parse: %s", g_parse_cs.error_what());
+		}
+		return 0;
+	}
+}
+
+ty_real
+peggml_parse_elt_get_uuid()
+{
+	return static_cast<uuid_t>(g_uuid);
+}
+
+ty_string
+peggml_parse_elt_get_string()
+{
+	return STORE_STRING(g_sv->sv());
+}
+
+ty_real
+peggml_parse_elt_get_string_offset()
+{
+	return g_sv->sv().data() - g_sv->ss;
+}
+
+ty_real
+peggml_parse_elt_get_string_line()
+{
+	return g_sv->line_info().first;
+}
+
+ty_real
+peggml_parse_elt_get_string_column()
+{
+	return g_sv->line_info().second;
+}
+
+ty_real
+peggml_parse_elt_get_choice()
+{
+	return g_sv->choice();
+}
+
+#define RANGE_CHECK(i, container, rvalue) \
+	if (i < 0 || i >= (container).size()) \
+		{ return error(rvalue, "index out of bounds"); }
+
+index_t
+peggml_parse_elt_get_child_count()
+{
+	return g_sv->size();
+}
+
+ty_real
+peggml_parse_elt_get_child_uuid(index_t _i)
+{
+	size_t i = _i;
+	RANGE_CHECK(i, *g_sv, -1);
+	return g_sv->get<uuid_t>(i);
+}
+
+index_t
+peggml_parse_elt_get_token_count()
+{
+	return g_sv->tokens.size();
+}
+
+ty_real
+peggml_parse_elt_get_token_offset(index_t _i)
+{
+	size_t i = _i;
+	RANGE_CHECK(i, g_sv->tokens, 0);
+	return g_sv->token(i).data() - g_sv->ss;
+}
+
+ty_string
+peggml_parse_elt_get_token_string(index_t _i)
+{
+	size_t i = _i;
+	RANGE_CHECK(i, g_sv->tokens, "");
+	return STORE_STRING(g_sv->token(i));
+}
+
+ty_real
+peggml_parse_elt_get_token_number()
+{
+	try
+	{
+		return g_sv->token_to_number<ty_real>();
+	}
+	catch(...)
+	{
+		return error(0, "error occurred parsing number from token");
+	}
+}
+
+external uuid_t
+peggml_get_root_uuid()
+{
+	return g_root_uuid;
+}
+
+namespace
+{
+	#define AST_NODE(lvar, _i, rvalue) size_t lvar = _i; RANGE_CHECK(lvar, g_ast.rule, rvalue)
+
+	ty_real _ast_link(uint32_t node)
+	{
+		return node == FlatAst::none ? -1 : static_cast<ty_real>(node);
+	}
+}
+
+ty_real
+peggml_parser_enable_flat_ast(handle_t handle)
+{
+	get_parser(p, handle, 1);
+
+	p->enable_flat_ast();
+
+	return 0;
+}
+
+namespace
+{
+	std::string g_ast_cache_dir;
+	bool g_ast_cached = false; // (whether the last tree was read from the cache)
+
+	// parses g_ast_text into g_ast.
+	ty_real _parse_flat_ast(parser* p)
+	{
+		g_ast_parser = p;
+		g_ast_cached = false;
+		_set_stack_guard(p);
+		p->set_memo(nullptr);
+
+		// (on the callstack only for its room to nest: the rules' handlers
+		// are not called, so nothing yields.)
+		bool ok = false;
+		g_parse_cs.begin([p, &ok](){
+			ok = p->parse(g_ast_text, g_ast);
+		});
+		while (g_parse_cs.resume()) { }
+
+		if (g_parse_cs.is_error())
+		{
+			g_ast.clear();
+			return error(-4, "exception during parse: %s", g_parse_cs.error_what());
+		}
+
+		if (!ok)
+		{
+			return error(-5, "parse failed");
+		}
+
+		return 0;
+	}
+}
+
+ty_real
+peggml_parse_flat_ast(handle_t handle, ty_string text)
+{
+	if (g_parse_in_progress)
+	{
+		return error(-1, "parse already in progress.");
+	}
+
+	get_parser(p, handle, -2);
+
+	if (text == nullptr)
+	{
+		return error(-3, "argument string is nullptr");
+	}
+
+	g_ast_text = text;
+
+	return _parse_flat_ast(p);
+}
+
+ty_real
+peggml_ast_cache_set_directory(ty_string path)
+{
+	if (path == nullptr)
+	{
+		return error(1, "argument string is nullptr");
+	}
+
+	g_ast_cache_dir = path;
+
+	return 0;
+}
+
+ty_real
+peggml_parse_cached(handle_t handle, ty_string path)
+{
+	if (g_parse_in_progress)
+	{
+		return error(-1, "parse already in progress.");
+	}
+
+	get_parser(p, handle, -2);
+
+	if (path == nullptr)
+	{
+		return error(-3, "argument string is nullptr");
+	}
+
+	std::ifstream in(path, std::ios::binary);
+	if (!in)
+	{
+		return error(-6, "cannot read %s", path);
+	}
+	std::stringstream contents;
+	contents << in.rdbuf();
+	g_ast_text = contents.str();
+
+	// keyed by both hashes and whether the rules add nodes (the tree is
+	// empty if not), so a changed grammar, input or setup misses.
+	std::string cache_path;
+	if (!g_ast_cache_dir.empty())
+	{
+		cache_path = g_ast_cache_dir + "/" + strprintf("%016llx-%016llx-%d.ast",
+			static_cast<unsigned long long>(g_parser_hashes[static_cast<size_t>(handle)]),
+			static_cast<unsigned long long>(fnv1a(g_ast_text.data(), g_ast_text.size())),
+			p->flat_ast_enabled() ? 1 : 0);
+
+		std::ifstream cached(cache_path, std::ios::binary);
+		if (cached && p->read_flat_ast(cached, g_ast, g_ast_text.size()))
+		{
+			g_ast_parser = p;
+			g_ast_cached = true;
+			return 0;
+		}
+	}
+
+	ty_real result = _parse_flat_ast(p);
+	if (result == 0 && !cache_path.empty())
+	{
+		// (written aside and then renamed, so no reader sees part of a file.)
+		std::string temp_path = cache_path + ".tmp";
+		std::ofstream out(temp_path, std::ios::binary);
+		g_ast.write(out);
+		out.close();
+		if (out)
+		{
+			std::remove(cache_path.c_str());
+			std::rename(temp_path.c_str(), cache_path.c_str());
+		}
+		else
+		{
+			std::remove(temp_path.c_str());
+		}
+	}
+	return result;
+}
+
+ty_real
+peggml_ast_is_cached()
+{
+	return g_ast_cached;
+}
+
+index_t
+peggml_ast_get_count()
+{
+	return g_ast.size();
+}
+
+ty_string
+peggml_ast_get_rule_name(index_t _i)
+{
+	AST_NODE(i, _i, "");
+	return g_ast.name(i).c_str();
+}
+
+ty_string
+peggml_ast_get_original_rule_name(index_t _i)
+{
+	AST_NODE(i, _i, "");
+	return g_ast.original_name(i).c_str();
+}
+
+ty_real
+peggml_ast_optimize()
+{
+	if (!g_ast_parser)
+	{
+		return error(1, "no flat tree to optimize");
+	}
+
+	g_ast_parser->optimize_ast(g_ast);
+
+	return 0;
+}
+
+ty_real
+peggml_ast_get_offset(index_t _i)
+{
+	AST_NODE(i, _i, -1);
+	return g_ast.offset[i];
+}
+
+ty_real
+peggml_ast_get_length(index_t _i)
+{
+	AST_NODE(i, _i, -1);
+	return g_ast.length[i];
+}
+
+ty_string
+peggml_ast_get_string(index_t _i)
+{
+	AST_NODE(i, _i, "");
+	return STORE_STRING(g_ast.text(i, g_ast_text.data()));
+}
+
+ty_real
+peggml_ast_get_choice(index_t _i)
+{
+	AST_NODE(i, _i, -1);
+	return g_ast.choice[i];
+}
+
+ty_real
+peggml_ast_get_parent(index_t _i)
+{
+	AST_NODE(i, _i, -1);
+	return _ast_link(g_ast.parent[i]);
+}
+
+ty_real
+peggml_ast_get_first_child(index_t _i)
+{
+	AST_NODE(i, _i, -1);
+	return _ast_link(g_ast.first_child[i]);
+}
+
+ty_real
+peggml_ast_get_next_sibling(index_t _i)
+{
+	AST_NODE(i, _i, -1);
+	return _ast_link(g_ast.next_sibling[i]);
+}
+
+#ifndef PEGGML_IS_DLL
+
+#include <chrono>
+#include <filesystem>
+#include <cstring>
+#include <cstdlib>
+#include <new>
+#include <random>
+
+namespace
+{
+	size_t g_allocation_count = 0;
+}
+
+// counts heap allocations, for test_allocations(). (kept out of line, so the
+// compiler does not see the malloc and free within them at new and delete
+// expressions, and warn of mismatched deallocations.)
+[[gnu::noinline]] void* operator new(std::size_t size)
+{
+	++g_allocation_count;
+	if (void* p = std::malloc(size ? size : 1))
+	{
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
+
+[[gnu::noinline]] void operator delete(void* p, std::size_t) noexcept
+{
+	std::free(p);
+}
+
+namespace
+{
+	// once the parser's stacks have grown, matching more input
+	// should not allocate any further.
+	int test_allocations()
+	{
+		TEST_INIT;
+		parser p(R"(
+			Program     <- (~Statement)*
+			Statement   <- Keyword Identifier '=' Value ';' / Identifier '(' Value? ')' ';'
+			Keyword     <- 'var' / 'globalvar'
+			Identifier  <- < [a-zA-Z_] [a-zA-Z_0-9]* >
+			Value       <- Number / String / Identifier
+			Number      <- < [0-9]+ ('.' [0-9]+)? >
+			String      <- '"' < (!'"' .)* > '"'
+			%whitespace <- [ \t\r\n]*
+			%word       <- [a-zA-Z_] [a-zA-Z_0-9]*
+		)");
+		TEST_ASSERT(p);
+		p.log = nullptr;
+		p["Identifier"] = [](const SemanticValues& vs) { return vs.line_info().first; };
+		p["Number"] = [](const SemanticValues& vs) { return vs.token_to_number<double>(); };
+
+		auto count_allocations = [&](size_t statements)
+		{
+			std::string input;
+			for (size_t i = 0; i < statements; ++i)
+			{
+				input += "var x" + std::to_string(i) + " = " + std::to_string(i) + ".5;\n";
+				input += "show_message(\"hello world\");\n";
+				input += "globalvar y = x;\n";
+			}
+			size_t before = g_allocation_count;
+			bool result = p.parse(input);
+			return result ? g_allocation_count - before : 0;
+		};
+
+		count_allocations(10); // warm up
+		size_t small = count_allocations(10);
+		size_t large = count_allocations(1000);
+		TEST_ASSERT(small > 0);
+		TEST_ASSERT(small == large);
+		TEST_END;
+	}
+
+	// parses nested input through the callstack, returning how many
+	// elements were reduced (-1 on error.)
+	int count_nested_reductions(handle_t handle, size_t depth)
+	{
+		std::string input(depth, '(');
+		input += 'x';
+		input.append(depth, ')');
+		if (peggml_parse_begin(handle, input.c_str()))
+		{
+			return -1;
+		}
+		int count = 0;
+		ty_real symbol_id;
+		while ((symbol_id = peggml_parse_next()) > 0)
+		{
+			++count;
+		}
+		return symbol_id < 0 ? -1 : count;
+	}
+
+	// nesting is bounded by memory and the configured depth limit,
+	// not by the size of the callstack.
+	int test_deep_nesting()
+	{
+		TEST_INIT;
+		TEST_ASSERT(peggml_set_stack_size(256000) == 0);
+		handle_t handle = peggml_parser_create(R"(
+			Nested <- '(' Nested ')' / 'x'
+		)");
+		TEST_ASSERT(handle >= 0);
+		peggml_parser_set_symbol_id(handle, "Nested", 1);
+
+		TEST_ASSERT(count_nested_reductions(handle, 50000) == 50001);
+
+		peggml_parser_set_max_depth(handle, 1000);
+		TEST_ASSERT(count_nested_reductions(handle, 998) == 999);
+		TEST_ASSERT(count_nested_reductions(handle, 1000) == 0);
+
+		peggml_parser_destroy(handle);
+		TEST_ASSERT(peggml_set_stack_size(8000000) == 0);
+		TEST_END;
+	}
+
+	// records every reduction of the README's Additive rule.
+	std::string reduction_log(const char* additive, const std::string& input)
+	{
+		parser p((std::string(additive) + R"(
+			Multitive   <- Primary '*' Multitive / Primary
+			Primary     <- '(' Additive ')' / Number
+			Number      <- < [0-9]+ >
+			%whitespace <- [ \t]*
+		)").c_str());
+		std::string log;
+		if (!p) return log;
+		p["Additive"] = [&log](const SemanticValues& vs)
+		{
+			log += std::to_string(vs.choice()) + ":" + std::to_string(vs.sv().size());
+			for (size_t i = 0; i < vs.size(); ++i)
+			{
+				log += " " + std::to_string(vs.get<size_t>(i));
+			}
+			log += "\n";
+			return vs.sv().size();
+		};
+		p["Multitive"] = [](const SemanticValues& vs) { return vs.sv().size(); };
+		log += p.parse(input) ? "ok" : "failed";
+		return log;
+	}
+
+	// { flatten } matches iteratively, but reduces as the recursive rule would.
+	int test_flatten()
+	{
+		TEST_INIT;
+		const char* recursive = "Additive <- Multitive '+' Additive / Multitive";
+		const char* flattened = "Additive <- Multitive '+' Additive / Multitive { flatten }";
+		for (const char* input : { "5 + (3 * 7) + 2", "1 + 2 + (3 + 4) * 5", "1 + 2 +", "7" })
+		{
+			TEST_ASSERT(reduction_log(recursive, input) == reduction_log(flattened, input));
+		}
+
+		std::string input = "1";
+		for (size_t i = 0; i < 200000; ++i)
+		{
+			input += " + 1";
+		}
+		TEST_ASSERT(reduction_log(flattened, input).size() > input.size());
+
+		TEST_ASSERT(!parser("A <- 'a' A 'b' / 'c' { flatten }"));
+		TEST_END;
+	}
+
+	struct recorded_node
+	{
+		std::string text;
+		std::vector<uuid_t> children;
+	};
+
+	// drives the parse in progress, adding its elements to nodes;
+	// returns how many were reduced (-1 on error.)
+	int record_nodes(std::map<uuid_t, recorded_node>& nodes)
+	{
+		int count = 0;
+		ty_real symbol_id;
+		while ((symbol_id = peggml_parse_next()) > 0)
+		{
+			recorded_node& node = nodes[peggml_parse_elt_get_uuid()];
+			node.text = peggml_parse_elt_get_string();
+			node.children.clear();
+			for (index_t i = 0; i < peggml_parse_elt_get_child_count(); ++i)
+			{
+				node.children.push_back(peggml_parse_elt_get_child_uuid(i));
+			}
+			++count;
+		}
+		return symbol_id < 0 ? -1 : count;
+	}
+
+	std::string render(const std::map<uuid_t, recorded_node>& nodes, uuid_t uuid)
+	{
+		auto iter = nodes.find(uuid);
+		if (iter == nodes.end()) return "?";
+		std::string out = "(" + iter->second.text;
+		for (uuid_t child : iter->second.children)
+		{
+			out += " " + render(nodes, child);
+		}
+		return out + ")";
+	}
+
+	// reparsing after an edit only reduces the elements touching it, and
+	// yields the same tree as parsing the edited text from scratch.
+	int test_incremental()
+	{
+		TEST_INIT;
+		handle_t handle = peggml_parser_create(R"(
+			Program     <- Statement*
+			Statement   <- Name '=' Sum ';'
+			Sum         <- Sum '+' Value / Value
+			Value       <- Number / Name
+			Name        <- < [a-z]+ >
+			Number      <- < [0-9]+ >
+			%whitespace <- [ \t\n]*
+		)");
+		TEST_ASSERT(handle >= 0);
+		const char* symbols[] = { "Program", "Statement", "Sum", "Value", "Name", "Number" };
+		for (size_t i = 0; i < 6; ++i)
+		{
+			peggml_parser_set_symbol_id(handle, symbols[i], i + 1);
+		}
+
+		std::string text;
+		for (size_t i = 0; i < 1000; ++i)
+		{
+			text += "x = a + " + std::to_string(i) + " + b;\n";
+		}
+
+		handle_t session = peggml_session_create(handle);
+		TEST_ASSERT(session >= 0);
+		std::map<uuid_t, recorded_node> nodes;
+		TEST_ASSERT(peggml_parse_edit(session, 0, 0, text.c_str()) == 0);
+		int full = record_nodes(nodes);
+		TEST_ASSERT(full > 10000);
+
+		// each edit reduces a handful of elements, giving the tree a full parse would.
+		auto edit = [&](size_t offset, size_t removed_len, const char* inserted)
+		{
+			text.replace(offset, removed_len, inserted);
+			if (peggml_parse_edit(session, offset, removed_len, inserted)) return false;
+			int count = record_nodes(nodes);
+			if (count <= 0 || count > 50) return false;
+			std::string incremental = render(nodes, peggml_get_root_uuid());
+
+			std::map<uuid_t, recorded_node> fresh;
+			if (peggml_parse_begin(handle, text.c_str()) || record_nodes(fresh) < 0) return false;
+			return incremental == render(fresh, peggml_get_root_uuid());
+		};
+		TEST_ASSERT(edit(text.find("+ 500 +") + 2, 3, "12345"));
+		TEST_ASSERT(edit(text.find("x = a + 200"), 0, "y = 7;\n"));
+		TEST_ASSERT(edit(text.find("x = a + 700"), text.find("x = a + 701") - text.find("x = a + 700"), ""));
+		TEST_ASSERT(edit(text.size(), 0, "z = q;"));
+
+		TEST_ASSERT(peggml_parse_edit(session, text.size() + 1, 0, "") != 0);
+		peggml_session_destroy(session);
+		peggml_parser_destroy(handle);
+
+		// the memo keeps and shifts the results an edit leaves alone, as
+		// rebuilding it for each edit would.
+		Memo kept;
+		std::map<std::pair<size_t, size_t>, std::pair<size_t, size_t>> expected;
+		std::mt19937 random(38);
+		size_t size = 1000;
+		bool same = true;
+		for (size_t round = 0; round < 200; ++round)
+		{
+			for (size_t i = 0; i < 20; ++i)
+			{
+				size_t pos = random() % size, def_id = random() % 4, examined = 1 + random() % 40;
+				kept.add(pos, def_id, pos, examined, Value(pos));
+				expected[{ pos, def_id }] = { pos, examined };
+			}
+			size_t offset = random() % size, removed = random() % std::min<size_t>(size - offset, 30), inserted = random() % 30;
+			kept.edit(offset, removed, inserted);
+			decltype(expected) shifted;
+			for (const auto& [key, entry] : expected)
+			{
+				if (key.first >= offset + removed)
+				{
+					shifted[{ key.first - removed + inserted, key.second }] = entry;
+				}
+				else if (key.first + entry.second <= offset)
+				{
+					shifted[key] = entry;
+				}
+			}
+			expected.swap(shifted);
+			size = size - removed + inserted;
+
+			same = same && kept.size() == expected.size();
+			for (const auto& [key, entry] : expected)
+			{
+				auto found = kept.find(key.first, key.second);
+				same = same && found && found->len == entry.first && found->examined == entry.second && found->val.get<size_t>() == entry.first;
+			}
+		}
+		TEST_ASSERT(same && kept.size() > 100);
+
+		// results are not reused in a grammar with captures: editing the
+		// captured tag changes whether the back reference matches.
+		const char* tags = R"(
+			Doc     <- Open Body Close
+			Open    <- '<' $tag<[a-z]+> '>'
+			Body    <- [a-z ]*
+			Close   <- '</' $tag '>'
+		)";
+		parser p(tags), fresh(tags);
+		TEST_ASSERT(p && fresh && p.uses_captures());
+		p.log = nullptr;
+		fresh.log = nullptr;
+		Memo memo;
+		TEST_ASSERT(!p.set_memo(&memo));
+		std::string doc = "<ab>some text</ab>";
+		TEST_ASSERT(p.parse(doc));
+		for (auto [offset, removed, inserted] : { std::tuple<size_t, size_t, const char*>(1, 2, "cd"), { 15, 2, "cd" }, { 2, 0, "x" } })
+		{
+			doc.replace(offset, removed, inserted);
+			memo.edit(offset, removed, strlen(inserted));
+			TEST_ASSERT(p.parse(doc) == fresh.parse(doc));
+		}
+		TEST_ASSERT(doc == "<cxd>some text</cd>" && !p.parse(doc) && memo.size() == 0);
+
+		handle = peggml_parser_create(tags);
+		TEST_ASSERT(handle >= 0 && peggml_session_create(handle) < 0);
+		peggml_parser_destroy(handle);
+		TEST_END;
+	}
+
+	// a stream reports each line once it is complete, with its offset in
+	// the whole input, while buffering no more than the line in progress.
+	int test_stream()
+	{
+		TEST_INIT;
+		handle_t handle = peggml_parser_create(R"(
+			Log     <- Line* !.
+			Line    <- Time ' ' Message '\n'
+			Time    <- < [0-9]+ >
+			Message <- < (!'\n' .)* >
+		)");
+		TEST_ASSERT(handle >= 0);
+		peggml_parser_set_symbol_id(handle, "Line", 1);
+
+		std::string text;
+		for (size_t i = 0; i < 2000; ++i)
+		{
+			text += std::to_string(i * 7) + " event " + std::to_string(i) + "\n";
+		}
+
+		handle_t st = peggml_stream_create(handle, 64);
+		TEST_ASSERT(st >= 0);
+		size_t lines = 0;
+		bool offsets_match = true;
+		auto drain = [&]()
+		{
+			ty_real symbol_id;
+			while ((symbol_id = peggml_parse_next()) > 0)
+			{
+				size_t offset = peggml_stream_get_offset(st) + peggml_parse_elt_get_string_offset();
+				offsets_match = offsets_match && text.compare(offset, strlen(peggml_parse_elt_get_string()), peggml_parse_elt_get_string()) == 0;
+			}
+			lines += peggml_stream_get_element_count(st);
+			return symbol_id == 0;
+		};
+		for (size_t i = 0, chunk = 1; i < text.size(); i += chunk, chunk = chunk % 37 + 1)
+		{
+			std::string part = text.substr(i, chunk);
+			TEST_ASSERT(peggml_stream_feed(st, part.c_str()) == 0 && drain());
+		}
+		TEST_ASSERT(peggml_stream_finish(st) == 0 && drain());
+		TEST_ASSERT(lines == 2000 && offsets_match);
+		peggml_stream_destroy(st);
+
+		// a line longer than the buffer limit is an error.
+		st = peggml_stream_create(handle, 64);
+		peggml_clear_error();
+		TEST_ASSERT(peggml_stream_feed(st, (std::string(100, '1') + " x").c_str()) == 0 && drain());
+		TEST_ASSERT(peggml_error() == 0);
+		peggml_stream_destroy(st);
+
+		peggml_parser_destroy(handle);
+
+		// the start rule must be a repetition of elements.
+		handle = peggml_parser_create("S <- 'a' 'b'");
+		TEST_ASSERT(peggml_stream_create(handle, 64) < 0);
+		peggml_parser_destroy(handle);
+		TEST_END;
+	}
+
+	// records parsed on several threads give the trees a sequential parse
+	// gives, in order, though cuts fall inside records spanning lines.
+	int test_parallel()
+	{
+		TEST_INIT;
+		handle_t handle = peggml_parser_create(R"(
+			Program     <- Statement* !.
+			Statement   <- Name '=' Sum ';' / '{' Statement* '}'
+			Sum         <- Sum '+' Value / Value
+			Value       <- Number / Name
+			Name        <- < [a-z]+ >
+			Number      <- < [0-9]+ >
+			%whitespace <- [ \t\n]*
+		)");
+		TEST_ASSERT(handle >= 0);
+		const char* symbols[] = { "Program", "Statement", "Sum", "Value", "Name", "Number" };
+		for (size_t i = 0; i < 6; ++i)
+		{
+			peggml_parser_set_symbol_id(handle, symbols[i], i + 1);
+		}
+
+		std::string text;
+		for (size_t i = 0; i < 2000; ++i)
+		{
+			text += (i % 3 == 0)
+				? "{\n  x = a\n  + " + std::to_string(i) + ";\n}\n"
+				: "y = b + " + std::to_string(i) + ";\n";
+		}
+
+		std::map<uuid_t, recorded_node> nodes;
+		TEST_ASSERT(peggml_parse_begin(handle, text.c_str()) == 0 && record_nodes(nodes) > 0);
+		const recorded_node& root = nodes[peggml_get_root_uuid()];
+
+		handle_t pl = peggml_parallel_create(handle, "Statement", "\n", 4);
+		TEST_ASSERT(pl >= 0);
+		std::map<uuid_t, recorded_node> parallel_nodes;
+		TEST_ASSERT(peggml_parallel_parse_begin(pl, text.c_str()) == 0 && record_nodes(parallel_nodes) > 0);
+		TEST_ASSERT(peggml_parallel_get_element_count(pl) == root.children.size());
+		bool trees_match = true;
+		for (index_t i = 0; i < peggml_parallel_get_element_count(pl); ++i)
+		{
+			trees_match = trees_match && render(parallel_nodes, peggml_parallel_get_element_uuid(pl, i)) == render(nodes, root.children[i]);
+		}
+		TEST_ASSERT(trees_match);
+
+		// a syntax error in any chunk fails the parse.
+		text.replace(text.size() / 2, 1, "#");
+		peggml_clear_error();
+		TEST_ASSERT(peggml_parallel_parse_begin(pl, text.c_str()) == 0 && record_nodes(parallel_nodes) >= 0);
+		TEST_ASSERT(peggml_error() == 0);
+		peggml_parallel_destroy(pl);
+
+		// the split rule must be the start rule's element.
+		TEST_ASSERT(peggml_parallel_create(handle, "Sum", "\n", 4) < 0);
+		peggml_parser_destroy(handle);
+
+		// every action is called as in a sequential parse, also those whose
+		// values are dropped by a rule without one; a text cut at the ends
+		// of its records is not parsed again.
+		parser lines(R"(
+			Log   <- Line* !.
+			Line  <- Item+ '\n'
+			Item  <- [a-z] ','?
+		)");
+		TEST_ASSERT(lines);
+		size_t items = 0;
+		lines["Item"] = [&](const SemanticValues&) { ++items; };
+		std::string log;
+		for (size_t i = 0; i < 100; ++i)
+		{
+			log += "a,b,c\n";
+		}
+		TEST_ASSERT(lines.parse(log) && items == 300);
+		items = 0;
+		size_t records = 0;
+		ParallelParser split(lines, "Line", "\n", [&](Value&, size_t, size_t) { ++records; }, 4);
+		TEST_ASSERT(split && split.parse(log));
+		TEST_ASSERT(items == 300 && records == 100);
+		TEST_ASSERT(split.reparsed() == 0);
+		// the workers started by the first parse are reused by the next ones
+		for (size_t i = 0; i < 10; ++i)
+		{
+			items = records = 0;
+			TEST_ASSERT(split.parse(log) && items == 300 && records == 100);
+		}
+		items = records = 0;
+		TEST_ASSERT(split.parse("a\n") && items == 1 && records == 1);
+		TEST_END;
+	}
+
+	// a flat tree holds every node of the parse in one table, in document
+	// order, rather than allocating per node.
+	int test_flat_ast()
+	{
+		TEST_INIT;
+		const char* grammar = R"(
+			Program     <- Statement*
+			Statement   <- Name '=' Sum ';'
+			Sum         <- Value ('+' Value)*
+			Value       <- Number / Name
+			Name        <- < [a-z]+ >
+			Number      <- < [0-9]+ >
+			%whitespace <- [ \t\n]*
+		)";
+		handle_t handle = peggml_parser_create(grammar);
+		TEST_ASSERT(handle >= 0);
+		TEST_ASSERT(peggml_parser_enable_flat_ast(handle) == 0);
+
+		TEST_ASSERT(peggml_parse_flat_ast(handle, "x = a + 12;\ny = 3;") == 0);
+		TEST_ASSERT(peggml_ast_get_count() == 13);
+		TEST_ASSERT(!strcmp(peggml_ast_get_rule_name(0), "Program") && peggml_ast_get_parent(0) == -1);
+		index_t statement = peggml_ast_get_next_sibling(peggml_ast_get_first_child(0));
+		TEST_ASSERT(!strcmp(peggml_ast_get_string(statement), "y = 3;") && peggml_ast_get_parent(statement) == 0);
+		index_t name = peggml_ast_get_first_child(statement);
+		TEST_ASSERT(!strcmp(peggml_ast_get_rule_name(name), "Name") && !strcmp(peggml_ast_get_string(name), "y"));
+		TEST_ASSERT(peggml_ast_get_offset(name) == 12 && peggml_ast_get_first_child(name) == -1);
+		index_t value = peggml_ast_get_first_child(peggml_ast_get_next_sibling(peggml_ast_get_first_child(peggml_ast_get_first_child(0))));
+		TEST_ASSERT(!strcmp(peggml_ast_get_string(value), "a ") && peggml_ast_get_choice(value) == 1);
+
+		// symbol ids leave the tree as it is, and their handlers uncalled.
+		uint32_t next_uuid = g_uuid;
+		peggml_parser_set_symbol_id(handle, "Program", 1);
+		peggml_parser_set_symbol_id(handle, "Name", 2);
+		TEST_ASSERT(peggml_parse_flat_ast(handle, "x = a + 12;\ny = 3;") == 0);
+		TEST_ASSERT(peggml_ast_get_count() == 13 && g_uuid == next_uuid);
+		TEST_ASSERT(!strcmp(peggml_ast_get_rule_name(name), "Name") && !strcmp(peggml_ast_get_string(name), "y"));
+
+		// optimizing replaces single-child nodes with their children.
+		TEST_ASSERT(peggml_ast_optimize() == 0 && peggml_ast_get_count() == 9);
+		TEST_ASSERT(!strcmp(peggml_ast_get_rule_name(8), "Number") && !strcmp(peggml_ast_get_original_rule_name(8), "Sum"));
+		TEST_ASSERT(peggml_ast_get_parent(8) == 6 && peggml_ast_get_next_sibling(7) == 8 && !strcmp(peggml_ast_get_string(8), "3"));
+
+		std::string text;
+		for (size_t i = 0; i < 20000; ++i)
+		{
+			text += "x = a + " + std::to_string(i) + " + b;\n";
+		}
+		size_t allocations = g_allocation_count;
+		TEST_ASSERT(peggml_parse_flat_ast(handle, text.c_str()) == 0);
+		TEST_ASSERT(peggml_ast_get_count() == 180001);
+		TEST_ASSERT(g_allocation_count - allocations < peggml_ast_get_count() / 10);
+
+		TEST_ASSERT(peggml_parse_flat_ast(handle, "x = ;") != 0);
+
+		// a cached parse of an unchanged file reads back the same tree.
+		std::filesystem::path directory = std::filesystem::temp_directory_path() / "peggml_test_cache";
+		std::filesystem::create_directories(directory);
+		std::string path = (directory / "input.txt").string();
+		std::ofstream(path) << "x = a + 12;\ny = 3;";
+		TEST_ASSERT(peggml_ast_cache_set_directory(directory.string().c_str()) == 0);
+		TEST_ASSERT(peggml_parse_cached(handle, path.c_str()) == 0 && !peggml_ast_is_cached());
+		TEST_ASSERT(peggml_parse_cached(handle, path.c_str()) == 0 && peggml_ast_is_cached());
+		TEST_ASSERT(peggml_ast_get_count() == 13 && peggml_ast_get_offset(statement) == 12);
+		TEST_ASSERT(!strcmp(peggml_ast_get_string(value), "a ") && peggml_ast_get_choice(value) == 1);
+
+		// a parser that adds no nodes does not read the tree back.
+		handle_t other = peggml_parser_create(grammar);
+		TEST_ASSERT(peggml_parse_cached(other, path.c_str()) == 0 && !peggml_ast_is_cached());
+		peggml_parser_destroy(other);
+
+		// a table cut short, or with spans past the end of the text, is not
+		// read (nor allocated for the node count it claims.)
+		TEST_ASSERT(peggml_parse_cached(handle, path.c_str()) == 0 && peggml_ast_is_cached());
+		std::stringstream written;
+		g_ast.write(written);
+		const std::string table = written.str();
+		const size_t text_size = g_ast_text.size();
+		FlatAst ast;
+		std::istringstream whole(table);
+		TEST_ASSERT(g_ast_parser->read_flat_ast(whole, ast, text_size) && ast.size() == 13);
+		std::istringstream cut(table.substr(0, table.size() - 1));
+		TEST_ASSERT(!g_ast_parser->read_flat_ast(cut, ast, text_size) && ast.size() == 0 && ast.names.empty());
+		std::string claimed = table;
+		uint64_t count = 0xfffffffe;
+		claimed.replace(8, sizeof(count), reinterpret_cast<const char*>(&count), sizeof(count));
+		std::istringstream large(claimed);
+		TEST_ASSERT(!g_ast_parser->read_flat_ast(large, ast, text_size) && ast.size() == 0);
+		std::istringstream shorter(table);
+		TEST_ASSERT(!g_ast_parser->read_flat_ast(shorter, ast, text_size - 1) && ast.size() == 0);
+
+		std::ofstream(path) << "x = 5;";
+		TEST_ASSERT(peggml_parse_cached(handle, path.c_str()) == 0 && !peggml_ast_is_cached());
+		TEST_ASSERT(peggml_ast_get_count() == 6);
+		std::filesystem::remove_all(directory);
+		peggml_parser_destroy(handle);
+		TEST_END;
+	}
+
+	// parsing a text again runs its handlers on the same elements, without
+	// matching it; the least recently used texts are dropped first.
+	int test_parse_cache()
+	{
+		TEST_INIT;
+		const char* grammar = R"(
+			Program     <- Statement*
+			Statement   <- Name '=' Sum ';'
+			Sum         <- Sum '+' Value / Value
+			Value       <- Number / Name
+			Name        <- < [a-z]+ >
+			Number      <- < [0-9]+ >
+			%whitespace <- [ \t\n]*
+		)";
+		handle_t handle = peggml_parser_create(grammar);
+		TEST_ASSERT(handle >= 0);
+		const char* symbols[] = { "Program", "Statement", "Sum", "Value", "Name", "Number" };
+		for (size_t i = 0; i < 6; ++i)
+		{
+			peggml_parser_set_symbol_id(handle, symbols[i], i + 1);
+		}
+
+		const char* text = "x = a + 12 + b;\ny = 3;";
+		auto parse = [&]()
+		{
+			std::map<uuid_t, recorded_node> nodes;
+			if (peggml_parse_begin(handle, text) || record_nodes(nodes) < 0) return std::string("failed");
+			return render(nodes, peggml_get_root_uuid());
+		};
+		std::string uncached = parse();
+		TEST_ASSERT(uncached.size() > 50);
+
+		TEST_ASSERT(peggml_parser_enable_parse_cache(handle, 1 << 20) == 0);
+		TEST_ASSERT(parse() == uncached && parse() == uncached);
+		TEST_ASSERT(peggml_parser_get_cache_hits(handle) == 1 && peggml_parser_get_cache_misses(handle) == 1);
+		text = "x = ;";
+		parse();
+		parse();
+		TEST_ASSERT(peggml_parser_get_cache_misses(handle) == 3);
+		peggml_parser_destroy(handle);
+
+		parser p(grammar);
+		TEST_ASSERT(p);
+		p["Number"] = [](const SemanticValues& vs) { return vs.token_to_number<int>(); };
+		p["Sum"] = [](const SemanticValues& vs) { return vs.choice() == 0 ? vs.get<int>(0) + vs.get<int>(1) : vs.get<int>(0); };
+		p["Statement"] = [](const SemanticValues& vs) { return vs.get<int>(1); };
+		size_t entry_bytes;
+		{
+			ParseCache one(p, 1 << 20);
+			int value = 0;
+			TEST_ASSERT(one.parse("x = 1 + 2;", value) && value == 3);
+			entry_bytes = one.bytes();
+		}
+		ParseCache cache(p, entry_bytes * 2);
+		int value = 0;
+		TEST_ASSERT(cache.parse("x = 1 + 2;", value) && cache.parse("y = 4 + 2;", value));
+		TEST_ASSERT(cache.parse("x = 1 + 2;", value) && value == 3 && cache.hits() == 1);
+		TEST_ASSERT(cache.parse("z = 9 + 2;", value) && cache.size() == 2);
+		TEST_ASSERT(cache.parse("x = 1 + 2;", value) && cache.hits() == 2);
+		TEST_ASSERT(cache.parse("y = 4 + 2;", value) && value == 6 && cache.misses() == 4);
+
+		// the actions below a rule without one are called, on a hit as on
+		// a miss, though their values are dropped.
+		parser items(R"(
+			Program     <- Item*
+			Item        <- [a-z]
+		)");
+		TEST_ASSERT(items);
+		size_t calls = 0;
+		items["Item"] = [&](const SemanticValues&) { ++calls; };
+		TEST_ASSERT(items.parse("abcd") && calls == 4);
+		ParseCache item_cache(items, 1 << 20);
+		std::any dt;
+		Value result;
+		TEST_ASSERT(item_cache.parse("abcd", dt, result) && calls == 8);
+		TEST_ASSERT(item_cache.parse("abcd", dt, result) && calls == 12 && item_cache.hits() == 1);
+		TEST_END;
+	}
+
+	// the analysis flags grammars that rescan input, and passes those that don't.
+	int test_analyze()
+	{
+		TEST_INIT;
+		handle_t handle = peggml_parser_create(R"(
+			Program     <- (Statement / Comment / Scan)*
+			Statement   <- Name '=' Value ';' / Name '=' Value '.' / Call
+			Call        <- Name '(' Name ')' ';'
+			Value       <- '(' Value ')' '+' Value / '(' Value ')' / Number / Name
+			Comment     <- '#' ([a-z]+ ' '?)* ';'
+			Scan        <- '@' (!(Name* ';') Name)* ';'
+			Unused      <- 'x'
+			Name        <- < [a-z]+ >
+			Number      <- < [0-9]+ >
+			%whitespace <- [ \t\n]*
+		)");
+		TEST_ASSERT(handle >= 0);
+		std::string report = peggml_parser_analyze(handle);
+		auto has = [&](const char* hazard) { return report.find(hazard) != std::string::npos; };
+		TEST_ASSERT(has("\nStatement: shared prefix: in `Name '=' Value ';' / Name '=' Value '.' / Call`: alternatives 1 and 2 both start with `Name '=' Value`"));
+		TEST_ASSERT(has("\nStatement: overlapping first sets: in `Name '=' Value ';' / Name '=' Value '.' / Call`: alternatives 1 and 3 can both start with [a-z],"));
+		TEST_ASSERT(has("\nValue: needs memoization: alternatives 1 and 2 of `'(' Value ')' '+' Value / '(' Value ')' / Number / Name` both match it"));
+		TEST_ASSERT(has("Comment: nested repetition: `([a-z]+ ' '?)*` repeats what is mostly the repetition `[a-z]+`"));
+		TEST_ASSERT(has("\nScan: nested repetition: the lookahead `!(Name* ';')` in"));
+		TEST_ASSERT(has("\nUnused: unused rule:"));
+		TEST_ASSERT(std::count(report.begin(), report.end(), '\n') == 7);
+		peggml_parser_destroy(handle);
+
+		handle = peggml_parser_create(R"(
+			List        <- Item (',' Item)* !.
+			Item        <- Number / Name / '(' List ')'
+			Name        <- < [a-z]+ >
+			Number      <- < [0-9]+ >
+			%whitespace <- [ \t]*
+		)");
+		TEST_ASSERT(handle >= 0 && !strcmp(peggml_parser_analyze(handle), ""));
+		peggml_parser_destroy(handle);
+
+		// the alternatives grown from a left-recursive rule's seed do not
+		// overlap the ones it starts with.
+		handle = peggml_parser_create(R"(
+			Expr        <- Expr '+' Term / Expr '-' Term / Term
+			Term        <- Term '*' Number / Number
+			Number      <- < [0-9]+ >
+			%whitespace <- [ \t]*
+		)");
+		TEST_ASSERT(handle >= 0 && !strcmp(peggml_parser_analyze(handle), ""));
+		peggml_parser_destroy(handle);
+		TEST_END;
+	}
+
+	int test_profile()
+	{
+		TEST_INIT;
+		handle_t handle = peggml_parser_create(R"(
+			Additive    <- Multitive '+' Additive / Multitive
+			Multitive   <- Primary '*' Multitive / Primary
+			Primary     <- '(' Additive ')' / Number
+			Number      <- < [0-9]+ >
+			%whitespace <- [ \t]*
+		)");
+		TEST_ASSERT(handle >= 0);
+		peggml_parser_enable_packrat(handle);
+		peggml_parser_set_symbol_id(handle, "Number", 1);
+		TEST_ASSERT(peggml_profile_get_rule_count(handle) == 0);
+		TEST_ASSERT(peggml_parser_enable_profile(handle, 1) == 0);
+
+		std::map<uuid_t, recorded_node> nodes;
+		TEST_ASSERT(peggml_parse_begin(handle, "12 + (3 * 4)") == 0 && record_nodes(nodes) >= 0);
+		TEST_ASSERT(peggml_profile_get_rule_count(handle) == 4);
+		std::map<std::string, size_t> index;
+		for (size_t i = 0; i < 4; ++i)
+		{
+			index[peggml_profile_get_name(handle, i)] = i;
+			TEST_ASSERT(peggml_profile_get_invocations(handle, i) == peggml_profile_get_successes(handle, i) + peggml_profile_get_failures(handle, i));
+			TEST_ASSERT(peggml_profile_get_exclusive_time(handle, i) <= peggml_profile_get_inclusive_time(handle, i));
+		}
+		size_t number = index["Number"];
+		TEST_ASSERT(peggml_profile_get_invocations(handle, number) == 3 && peggml_profile_get_bytes(handle, number) == 6);
+		TEST_ASSERT(peggml_profile_get_memo_hits(handle, index["Multitive"]) == 2 && peggml_profile_get_memo_misses(handle, index["Multitive"]) == 4);
+		TEST_ASSERT(peggml_profile_get_memo_hits(handle, index["Primary"]) == 3);
+		TEST_ASSERT(peggml_profile_get_invocations(handle, 4) < 0);
+
+		std::string csv = peggml_profile_dump_csv(handle);
+		TEST_ASSERT(csv.find("\nNumber,3,3,0,0,3,6,") != std::string::npos && std::count(csv.begin(), csv.end(), '\n') == 5);
+		std::string json = peggml_profile_dump_json(handle);
+		TEST_ASSERT(json.find("{\"rule\":\"Number\",\"invocations\":3,\"successes\":3,\"failures\":0,") != std::string::npos);
+		TEST_ASSERT(json.front() == '[' && json.back() == ']' && std::count(json.begin(), json.end(), '{') == 4);
+
+		// a failed parse is counted too, and turning profiling off and on starts over.
+		TEST_ASSERT(peggml_parse_begin(handle, "12 +") == 0);
+		record_nodes(nodes);
+		TEST_ASSERT(peggml_profile_get_invocations(handle, number) == 4);
+		TEST_ASSERT(peggml_profile_get_failures(handle, index["Additive"]) == 1);
+		peggml_parser_enable_profile(handle, 0);
+		TEST_ASSERT(peggml_profile_get_rule_count(handle) == 0 && !strcmp(peggml_profile_dump_json(handle), "[]"));
+		peggml_parser_enable_profile(handle, 1);
+		TEST_ASSERT(peggml_profile_get_rule_count(handle) == 0);
+
+		// counting only gives the same counts, without times.
+		TEST_ASSERT(peggml_parser_enable_profile(handle, 3) == 2);
+		TEST_ASSERT(peggml_parser_enable_profile(handle, 2) == 0);
+		TEST_ASSERT(peggml_parse_begin(handle, "12 + (3 * 4)") == 0 && record_nodes(nodes) >= 0);
+		TEST_ASSERT(peggml_profile_get_rule_count(handle) == 4);
+		TEST_ASSERT(!strcmp(peggml_profile_get_name(handle, number), "Number"));
+		TEST_ASSERT(peggml_profile_get_invocations(handle, number) == 3 && peggml_profile_get_bytes(handle, number) == 6);
+		TEST_ASSERT(peggml_profile_get_inclusive_time(handle, number) == 0 && peggml_profile_get_exclusive_time(handle, number) == 0);
+		peggml_parser_enable_profile(handle, 1);
+		TEST_ASSERT(peggml_parse_begin(handle, "12 + (3 * 4)") == 0 && record_nodes(nodes) >= 0);
+		TEST_ASSERT(peggml_profile_get_inclusive_time(handle, number) > 0);
+		peggml_parser_destroy(handle);
+		TEST_END;
+	}
+
+	int test_trace()
+	{
+		TEST_INIT;
+		handle_t handle = peggml_parser_create(R"(
+			Additive    <- Multitive '+' Additive / Multitive
+			Multitive   <- Primary '*' Multitive / Primary
+			Primary     <- '(' Additive ')' / Number
+			Number      <- < [0-9]+ >
+			%whitespace <- [ \t]*
+		)");
+		TEST_ASSERT(handle >= 0);
+		peggml_parser_set_symbol_id(handle, "Number", 1);
+		TEST_ASSERT(peggml_trace_save(handle, "unused.json") == 2);
+		TEST_ASSERT(peggml_parser_enable_trace(handle, 1000) == 0);
+
+		std::map<uuid_t, recorded_node> nodes;
+		TEST_ASSERT(peggml_parse_begin(handle, "12 + 3") == 0 && record_nodes(nodes) >= 0);
+		// (without packrat parsing, Multitive and Primary are matched again.)
+		TEST_ASSERT(peggml_trace_get_event_count(handle) == 17 && peggml_trace_get_dropped(handle) == 0);
+
+		std::filesystem::path path = std::filesystem::temp_directory_path() / "peggml_test_trace.json";
+		TEST_ASSERT(peggml_trace_save(handle, path.string().c_str()) == 0);
+		std::ifstream in(path);
+		std::string json((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		in.close();
+		std::filesystem::remove(path);
+		TEST_ASSERT(json.rfind("{\"traceEvents\":[\n{\"name\":\"Number\",\"cat\":\"match\",\"ph\":\"X\",", 0) == 0);
+		TEST_ASSERT(json.find(",\"args\":{\"pos\":0,\"len\":6}}\n],\"displayTimeUnit\":\"ns\"}\n") != std::string::npos);
+		TEST_ASSERT(std::count(json.begin(), json.end(), '\n') == 19);
+
+		// the ring keeps the latest events.
+		TEST_ASSERT(peggml_parser_enable_trace(handle, 4) == 0);
+		TEST_ASSERT(peggml_parse_begin(handle, "12 + 3") == 0 && record_nodes(nodes) >= 0);
+		TEST_ASSERT(peggml_trace_get_event_count(handle) == 4 && peggml_trace_get_dropped(handle) == 13);
+		peggml_trace_clear(handle);
+		TEST_ASSERT(peggml_trace_get_event_count(handle) == 0 && peggml_trace_get_dropped(handle) == 0);
+		peggml_parser_destroy(handle);
+
+		Trace trace(3);
+		parser p(R"(
+			List   <- Item (',' Item)*
+			Item   <- [a-z]
+		)");
+		TEST_ASSERT(p);
+		p.set_trace(&trace);
+		p.parse("a,b,1");
+		TEST_ASSERT(trace.size() == 3 && trace.dropped() == 1);
+		TEST_ASSERT(trace[0].pos == 2 && trace[1].pos == 4 && trace[2].pos == 0 && trace[2].len == 3);
+		TEST_ASSERT(trace[1].len == static_cast<size_t>(-1));
+		TEST_ASSERT(trace.rule(trace[2].rule)->name == "List" && trace[2].start <= trace[0].start);
+		TEST_ASSERT(trace[2].duration >= trace[0].duration + trace[1].duration);
+		std::ostringstream out;
+		trace.write_chrome_json(out);
+		TEST_ASSERT(out.str().find("{\"name\":\"Item\",\"cat\":\"fail\",") != std::string::npos);
+		TEST_ASSERT(out.str().find(",\"args\":{\"pos\":4}}") != std::string::npos);
+
+		// without instrumentation, neither the trace nor the callbacks see the parse.
+		size_t calls = 0;
+		p.enable_trace(
+			[&](const Ope&, const char*, size_t, const SemanticValues&, const Context&, const std::any&) { ++calls; },
+			[&](const Ope&, const char*, size_t, const SemanticValues&, const Context&, const std::any&, size_t) {}
+		);
+		TEST_ASSERT(p.instrumentation() == Instrumentation::trace);
+		p.parse("a,b");
+		TEST_ASSERT(calls > 0 && trace.dropped() == 4);
+		calls = 0;
+		p.set_instrumentation(Instrumentation::off);
+		p.parse("a,b");
+		TEST_ASSERT(calls == 0 && trace.dropped() == 4);
+		TEST_END;
+	}
+
+	int test_memory_stats()
+	{
+		TEST_INIT;
+		const char* grammar = R"(
+			Additive    <- Multitive '+' Additive / Multitive
+			Multitive   <- Primary '*' Multitive / Primary
+			Primary     <- '(' Additive ')' / Number
+			Number      <- < [0-9]+ >
+			%whitespace <- [ \t]*
+		)";
+		handle_t handle = peggml_parser_create(grammar);
+		TEST_ASSERT(handle >= 0);
+		handle_t larger = peggml_parser_create((std::string(grammar) + "Unused <- 'a' / 'b' / 'c' / 'd'").c_str());
+		TEST_ASSERT(larger >= 0);
+		TEST_ASSERT(peggml_memory_get_grammar_bytes(handle) > 1000);
+		TEST_ASSERT(peggml_memory_get_grammar_bytes(larger) > peggml_memory_get_grammar_bytes(handle));
+		peggml_parser_destroy(larger);
+
+		peggml_parser_set_symbol_id(handle, "Number", 1);
+		std::map<uuid_t, recorded_node> nodes;
+		TEST_ASSERT(peggml_parse_begin(handle, "1 + (2 * (3 + 4))") == 0 && record_nodes(nodes) >= 0);
+		TEST_ASSERT(peggml_memory_get_packrat_bytes() == 0);
+		TEST_ASSERT(peggml_memory_get_value_stack_frames() > 5);
+		size_t frames = peggml_memory_get_value_stack_frames();
+		TEST_ASSERT(peggml_memory_get_value_stack_bytes() >= frames * sizeof(SemanticValues));
+		// (only the outermost scope: the grammar has no captures.)
+		TEST_ASSERT(peggml_memory_get_capture_scope_bytes() <= sizeof(size_t));
+		TEST_ASSERT(peggml_memory_get_callstack_reserved() >= peggml_get_stack_size());
+		TEST_ASSERT(peggml_memory_get_callstack_committed() > 0);
+		TEST_ASSERT(peggml_memory_get_callstack_committed() <= peggml_memory_get_callstack_reserved());
+
+		// deeper nesting takes more frames; packrat parsing keeps results.
+		peggml_parser_enable_packrat(handle);
+		TEST_ASSERT(peggml_parse_begin(handle, "((((((1))))))") == 0 && record_nodes(nodes) >= 0);
+		TEST_ASSERT(peggml_memory_get_value_stack_frames() > frames);
+		TEST_ASSERT(peggml_memory_get_packrat_bytes() > 0);
+
+		TEST_ASSERT(peggml_memory_get_memo_bytes() == 0);
+		handle_t session = peggml_session_create(handle);
+		TEST_ASSERT(peggml_parse_edit(session, 0, 0, "1 + 2") == 0 && record_nodes(nodes) >= 0);
+		TEST_ASSERT(peggml_memory_get_memo_bytes() > 0);
+		peggml_session_destroy(session);
+		TEST_ASSERT(peggml_memory_get_memo_bytes() == 0);
+
+		std::string stats = peggml_get_memory_stats();
+		TEST_ASSERT(stats.front() == '{' && stats.back() == '}' && std::count(stats.begin(), stats.end(), ':') == 10);
+		TEST_ASSERT(stats.find(strprintf("\"grammar_bytes\":%.0f,", peggml_memory_get_grammar_bytes(handle))) != std::string::npos);
+		TEST_ASSERT(peggml_memory_get_string_buffer_bytes() >= stats.size());
+		peggml_parser_destroy(handle);
+		TEST_END;
+	}
+
+	// a back reference matches the innermost capture still in scope: those
+	// of a failed alternative or predicate are dropped.
+	int test_captures()
+	{
+		TEST_INIT;
+		parser p(R"(
+			Doc   <- Tag ':' $tag
+			Tag   <- $tag<[a-z]+>
+		)");
+		TEST_ASSERT(p);
+		p.log = nullptr;
+		TEST_ASSERT(p.parse("ab:ab"));
+		TEST_ASSERT(!p.parse("ab:cd"));
+		TEST_ASSERT(!p.parse("ab:a"));
+
+		parser last(R"(
+			Doc   <- ($x<[a-z]> / '-')* '=' $x
+		)");
+		TEST_ASSERT(last);
+		last.log = nullptr;
+		TEST_ASSERT(last.parse("ab-=b"));
+		TEST_ASSERT(!last.parse("ab-=a"));
+
+		parser scoped(R"(
+			Doc   <- $x<[a-z]> ($x<[a-z]> '!' / [a-z] '?') &($x<[a-z]>) $($x<[a-z]>) [a-z] '=' $x
+		)");
+		TEST_ASSERT(scoped);
+		scoped.log = nullptr;
+		TEST_ASSERT(scoped.parse("ab!cd=b"));
+		TEST_ASSERT(scoped.parse("ab?cd=a"));
+		TEST_ASSERT(!scoped.parse("ab?cd=b"));
+		TEST_ASSERT(!scoped.parse("ab!cd=c"));
+
+		// only a grammar with captures keeps their scopes.
+		ParseMemory with, without;
+		scoped.set_parse_memory(&with);
+		TEST_ASSERT(scoped.parse("ab!cd=b"));
+		parser plain(R"(
+			Doc   <- ([a-z] / '-')* '=' [a-z]
+		)");
+		TEST_ASSERT(plain);
+		plain.set_parse_memory(&without);
+		TEST_ASSERT(plain.parse("ab-=b"));
+		TEST_ASSERT(with.capture_scope_bytes > without.capture_scope_bytes);
+		TEST_ASSERT(without.capture_scope_bytes <= sizeof(size_t));
+		TEST_END;
+	}
+
+	// a grammar compiled ahead of time by peggml_codegen parses as its source
+	// does when compiled at runtime: to the same trees, or the same errors.
+	int test_static_grammar()
+	{
+		TEST_INIT;
+		auto iter = static_grammars().find("arithmetic");
+		if (iter == static_grammars().end())
+		{
+			printf("(no static grammars were generated.)\n");
+			TEST_END;
+		}
+		handle_t compiled = peggml_parser_create_static("arithmetic");
+		handle_t interpreted = peggml_parser_create(iter->second.source);
+		TEST_ASSERT(compiled >= 0 && interpreted >= 0);
+		const char* symbols[] = { "Expression", "Sum", "Product", "Unary", "Primary", "Call", "SumOp", "ProductOp", "Number", "String", "Name" };
+		for (size_t i = 0; i < 11; ++i)
+		{
+			TEST_ASSERT(peggml_parser_set_symbol_id(compiled, symbols[i], i + 1) == 0);
+			TEST_ASSERT(peggml_parser_set_symbol_id(interpreted, symbols[i], i + 1) == 0);
+		}
+
+		auto parse = [&](handle_t handle, const std::string& text)
+		{
+			std::map<uuid_t, recorded_node> nodes;
+			if (peggml_parse_begin(handle, text.c_str()) || record_nodes(nodes) < 0)
+			{
+				return std::string("exception");
+			}
+			return render(nodes, peggml_get_root_uuid());
+		};
+
+		// syntax errors are only logged, so they are compared on the parsers themselves.
+		std::unique_ptr<parser> compiled_parser = iter->second.make_parser();
+		parser interpreted_parser(iter->second.source);
+		TEST_ASSERT(compiled_parser && interpreted_parser);
+		std::string compiled_errors, interpreted_errors;
+		compiled_parser->log = [&](size_t line, size_t col, const std::string& msg) {
+			compiled_errors += strprintf("%zu:%zu: %s\n", line, col, msg.c_str());
+		};
+		interpreted_parser.log = [&](size_t line, size_t col, const std::string& msg) {
+			interpreted_errors += strprintf("%zu:%zu: %s\n", line, col, msg.c_str());
+		};
+
+		std::vector<std::string> inputs = {
+			"1 + 2 * 3", "-(x - $ff) mod 2", "f(a, \"b\", g()) div y_1", "1.5 /", "mod", "modx + 1", "\"open", "(1", "",
+		};
+		std::mt19937 random(50);
+		const std::string alphabet = "0123456789$.abdfimoxy_+-*/%(),\" \n";
+		for (size_t i = 0; i < 2000; ++i)
+		{
+			std::string text(random() % 16, ' ');
+			for (char& ch : text)
+			{
+				ch = alphabet[random() % alphabet.size()];
+			}
+			inputs.push_back(text);
+		}
+
+		size_t parsed = 0;
+		bool same = true;
+		for (int packrat = 0; packrat < 2; ++packrat)
+		{
+			if (packrat)
+			{
+				peggml_parser_enable_packrat(compiled);
+				peggml_parser_enable_packrat(interpreted);
+				compiled_parser->enable_packrat_parsing();
+				interpreted_parser.enable_packrat_parsing();
+			}
+			for (const auto& text : inputs)
+			{
+				std::string expected = parse(interpreted, text);
+				same = same && parse(compiled, text) == expected;
+				parsed += expected != "?";
+
+				compiled_errors.clear();
+				interpreted_errors.clear();
+				bool ok = interpreted_parser.parse(text);
+				same = same && compiled_parser->parse(text) == ok && compiled_errors == interpreted_errors;
+				same = same && ok == (expected != "?") && ok == interpreted_errors.empty();
+			}
+		}
+		TEST_ASSERT(same);
+		TEST_ASSERT(parsed > 100 && parsed < 2 * inputs.size());
+		peggml_parser_destroy(compiled);
+		peggml_parser_destroy(interpreted);
+		TEST_END;
+	}
+
+	// a left-recursive rule reduces left-associatively, and is grown
+	// iteratively rather than recursing per operand.
+	int test_left_recursion()
+	{
+		TEST_INIT;
+		parser p(R"(
+			Sum     <- Sum '-' Number / Number
+			Number  <- < [0-9]+ >
+		)");
+		TEST_ASSERT(p);
+		p["Sum"] = [](const SemanticValues& vs) { return vs.choice() == 0 ? vs.get<int>(0) - vs.get<int>(1) : vs.get<int>(0); };
+		p["Number"] = [](const SemanticValues& vs) { return vs.token_to_number<int>(); };
+
+		int value = 0;
+		TEST_ASSERT(p.parse("10-3-2", value) && value == 5);
+
+		std::string input = "0";
+		for (size_t i = 0; i < 200000; ++i)
+		{
+			input += "-1";
+		}
+		TEST_ASSERT(p.parse(input, value) && value == -200000);
+		TEST_END;
+	}
+
+	// precedence climbing builds the same trees, and reports the same errors,
+	// whether or not the operators' matches come from the packrat cache.
+	int test_precedence_climbing()
+	{
+		TEST_INIT;
+		const char* grammar = R"(
+			Expression  <- Infix(Atom, Operator)
+			Atom        <- Number / '(' Expression ')' / Negation
+			Negation    <- '-' Atom
+			Operator    <- < '<<' / '<=' / '<' / '==' / '=' / '+' / '-' / '**' / '*' / '/' >
+			Number      <- < [0-9]+ >
+			%whitespace <- [ \t]*
+			Infix(A, O) <- A (O A)* {
+				precedence
+					R =
+					L == < <=
+					L <<
+					L + -
+					L * /
+					R **
+			}
+		)";
+		parser plain(grammar), packrat(grammar);
+		TEST_ASSERT(plain && packrat);
+		plain.enable_ast();
+		packrat.enable_ast();
+		packrat.enable_packrat_parsing();
+		std::string plain_errors, packrat_errors;
+		plain.log = [&](size_t line, size_t col, const std::string& msg) {
+			plain_errors += strprintf("%zu:%zu: %s\n", line, col, msg.c_str());
+		};
+		packrat.log = [&](size_t line, size_t col, const std::string& msg) {
+			packrat_errors += strprintf("%zu:%zu: %s\n", line, col, msg.c_str());
+		};
+
+		const char* operators[] = { "<<", "<=", "<", "==", "=", "+", "-", "**", "*", "/" };
+		std::mt19937 random(34);
+		std::function<std::string(int)> expression = [&](int depth)
+		{
+			std::string text;
+			size_t operands = 1 + random() % 4;
+			for (size_t i = 0; i < operands; ++i)
+			{
+				if (i > 0)
+				{
+					text += random() % 2 ? " " : "";
+					text += operators[random() % 10];
+					text += random() % 2 ? " " : "";
+				}
+				switch (depth > 0 ? random() % 4 : 0)
+				{
+					case 0: case 1: text += std::to_string(random() % 100); break;
+					case 2: text += "(" + expression(depth - 1) + ")"; break;
+					case 3: text += "-" + expression(depth - 1); break;
+				}
+			}
+			return text;
+		};
+
+		size_t parsed = 0, failed = 0;
+		bool same = true;
+		for (size_t i = 0; i < 3000; ++i)
+		{
+			std::string text = expression(3);
+			if (i % 4 == 3)
+			{
+				// damage one character in a quarter of the inputs.
+				text[random() % text.size()] = "()<=*- x"[random() % 8];
+			}
+			std::shared_ptr<Ast> plain_ast, packrat_ast;
+			plain_errors.clear();
+			packrat_errors.clear();
+			bool ok = plain.parse(text, plain_ast);
+			same = same && packrat.parse(text, packrat_ast) == ok && plain_errors == packrat_errors;
+			if (ok)
+			{
+				same = same && plain_ast && packrat_ast && ast_to_s(plain_ast) == ast_to_s(packrat_ast);
+			}
+			++(ok ? parsed : failed);
+		}
+		TEST_ASSERT(same);
+		TEST_ASSERT(parsed > 2000 && failed > 200);
+
+		std::function<std::string(const Ast&)> group = [&](const Ast& node)
+		{
+			if (node.is_token) return std::string(node.token);
+			if (node.nodes.size() == 1) return group(*node.nodes[0]);
+			std::string text;
+			for (const auto& child : node.nodes)
+			{
+				text += (text.empty() ? "(" : " ") + group(*child);
+			}
+			return text + ")";
+		};
+		std::shared_ptr<Ast> ast;
+		TEST_ASSERT(packrat.parse("1 <= 2 ** 3 ** 4 * 5 - 6", ast));
+		TEST_ASSERT(group(*ast) == "(1 <= (((2 ** (3 ** 4)) * 5) - 6))");
+		// after "*", the operators "<<" and "==" are matched again by the
+		// outer levels, from the cache.
+		TEST_ASSERT(packrat.parse("1 = 2 < 3 * 4 << 5 == 6", ast));
+		TEST_ASSERT(group(*ast) == "(1 = ((2 < ((3 * 4) << 5)) == 6))");
+		TEST_END;
+	}
+
+	// prioritized choices only try the alternatives which can start with the
+	// next byte, with the same results as trying them all. The tracer turns
+	// the dispatch off.
+	int test_choice_dispatch()
+	{
+		TEST_INIT;
+		const char* grammar = R"(
+			Document  <- '(' Raw '!' / List
+			Raw       <- [^!]*
+			List      <- Item (',' Item)* !.
+			Item      <- Call / Name / Number / String / 'nil'i / At / '(' List? ')'
+			Call      <- Name '(' (Item (',' Item)*)? ')'
+			Name      <- < [a-zA-Z_\xc3\xa9] [a-zA-Z0-9_]* >
+			Number    <- < '-'? [0-9]+ >
+			String    <- '"' < (!'"' .)* > '"'
+			At        <- '@' Name
+			%whitespace <- [ \t]*
+		)";
+		parser dispatched(grammar), traced(grammar);
+		TEST_ASSERT(dispatched && traced);
+		dispatched.enable_ast();
+		traced.enable_ast();
+		traced.enable_trace([](const Ope&, const char*, size_t, const SemanticValues&, const Context&, const std::any&) {},
+			[](const Ope&, const char*, size_t, const SemanticValues&, const Context&, const std::any&, size_t) {});
+		size_t dispatched_calls = 0, traced_calls = 0;
+		dispatched["Call"].enter = [&](const char*, size_t, std::any&) { ++dispatched_calls; };
+		traced["Call"].enter = [&](const char*, size_t, std::any&) { ++traced_calls; };
+
+		std::mt19937 random(27);
+		const std::string alphabet = "aaZ_99-\"(),,@nNiIl \xc3\xa9;";
+		size_t parsed = 0;
+		bool same = true;
+		for (size_t i = 0; i < 5000; ++i)
+		{
+			std::string text(1 + random() % 12, ' ');
+			for (char& ch : text)
+			{
+				ch = alphabet[random() % alphabet.size()];
+			}
+			std::shared_ptr<Ast> dispatched_ast, traced_ast;
+			bool ok = traced.parse(text, traced_ast);
+			same = same && dispatched.parse(text, dispatched_ast) == ok;
+			if (ok)
+			{
+				same = same && ast_to_s(dispatched_ast) == ast_to_s(traced_ast);
+				++parsed;
+			}
+		}
+		TEST_ASSERT(same);
+		TEST_ASSERT(parsed > 500 && parsed < 4500);
+		TEST_ASSERT(dispatched_calls < traced_calls);
+
+		// an error is reported where, and as, it would be if every
+		// alternative had been tried. In "(;;", the first alternative of
+		// Document fails further on than the Item at ';', none of whose
+		// alternatives is then tried.
+		auto syntax_error = [](parser& p, const char* text)
+		{
+			std::string message;
+			p.log = [&](size_t line, size_t col, const std::string& msg) {
+				message = strprintf("%zu:%zu: %s", line, col, msg.c_str());
+			};
+			bool ok = p.parse(text);
+			p.log = nullptr;
+			return ok ? std::string() : message;
+		};
+		const char* inputs[] = { "(;;", "a, ;", "f(1, ;)", "f(1, \"x)", "@1", "" };
+		for (const char* text : inputs)
+		{
+			std::string expected = syntax_error(traced, text);
+			TEST_ASSERT(!expected.empty() && syntax_error(dispatched, text) == expected);
+		}
+		TEST_ASSERT(syntax_error(dispatched, "(;;") == "1:4: syntax error.");
+		TEST_ASSERT(syntax_error(dispatched, "f(1, ;)") == "1:6: syntax error, unexpected ';', expecting <Number>, <Name>, <Call>.");
+		TEST_END;
+	}
+
+	// a character class matches ASCII through its bitmap and other characters
+	// through its merged ranges, as it did by trying each range in turn.
+	int test_character_class()
+	{
+		TEST_INIT;
+		using ranges_t = std::vector<std::pair<char32_t, char32_t>>;
+		std::vector<ranges_t> classes = {
+			{ { 'a', 'z' } },
+			{ { 'a', 'c' }, { 'd', 'f' }, { 'h', 'h' } },		// adjacent
+			{ { 'm', 'z' }, { 'a', 'n' }, { 'c', 'e' } },		// overlapping, unsorted
+			{ { 'z', 'a' }, { 'q', 'q' } },						// (an empty range)
+			{ { 0, 0x7f } },
+			{ { 0x7f, 0x80 }, { 0xe9, 0xe9 }, { 0xe8, 0xea } },	// across the ASCII boundary
+			{ { 0x400, 0x4ff }, { 0x300, 0x3ff }, { '0', '9' } },
+			{ { 0xd7ff, 0xe000 }, { 0xffff, 0x10000 }, { 0x10fffe, 0x10ffff } },
+		};
+
+		std::vector<std::string> inputs = { "\x80", "\xbf", "\xff", "\xc3", "\xe2\x82", "\xf0\x9f\x98" };
+		for (char32_t cp = 0; cp < 0x600; ++cp)
+		{
+			inputs.push_back(encode_codepoint(cp));
+		}
+		for (char32_t cp : { 0xd7ffu, 0xe000u, 0xfffeu, 0xffffu, 0x10000u, 0x10001u, 0x10fffeu, 0x10ffffu })
+		{
+			inputs.push_back(encode_codepoint(cp));
+		}
+
+		bool same = true;
+		size_t matched = 0;
+		for (const auto& ranges : classes)
+		{
+			for (bool negated : { false, true })
+			{
+				CharacterClass cls(ranges, negated);
+				for (const auto& text : inputs)
+				{
+					char32_t cp = 0;
+					size_t len = decode_codepoint(text.data(), text.size(), cp);
+					bool in_range = std::any_of(ranges.begin(), ranges.end(), [&](const auto& range) {
+						return range.first <= cp && cp <= range.second;
+					});
+					size_t expected = in_range != negated ? len : static_cast<size_t>(-1);
+					same = same && cls.match(text.data(), text.size()) == expected;
+					matched += success(expected);
+				}
+			}
+		}
+		TEST_ASSERT(same);
+		TEST_ASSERT(matched > inputs.size() * classes.size() / 2);
+
+		// merged: adjacent and overlapping ranges become one.
+		TEST_ASSERT(CharacterClass(classes[1], false).merged_ranges_ == ranges_t({ { 'a', 'f' }, { 'h', 'h' } }));
+		TEST_ASSERT(CharacterClass(classes[2], false).merged_ranges_ == ranges_t({ { 'a', 'z' } }));
+		TEST_ASSERT(CharacterClass("a-cd-fh", false).merged_ranges_ == ranges_t({ { 'a', 'f' }, { 'h', 'h' } }));
+
+		// in a grammar, negated and with non-ASCII characters.
+		parser p(R"(
+			Doc   <- [^a-c\u00e9-\u00ff]+ [a-c\u00e9]*
+		)");
+		TEST_ASSERT(p);
+		TEST_ASSERT(p.parse("xyz\xc3\xa8" "ab\xc3\xa9" "c"));
+		TEST_ASSERT(!p.parse("xyz\xc3\xaa"));
+		TEST_ASSERT(!p.parse("a"));
+		TEST_ASSERT(p.parse("\xd0\x96" "a"));
+		TEST_END;
+	}
+
+	// a repetition lowered to a span matches, and reports errors, as one
+	// bounded by a count (which is left as it is) does: whichever lane of the
+	// vector the run stops at, and over runs longer than a vector.
+	int test_span()
+	{
+		TEST_INIT;
+		struct span_case
+		{
+			const char* span;
+			const char* repetition;
+			std::vector<std::string> run;	// (characters the run is made of)
+			std::vector<std::string> stop;	// (characters that end it)
+		};
+		std::vector<span_case> cases = {
+			{ "[a-z0-9_]*", "[a-z0-9_]{0,1000000}", { "a", "z", "_", "5" }, { "\"", "`", "{", "/", ":", "^", "\x7f", "\xc3\xa9", "\x80" } },
+			{ "[a-z0-9_]+", "[a-z0-9_]{1,1000000}", { "q", "0" }, { "\"", " ", "\xc3" } },
+			{ "[^\"\\\\]*", "[^\"\\\\]{0,1000000}", { "a", " ", "\x01", "\xc3\xa9", "\xe2\x82\xac" }, { "\"", "\\" } },
+			{ "[a-cf-hk-mp-rx-z]*", "[a-cf-hk-mp-rx-z]{0,1000000}", { "a", "h", "z" }, { "\"", "d", "e", "i", "w", "{" } },
+			{ "[a-z\u00e9]+", "[a-z\u00e9]{1,1000000}", { "m", "\xc3\xa9" }, { "\"", "\xc3\xa8", "\xc3" } },
+			{ "(!'*/' .)*", "(!'*/' .){0,1000000}", { "a", "*", "/", "\xc3\xa9" }, { "*/", "\xc3", "\xf0\x9f" } },
+		};
+
+		std::mt19937 random(29);
+		bool same = true;
+		size_t runs = 0;
+		for (const auto& test : cases)
+		{
+			auto make = [&](const char* body, std::string& errors)
+			{
+				auto p = std::make_unique<parser>(strprintf("Doc <- '\"' Body '\"' !.\nBody <- %s\n", body).c_str());
+				p->log = [&errors](size_t line, size_t col, const std::string& msg) {
+					errors += strprintf("%zu:%zu: %s\n", line, col, msg.c_str());
+				};
+				return p;
+			};
+			std::string span_errors, repetition_errors;
+			auto span = make(test.span, span_errors);
+			auto repetition = make(test.repetition, repetition_errors);
+			TEST_ASSERT(*span && *repetition);
+			TEST_ASSERT(dynamic_cast<Span*>((*span)["Body"].get_core_operator().get()));
+			TEST_ASSERT(!dynamic_cast<Span*>((*repetition)["Body"].get_core_operator().get()));
+
+			for (size_t length = 0; length < 80; ++length)
+			{
+				std::string run;
+				for (size_t i = 0; i < length; ++i)
+				{
+					run += test.run[random() % test.run.size()];
+				}
+				std::vector<std::string> texts = { "\"" + run + "\"", "\"" + run };
+				for (const auto& stop : test.stop)
+				{
+					texts.push_back("\"" + run + stop + "\"");
+					texts.push_back("\"" + run + stop + "xy");
+				}
+				for (const auto& text : texts)
+				{
+					span_errors.clear();
+					repetition_errors.clear();
+					bool ok = repetition->parse(text);
+					same = same && span->parse(text) == ok && span_errors == repetition_errors;
+					runs += ok;
+				}
+			}
+		}
+		TEST_ASSERT(same);
+		TEST_ASSERT(runs > 200);
+
+		// a negated class matches an invalid byte with no length, so the
+		// repetition never got past it; the span stops there.
+		std::string errors;
+		parser negated(R"(
+			Doc   <- '"' [^"]* '"'
+		)");
+		TEST_ASSERT(negated);
+		negated.log = [&](size_t line, size_t col, const std::string& msg) {
+			errors += strprintf("%zu:%zu: %s", line, col, msg.c_str());
+		};
+		std::string text = "\"" + std::string(40, 'a') + "\xff\"";
+		TEST_ASSERT(!negated.parse(text) && errors.compare(0, 5, "1:42:") == 0);
+		TEST_END;
+	}
+
+	// counts its live instances, to check that values are destroyed once.
+	struct counted
+	{
+		static int live;
+		std::string text;
+		counted(const char* t) : text(t) { ++live; }
+		counted(const counted& rhs) : text(rhs.text) { ++live; }
+		~counted() { --live; }
+	};
+	int counted::live = 0;
+
+	// a semantic value holds small trivially copyable values inline, and
+	// boxes others; either way it copies, moves and destroys them as std::any
+	// would.
+	int test_value()
+	{
+		TEST_INIT;
+		struct pair_t { double a, b; };
+
+		// inline values are not allocated; boxed ones are, once per copy.
+		size_t allocations = g_allocation_count;
+		Value number(2.5), id(static_cast<uint32_t>(7)), pointer(&counted::live);
+		TEST_ASSERT(g_allocation_count == allocations);
+		Value pair(pair_t{ 1, 2 }), text(std::string("a string too long to be stored in small-string buffers"));
+		TEST_ASSERT(g_allocation_count == allocations + 3);
+
+		TEST_ASSERT(number.get<double>() == 2.5 && id.get<uint32_t>() == 7 && *pointer.get<int*>() == counted::live);
+		TEST_ASSERT(pair.get<pair_t>().b == 2 && text.get<std::string>().size() == 54);
+		TEST_ASSERT(!number.get_if<float>() && !number.get_if<int64_t>() && !text.get_if<const char*>());
+		bool thrown = false;
+		try { id.get<int>(); } catch (const std::bad_any_cast&) { thrown = true; }
+		TEST_ASSERT(thrown);
+
+		// copies are independent.
+		Value number_copy(number), text_copy(text);
+		number_copy.get<double>() = 3;
+		text_copy.get<std::string>() += "!";
+		TEST_ASSERT(number.get<double>() == 2.5 && number_copy.get<double>() == 3);
+		TEST_ASSERT(text.get<std::string>().size() == 54 && text_copy.get<std::string>().size() == 55);
+		number_copy = text;
+		TEST_ASSERT(number_copy.get<std::string>() == text.get<std::string>() && !number_copy.get_if<double>());
+		number_copy = number_copy;
+		TEST_ASSERT(number_copy.get<std::string>().size() == 54);
+
+		// moves take the value without copying it, and leave the source empty.
+		allocations = g_allocation_count;
+		const std::string* address = &text.get<std::string>();
+		Value moved(std::move(text));
+		TEST_ASSERT(!text.has_value() && !text.get_if<std::string>() && &moved.get<std::string>() == address);
+		Value moved_number(std::move(number));
+		TEST_ASSERT(!number.has_value() && moved_number.get<double>() == 2.5);
+		number = std::move(moved);
+		TEST_ASSERT(!moved.has_value() && &number.get<std::string>() == address);
+		TEST_ASSERT(g_allocation_count == allocations);
+
+		// values from std::any are looked into; an empty one gives an empty value.
+		Value any_number(std::any(4.0)), any_empty(std::any{});
+		TEST_ASSERT(any_number.get<double>() == 4.0 && !any_empty.has_value());
+
+		// boxed values are destroyed once, whether copied, moved, reassigned or reset.
+		{
+			Value a(counted("a")), b(a), c(std::move(b));
+			TEST_ASSERT(counted::live == 2);
+			Value d(std::any(counted("d")));
+			TEST_ASSERT(counted::live == 3);
+			b = d;
+			a = 1;
+			TEST_ASSERT(counted::live == 3 && b.get<counted>().text == "d");
+			d.reset();
+			TEST_ASSERT(counted::live == 2);
+			SemanticValues vs;
+			vs.emplace_back(c);
+			vs.emplace_back(std::move(b));
+			TEST_ASSERT(counted::live == 3 && vs.get<counted>(0).text == "a" && vs.get<counted>(1).text == "d");
+		}
+		TEST_ASSERT(counted::live == 0);
+
+		// actions may return plain values or std::any.
+		parser p(R"(
+			Sum     <- Number ('+' Number)*
+			Number  <- < [0-9]+ >
+		)");
+		TEST_ASSERT(p);
+		p["Sum"] = [](const SemanticValues& vs) {
+			double sum = 0;
+			for (size_t i = 0; i < vs.size(); ++i)
+			{
+				sum += vs.get<double>(i);
+			}
+			return std::any(sum);
+		};
+		p["Number"] = [](const SemanticValues& vs) { return vs.token_to_number<double>(); };
+		double sum = 0;
+		TEST_ASSERT(p.parse("1+2+39", sum) && sum == 42);
+		TEST_END;
+	}
+
+	// longest-prefix lookup by probing a map with every prefix, as Trie used to.
+	size_t map_match(const std::map<std::string, bool, std::less<>>& dic, const char* text, size_t text_len)
+	{
+		size_t match_len = 0;
+		for (size_t len = 1; len <= text_len; ++len)
+		{
+			auto it = dic.find(std::string_view(text, len));
+			if (it == dic.end()) break;
+			if (it->second) match_len = len;
+		}
+		return match_len;
+	}
+
+	// the prefixes of the items (lowercased, if ignoring case), each marked
+	// with whether it is a whole item, for map_match.
+	std::map<std::string, bool, std::less<>> prefix_map(const std::vector<std::string>& items, bool ignore_case)
+	{
+		std::map<std::string, bool, std::less<>> dic;
+		for (const auto& item : items)
+		{
+			for (size_t len = 1; len <= item.size(); ++len)
+			{
+				std::string prefix = item.substr(0, len);
+				if (ignore_case)
+				{
+					for (auto& ch : prefix) ch = static_cast<char>(std::tolower(static_cast<unsigned char>(ch)));
+				}
+				dic[prefix] |= len == item.size();
+			}
+		}
+		return dic;
+	}
+
+	// GML-like function names, and a text of them: whole, cut short, behind
+	// a capitalised prefix, or behind another character.
+	std::vector<std::string> dictionary_items()
+	{
+		const char* prefixes[] = { "draw_", "ds_list_", "ds_map_", "ds_grid_", "instance_", "sprite_", "surface_", "buffer_", "audio_", "string_", "file_text_", "layer_", "camera_", "physics_", "path_", "room_" };
+		const char* suffixes[] = { "create", "destroy", "add", "get", "set", "exists", "count", "clear", "copy", "find", "delete", "read", "write", "size", "free", "get_width", "get_height", "set_colour" };
+		std::vector<std::string> items;
+		for (auto prefix : prefixes)
+		{
+			for (auto suffix : suffixes)
+			{
+				items.push_back(std::string(prefix) + suffix);
+			}
+		}
+		return items;
+	}
+
+	std::string dictionary_text(const std::vector<std::string>& items, size_t count)
+	{
+		std::string text;
+		for (size_t i = 0; i < count; ++i)
+		{
+			const auto& item = items[(i * 7919) % items.size()];
+			switch (i % 4)
+			{
+			case 0: text += item; break;
+			case 1: text += item.substr(0, item.size() / 2); break;
+			case 2: text += "DRAW_" + item; break;
+			default: text += "x" + item; break;
+			}
+			text += ' ';
+		}
+		return text;
+	}
+
+	// the minimal DFA of a Trie finds the same longest items as looking up
+	// every prefix, with and without case.
+	int test_trie()
+	{
+		TEST_INIT;
+		auto check = [](const std::vector<std::string>& items, const std::string& text)
+		{
+			Trie trie(items), triei(items, true);
+			auto dic = prefix_map(items, false), dici = prefix_map(items, true);
+			std::string lower = text;
+			for (auto& ch : lower) ch = static_cast<char>(std::tolower(static_cast<unsigned char>(ch)));
+			for (size_t i = 0; i <= text.size(); ++i)
+			{
+				// (and cut short, at every length from there.)
+				for (size_t n = text.size() - i; ; n /= 2)
+				{
+					if (trie.match(text.data() + i, n) != map_match(dic, text.data() + i, n)) return false;
+					if (triei.match(text.data() + i, n) != map_match(dici, lower.data() + i, n)) return false;
+					if (n == 0) break;
+				}
+			}
+			return true;
+		};
+
+		auto items = dictionary_items();
+		TEST_ASSERT(check(items, dictionary_text(items, 2000)));
+
+		// items that are prefixes and suffixes of each other share states.
+		std::vector<std::string> nested = { "a", "ab", "abc", "b", "bc", "xbc", "c", "cab", "Ab", "ABC", "" };
+		TEST_ASSERT(check(nested, "abcabcxbcABCaBcxxcab abab bc AbC"));
+		std::vector<std::string> bytes = { "\xc3\xa9", "\xc3\xa9t\xc3\xa9", "\xff", std::string("\0a", 2), "\xc3\x89T" };
+		TEST_ASSERT(check(bytes, std::string("\xc3\xa9t\xc3\xa9\xc3\xa9T\xff\0a\0\xc3\x89t\xc3", 16)));
+
+		Trie trie(nested), none, empty(std::vector<std::string>{ "" });
+		TEST_ASSERT(trie.max_length() == 3 && !trie.ignore_case() && Trie(nested, true).ignore_case());
+		TEST_ASSERT(none.match("abc", 3) == 0 && none.max_length() == 0);
+		TEST_ASSERT(empty.match("abc", 3) == 0 && empty.max_length() == 0);
+		TEST_ASSERT(Trie(items, true).match("DS_MAP_GET_WIDTHx", 17) == 16);
+		TEST_END;
+	}
+
+	// compares a left-recursive expression grammar against the same grammar
+	// written with repetitions, on long left-associative chains.
+	int benchmark_left_recursion()
+	{
+		TEST_INIT;
+		const char* left_recursive = R"(
+			Expr    <- Expr '+' Term / Expr '-' Term / Term
+			Term    <- Term '*' Number / Number
+			Number  <- < [0-9]+ >
+			%whitespace <- [ \t]*
+		)";
+		const char* repetition = R"(
+			Expr    <- Term (AddOp Term)*
+			AddOp   <- < '+' / '-' >
+			Term    <- Number ('*' Number)*
+			Number  <- < [0-9]+ >
+			%whitespace <- [ \t]*
+		)";
+
+		std::string text = "1";
+		for (size_t i = 0; i < 200000; ++i)
+		{
+			text += (i % 3 == 0) ? " - 2 * 3" : (i % 3 == 1) ? " + 4" : " - 1";
+		}
+
+		auto time = [&](const char* name, const char* grammar, bool packrat, long long& value)
+		{
+			parser p(grammar);
+			if (!p) return false;
+			if (packrat) p.enable_packrat_parsing();
+			p["Number"] = [](const SemanticValues& vs) { return vs.token_to_number<long long>(); };
+			if (grammar == left_recursive)
+			{
+				p["Expr"] = [](const SemanticValues& vs) {
+					switch (vs.choice())
+					{
+					case 0: return vs.get<long long>(0) + vs.get<long long>(1);
+					case 1: return vs.get<long long>(0) - vs.get<long long>(1);
+					default: return vs.get<long long>(0);
+					}
+				};
+				p["Term"] = [](const SemanticValues& vs) { return vs.choice() == 0 ? vs.get<long long>(0) * vs.get<long long>(1) : vs.get<long long>(0); };
+			}
+			else
+			{
+				p["Expr"] = [](const SemanticValues& vs) {
+					long long result = vs.get<long long>(0);
+					for (size_t i = 1; i + 1 < vs.size(); i += 2)
+					{
+						result += (vs.get<char>(i) == '+') ? vs.get<long long>(i + 1) : -vs.get<long long>(i + 1);
+					}
+					return result;
+				};
+				p["AddOp"] = [](const SemanticValues& vs) { return *vs.sv().data(); };
+				p["Term"] = [](const SemanticValues& vs) {
+					long long result = 1;
+					for (size_t i = 0; i < vs.size(); ++i) result *= vs.get<long long>(i);
+					return result;
+				};
+			}
+
+			auto start = std::chrono::steady_clock::now();
+			bool result = p.parse(text, value);
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+			printf("%-20s %8.3f ms (%lld)\n", name, elapsed.count() * 1000, value);
+			return result;
+		};
+
+		long long expected = 0, value = 0;
+		TEST_ASSERT(time("repetition", repetition, false, expected));
+		TEST_ASSERT(time("left recursion", left_recursive, false, value) && value == expected);
+		TEST_ASSERT(time("left recursion/pk", left_recursive, true, value) && value == expected);
+		TEST_END;
+	}
+
+	// compares the parse time of each instrumentation against none.
+	int benchmark_instrumentation()
+	{
+		TEST_INIT;
+		const char* grammar = R"(
+			Expr    <- Term (AddOp Term)*
+			AddOp   <- < '+' / '-' >
+			Term    <- Factor ('*' Factor)*
+			Factor  <- '(' Expr ')' / Number
+			Number  <- < [0-9]+ >
+			%whitespace <- [ \t]*
+		)";
+
+		std::string text = "1";
+		for (size_t i = 0; i < 100000; ++i)
+		{
+			text += (i % 3 == 0) ? " - (2 * 3)" : (i % 3 == 1) ? " + 4" : " - 1";
+		}
+
+		auto time = [&](const char* name, auto setup)
+		{
+			parser p(grammar);
+			if (!p) return false;
+			Profile profile;
+			Trace trace(1 << 16);
+			setup(p, profile, trace);
+
+			auto start = std::chrono::steady_clock::now();
+			bool result = p.parse(text);
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+			printf("%-20s %8.3f ms\n", name, elapsed.count() * 1000);
+			return result;
+		};
+
+		TEST_ASSERT(time("off", [](parser&, Profile&, Trace&) {}));
+		TEST_ASSERT(time("counters", [](parser& p, Profile& profile, Trace&) {
+			p.set_instrumentation(Instrumentation::counters);
+			p.set_profile(&profile);
+		}));
+		TEST_ASSERT(time("profile", [](parser& p, Profile& profile, Trace&) { p.set_profile(&profile); }));
+		TEST_ASSERT(time("trace", [](parser& p, Profile&, Trace& trace) { p.set_trace(&trace); }));
+		TEST_ASSERT(time("trace callbacks", [](parser& p, Profile&, Trace&) {
+			p.enable_trace(
+				[](const Ope&, const char*, size_t, const SemanticValues&, const Context&, const std::any&) {},
+				[](const Ope&, const char*, size_t, const SemanticValues&, const Context&, const std::any&, size_t) {}
+			);
+		}));
+		TEST_END;
+	}
+
+	// times Trie against the map lookup on a few hundred GML-like names (see
+	// test_trie for their results.)
+	int benchmark_dictionary()
+	{
+		TEST_INIT;
+		auto items = dictionary_items();
+		auto dic = prefix_map(items, false);
+		Trie trie(items);
+		Trie triei(items, true);
+		std::string text = dictionary_text(items, 50000);
+
+		auto time = [&](const char* name, auto fn)
+		{
+			auto start = std::chrono::steady_clock::now();
+			size_t total = 0;
+			for (size_t i = 0; i < text.size(); ++i)
+			{
+				total += fn(text.data() + i, text.size() - i);
+			}
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+			printf("%-8s %8.3f ms (%zu)\n", name, elapsed.count() * 1000, total);
+			return total;
+		};
+		size_t total = time("map", [&](const char* s, size_t n) { return map_match(dic, s, n); });
+		TEST_ASSERT(time("trie", [&](const char* s, size_t n) { return trie.match(s, n); }) == total);
+		time("trie/i", [&](const char* s, size_t n) { return triei.match(s, n); });
+		TEST_END;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	if (argc > 1 && !strcmp(argv[1], "--bench"))
+	{
+		return benchmark_dictionary() || benchmark_left_recursion() || benchmark_instrumentation();
+	}
+
+	if (test_allocations())
+	{
+		return 1;
+	}
+
+	if (test_deep_nesting())
+	{
+		return 1;
+	}
+
+	if (test_flatten())
+	{
+		return 1;
+	}
+
+	if (test_left_recursion())
+	{
+		return 1;
+	}
+	if (test_precedence_climbing())
+	{
+		return 1;
+	}
+	if (test_choice_dispatch())
+	{
+		return 1;
+	}
+	if (test_character_class())
+	{
+		return 1;
+	}
+	if (test_span())
+	{
+		return 1;
+	}
+	if (test_value())
+	{
+		return 1;
+	}
+	if (test_trie())
+	{
+		return 1;
+	}
+
+	if (test_incremental())
+	{
+		return 1;
+	}
+
+	if (test_stream())
+	{
+		return 1;
+	}
+
+	if (test_parallel())
+	{
+		return 1;
+	}
+
+	if (test_flat_ast())
+	{
+		return 1;
+	}
+
+	if (test_parse_cache())
+	{
+		return 1;
+	}
+
+	if (test_analyze())
+	{
+		return 1;
+	}
+
+	if (test_profile())
+	{
+		return 1;
+	}
+
+	if (test_trace())
+	{
+		return 1;
+	}
+
+	if (test_memory_stats())
+	{
+		return 1;
+	}
+
+	if (test_captures())
+	{
+		return 1;
+	}
+
+	if (test_static_grammar())
+	{
+		return 1;
+	}
+
 	std::cout << "hello world\n";
 	int handle = peggml_parser_create(R"(
 		# Grammar for Calculator...
@@ -31,12 +31,62 @@ peggml_stack_current_depth();
 external ty_real
 peggml_estimate_stack_usage();
 
+// memory held by peggml, in bytes, estimated from the sizes of its
+// containers. The callstack reserves the parsing stack and the heap
+// segments deep recursion spills onto; of that, the deepest the parsing
+// stack has been used and the segments count as committed.
+external ty_real
+peggml_memory_get_callstack_reserved();
+
+external ty_real
+peggml_memory_get_callstack_committed();
+
+// packrat bitmaps and results, value stack and capture scopes of the last
+// parse that matched a grammar (the value stack and capture scopes at their
+// deepest during it.)
+external ty_real
+peggml_memory_get_packrat_bytes();
+
+external ty_real
+peggml_memory_get_value_stack_frames();
+
+external ty_real
+peggml_memory_get_value_stack_bytes();
+
+external ty_real
+peggml_memory_get_capture_scope_bytes();
+
+// results kept by all sessions, and elements kept by all parse caches.
+external ty_real
+peggml_memory_get_memo_bytes();
+
+external ty_real
+peggml_memory_get_parse_cache_bytes();
+
+// rules and operators of the parser's grammar.
+external ty_real
+peggml_memory_get_grammar_bytes(handle_t);
+
+// the buffer strings are returned in.
+external ty_real
+peggml_memory_get_string_buffer_bytes();
+
+// all of the above as a JSON object, with the grammars of all parsers
+// added up as "grammar_bytes".
+external ty_string
+peggml_get_memory_stats();
+
 // Create new parser for the given grammar syntax
 // see [https://github.com/yhirose/cpp-peglib#cpp-peglib] for syntax
 // returns its handle, or -1 on failure
 external handle_t
 peggml_parser_create(ty_string);
 
+// Create new parser for a grammar compiled into the library by peggml_codegen
+// returns its handle, or -1 if no such grammar exists
+external handle_t
+peggml_parser_create_static(ty_string name);
+
 // Destroy grammar syntax
 // (returns 0 on success)
 external ty_real
@@ -46,6 +96,112 @@ peggml_parser_destroy(handle_t);
 external ty_real
 peggml_parser_enable_packrat(handle_t);
 
+// limits how deeply rules may nest; deeper input fails to parse.
+// (0, the default, means no limit -- nesting is bounded only by memory,
+// as the parse moves onto additional heap stacks as needed.)
+external ty_real
+peggml_parser_set_max_depth(handle_t, ty_real depth);
+
+// keeps the elements of recently parsed texts, up to about budget bytes, so
+// that parsing one of them again passes its elements to peggml_parse_next
+// without matching the grammar (0 turns this off.) Every element the parse
+// reduced is reported again, those of alternatives it backtracked over
+// included, just as a parse that is not cached reports them.
+external ty_real
+peggml_parser_enable_parse_cache(handle_t, ty_real budget);
+
+// parses whose text was found in the cache, and those whose was not.
+external ty_real
+peggml_parser_get_cache_hits(handle_t);
+
+external ty_real
+peggml_parser_get_cache_misses(handle_t);
+
+// performance hazards in the parser's grammar, one per line as
+// "rule: kind: message" ("" if none are found.) Kinds are
+// "unused rule", "needs memoization", "shared prefix", "nested repetition"
+// and "overlapping first sets". (Rules of a static grammar are compiled,
+// so only unused ones can be found.)
+external ty_string
+peggml_parser_analyze(handle_t);
+
+// counts and times the invocations of each rule in the parses of the parser
+// (mode 1), or only counts them, leaving the times at 0 (mode 2; 0 turns
+// this off, and turning it on starts over.) Parses whose text is found in
+// the parse cache invoke no rules, and the compiled rules of a static
+// grammar are not counted.
+external ty_real
+peggml_parser_enable_profile(handle_t, ty_real mode);
+
+// rules invoked since profiling was turned on, indexed from 0 in the order
+// of their first invocation.
+external ty_real
+peggml_profile_get_rule_count(handle_t);
+
+external ty_string
+peggml_profile_get_name(handle_t, ty_real index);
+
+// invocations of the rule, and those that matched and failed.
+external ty_real
+peggml_profile_get_invocations(handle_t, ty_real index);
+
+external ty_real
+peggml_profile_get_successes(handle_t, ty_real index);
+
+external ty_real
+peggml_profile_get_failures(handle_t, ty_real index);
+
+// invocations whose result was, or was not, found among those kept by
+// packrat parsing or a session.
+external ty_real
+peggml_profile_get_memo_hits(handle_t, ty_real index);
+
+external ty_real
+peggml_profile_get_memo_misses(handle_t, ty_real index);
+
+// bytes matched by the rule's successful invocations.
+external ty_real
+peggml_profile_get_bytes(handle_t, ty_real index);
+
+// microseconds spent in the rule, including and excluding the rules it
+// invokes (and including the symbol handlers run meanwhile.)
+external ty_real
+peggml_profile_get_inclusive_time(handle_t, ty_real index);
+
+external ty_real
+peggml_profile_get_exclusive_time(handle_t, ty_real index);
+
+// the profile as CSV, one line per rule after a header line, and as a JSON
+// array of one object per rule.
+external ty_string
+peggml_profile_dump_csv(handle_t);
+
+external ty_string
+peggml_profile_dump_json(handle_t);
+
+// records the latest rule invocations of the parser's parses in a ring of
+// capacity events, overwriting the oldest (0 turns this off; turning it on
+// starts over.) Each event is the rule, its position and length in the text,
+// and its start time and duration.
+external ty_real
+peggml_parser_enable_trace(handle_t, ty_real capacity);
+
+// events kept, and those overwritten since tracing was turned on or cleared.
+external ty_real
+peggml_trace_get_event_count(handle_t);
+
+external ty_real
+peggml_trace_get_dropped(handle_t);
+
+// forgets the events.
+external ty_real
+peggml_trace_clear(handle_t);
+
+// writes the events to a file in the Chrome trace event format, which can
+// be opened in Perfetto or chrome://tracing (returns 0 on success.)
+external ty_real
+peggml_trace_save(handle_t, ty_string path);
+
 // define a nonzero symbol id for a symbol
 // this will be returned from peggml_parse_next().
 // if this is not invoked, the symbol will not be handlable.
@@ -56,6 +212,85 @@ peggml_parser_set_symbol_id(handle_t, ty_string, symbol_id_t);
 external ty_real
 peggml_parse_begin(handle_t, ty_string);
 
+// creates a session for parsing a text that is edited between parses
+// (starting out empty), returning its handle, or a negative value on
+// failure. The grammar must not have captures or back references.
+external handle_t
+peggml_session_create(handle_t parser);
+
+external ty_real
+peggml_session_destroy(handle_t session);
+
+// replaces removed_len bytes at byte offset with inserted_text, then starts
+// reparsing the session's text (continue with peggml_parse_next.)
+// Rule results from earlier parses are reused where the edit could not
+// change them, so only elements touching the edit are reported again; the
+// new tree refers to unchanged elements by the uuids they were given
+// before. Those stay in use for as long as the session exists.
+external ty_real
+peggml_parse_edit(handle_t session, ty_real offset, ty_real removed_len, ty_string inserted_text);
+
+// creates a stream, parsing input as it arrives in chunks; returns its
+// handle, or a negative value on failure. The grammar's start rule must be
+// of the form Element* (or Element* !.), without back references. At most
+// max_buffer bytes are kept: the element in progress must fit.
+external handle_t
+peggml_stream_create(handle_t parser, ty_real max_buffer);
+
+external ty_real
+peggml_stream_destroy(handle_t stream);
+
+// adds a chunk of input and starts parsing the elements it completes
+// (continue with peggml_parse_next; peggml_error is set if parsing fails.)
+external ty_real
+peggml_stream_feed(handle_t stream, ty_string chunk);
+
+// starts parsing the rest of the input, which must be whole elements.
+external ty_real
+peggml_stream_finish(handle_t stream);
+
+// the elements completed by the last feed or finish, in order.
+external index_t
+peggml_stream_get_element_count(handle_t stream);
+
+external uuid_t
+peggml_stream_get_element_uuid(handle_t stream, index_t);
+
+// offset in the whole input of the text parsed by the last feed or finish
+// (string and token offsets reported while parsing it are relative to this.)
+external ty_real
+peggml_stream_get_offset(handle_t stream);
+
+// creates a parallel parser, which splits text into records matched by the
+// rule split_rule and parses them on `threads` threads (0: one per core);
+// returns its handle, or a negative value on failure. The grammar's start
+// rule must be of the form split_rule* (or split_rule* !.), without back
+// references. Text is cut just after occurrences of resync, a string that
+// usually ends a record (such as "\n"); a cut inside a record costs only
+// reparsing that part of the text.
+external handle_t
+peggml_parallel_create(handle_t parser, ty_string split_rule, ty_string resync, ty_real threads);
+
+external ty_real
+peggml_parallel_destroy(handle_t parallel);
+
+// starts parsing text (continue with peggml_parse_next; peggml_error is set
+// if parsing fails.) Elements are reported in document order, and only for
+// the records' final parse trees.
+external ty_real
+peggml_parallel_parse_begin(handle_t parallel, ty_string text);
+
+// the records of the last parse, in order.
+external index_t
+peggml_parallel_get_element_count(handle_t parallel);
+
+external uuid_t
+peggml_parallel_get_element_uuid(handle_t parallel, index_t);
+
+// bytes reparsed by the last parse because a cut fell inside a record.
+external ty_real
+peggml_parallel_get_reparsed(handle_t parallel);
+
 // returns symbol id if a new element is being parsed, 0 if parsing has completed.
 external ty_real
 peggml_parse_next();
@@ -99,4 +334,70 @@ peggml_parse_elt_get_token_number();
 
 // retrieves root uuid of most recent parse
 external uuid_t
-peggml_get_root_uuid();
\ No newline at end of file
+peggml_get_root_uuid();
+
+// makes every rule add nodes to a flat tree when parsed with
+// peggml_parse_flat_ast, whether or not it has a symbol id.
+external ty_real
+peggml_parser_enable_flat_ast(handle_t parser);
+
+// parses text into a flat tree, read with the peggml_ast_* functions below
+// (returns 0 on success.) No handlers are run.
+external ty_real
+peggml_parse_flat_ast(handle_t parser, ty_string text);
+
+// directory in which peggml_parse_cached keeps its trees (none by default.)
+external ty_real
+peggml_ast_cache_set_directory(ty_string path);
+
+// as peggml_parse_flat_ast, on the contents of the file at path; the tree is
+// read back from the cache directory instead if neither the file nor the
+// grammar has changed since it was stored there.
+external ty_real
+peggml_parse_cached(handle_t parser, ty_string path);
+
+// whether the last flat tree was read from the cache.
+external ty_real
+peggml_ast_is_cached();
+
+// nodes of the last flat tree, indexed from 0 in document order, each
+// followed by its descendants (node 0 is the root.) Links are node
+// indices, or -1 for none.
+external index_t
+peggml_ast_get_count();
+
+external ty_string
+peggml_ast_get_rule_name(index_t node);
+
+// rule of the outermost node that peggml_ast_optimize replaced with this one
+// (or the node's own rule.)
+external ty_string
+peggml_ast_get_original_rule_name(index_t node);
+
+// replaces each node of the last flat tree that has a single child with
+// that child, except for rules marked no_ast_opt; renumbers the nodes.
+external ty_real
+peggml_ast_optimize();
+
+// byte offset and length in the text of the node's match (or its token,
+// for a token rule.)
+external ty_real
+peggml_ast_get_offset(index_t node);
+
+external ty_real
+peggml_ast_get_length(index_t node);
+
+external ty_string
+peggml_ast_get_string(index_t node);
+
+external ty_real
+peggml_ast_get_choice(index_t node);
+
+external ty_real
+peggml_ast_get_parent(index_t node);
+
+external ty_real
+peggml_ast_get_first_child(index_t node);
+
+external ty_real
+peggml_ast_get_next_sibling(index_t node);
\ No newline at end of file
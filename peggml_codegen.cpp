@@ -0,0 +1,536 @@
+// peggml_codegen: compiles a PEG grammar ahead of time into a C++ header.
+//
+// usage: peggml_codegen <grammar.peg> <name> [output.h]
+//
+// The generated header defines namespace peggml_grammar_<name>, containing
+// one function per rule and make_grammar()/make_parser() to build a peg::parser
+// from them. Actions, packrat parsing, AST generation and so forth all work as
+// usual, since each rule is still wrapped in a peg::Definition. (Packrat
+// results stay in the parse's Context, where the rule's id already indexes
+// them directly: slots in static storage would be shared by every parse of
+// the grammar, including those running at once on other threads.) The
+// grammar's source is kept too, so it can be compiled at runtime to check the
+// generated rules against.
+//
+// Include the header from peggml.cpp (via static_grammars.h) with
+// PEGGML_REGISTER_STATIC_GRAMMAR defined to make the grammar available to
+// peggml_parser_create_static().
+
+#include "peglib.h"
+#include "util.h"
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <cctype>
+
+using namespace peg;
+
+namespace
+{
+	bool is_plain(unsigned char ch)
+	{
+		return std::isprint(ch) && ch != '"' && ch != '\'' && ch != '\\' && ch != '?';
+	}
+
+	// C++ string literal with every special character escaped.
+	std::string quote(const std::string& s)
+	{
+		std::string out = "\"";
+		for (unsigned char ch : s)
+		{
+			if (is_plain(ch))
+			{
+				out += ch;
+			}
+			else
+			{
+				char buf[8];
+				snprintf(buf, sizeof(buf), "\\%03o", ch);
+				out += buf;
+			}
+		}
+		return out + "\"";
+	}
+
+	std::string quote_char(unsigned char ch)
+	{
+		char buf[16];
+		if (is_plain(ch))
+		{
+			snprintf(buf, sizeof(buf), "'%c'", ch);
+		}
+		else
+		{
+			snprintf(buf, sizeof(buf), "'\\%03o'", ch);
+		}
+		return buf;
+	}
+
+	std::string identifier(const std::string& s)
+	{
+		std::string out;
+		for (unsigned char ch : s)
+		{
+			out += (std::isalnum(ch)) ? static_cast<char>(ch) : '_';
+		}
+		return out;
+	}
+
+	// expression constructing a copy of the given character class.
+	std::string character_class(const CharacterClass& cls)
+	{
+		std::string out = "std::make_shared<CharacterClass>(std::vector<std::pair<char32_t, char32_t>>{";
+		for (size_t i = 0; i < cls.ranges_.size(); ++i)
+		{
+			auto range = cls.ranges_[i];
+			if (i > 0) out += ", ";
+			out += "{" + std::to_string(range.first) + ", " + std::to_string(range.second) + "}";
+		}
+		return out + std::string("}, ") + (cls.negated_ ? "true" : "false") + ")";
+	}
+
+	constexpr const char* k_lambda = "[&](const char *s, size_t n, SemanticValues &vs) -> size_t ";
+	constexpr const char* k_fail = "{ c.set_error_pos(s); return static_cast<size_t>(-1); }";
+
+	// emits each operator as a lambda expression of type
+	// size_t(const char *s, size_t n, SemanticValues &vs)
+	struct Emitter : public Ope::Visitor
+	{
+		Emitter(const std::map<const Definition*, size_t>& index)
+			: m_index(index)
+		{ }
+
+		std::string m_out;
+		std::string m_error;
+		size_t m_depth = 0;
+		const std::map<const Definition*, size_t>& m_index;
+
+		std::string indent(int extra = 0)
+		{
+			return std::string(static_cast<size_t>(static_cast<int>(m_depth) + extra), '\t');
+		}
+
+		void unsupported(const char* what)
+		{
+			if (m_error.empty())
+			{
+				m_error = std::string(what) + " is not supported by peggml_codegen";
+			}
+			m_out += "nullptr";
+		}
+
+		void emit(Ope& ope)
+		{
+			m_depth += 2;
+			ope.accept(*this);
+			m_depth -= 2;
+		}
+
+		// op(s, n, <prefix>, operands...)
+		template<typename Container>
+		void emit_call(const std::string& op, const std::string& args, const Container& opes)
+		{
+			m_out += k_lambda;
+			m_out += "{\n" + indent() + "return NativeOps::" + op + "(" + args;
+			for (auto& ope : opes)
+			{
+				m_out += ",\n" + indent(1);
+				emit(*ope);
+			}
+			m_out += ");\n" + indent(-1) + "}";
+		}
+
+		void visit(Sequence& ope) override
+		{
+			emit_call("sequence", "s, n, vs, c", ope.opes_);
+		}
+
+		void visit(PrioritizedChoice& ope) override
+		{
+			if (ope.for_label_)
+			{
+				return unsupported("error recovery");
+			}
+			emit_call("choice", "s, n, vs, c", ope.opes_);
+		}
+
+		void visit(Repetition& ope) override
+		{
+			std::string max = (ope.max_ == std::numeric_limits<size_t>::max())
+				? "std::numeric_limits<size_t>::max()"
+				: std::to_string(ope.max_);
+			emit_call("repetition", "s, n, vs, c, " + std::to_string(ope.min_) + ", " + max, std::vector<std::shared_ptr<Ope>>{ ope.ope_ });
+		}
+
+		void visit(AndPredicate& ope) override
+		{
+			emit_call("and_predicate", "s, n, c", std::vector<std::shared_ptr<Ope>>{ ope.ope_ });
+		}
+
+		void visit(NotPredicate& ope) override
+		{
+			emit_call("not_predicate", "s, n, c", std::vector<std::shared_ptr<Ope>>{ ope.ope_ });
+		}
+
+		void visit(CaptureScope& ope) override
+		{
+			emit_call("capture_scope", "s, n, vs, c", std::vector<std::shared_ptr<Ope>>{ ope.ope_ });
+		}
+
+		void visit(TokenBoundary& ope) override
+		{
+			emit_call("token_boundary", "s, n, vs, c, dt", std::vector<std::shared_ptr<Ope>>{ ope.ope_ });
+		}
+
+		void visit(Ignore& ope) override
+		{
+			emit_call("ignore", "s, n, c", std::vector<std::shared_ptr<Ope>>{ ope.ope_ });
+		}
+
+		void visit(Whitespace& ope) override
+		{
+			emit_call("whitespace", "s, n, vs, c", std::vector<std::shared_ptr<Ope>>{ ope.ope_ });
+		}
+
+		void visit(Cut&) override
+		{
+			m_out += k_lambda;
+			m_out += "{ return NativeOps::cut(c); }";
+		}
+
+		void visit(Reference& ope) override
+		{
+			if (!ope.rule_ || ope.is_macro_)
+			{
+				return unsupported("macro");
+			}
+			m_out += k_lambda;
+			m_out += "{ return NativeOps::reference(s, n, vs, c, dt, rules[" + std::to_string(m_index.at(ope.rule_)) + "]); }";
+		}
+
+		// literals are compared inline, byte by byte.
+		void visit(LiteralString& ope) override
+		{
+			const std::string& lit = ope.lit_;
+			m_out += k_lambda;
+			m_out += "{\n";
+			m_out += indent() + "static std::once_flag init_is_word;\n";
+			m_out += indent() + "static bool is_word = false;\n";
+			m_out += indent() + "c.examine(s + std::min<size_t>(n + 1, " + std::to_string(lit.size()) + "));\n";
+			m_out += indent() + "if (n < " + std::to_string(lit.size());
+			for (size_t i = 0; i < lit.size(); ++i)
+			{
+				m_out += "\n" + indent(1) + "|| ";
+				if (ope.ignore_case_)
+				{
+					m_out += "std::tolower(s[" + std::to_string(i) + "]) != " + quote_char(std::tolower(lit[i]));
+				}
+				else
+				{
+					m_out += "s[" + std::to_string(i) + "] != " + quote_char(lit[i]);
+				}
+			}
+			m_out += ")\n" + indent() + "{ c.set_error_pos(s, " + quote(lit) + "); return static_cast<size_t>(-1); }\n";
+			m_out += indent() + "return parse_literal_suffix(s, " + std::to_string(lit.size()) + ", n, vs, c, dt, std::string_view(" + quote(lit) + ", " + std::to_string(lit.size()) + "), init_is_word, is_word);\n";
+			m_out += indent(-1) + "}";
+		}
+
+		void visit(Character& ope) override
+		{
+			m_out += k_lambda;
+			m_out += "{\n" + indent() + "c.examine(s + 1);\n";
+			m_out += indent() + "if (n < 1 || s[0] != " + quote_char(ope.ch_) + ") " + k_fail + "\n";
+			m_out += indent() + "return 1;\n" + indent(-1) + "}";
+		}
+
+		void visit(AnyCharacter&) override
+		{
+			m_out += k_lambda;
+			m_out += "{\n" + indent() + "auto len = codepoint_length(s, n);\n";
+			m_out += indent() + "c.examine_codepoint(s, n, len);\n";
+			m_out += indent() + "if (len < 1) " + k_fail + "\n";
+			m_out += indent() + "return len;\n" + indent(-1) + "}";
+		}
+
+		static std::string range_test(const std::vector<std::pair<char32_t, char32_t>>& ranges, const char* var)
+		{
+			std::string out;
+			for (auto range : ranges)
+			{
+				if (!out.empty()) out += " || ";
+				if (range.first == range.second)
+				{
+					out += std::string(var) + " == " + std::to_string(range.first);
+				}
+				else
+				{
+					out += "(" + std::string(var) + " >= " + std::to_string(range.first) + " && " + var + " <= " + std::to_string(range.second) + ")";
+				}
+			}
+			return out.empty() ? "false" : out;
+		}
+
+		// ASCII input is handled by a switch on the first byte;
+		// anything else falls back to decoding the codepoint.
+		void visit(CharacterClass& ope) override
+		{
+			m_out += k_lambda;
+			m_out += "{\n";
+			m_out += indent() + "if (n < 1) { c.examine(s + 1); c.set_error_pos(s); return static_cast<size_t>(-1); }\n";
+			m_out += indent() + "auto b = static_cast<unsigned char>(s[0]);\n";
+			m_out += indent() + "size_t len = 1;\n";
+			m_out += indent() + "bool match;\n";
+			m_out += indent() + "switch (b)\n" + indent() + "{\n";
+			bool any = false;
+			for (unsigned b = 0; b < 0x80; ++b)
+			{
+				for (auto& range : ope.ranges_)
+				{
+					if (range.first <= b && b <= range.second)
+					{
+						m_out += indent() + "case " + std::to_string(b) + ":\n";
+						any = true;
+						break;
+					}
+				}
+			}
+			if (any)
+			{
+				m_out += indent(1) + "match = true;\n";
+				m_out += indent(1) + "break;\n";
+			}
+			m_out += indent() + "default:\n";
+			m_out += indent(1) + "if (b < 0x80)\n";
+			m_out += indent(1) + "{\n";
+			m_out += indent(2) + "match = false;\n";
+			m_out += indent(1) + "}\n";
+			m_out += indent(1) + "else\n";
+			m_out += indent(1) + "{\n";
+			m_out += indent(2) + "char32_t cp = 0;\n";
+			m_out += indent(2) + "len = decode_codepoint(s, n, cp);\n";
+			m_out += indent(2) + "match = " + range_test(ope.merged_ranges_, "cp") + ";\n";
+			m_out += indent(1) + "}\n";
+			m_out += indent(1) + "break;\n";
+			m_out += indent() + "}\n";
+			m_out += indent() + "c.examine_codepoint(s, n, len);\n";
+			m_out += indent() + "if (" + (ope.negated_ ? "" : "!") + "match) " + k_fail + "\n";
+			m_out += indent() + "return len;\n" + indent(-1) + "}";
+		}
+
+		void visit(Span& ope) override
+		{
+			m_out += k_lambda;
+			m_out += "{\n" + indent() + "static const Span span(";
+			if (ope.cls_)
+			{
+				m_out += character_class(*ope.cls_);
+			}
+			else
+			{
+				m_out += "std::string(" + quote(ope.lit_) + ", " + std::to_string(ope.lit_.size()) + ")";
+			}
+			m_out += ", " + std::to_string(ope.min_) + ");\n";
+			m_out += indent() + "return span.parse_core(s, n, vs, c, dt);\n" + indent(-1) + "}";
+		}
+
+		void visit(Dictionary& ope) override
+		{
+			m_out += k_lambda;
+			m_out += "{\n" + indent() + "static const Trie trie({";
+			for (size_t i = 0; i < ope.items_.size(); ++i)
+			{
+				if (i > 0) m_out += ", ";
+				m_out += quote(ope.items_[i]);
+			}
+			m_out += std::string("}, ") + (ope.ignore_case_ ? "true" : "false") + ");\n";
+			m_out += indent() + "c.examine(s + std::min(n + 1, trie.max_length()));\n";
+			m_out += indent() + "auto len = trie.match(s, n);\n";
+			m_out += indent() + "if (len > 0) { return len; }\n";
+			m_out += indent() + k_fail + "\n" + indent(-1) + "}";
+		}
+
+		void visit(Capture&) override { unsupported("capture"); }
+		void visit(BackReference&) override { unsupported("back reference"); }
+		void visit(PrecedenceClimbing&) override { unsupported("precedence instruction"); }
+		void visit(Flatten&) override { unsupported("flatten instruction"); }
+		void visit(Recovery&) override { unsupported("error recovery"); }
+		void visit(User&) override { unsupported("user operator"); }
+		void visit(Native&) override { unsupported("native operator"); }
+		void visit(WeakHolder&) override { unsupported("weak holder"); }
+		void visit(Holder&) override { unsupported("holder"); }
+	};
+
+	int generate(const std::string& grammar_text, const std::string& name, std::ostream& out)
+	{
+		std::string start;
+		bool enable_packrat = true;
+		auto grammar = ParserGenerator::parse(grammar_text.data(), grammar_text.size(), start, enable_packrat,
+			[](size_t line, size_t col, const std::string& msg) {
+				std::cerr << line << ":" << col << ": " << msg << "\n";
+			}
+		);
+
+		if (!grammar)
+		{
+			return 1;
+		}
+
+		// rules in a stable order.
+		std::vector<std::string> names;
+		for (auto& [rule_name, rule] : *grammar)
+		{
+			// (references to macros are rejected by the emitter.)
+			if (!rule.is_macro)
+			{
+				names.push_back(rule_name);
+			}
+		}
+		std::sort(names.begin(), names.end());
+
+		std::map<const Definition*, size_t> index;
+		for (size_t i = 0; i < names.size(); ++i)
+		{
+			index[&grammar->at(names[i])] = i;
+		}
+
+		const Definition& start_rule = grammar->at(start);
+
+		out << "// Generated by peggml_codegen -- do not edit.\n";
+		out << "#pragma once\n\n";
+		out << "#include \"peglib.h\"\n\n";
+		out << "namespace peggml_grammar_" << identifier(name) << "\n{\n";
+		out << "using namespace peg;\n\n";
+		out << "constexpr const char *name = " << quote(name) << ";\n";
+		out << "constexpr const char *start = " << quote(start) << ";\n";
+		out << "constexpr unsigned long long grammar_hash = " << fnv1a(grammar_text.data(), grammar_text.size()) << "ull;\n";
+		out << "constexpr const char *source = " << quote(grammar_text) << ";\n\n";
+
+		for (size_t i = 0; i < names.size(); ++i)
+		{
+			const Definition& rule = grammar->at(names[i]);
+			Emitter emitter(index);
+			emitter.emit(*rule.get_core_operator());
+			if (!emitter.m_error.empty())
+			{
+				std::cerr << "'" << names[i] << "': " << emitter.m_error << "\n";
+				return 1;
+			}
+
+			out << "// " << names[i] << "\n";
+			out << "inline size_t rule_" << i << "(const char *s, size_t n, SemanticValues &vs, Context &c, std::any &dt, Definition *const *rules)\n{\n";
+			out << "\t(void)dt;\n\t(void)rules;\n";
+			out << "\treturn (" << emitter.m_out << ")(s, n, vs);\n";
+			out << "}\n\n";
+		}
+
+		out << "inline std::shared_ptr<Grammar> make_grammar()\n{\n";
+		out << "\tauto grammar = std::make_shared<Grammar>();\n";
+		out << "\tauto rules = std::make_shared<std::vector<Definition *>>();\n";
+		out << "\tauto &g = *grammar;\n";
+		for (size_t i = 0; i < names.size(); ++i)
+		{
+			out << "\trules->push_back(&g[" << quote(names[i]) << "]);\n";
+		}
+		for (size_t i = 0; i < names.size(); ++i)
+		{
+			const Definition& rule = grammar->at(names[i]);
+			std::string r = "(*rules)[" + std::to_string(i) + "]->";
+			out << "\t" << r << "name = " << quote(names[i]) << ";\n";
+			out << "\t*" << "(*rules)[" << i << "] <= std::make_shared<Native>(rule_" << i << ", rules, "
+				<< (rule.is_token() ? "true" : "false") << ", "
+				<< (IsPrioritizedChoice::check(*rule.get_core_operator()) ? "true" : "false") << ");\n";
+			if (rule.ignoreSemanticValue)
+			{
+				out << "\t" << r << "ignoreSemanticValue = true;\n";
+			}
+			if (!rule.error_message.empty())
+			{
+				out << "\t" << r << "error_message = " << quote(rule.error_message) << ";\n";
+			}
+			if (rule.no_ast_opt)
+			{
+				out << "\t" << r << "no_ast_opt = true;\n";
+			}
+			if (rule.is_left_recursive)
+			{
+				out << "\t" << r << "is_left_recursive = true;\n";
+			}
+		}
+
+		std::string s = "(*rules)[" + std::to_string(index.at(&start_rule)) + "]->";
+		if (start_rule.whitespaceOpe)
+		{
+			out << "\t" << s << "whitespaceOpe = wsp(std::make_shared<Native>(rule_" << index.at(&grammar->at(WHITESPACE_DEFINITION_NAME)) << ", rules));\n";
+		}
+		if (start_rule.wordOpe)
+		{
+			// word checks only need the first character, when that decides the match.
+			if (auto cls = word_start_class(start_rule.wordOpe))
+			{
+				out << "\t" << s << "wordOpe = " << character_class(*cls) << ";\n";
+			}
+			else
+			{
+				out << "\t" << s << "wordOpe = std::make_shared<Native>(rule_" << index.at(&grammar->at(WORD_DEFINITION_NAME)) << ", rules);\n";
+			}
+		}
+		out << "\treturn grammar;\n}\n\n";
+
+		out << "inline std::unique_ptr<parser> make_parser()\n{\n";
+		out << "\tstd::unique_ptr<parser> p(new parser());\n";
+		out << "\tp->load_grammar(make_grammar(), start, " << (enable_packrat ? "true" : "false") << ");\n";
+		out << "\treturn p;\n}\n";
+		out << "}\n\n";
+
+		out << "#ifdef PEGGML_REGISTER_STATIC_GRAMMAR\n";
+		out << "PEGGML_REGISTER_STATIC_GRAMMAR(" << identifier(name) << ")\n";
+		out << "#endif\n";
+
+		return 0;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 3)
+	{
+		std::cerr << "usage: " << argv[0] << " <grammar.peg> <name> [output.h]\n";
+		return 2;
+	}
+
+	std::ifstream in(argv[1], std::ios::binary);
+	if (!in)
+	{
+		std::cerr << "cannot read " << argv[1] << "\n";
+		return 2;
+	}
+	std::stringstream grammar_text;
+	grammar_text << in.rdbuf();
+
+	std::stringstream out;
+	int result = generate(grammar_text.str(), argv[2], out);
+	if (result != 0)
+	{
+		return result;
+	}
+
+	if (argc > 3)
+	{
+		std::ofstream file(argv[3], std::ios::binary);
+		file << out.str();
+		if (!file)
+		{
+			std::cerr << "cannot write " << argv[3] << "\n";
+			return 2;
+		}
+	}
+	else
+	{
+		std::cout << out.str();
+	}
+	return 0;
+}
@@ -9,11 +9,14 @@
 
 #include <algorithm>
 #include <any>
+#include <bitset>
 #include <cassert>
 #include <cctype>
+#include <chrono>
 #if __has_include(<charconv>)
 #include <charconv>
 #endif
+#include <condition_variable>
 #include <cstring>
 #include <functional>
 #include <initializer_list>
@@ -26,10 +29,19 @@
 #include <set>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#endif
+
 #if !defined(__cplusplus) || __cplusplus < 201703L
 #error "Requires complete C++17 support"
 #endif
@@ -340,7 +352,10 @@ inline std::string resolve_escape_sequence(const char *s, size_t n) {
 
 template <typename T> T token_to_number_(std::string_view sv) {
   T n = 0;
-#if __has_include(<charconv>)
+#if defined(__cpp_lib_to_chars)
+  if constexpr (true) {
+    std::from_chars(sv.data(), sv.data() + sv.size(), n);
+#elif __has_include(<charconv>)
   if constexpr (!std::is_floating_point<T>::value) {
     std::from_chars(sv.data(), sv.data() + sv.size(), n);
 #else
@@ -358,55 +373,122 @@ template <typename T> T token_to_number_(std::string_view sv) {
  *  Trie
  *---------------------------------------------------------------------------*/
 
+// Longest-match lookup of a set of strings, as a minimal DFA: trie states
+// with the same set of continuations are merged, and bytes no state tells
+// apart share a column of the transition table. Each input byte costs one
+// table lookup.
 class Trie {
 public:
   Trie() = default;
   Trie(const Trie &) = default;
 
-  Trie(const std::vector<std::string> &items) {
+  Trie(const std::vector<std::string> &items, bool ignore_case = false)
+      : ignore_case_(ignore_case) {
+    // Plain trie; children always come after their parent.
+    struct Node {
+      std::map<uint8_t, size_t> next;
+      bool match = false;
+    };
+    std::vector<Node> nodes(1);
     for (const auto &item : items) {
-      for (size_t len = 1; len <= item.size(); len++) {
-        auto last = len == item.size();
-        std::string_view sv(item.data(), len);
-        auto it = dic_.find(sv);
-        if (it == dic_.end()) {
-          dic_.emplace(sv, Info{last, last});
-        } else if (last) {
-          it->second.match = true;
+      if (item.empty()) { continue; }
+      max_length_ = std::max(max_length_, item.size());
+      size_t node = 0;
+      for (auto ch : item) {
+        auto b = fold(static_cast<uint8_t>(ch));
+        auto it = nodes[node].next.find(b);
+        if (it == nodes[node].next.end()) {
+          nodes[node].next.emplace(b, nodes.size());
+          node = nodes.size();
+          nodes.emplace_back();
         } else {
-          it->second.done = false;
+          node = it->second;
+        }
+      }
+      nodes[node].match = true;
+    }
+
+    // Merge equivalent states, children first. State 0 is the dead state.
+    using Signature = std::pair<bool, std::vector<std::pair<uint8_t, size_t>>>;
+    std::map<Signature, size_t> states;
+    std::vector<Signature> signatures;
+    std::vector<size_t> state_of(nodes.size());
+    for (auto i = nodes.size(); i-- > 0;) {
+      Signature sig;
+      sig.first = nodes[i].match;
+      for (const auto &[b, child] : nodes[i].next) {
+        sig.second.emplace_back(b, state_of[child]);
+      }
+      auto it = states.find(sig);
+      if (it == states.end()) {
+        it = states.emplace(sig, signatures.size() + 1).first;
+        signatures.push_back(sig);
+      }
+      state_of[i] = it->second;
+    }
+    root_ = state_of[0];
+    auto state_count = signatures.size() + 1;
+
+    // Group bytes by their column in the transition table; bytes which
+    // never lead anywhere share class 0.
+    std::map<std::vector<size_t>, uint16_t> columns;
+    columns.emplace(std::vector<size_t>(state_count), 0);
+    for (size_t b = 0; b < 256; b++) {
+      std::vector<size_t> column(state_count);
+      for (size_t s = 1; s < state_count; s++) {
+        for (const auto &[c, next] : signatures[s - 1].second) {
+          if (c == fold(static_cast<uint8_t>(b))) { column[s] = next; }
         }
       }
+      auto it = columns.find(column);
+      if (it == columns.end()) {
+        auto cls = static_cast<uint16_t>(columns.size());
+        it = columns.emplace(column, cls).first;
+      }
+      class_[b] = it->second;
+    }
+
+    class_count_ = columns.size();
+    next_.resize(state_count * class_count_);
+    for (const auto &[column, cls] : columns) {
+      for (size_t s = 0; s < state_count; s++) {
+        next_[s * class_count_ + cls] = static_cast<uint32_t>(column[s]);
+      }
+    }
+    match_.resize(state_count);
+    for (size_t s = 1; s < state_count; s++) {
+      match_[s] = signatures[s - 1].first;
     }
   }
 
   size_t match(const char *text, size_t text_len) const {
     size_t match_len = 0;
-    auto done = false;
-    size_t len = 1;
-    while (!done && len <= text_len) {
-      std::string_view sv(text, len);
-      auto it = dic_.find(sv);
-      if (it == dic_.end()) {
-        done = true;
-      } else {
-        if (it->second.match) { match_len = len; }
-        if (it->second.done) { done = true; }
-      }
-      len += 1;
+    auto state = root_;
+    for (size_t i = 0; state && i < text_len; i++) {
+      auto b = static_cast<uint8_t>(text[i]);
+      state = next_[state * class_count_ + class_[b]];
+      if (match_[state]) { match_len = i + 1; }
     }
     return match_len;
   }
 
+  bool ignore_case() const { return ignore_case_; }
+
+  // How far match() can look into the text: the longest item.
+  size_t max_length() const { return max_length_; }
+
 private:
-  struct Info {
-    bool done;
-    bool match;
-  };
+  uint8_t fold(uint8_t b) const {
+    return ignore_case_ ? static_cast<uint8_t>(std::tolower(b)) : b;
+  }
 
-  // TODO: Use unordered_map when heterogeneous lookup is supported in C++20
-  // std::unordered_map<std::string, Info> dic_;
-  std::map<std::string, Info, std::less<>> dic_;
+  bool ignore_case_ = false;
+  size_t max_length_ = 0;
+  size_t root_ = 0;
+  size_t class_count_ = 0;
+  uint16_t class_[256] = {};
+  std::vector<uint32_t> next_;
+  std::vector<uint8_t> match_;
 };
 
 /*-----------------------------------------------------------------------------
@@ -456,20 +538,174 @@ inline constexpr unsigned int operator"" _(const char *s, size_t l) {
 
 } // namespace udl
 
+/*
+ * Semantic value
+ */
+// Holds one semantic value, like std::any. Trivially copyable values of up
+// to 8 bytes (numbers, indices into an arena, pointers...) are stored
+// inline, so they are never boxed and move as plain bytes; other values are
+// boxed on the heap. Types are told apart by the address of a per-type
+// descriptor rather than by RTTI.
+class Value {
+public:
+  Value() = default;
+
+  Value(const Value &rhs) : type_(rhs.type_) {
+    if (type_) { type_->copy(data_, rhs.data_); }
+  }
+
+  Value(Value &&rhs) noexcept : type_(rhs.type_) {
+    std::memcpy(data_, rhs.data_, sizeof(data_));
+    rhs.type_ = nullptr;
+  }
+
+  // An empty std::any gives an empty value. Other std::any are kept whole,
+  // and get<T>() looks inside them.
+  Value(std::any &&v) {
+    if (v.has_value()) { emplace<std::any>(std::move(v)); }
+  }
+  Value(const std::any &v) {
+    if (v.has_value()) { emplace<std::any>(v); }
+  }
+
+  template <typename T, typename U = typename std::decay<T>::type,
+            typename = typename std::enable_if<
+                !std::is_same<U, Value>::value &&
+                !std::is_same<U, std::any>::value>::type>
+  Value(T &&v) {
+    emplace<U>(std::forward<T>(v));
+  }
+
+  ~Value() { reset(); }
+
+  Value &operator=(const Value &rhs) {
+    if (this != &rhs) { *this = Value(rhs); }
+    return *this;
+  }
+
+  Value &operator=(Value &&rhs) noexcept {
+    if (this != &rhs) {
+      reset();
+      std::memcpy(data_, rhs.data_, sizeof(data_));
+      type_ = rhs.type_;
+      rhs.type_ = nullptr;
+    }
+    return *this;
+  }
+
+  bool has_value() const { return type_ != nullptr; }
+
+  void reset() {
+    if (type_) {
+      if (type_->destroy) { type_->destroy(data_); }
+      type_ = nullptr;
+    }
+  }
+
+  template <typename T, typename... Args> T &emplace(Args &&... args) {
+    reset();
+    T *p;
+    if constexpr (is_inline<T>()) {
+      p = new (data_) T(std::forward<Args>(args)...);
+    } else {
+      p = new T(std::forward<Args>(args)...);
+      std::memcpy(data_, &p, sizeof(p));
+    }
+    type_ = &type_of<T>;
+    return *p;
+  }
+
+  // The value, if it is a T; nullptr otherwise.
+  template <typename T> const T *get_if() const {
+    if (type_ == &type_of<T>) { return static_cast<const T *>(ptr()); }
+    if (type_ == &type_of<std::any>) {
+      return std::any_cast<T>(static_cast<const std::any *>(ptr()));
+    }
+    return nullptr;
+  }
+
+  template <typename T> T *get_if() {
+    return const_cast<T *>(static_cast<const Value *>(this)->get_if<T>());
+  }
+
+  // The value, which must be a T (throws std::bad_any_cast otherwise.)
+  template <typename T> const T &get() const {
+    auto p = get_if<T>();
+    if (!p) { throw std::bad_any_cast(); }
+    return *p;
+  }
+
+  template <typename T> T &get() {
+    auto p = get_if<T>();
+    if (!p) { throw std::bad_any_cast(); }
+    return *p;
+  }
+
+private:
+  struct Type {
+    bool boxed;
+    void (*copy)(unsigned char *dst, const unsigned char *src);
+    void (*destroy)(unsigned char *data); // (nullptr if trivial)
+  };
+
+  template <typename T> static constexpr bool is_inline() {
+    return std::is_trivially_copyable<T>::value && sizeof(T) <= 8 &&
+           alignof(T) <= 8;
+  }
+
+  template <typename T> static T *boxed(const unsigned char *data) {
+    T *p;
+    std::memcpy(&p, data, sizeof(p));
+    return p;
+  }
+
+  template <typename T> static const Type type_of;
+
+  const void *ptr() const {
+    return type_->boxed ? boxed<void>(data_) : static_cast<const void *>(data_);
+  }
+
+  alignas(8) unsigned char data_[8];
+  const Type *type_ = nullptr;
+};
+
+template <typename T>
+const Value::Type Value::type_of = []() {
+  if constexpr (is_inline<T>()) {
+    return Type{false,
+                [](unsigned char *dst, const unsigned char *src) {
+                  std::memcpy(dst, src, sizeof(T));
+                },
+                nullptr};
+  } else {
+    return Type{true,
+                [](unsigned char *dst, const unsigned char *src) {
+                  auto p = new T(*boxed<T>(src));
+                  std::memcpy(dst, &p, sizeof(p));
+                },
+                [](unsigned char *data) { delete boxed<T>(data); }};
+  }
+}();
+
 /*
  * Semantic values
  */
-struct SemanticValues : protected std::vector<std::any> {
+class Context;
+class Definition;
+
+struct SemanticValues : protected std::vector<Value> {
   // Input text
   const char *path = nullptr;
   const char *ss = nullptr;
-  std::function<const std::vector<size_t> &()> source_line_index;
+
+  // Offsets of the line ends in the input text (built on first use)
+  const std::vector<size_t> &source_line_index() const;
 
   // Matched string
   std::string_view sv() const { return sv_; }
 
   // Definition name
-  const std::string &name() const { return name_; }
+  const std::string &name() const;
 
   std::vector<unsigned int> tags;
 
@@ -511,6 +747,15 @@ struct SemanticValues : protected std::vector<std::any> {
     return token_to_number_<T>(token());
   }
 
+  // Semantic value i, which must be a T
+  template <typename T> const T &get(size_t i) const {
+    return (*this)[i].template get<T>();
+  }
+
+  template <typename T> T &get(size_t i) {
+    return (*this)[i].template get<T>();
+  }
+
   // Transform the semantic value vector to another vector
   template <typename T>
   std::vector<T> transform(size_t beg = 0,
@@ -518,33 +763,33 @@ struct SemanticValues : protected std::vector<std::any> {
     std::vector<T> r;
     end = (std::min)(end, size());
     for (size_t i = beg; i < end; i++) {
-      r.emplace_back(std::any_cast<T>((*this)[i]));
+      r.emplace_back(get<T>(i));
     }
     return r;
   }
 
-  using std::vector<std::any>::iterator;
-  using std::vector<std::any>::const_iterator;
-  using std::vector<std::any>::size;
-  using std::vector<std::any>::empty;
-  using std::vector<std::any>::assign;
-  using std::vector<std::any>::begin;
-  using std::vector<std::any>::end;
-  using std::vector<std::any>::rbegin;
-  using std::vector<std::any>::rend;
-  using std::vector<std::any>::operator[];
-  using std::vector<std::any>::at;
-  using std::vector<std::any>::resize;
-  using std::vector<std::any>::front;
-  using std::vector<std::any>::back;
-  using std::vector<std::any>::push_back;
-  using std::vector<std::any>::pop_back;
-  using std::vector<std::any>::insert;
-  using std::vector<std::any>::erase;
-  using std::vector<std::any>::clear;
-  using std::vector<std::any>::swap;
-  using std::vector<std::any>::emplace;
-  using std::vector<std::any>::emplace_back;
+  using std::vector<Value>::iterator;
+  using std::vector<Value>::const_iterator;
+  using std::vector<Value>::size;
+  using std::vector<Value>::empty;
+  using std::vector<Value>::assign;
+  using std::vector<Value>::begin;
+  using std::vector<Value>::end;
+  using std::vector<Value>::rbegin;
+  using std::vector<Value>::rend;
+  using std::vector<Value>::operator[];
+  using std::vector<Value>::at;
+  using std::vector<Value>::resize;
+  using std::vector<Value>::front;
+  using std::vector<Value>::back;
+  using std::vector<Value>::push_back;
+  using std::vector<Value>::pop_back;
+  using std::vector<Value>::insert;
+  using std::vector<Value>::erase;
+  using std::vector<Value>::clear;
+  using std::vector<Value>::swap;
+  using std::vector<Value>::emplace;
+  using std::vector<Value>::emplace_back;
 
 private:
   friend class Context;
@@ -552,26 +797,28 @@ private:
   friend class PrioritizedChoice;
   friend class Holder;
   friend class PrecedenceClimbing;
+  friend class Flatten;
+  friend struct NativeOps;
+  friend class ParallelParser;
+  friend class ParseCache;
 
   std::string_view sv_;
   size_t choice_count_ = 0;
   size_t choice_ = 0;
-  std::string name_;
+  Context *context_ = nullptr;
+  const Definition *rule_ = nullptr;
 };
 
 /*
  * Semantic action
  */
-template <typename F, typename... Args> std::any call(F fn, Args &&... args) {
+template <typename F, typename... Args> Value call(F fn, Args &&... args) {
   using R = decltype(fn(std::forward<Args>(args)...));
   if constexpr (std::is_void<R>::value) {
     fn(std::forward<Args>(args)...);
-    return std::any();
-  } else if constexpr (std::is_same<typename std::remove_cv<R>::type,
-                                    std::any>::value) {
-    return fn(std::forward<Args>(args)...);
+    return Value();
   } else {
-    return std::any(fn(std::forward<Args>(args)...));
+    return Value(fn(std::forward<Args>(args)...));
   }
 }
 
@@ -597,12 +844,12 @@ public:
 
   operator bool() const { return bool(fn_); }
 
-  std::any operator()(SemanticValues &vs, std::any &dt) const {
+  Value operator()(SemanticValues &vs, std::any &dt) const {
     return fn_(vs, dt);
   }
 
 private:
-  using Fty = std::function<std::any(SemanticValues &vs, std::any &dt)>;
+  using Fty = std::function<Value(SemanticValues &vs, std::any &dt)>;
 
   template <typename F> Fty make_adaptor(F fn) {
     if constexpr (argument_count<F>::value == 1) {
@@ -780,6 +1027,7 @@ private:
 class Context;
 class Ope;
 class Definition;
+class CharacterClass;
 
 using TracerEnter = std::function<void(const Ope &name, const char *s, size_t n,
                                        const SemanticValues &vs,
@@ -789,6 +1037,351 @@ using TracerLeave = std::function<void(
     const Ope &ope, const char *s, size_t n, const SemanticValues &vs,
     const Context &c, const std::any &dt, size_t)>;
 
+// Results of rule invocations, kept across parses of a text that is edited
+// in between (see parser::set_memo.) Each result records how far into the
+// text its rule looked, so an edit drops only the results it may change and
+// shifts those after it. Values are reused as they are, so they must not
+// point into the text; the ids of a grammar's rules key the results, so a
+// memo belongs to one grammar.
+//
+// Like a gap buffer, the results are split at the last edit: those before
+// it are kept by position, and those after it by position less the shift
+// of all edits so far. An edit moves the split to itself, shifts everything
+// after it by adjusting that shift, and drops the results it touches, so
+// its cost depends on those results and on how far it is from the last
+// edit, but not on the results after it.
+class Memo {
+public:
+  struct Entry {
+    size_t len;      // (-1 for a failed match)
+    size_t examined; // bytes looked at, from the start of the match
+    Value val;
+  };
+
+  const Entry *find(size_t pos, size_t def_id) const {
+    const auto &entries = pos < gap_ ? before_ : after_;
+    auto it = entries.find(key(pos, def_id));
+    return it != entries.end() ? &it->second : nullptr;
+  }
+
+  void add(size_t pos, size_t def_id, size_t len, size_t examined,
+           const Value &val) {
+    auto k = key(pos, def_id);
+    if (pos >= gap_) {
+      after_.insert_or_assign(k, Entry{len, examined, val});
+      return;
+    }
+    auto it = before_.find(k);
+    if (it != before_.end()) { ends_.erase(end_of(*it)); }
+    ends_.emplace(pos + examined, k);
+    before_.insert_or_assign(k, Entry{len, examined, val});
+  }
+
+  // Replaces `removed` bytes at `offset` with `inserted` bytes.
+  void edit(size_t offset, size_t removed, size_t inserted) {
+    move_gap(offset);
+
+    // Results within the removed bytes, and results before them which
+    // looked at them (or at the insertion point.)
+    after_.erase(after_.lower_bound(key(offset, 0)),
+                 after_.lower_bound(key(offset + removed, 0)));
+    auto first = ends_.lower_bound(
+        std::pair(offset + 1, Key{std::numeric_limits<Pos>::min(), 0}));
+    for (auto it = first; it != ends_.end(); ++it) {
+      before_.erase(it->second);
+    }
+    ends_.erase(first, ends_.end());
+
+    shift_ += static_cast<Pos>(inserted) - static_cast<Pos>(removed);
+    gap_ = offset + inserted;
+  }
+
+  void clear() {
+    before_.clear();
+    after_.clear();
+    ends_.clear();
+    gap_ = 0;
+    shift_ = 0;
+  }
+
+  size_t size() const { return before_.size() + after_.size(); }
+
+  // Bytes held, estimated from the entries and tree nodes (values' own
+  // allocations are not counted.)
+  size_t bytes() const {
+    auto node = sizeof(Key) + sizeof(Entry) + 4 * sizeof(void *);
+    auto end = sizeof(std::pair<size_t, Key>) + 4 * sizeof(void *);
+    return size() * node + ends_.size() * end;
+  }
+
+private:
+  using Pos = std::ptrdiff_t;
+
+  struct Key {
+    Pos pos; // (before the gap, the position; after it, less shift_)
+    size_t def_id;
+    bool operator<(const Key &rhs) const {
+      return pos < rhs.pos || (pos == rhs.pos && def_id < rhs.def_id);
+    }
+  };
+
+  Key key(size_t pos, size_t def_id) const {
+    auto p = static_cast<Pos>(pos);
+    return Key{pos < gap_ ? p : p - shift_, def_id};
+  }
+
+  static std::pair<size_t, Key> end_of(const std::pair<const Key, Entry> &e) {
+    return std::pair(static_cast<size_t>(e.first.pos) + e.second.examined,
+                     e.first);
+  }
+
+  // Moves the results between the gap and pos to the other side of it.
+  void move_gap(size_t pos) {
+    if (pos < gap_) {
+      auto first = before_.lower_bound(key(pos, 0));
+      for (auto it = first; it != before_.end(); ++it) {
+        ends_.erase(end_of(*it));
+        after_.emplace(Key{it->first.pos - shift_, it->first.def_id},
+                       std::move(it->second));
+      }
+      before_.erase(first, before_.end());
+    } else {
+      auto last = after_.lower_bound(Key{static_cast<Pos>(pos) - shift_, 0});
+      for (auto it = after_.begin(); it != last; ++it) {
+        Key k{it->first.pos + shift_, it->first.def_id};
+        ends_.emplace(static_cast<size_t>(k.pos) + it->second.examined, k);
+        before_.emplace(k, std::move(it->second));
+      }
+      after_.erase(after_.begin(), last);
+    }
+    gap_ = pos;
+  }
+
+  std::map<Key, Entry> before_;
+  std::map<Key, Entry> after_;
+  // The results before the gap, by where what they looked at ends.
+  std::set<std::pair<size_t, Key>> ends_;
+  size_t gap_ = 0;
+  Pos shift_ = 0;
+};
+
+// What the parses of a parser record besides their results, set with
+// parser::set_instrumentation and turned on by enable_trace, set_trace and
+// set_profile. A parse copies it into its Context once, so an uninstrumented
+// parse tests a single flag per operator instead of the tracer callbacks.
+enum class Instrumentation : uint8_t {
+  off = 0,
+  trace = 1 << 0,    // the tracer callbacks, and Trace
+  profile = 1 << 1,  // Profile, counted and timed
+  counters = 1 << 2, // Profile, counted only (no clock reads)
+};
+
+inline constexpr Instrumentation operator|(Instrumentation a,
+                                           Instrumentation b) {
+  return static_cast<Instrumentation>(static_cast<uint8_t>(a) |
+                                      static_cast<uint8_t>(b));
+}
+
+inline constexpr Instrumentation operator&(Instrumentation a,
+                                           Instrumentation b) {
+  return static_cast<Instrumentation>(static_cast<uint8_t>(a) &
+                                      static_cast<uint8_t>(b));
+}
+
+inline constexpr Instrumentation operator~(Instrumentation a) {
+  return static_cast<Instrumentation>(~static_cast<uint8_t>(a));
+}
+
+// Whether a has any of the flags of b.
+inline constexpr bool has(Instrumentation a, Instrumentation b) {
+  return (a & b) != Instrumentation::off;
+}
+
+// Counts and times of the invocations of each rule, gathered by the parses
+// of a parser it is set on (see parser::set_profile.) Times are inclusive of
+// the rules a rule invokes, and exclusive of them; a recursive rule counts the
+// time of its inner invocations again in its inclusive time. (Times are left
+// at 0 under Instrumentation::counters.) Rules are found
+// by their ids, so a profile belongs to one grammar and start rule. (The
+// parses of a ParallelParser, run on several threads, are not profiled.)
+class Profile {
+public:
+  struct Stats {
+    const Definition *rule;
+    size_t invocations = 0;
+    size_t successes = 0;
+    size_t failures = 0;
+    size_t memo_hits = 0;   // (results found in the packrat cache or Memo)
+    size_t memo_misses = 0; // (results that were not)
+    size_t bytes = 0;       // matched by the successful invocations
+    std::chrono::nanoseconds inclusive{0};
+    std::chrono::nanoseconds exclusive{0};
+  };
+
+  // The invoked rules, in the order of their first invocation.
+  const std::vector<Stats> &rules() const { return stats_; }
+
+  void clear() {
+    index_.clear();
+    stats_.clear();
+  }
+
+private:
+  friend class Holder;
+  friend class Context;
+
+  using clock = std::chrono::steady_clock;
+
+  size_t index(size_t def_id, const Definition *rule) {
+    if (index_.size() <= def_id) { index_.resize(def_id + 1, npos); }
+    auto &i = index_[def_id];
+    if (i == npos) {
+      i = stats_.size();
+      stats_.push_back(Stats{rule});
+    }
+    return i;
+  }
+
+  void memo_hit(size_t def_id) { stats_[index_[def_id]].memo_hits++; }
+  void memo_miss(size_t def_id) { stats_[index_[def_id]].memo_misses++; }
+
+  clock::time_point enter() {
+    nested_.push_back(clock::duration::zero());
+    return clock::now();
+  }
+
+  void leave(size_t i, clock::time_point start) {
+    auto &stats = stats_[i];
+    auto inclusive = clock::now() - start;
+    auto nested = nested_.back();
+    nested_.pop_back();
+    if (!nested_.empty()) { nested_.back() += inclusive; }
+
+    stats.inclusive += inclusive;
+    stats.exclusive += inclusive - nested;
+  }
+
+  void count(size_t i, size_t len) {
+    auto &stats = stats_[i];
+    stats.invocations++;
+    if (len != static_cast<size_t>(-1)) {
+      stats.successes++;
+      stats.bytes += len;
+    } else {
+      stats.failures++;
+    }
+  }
+
+  static constexpr size_t npos = static_cast<size_t>(-1);
+  std::vector<size_t> index_; // (by rule id, into stats_)
+  std::vector<Stats> stats_;
+  std::vector<clock::duration> nested_; // time of the invoked rules, by level
+};
+
+// The latest rule invocations of the parses of a parser it is set on (see
+// parser::set_trace), kept as fixed-size events in a ring buffer: tracing a
+// long parse takes a bounded amount of memory and allocates nothing per
+// invocation, the oldest events being overwritten. Like a Profile, it
+// belongs to one grammar and start rule.
+class Trace {
+public:
+  struct Event {
+    size_t rule;      // (id)
+    size_t pos;       // in the text
+    size_t len;       // (-1 for a failed match)
+    int64_t start;    // nanoseconds since the trace was started
+    int64_t duration; // nanoseconds
+  };
+
+  explicit Trace(size_t capacity)
+      : events_(std::max<size_t>(capacity, 1)), epoch_(clock::now()) {}
+
+  size_t capacity() const { return events_.size(); }
+
+  // Events kept, and those overwritten since the trace was started.
+  size_t size() const { return std::min(count_, events_.size()); }
+  size_t dropped() const { return count_ - size(); }
+
+  // The kept events, oldest (to finish) first.
+  const Event &operator[](size_t i) const {
+    auto first = count_ > events_.size() ? next_ : 0;
+    return events_[(first + i) % events_.size()];
+  }
+
+  const Definition *rule(size_t id) const { return rules_[id]; }
+
+  void clear() {
+    count_ = 0;
+    next_ = 0;
+    epoch_ = clock::now();
+  }
+
+  // Writes the events in the Chrome trace event format, which Perfetto and
+  // chrome://tracing display, as one complete event per invocation.
+  void write_chrome_json(std::ostream &os) const;
+
+private:
+  friend class Holder;
+
+  using clock = std::chrono::steady_clock;
+
+  int64_t enter(size_t def_id, const Definition *rule) {
+    if (rules_.size() <= def_id) { rules_.resize(def_id + 1); }
+    rules_[def_id] = rule;
+    return now();
+  }
+
+  void leave(size_t def_id, size_t pos, int64_t start, size_t len) {
+    events_[next_] = Event{def_id, pos, len, start, now() - start};
+    if (++next_ == events_.size()) { next_ = 0; }
+    count_++;
+  }
+
+  int64_t now() const {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() -
+                                                                epoch_)
+        .count();
+  }
+
+  std::vector<Event> events_;
+  size_t next_ = 0;  // (the slot of the next event)
+  size_t count_ = 0; // (events since the trace was started)
+  clock::time_point epoch_;
+  std::vector<const Definition *> rules_; // (by id)
+};
+
+// Memory held by the state of a parse as it ends (see
+// parser::set_parse_memory), estimated from the capacities of its
+// containers. The value stack and capture scopes are kept at the deepest
+// nesting the parse reached, so this is the parse's peak for them.
+struct ParseMemory {
+  size_t packrat_bytes = 0; // (bitmaps and cached results)
+  size_t value_stack_frames = 0;
+  size_t value_stack_bytes = 0;
+  size_t capture_scope_bytes = 0;
+};
+
+// A semantic action whose call was put off (see ParallelParser): the rule,
+// and the semantic values it was to be called with. A value that is the
+// result of another put-off action holds a Reduction::Ref to it.
+struct Reduction {
+  struct Ref {
+    size_t index;
+  };
+
+  const Definition *rule;
+  std::string_view sv;
+  size_t choice_count;
+  size_t choice;
+  std::vector<Value> values;
+  std::vector<unsigned int> tags;
+  std::vector<std::string_view> tokens;
+};
+
+// Runs the given function, on a fresh stack if the current one is running
+// low. Called every Context::stack_guard_interval levels of rule nesting.
+using StackGuard = std::function<void(const std::function<void()> &)>;
+
 class Context {
 public:
   const char *path;
@@ -803,7 +1396,8 @@ public:
   size_t value_stack_size = 0;
 
   std::vector<Definition *> rule_stack;
-  std::vector<std::vector<std::shared_ptr<Ope>>> args_stack;
+  std::vector<const std::vector<std::shared_ptr<Ope>> *> args_stack;
+  const std::vector<std::shared_ptr<Ope>> no_args;
 
   size_t in_token_boundary_count = 0;
 
@@ -811,23 +1405,74 @@ public:
   bool in_whitespace = false;
 
   std::shared_ptr<Ope> wordOpe;
+  bool word_start_init = false;
+  std::shared_ptr<CharacterClass> word_start;
+  std::unique_ptr<Context> word_context;
+
+  // Captured texts ($name<...>), by scope: a scope's captures start at its
+  // entry of capture_scopes and end where the next scope's start. Nothing is
+  // kept if the grammar has no captures (see Definition::uses_captures_.)
+  struct CaptureEntry {
+    std::string_view name;
+    std::string_view value;
+  };
+  std::vector<CaptureEntry> capture_entries;
+  std::vector<size_t> capture_scopes;
+  bool uses_captures = true;
 
-  std::vector<std::map<std::string_view, std::string>> capture_scope_stack;
-  size_t capture_scope_stack_size = 0;
+  // The texts matched by back references (kept for the error report.)
+  std::set<std::string, std::less<>> capture_literals;
 
   std::vector<bool> cut_stack;
 
+  // Operator rule of the innermost precedence climbing, and the token of
+  // its last reduction.
+  const Definition *binop_rule = nullptr;
+  std::string_view binop_token;
+
   const size_t def_count;
   const bool enablePackratParsing;
   std::vector<bool> cache_registered;
   std::vector<bool> cache_success;
 
-  std::map<std::pair<size_t, size_t>, std::tuple<size_t, std::any>>
+  std::map<std::pair<size_t, size_t>, std::tuple<size_t, Value>>
       cache_values;
 
+  // Matches of left-recursive rules being grown, innermost last.
+  struct Seed {
+    const char *s;
+    const Definition *rule;
+    size_t len;
+    Value val;
+  };
+  std::vector<Seed> seeds;
+
+  // Results kept from earlier parses of the text (see Memo), and the end of
+  // the input looked at so far by the rule being memoized.
+  Memo *memo = nullptr;
+  const char *examined = s;
+
+  // Actions are put off and appended here, if set.
+  std::vector<Reduction> *reductions = nullptr;
+
+  // Set by instrument(): the rule invocations are counted (and timed) in
+  // profile, and recorded in trace, if set.
+  Instrumentation instrumentation = Instrumentation::off;
+  Profile *profile = nullptr;
+  Trace *trace = nullptr;
+
   TracerEnter tracer_enter;
   TracerLeave tracer_leave;
 
+  // Whether the rules' flat_ast_action are called instead of their actions.
+  bool flat_ast = false;
+
+  // Rule nesting depth, failing with an error past max_depth (0: no limit.)
+  size_t depth = 0;
+  size_t max_depth = 0;
+  StackGuard stack_guard;
+  static constexpr size_t stack_guard_interval = 16;
+
   Log log;
 
   Context(const char *path, const char *s, size_t l, size_t def_count,
@@ -840,7 +1485,7 @@ public:
         cache_success(enablePackratParsing ? def_count * (l + 1) : 0),
         tracer_enter(tracer_enter), tracer_leave(tracer_leave), log(log) {
 
-    args_stack.resize(1);
+    args_stack.push_back(&no_args);
 
     push_capture_scope();
   }
@@ -852,8 +1497,13 @@ public:
   Context operator=(const Context &) = delete;
 
   template <typename T>
-  void packrat(const char *a_s, size_t def_id, size_t &len, std::any &val,
+  void packrat(const char *a_s, size_t def_id, size_t &len, Value &val,
                T fn) {
+    if (memo) {
+      memoize(a_s, def_id, len, val, fn);
+      return;
+    }
+
     if (!enablePackratParsing) {
       fn(val);
       return;
@@ -863,6 +1513,7 @@ public:
     auto idx = def_count * static_cast<size_t>(col) + def_id;
 
     if (cache_registered[idx]) {
+      if (profile) { profile->memo_hit(def_id); }
       if (cache_success[idx]) {
         auto key = std::pair(col, def_id);
         std::tie(len, val) = cache_values[key];
@@ -872,7 +1523,10 @@ public:
         return;
       }
     } else {
+      if (profile) { profile->memo_miss(def_id); }
       fn(val);
+      // (results may depend on a seed that is still growing.)
+      if (!seeds.empty()) { return; }
       cache_registered[idx] = true;
       cache_success[idx] = success(len);
       if (success(len)) {
@@ -883,6 +1537,57 @@ public:
     }
   }
 
+  template <typename T>
+  void memoize(const char *a_s, size_t def_id, size_t &len, Value &val,
+               T fn) {
+    auto pos = static_cast<size_t>(a_s - s);
+    if (auto entry = memo->find(pos, def_id)) {
+      if (profile) { profile->memo_hit(def_id); }
+      len = entry->len;
+      if (success(len)) { val = entry->val; }
+      examine(a_s + entry->examined);
+      return;
+    }
+
+    if (profile) { profile->memo_miss(def_id); }
+    auto outer = examined;
+    examined = a_s;
+    fn(val);
+    auto end = examined;
+    examined = std::max(outer, end);
+
+    // (results may depend on a seed that is still growing.)
+    if (!seeds.empty()) { return; }
+    memo->add(pos, def_id, len, static_cast<size_t>(end - a_s), val);
+  }
+
+  // Puts off the action of rule on vs, returning a reference to it.
+  Value defer_action(const Definition &rule, SemanticValues &vs) {
+    reductions->push_back(
+        Reduction{&rule, vs.sv_, vs.choice_count_, vs.choice_,
+                  std::vector<Value>(std::make_move_iterator(vs.begin()),
+                                     std::make_move_iterator(vs.end())),
+                  vs.tags, vs.tokens});
+    return Value(Reduction::Ref{reductions->size() - 1});
+  }
+
+  // Records that the input up to `end` (exclusive) was looked at; looking
+  // at the end of the input counts as one byte past it.
+  void examine(const char *end) {
+    if (examined < end) { examined = end; }
+  }
+
+  // Records a codepoint of `len` bytes read at a_s, or a failed decode
+  // (len 0), which may have read up to 4 bytes.
+  void examine_codepoint(const char *a_s, size_t n, size_t len) {
+    if (!len) {
+      len = (n > 0 && static_cast<uint8_t>(a_s[0]) < 0x80)
+                ? 1
+                : std::min<size_t>(n + 1, 4);
+    }
+    examine(a_s + len);
+  }
+
   SemanticValues &push() {
     assert(value_stack_size <= value_stack.size());
     if (value_stack_size == value_stack.size()) {
@@ -896,62 +1601,135 @@ public:
       vs.sv_ = std::string_view();
       vs.choice_count_ = 0;
       vs.choice_ = 0;
+      vs.rule_ = nullptr;
       if (!vs.tokens.empty()) { vs.tokens.clear(); }
     }
 
     auto &vs = *value_stack[value_stack_size++];
     vs.path = path;
     vs.ss = s;
-    vs.source_line_index = [&]() -> const std::vector<size_t> & {
-      if (source_line_index.empty()) {
-        for (size_t pos = 0; pos < l; pos++) {
-          if (s[pos] == '\n') { source_line_index.push_back(pos); }
-        }
-        source_line_index.push_back(l);
-      }
-      return source_line_index;
-    };
+    vs.context_ = this;
 
     return vs;
   }
 
   void pop() { value_stack_size--; }
 
-  void push_args(std::vector<std::shared_ptr<Ope>> &&args) {
-    args_stack.emplace_back(args);
+  // args must outlive the matching pop_args().
+  void push_args(const std::vector<std::shared_ptr<Ope>> &args) {
+    args_stack.push_back(&args);
   }
 
   void pop_args() { args_stack.pop_back(); }
 
   const std::vector<std::shared_ptr<Ope>> &top_args() const {
-    return args_stack[args_stack.size() - 1];
+    return *args_stack.back();
   }
 
   void push_capture_scope() {
-    assert(capture_scope_stack_size <= capture_scope_stack.size());
-    if (capture_scope_stack_size == capture_scope_stack.size()) {
-      capture_scope_stack.emplace_back(
-          std::map<std::string_view, std::string>());
-    } else {
-      auto &cs = capture_scope_stack[capture_scope_stack_size];
-      if (!cs.empty()) { cs.clear(); }
-    }
-    capture_scope_stack_size++;
+    if (!uses_captures) { return; }
+    capture_scopes.push_back(capture_entries.size());
   }
 
-  void pop_capture_scope() { capture_scope_stack_size--; }
+  void pop_capture_scope() {
+    if (!uses_captures) { return; }
+    capture_entries.resize(capture_scopes.back());
+    capture_scopes.pop_back();
+  }
 
+  // Moves the captures of the innermost scope into the enclosing one.
   void shift_capture_values() {
-    assert(capture_scope_stack.size() >= 2);
-    auto curr = &capture_scope_stack[capture_scope_stack_size - 1];
-    auto prev = curr - 1;
-    for (const auto &[k, v] : *curr) {
-      (*prev)[k] = v;
+    if (!uses_captures) { return; }
+    assert(capture_scopes.size() >= 2);
+    const auto first = capture_scopes[capture_scopes.size() - 2];
+    auto end = capture_scopes.back();
+    for (auto i = end; i < capture_entries.size(); i++) {
+      auto &entry = capture_entries[i];
+      auto j = first;
+      while (j < end && capture_entries[j].name != entry.name) {
+        j++;
+      }
+      if (j < end) {
+        capture_entries[j].value = entry.value;
+      } else {
+        capture_entries[end++] = entry;
+      }
+    }
+    capture_entries.resize(end);
+    capture_scopes.back() = end;
+  }
+
+  void set_capture(std::string_view name, std::string_view value) {
+    for (auto i = capture_scopes.back(); i < capture_entries.size(); i++) {
+      if (capture_entries[i].name == name) {
+        capture_entries[i].value = value;
+        return;
+      }
+    }
+    capture_entries.push_back(CaptureEntry{name, value});
+  }
+
+  // The innermost capture of name, or nullptr.
+  const std::string_view *find_capture(std::string_view name) const {
+    for (auto i = capture_entries.size(); i > 0; i--) {
+      if (capture_entries[i - 1].name == name) {
+        return &capture_entries[i - 1].value;
+      }
     }
+    return nullptr;
   }
 
   void set_error_pos(const char *a_s, const char *literal = nullptr);
 
+  // Whether the %word rule matches at a_s.
+  bool match_word(const char *a_s, size_t n);
+
+  Seed *find_seed(const char *a_s, const Definition *rule) {
+    for (auto &seed : seeds) {
+      if (seed.s == a_s && seed.rule == rule) { return &seed; }
+    }
+    return nullptr;
+  }
+
+  void instrument(Instrumentation a_instrumentation, Profile *a_profile,
+                  Trace *a_trace) {
+    instrumentation = a_instrumentation;
+    auto counted = Instrumentation::profile | Instrumentation::counters;
+    profile = has(instrumentation, counted) ? a_profile : nullptr;
+    trace = has(instrumentation, Instrumentation::trace) ? a_trace : nullptr;
+  }
+
+  // Whether the tracer callbacks are called.
+  bool tracing() const {
+    return has(instrumentation, Instrumentation::trace) && tracer_enter &&
+           tracer_leave;
+  }
+
+  void measure(ParseMemory &memory) const {
+    memory.packrat_bytes =
+        (cache_registered.capacity() + cache_success.capacity()) / 8 +
+        cache_values.size() *
+            (sizeof(decltype(cache_values)::value_type) + 4 * sizeof(void *));
+
+    memory.value_stack_frames = value_stack.size();
+    memory.value_stack_bytes =
+        value_stack.capacity() * sizeof(std::shared_ptr<SemanticValues>);
+    for (const auto &vs : value_stack) {
+      memory.value_stack_bytes +=
+          sizeof(SemanticValues) + vs->capacity() * sizeof(Value) +
+          vs->tags.capacity() * sizeof(unsigned int) +
+          vs->tokens.capacity() * sizeof(std::string_view);
+    }
+
+    memory.capture_scope_bytes =
+        capture_entries.capacity() * sizeof(CaptureEntry) +
+        capture_scopes.capacity() * sizeof(size_t);
+    for (const auto &lit : capture_literals) {
+      memory.capture_scope_bytes +=
+          sizeof(std::string) + 4 * sizeof(void *) + lit.capacity();
+    }
+  }
+
   // void trace_enter(const char *name, const char *a_s, size_t n,
   void trace_enter(const Ope &ope, const char *a_s, size_t n,
                    SemanticValues &vs, std::any &dt) const;
@@ -961,7 +1739,7 @@ public:
   bool is_traceable(const Ope &ope) const;
 
   mutable size_t next_trace_id = 0;
-  mutable std::list<size_t> trace_ids;
+  mutable std::vector<size_t> trace_ids;
 };
 
 /*
@@ -1033,56 +1811,48 @@ public:
   PrioritizedChoice(std::vector<std::shared_ptr<Ope>> &&opes) : opes_(opes) {}
 
   size_t parse_core(const char *s, size_t n, SemanticValues &vs, Context &c,
-                    std::any &dt) const override {
-    size_t len = static_cast<size_t>(-1);
-
-    if (!for_label_) { c.cut_stack.push_back(false); }
+                    std::any &dt) const override;
 
-    size_t id = 0;
-    for (const auto &ope : opes_) {
-      if (!c.cut_stack.empty()) { c.cut_stack.back() = false; }
+  // Returns true if the choice is decided (matched or cut.)
+  bool parse_alternative(size_t id, size_t &len, const char *s, size_t n,
+                         SemanticValues &vs, Context &c, std::any &dt) const {
+    if (!c.cut_stack.empty()) { c.cut_stack.back() = false; }
 
-      auto &chldsv = c.push();
-      c.push_capture_scope();
+    auto &chldsv = c.push();
+    c.push_capture_scope();
 
-      auto se = scope_exit([&]() {
-        c.pop();
-        c.pop_capture_scope();
-      });
+    auto se = scope_exit([&]() {
+      c.pop();
+      c.pop_capture_scope();
+    });
 
-      len = ope->parse(s, n, chldsv, c, dt);
+    len = opes_[id]->parse(s, n, chldsv, c, dt);
 
-      if (success(len)) {
-        if (!chldsv.empty()) {
-          for (size_t i = 0; i < chldsv.size(); i++) {
-            vs.emplace_back(std::move(chldsv[i]));
-          }
+    if (success(len)) {
+      if (!chldsv.empty()) {
+        for (size_t i = 0; i < chldsv.size(); i++) {
+          vs.emplace_back(std::move(chldsv[i]));
         }
-        if (!chldsv.tags.empty()) {
-          for (size_t i = 0; i < chldsv.tags.size(); i++) {
-            vs.tags.emplace_back(std::move(chldsv.tags[i]));
-          }
+      }
+      if (!chldsv.tags.empty()) {
+        for (size_t i = 0; i < chldsv.tags.size(); i++) {
+          vs.tags.emplace_back(std::move(chldsv.tags[i]));
         }
-        vs.sv_ = chldsv.sv_;
-        vs.choice_count_ = opes_.size();
-        vs.choice_ = id;
-        if (!chldsv.tokens.empty()) {
-          for (size_t i = 0; i < chldsv.tokens.size(); i++) {
-            vs.tokens.emplace_back(std::move(chldsv.tokens[i]));
-          }
+      }
+      vs.sv_ = chldsv.sv_;
+      vs.choice_count_ = opes_.size();
+      vs.choice_ = id;
+      if (!chldsv.tokens.empty()) {
+        for (size_t i = 0; i < chldsv.tokens.size(); i++) {
+          vs.tokens.emplace_back(std::move(chldsv.tokens[i]));
         }
-        c.shift_capture_values();
-        break;
-      } else if (!c.cut_stack.empty() && c.cut_stack.back()) {
-        break;
       }
-
-      id++;
+      c.shift_capture_values();
+      return true;
+    } else if (!c.cut_stack.empty() && c.cut_stack.back()) {
+      return true;
     }
-
-    if (!for_label_) { c.cut_stack.pop_back(); }
-
-    return len;
+    return false;
   }
 
   void accept(Visitor &v) override;
@@ -1091,6 +1861,11 @@ public:
 
   std::vector<std::shared_ptr<Ope>> opes_;
   bool for_label_ = false;
+
+  // FIRST-set dispatch (see SetupChoiceDispatch): the alternatives which can
+  // match, indexed by the next input byte (256 is the end of input.)
+  std::vector<size_t> dispatch_;
+  std::vector<std::vector<size_t>> candidates_;
 };
 
 class Repetition : public Ope {
@@ -1222,7 +1997,8 @@ public:
 
 class Dictionary : public Ope, public std::enable_shared_from_this<Dictionary> {
 public:
-  Dictionary(const std::vector<std::string> &v) : trie_(v) {}
+  Dictionary(const std::vector<std::string> &v, bool ignore_case)
+      : trie_(v, ignore_case), items_(v), ignore_case_(ignore_case) {}
 
   size_t parse_core(const char *s, size_t n, SemanticValues &vs, Context &c,
                     std::any &dt) const override;
@@ -1230,6 +2006,8 @@ public:
   void accept(Visitor &v) override;
 
   Trie trie_;
+  std::vector<std::string> items_;
+  bool ignore_case_;
 };
 
 class LiteralString : public Ope,
@@ -1271,47 +2049,203 @@ public:
       }
     }
     assert(!ranges_.empty());
+    compile();
   }
 
   CharacterClass(const std::vector<std::pair<char32_t, char32_t>> &ranges,
                  bool negated)
       : ranges_(ranges), negated_(negated) {
     assert(!ranges_.empty());
+    compile();
   }
 
   size_t parse_core(const char *s, size_t n, SemanticValues & /*vs*/,
                     Context &c, std::any & /*dt*/) const override {
-    if (n < 1) {
-      c.set_error_pos(s);
-      return static_cast<size_t>(-1);
-    }
+    auto len = match(s, n);
+    c.examine_codepoint(s, n, success(len) ? len : 0);
+    if (fail(len)) { c.set_error_pos(s); }
+    return len;
+  }
+
+  // Length of the character at the start of s, if it is in the class.
+  size_t match(const char *s, size_t n) const {
+    if (n < 1) { return static_cast<size_t>(-1); }
+
+    auto b = static_cast<uint8_t>(s[0]);
+    if (b < 0x80) { return ascii_.test(b) ? 1 : static_cast<size_t>(-1); }
 
     char32_t cp = 0;
     auto len = decode_codepoint(s, n, cp);
 
-    for (const auto &range : ranges_) {
-      if (range.first <= cp && cp <= range.second) {
-        if (negated_) {
-          c.set_error_pos(s);
-          return static_cast<size_t>(-1);
-        } else {
-          return len;
-        }
+    if (contains(cp) != negated_) { return len; }
+    return static_cast<size_t>(-1);
+  }
+
+  // Whether cp is in one of the ranges (ignoring negation.)
+  bool contains(char32_t cp) const {
+    auto it = std::upper_bound(
+        merged_ranges_.begin(), merged_ranges_.end(), cp,
+        [](char32_t x, const auto &range) { return x < range.first; });
+    return it != merged_ranges_.begin() && cp <= std::prev(it)->second;
+  }
+
+  void accept(Visitor &v) override;
+
+  std::vector<std::pair<char32_t, char32_t>> ranges_;
+  bool negated_;
+
+  // Matching ASCII characters (negation included.)
+  std::bitset<128> ascii_;
+  // ranges_, sorted and merged.
+  std::vector<std::pair<char32_t, char32_t>> merged_ranges_;
+
+private:
+  void compile() {
+    merged_ranges_ = ranges_;
+    std::sort(merged_ranges_.begin(), merged_ranges_.end());
+    size_t j = 0;
+    for (size_t i = 1; i < merged_ranges_.size(); i++) {
+      auto &last = merged_ranges_[j];
+      const auto &range = merged_ranges_[i];
+      if (range.first <= last.second || range.first - 1 == last.second) {
+        last.second = std::max(last.second, range.second);
+      } else {
+        merged_ranges_[++j] = range;
       }
     }
+    merged_ranges_.resize(j + 1);
 
-    if (negated_) {
-      return len;
-    } else {
-      c.set_error_pos(s);
-      return static_cast<size_t>(-1);
+    for (char32_t cp = 0; cp < 0x80; cp++) {
+      ascii_.set(cp, contains(cp) != negated_);
+    }
+  }
+};
+
+// `cls*`, `cls+`, `(!'lit' .)*` or `(!'lit' .)+`, where lit starts with an
+// ASCII character. Runs of ASCII characters are matched a block at a time
+// (with SIMD, where available) rather than one operator call per character.
+class Span : public Ope {
+public:
+  Span(const std::shared_ptr<CharacterClass> &cls, size_t min)
+      : cls_(cls), min_(min) {
+    ascii_ = cls_->ascii_;
+    for (const auto &range : cls_->merged_ranges_) {
+      if (range.first < 0x80) {
+        ranges_.emplace_back(range.first,
+                             std::min<char32_t>(range.second, 0x7f));
+      }
     }
+    negated_ = cls_->negated_;
   }
 
+  Span(const std::string &lit, size_t min) : lit_(lit), min_(min) {
+    assert(!lit_.empty() && static_cast<uint8_t>(lit_[0]) < 0x80);
+    ascii_.set();
+    ascii_.reset(static_cast<uint8_t>(lit_[0]));
+    ranges_.emplace_back(lit_[0], lit_[0]);
+    negated_ = true;
+  }
+
+  size_t parse_core(const char *s, size_t n, SemanticValues & /*vs*/,
+                    Context &c, std::any & /*dt*/) const override;
+
   void accept(Visitor &v) override;
 
+  // Length of the run of accepted ASCII characters at the start of s.
+  size_t scan_ascii(const char *s, size_t n) const {
+    size_t i = 0;
+#if defined(__AVX2__) || defined(__SSE2__) || defined(__wasm_simd128__)
+    if (ranges_.size() <= 4) { i = scan_simd(s, n); }
+#endif
+    while (i < n) {
+      auto b = static_cast<uint8_t>(s[i]);
+      if (b >= 0x80 || !ascii_.test(b)) { break; }
+      i++;
+    }
+    return i;
+  }
+
+  std::shared_ptr<CharacterClass> cls_; // (class form)
+  std::string lit_;                     // (literal form)
+  size_t min_;
+
+  // ASCII characters accepted, as a bitmap and as ranges.
+  std::bitset<128> ascii_;
   std::vector<std::pair<char32_t, char32_t>> ranges_;
   bool negated_;
+
+private:
+#if defined(__AVX2__) || defined(__SSE2__) || defined(__wasm_simd128__)
+  // A byte b is in [lo, hi] iff (b - lo) saturating-minus (hi - lo) is zero.
+  size_t scan_simd(const char *s, size_t n) const {
+    size_t i = 0;
+#if defined(__AVX2__)
+    constexpr size_t width = 32;
+    __m256i lo[4], span[4];
+    for (size_t k = 0; k < ranges_.size(); k++) {
+      lo[k] = _mm256_set1_epi8(static_cast<char>(ranges_[k].first));
+      span[k] = _mm256_set1_epi8(
+          static_cast<char>(ranges_[k].second - ranges_[k].first));
+    }
+    const auto zero = _mm256_setzero_si256();
+    for (; i + width <= n; i += width) {
+      auto x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s + i));
+      auto in = zero;
+      for (size_t k = 0; k < ranges_.size(); k++) {
+        auto d = _mm256_subs_epu8(_mm256_sub_epi8(x, lo[k]), span[k]);
+        in = _mm256_or_si256(in, _mm256_cmpeq_epi8(d, zero));
+      }
+      auto mask = static_cast<uint32_t>(_mm256_movemask_epi8(in));
+      if (negated_) { mask = ~mask; }
+      mask &= ~static_cast<uint32_t>(_mm256_movemask_epi8(x));
+      if (mask != 0xffffffffu) { return i + __builtin_ctz(~mask); }
+    }
+#elif defined(__SSE2__)
+    constexpr size_t width = 16;
+    __m128i lo[4], span[4];
+    for (size_t k = 0; k < ranges_.size(); k++) {
+      lo[k] = _mm_set1_epi8(static_cast<char>(ranges_[k].first));
+      span[k] = _mm_set1_epi8(
+          static_cast<char>(ranges_[k].second - ranges_[k].first));
+    }
+    const auto zero = _mm_setzero_si128();
+    for (; i + width <= n; i += width) {
+      auto x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + i));
+      auto in = zero;
+      for (size_t k = 0; k < ranges_.size(); k++) {
+        auto d = _mm_subs_epu8(_mm_sub_epi8(x, lo[k]), span[k]);
+        in = _mm_or_si128(in, _mm_cmpeq_epi8(d, zero));
+      }
+      auto mask = static_cast<uint32_t>(_mm_movemask_epi8(in));
+      if (negated_) { mask = ~mask & 0xffffu; }
+      mask &= ~static_cast<uint32_t>(_mm_movemask_epi8(x));
+      if (mask != 0xffffu) { return i + __builtin_ctz(~mask); }
+    }
+#else
+    constexpr size_t width = 16;
+    v128_t lo[4], span[4];
+    for (size_t k = 0; k < ranges_.size(); k++) {
+      lo[k] = wasm_i8x16_splat(static_cast<int8_t>(ranges_[k].first));
+      span[k] = wasm_i8x16_splat(
+          static_cast<int8_t>(ranges_[k].second - ranges_[k].first));
+    }
+    const auto zero = wasm_i8x16_splat(0);
+    for (; i + width <= n; i += width) {
+      auto x = wasm_v128_load(s + i);
+      auto in = zero;
+      for (size_t k = 0; k < ranges_.size(); k++) {
+        auto d = wasm_u8x16_sub_sat(wasm_i8x16_sub(x, lo[k]), span[k]);
+        in = wasm_v128_or(in, wasm_i8x16_eq(d, zero));
+      }
+      auto mask = static_cast<uint32_t>(wasm_i8x16_bitmask(in));
+      if (negated_) { mask = ~mask & 0xffffu; }
+      mask &= ~static_cast<uint32_t>(wasm_i8x16_bitmask(x));
+      if (mask != 0xffffu) { return i + __builtin_ctz(~mask); }
+    }
+#endif
+    return i;
+  }
+#endif
 };
 
 class Character : public Ope, public std::enable_shared_from_this<Character> {
@@ -1320,6 +2254,7 @@ public:
 
   size_t parse_core(const char *s, size_t n, SemanticValues & /*vs*/,
                     Context &c, std::any & /*dt*/) const override {
+    c.examine(s + 1);
     if (n < 1 || s[0] != ch_) {
       c.set_error_pos(s);
       return static_cast<size_t>(-1);
@@ -1338,6 +2273,7 @@ public:
   size_t parse_core(const char *s, size_t n, SemanticValues & /*vs*/,
                     Context &c, std::any & /*dt*/) const override {
     auto len = codepoint_length(s, n);
+    c.examine_codepoint(s, n, len);
     if (len < 1) {
       c.set_error_pos(s);
       return static_cast<size_t>(-1);
@@ -1423,8 +2359,9 @@ class User : public Ope {
 public:
   User(Parser fn) : fn_(fn) {}
   size_t parse_core(const char *s, size_t n, SemanticValues &vs,
-                    Context & /*c*/, std::any &dt) const override {
+                    Context &c, std::any &dt) const override {
     assert(fn_);
+    c.examine(s + n + 1); // (anything may have been looked at.)
     return fn_(s, n, vs, dt);
   }
   void accept(Visitor &v) override;
@@ -1433,6 +2370,31 @@ public:
       fn_;
 };
 
+using NativeParser = size_t (*)(const char *s, size_t n, SemanticValues &vs,
+                                Context &c, std::any &dt,
+                                Definition *const *rules);
+
+// Core operator of a rule compiled ahead of time by peggml_codegen.
+class Native : public Ope {
+public:
+  Native(NativeParser fn,
+         const std::shared_ptr<std::vector<Definition *>> &rules,
+         bool is_token = false, bool is_choice = false)
+      : fn_(fn), rules_(rules), is_token_(is_token), is_choice_(is_choice) {}
+
+  size_t parse_core(const char *s, size_t n, SemanticValues &vs, Context &c,
+                    std::any &dt) const override {
+    return fn_(s, n, vs, c, dt, rules_->data());
+  }
+
+  void accept(Visitor &v) override;
+
+  NativeParser fn_;
+  std::shared_ptr<std::vector<Definition *>> rules_;
+  bool is_token_;
+  bool is_choice_;
+};
+
 class WeakHolder : public Ope {
 public:
   WeakHolder(const std::shared_ptr<Ope> &ope) : weak_(ope) {}
@@ -1459,7 +2421,7 @@ public:
 
   void accept(Visitor &v) override;
 
-  std::any reduce(SemanticValues &vs, std::any &dt) const;
+  Value reduce(SemanticValues &vs, std::any &dt) const;
 
   const char *trace_name() const;
 
@@ -1468,6 +2430,16 @@ public:
   mutable std::string trace_name_;
 
   friend class Definition;
+
+private:
+  size_t parse_definition(const char *s, size_t n, SemanticValues &vs,
+                          Context &c, std::any &dt) const;
+  size_t parse_rule(const char *s, size_t n, Value &val, Context &c,
+                    std::any &dt) const;
+  size_t grow_seed(const char *s, size_t n, Value &val, Context &c,
+                   std::any &dt) const;
+  size_t parse_nested(const char *s, size_t n, SemanticValues &vs, Context &c,
+                      std::any &dt) const;
 };
 
 using Grammar = std::unordered_map<std::string, Definition>;
@@ -1554,7 +2526,30 @@ private:
   size_t parse_expression(const char *s, size_t n, SemanticValues &vs,
                           Context &c, std::any &dt, size_t min_prec) const;
 
-  Definition &get_reference_for_binop(Context &c) const;
+  std::string_view find_binop(const char *s, size_t n) const;
+
+  const Definition &get_reference_for_binop(Context &c) const;
+};
+
+// A self-tail-recursive rule `A <- P A / Q`, matched iteratively as
+// `P* Q` while reducing every level as the recursive rule would.
+class Flatten : public Ope {
+public:
+  Flatten(const std::shared_ptr<Ope> &head, const std::shared_ptr<Ope> &base,
+          const Definition &rule)
+      : head_(head), base_(base), rule_(rule) {}
+
+  size_t parse_core(const char *s, size_t n, SemanticValues &vs, Context &c,
+                    std::any &dt) const override;
+
+  void accept(Visitor &v) override;
+
+  std::shared_ptr<Ope> head_;
+  std::shared_ptr<Ope> base_;
+  const Definition &rule_;
+
+private:
+  bool reduce(SemanticValues &vs, Value &val, Context &c, std::any &dt) const;
 };
 
 class Recovery : public Ope {
@@ -1623,7 +2618,11 @@ inline std::shared_ptr<Ope> npd(const std::shared_ptr<Ope> &ope) {
 }
 
 inline std::shared_ptr<Ope> dic(const std::vector<std::string> &v) {
-  return std::make_shared<Dictionary>(v);
+  return std::make_shared<Dictionary>(v, false);
+}
+
+inline std::shared_ptr<Ope> dici(const std::vector<std::string> &v) {
+  return std::make_shared<Dictionary>(v, true);
 }
 
 inline std::shared_ptr<Ope> lit(std::string &&s) {
@@ -1703,6 +2702,12 @@ inline std::shared_ptr<Ope> pre(const std::shared_ptr<Ope> &atom,
   return std::make_shared<PrecedenceClimbing>(atom, binop, info, rule);
 }
 
+inline std::shared_ptr<Ope> flat(const std::shared_ptr<Ope> &head,
+                                 const std::shared_ptr<Ope> &base,
+                                 const Definition &rule) {
+  return std::make_shared<Flatten>(head, base, rule);
+}
+
 inline std::shared_ptr<Ope> rec(const std::shared_ptr<Ope> &ope) {
   return std::make_shared<Recovery>(ope);
 }
@@ -1722,6 +2727,7 @@ struct Ope::Visitor {
   virtual void visit(Dictionary &) {}
   virtual void visit(LiteralString &) {}
   virtual void visit(CharacterClass &) {}
+  virtual void visit(Span &) {}
   virtual void visit(Character &) {}
   virtual void visit(AnyCharacter &) {}
   virtual void visit(CaptureScope &) {}
@@ -1729,12 +2735,14 @@ struct Ope::Visitor {
   virtual void visit(TokenBoundary &) {}
   virtual void visit(Ignore &) {}
   virtual void visit(User &) {}
+  virtual void visit(Native &) {}
   virtual void visit(WeakHolder &) {}
   virtual void visit(Holder &) {}
   virtual void visit(Reference &) {}
   virtual void visit(Whitespace &) {}
   virtual void visit(BackReference &) {}
   virtual void visit(PrecedenceClimbing &) {}
+  virtual void visit(Flatten &) {}
   virtual void visit(Recovery &) {}
   virtual void visit(Cut &) {}
 };
@@ -1752,6 +2760,66 @@ private:
   bool is_reference_ = false;
 };
 
+// Whether an operator contains a back reference (references not followed.)
+struct HasBackReference : public Ope::Visitor {
+  void visit(Sequence &ope) override {
+    for (auto op : ope.opes_) {
+      op->accept(*this);
+    }
+  }
+  void visit(PrioritizedChoice &ope) override {
+    for (auto op : ope.opes_) {
+      op->accept(*this);
+    }
+  }
+  void visit(Repetition &ope) override { ope.ope_->accept(*this); }
+  void visit(AndPredicate &ope) override { ope.ope_->accept(*this); }
+  void visit(NotPredicate &ope) override { ope.ope_->accept(*this); }
+  void visit(CaptureScope &ope) override { ope.ope_->accept(*this); }
+  void visit(Capture &ope) override { ope.ope_->accept(*this); }
+  void visit(TokenBoundary &ope) override { ope.ope_->accept(*this); }
+  void visit(Ignore &ope) override { ope.ope_->accept(*this); }
+  void visit(Holder &ope) override { ope.ope_->accept(*this); }
+  void visit(Whitespace &ope) override { ope.ope_->accept(*this); }
+  void visit(BackReference &) override { found_ = true; }
+  void visit(PrecedenceClimbing &ope) override {
+    ope.atom_->accept(*this);
+    ope.binop_->accept(*this);
+  }
+  void visit(Flatten &ope) override {
+    ope.head_->accept(*this);
+    ope.base_->accept(*this);
+  }
+  void visit(Recovery &ope) override { ope.ope_->accept(*this); }
+
+  static bool check(Ope &ope) {
+    HasBackReference vis;
+    ope.accept(vis);
+    return vis.found_;
+  }
+
+protected:
+  bool found_ = false;
+};
+
+// Whether an operator contains a capture or a back reference, in itself or in
+// the arguments of the macros it calls (references not followed.)
+struct HasCapture : public HasBackReference {
+  using HasBackReference::visit;
+  void visit(Capture &) override { found_ = true; }
+  void visit(Reference &ope) override {
+    for (auto arg : ope.args_) {
+      arg->accept(*this);
+    }
+  }
+
+  static bool check(Ope &ope) {
+    HasCapture vis;
+    ope.accept(vis);
+    return vis.found_;
+  }
+};
+
 struct TraceOpeName : public Ope::Visitor {
   void visit(Sequence &) override { name_ = "Sequence"; }
   void visit(PrioritizedChoice &) override { name_ = "PrioritizedChoice"; }
@@ -1761,6 +2829,7 @@ struct TraceOpeName : public Ope::Visitor {
   void visit(Dictionary &) override { name_ = "Dictionary"; }
   void visit(LiteralString &) override { name_ = "LiteralString"; }
   void visit(CharacterClass &) override { name_ = "CharacterClass"; }
+  void visit(Span &) override { name_ = "Span"; }
   void visit(Character &) override { name_ = "Character"; }
   void visit(AnyCharacter &) override { name_ = "AnyCharacter"; }
   void visit(CaptureScope &) override { name_ = "CaptureScope"; }
@@ -1768,12 +2837,14 @@ struct TraceOpeName : public Ope::Visitor {
   void visit(TokenBoundary &) override { name_ = "TokenBoundary"; }
   void visit(Ignore &) override { name_ = "Ignore"; }
   void visit(User &) override { name_ = "User"; }
+  void visit(Native &) override { name_ = "Native"; }
   void visit(WeakHolder &) override { name_ = "WeakHolder"; }
   void visit(Holder &ope) override { name_ = ope.trace_name(); }
   void visit(Reference &) override { name_ = "Reference"; }
   void visit(Whitespace &) override { name_ = "Whitespace"; }
   void visit(BackReference &) override { name_ = "BackReference"; }
   void visit(PrecedenceClimbing &) override { name_ = "PrecedenceClimbing"; }
+  void visit(Flatten &) override { name_ = "Flatten"; }
   void visit(Recovery &) override { name_ = "Recovery"; }
   void visit(Cut &) override { name_ = "Cut"; }
 
@@ -1805,11 +2876,16 @@ struct AssignIDToDefinition : public Ope::Visitor {
   void visit(Capture &ope) override { ope.ope_->accept(*this); }
   void visit(TokenBoundary &ope) override { ope.ope_->accept(*this); }
   void visit(Ignore &ope) override { ope.ope_->accept(*this); }
+  void visit(Native &ope) override;
   void visit(WeakHolder &ope) override { ope.weak_.lock()->accept(*this); }
   void visit(Holder &ope) override;
   void visit(Reference &ope) override;
   void visit(Whitespace &ope) override { ope.ope_->accept(*this); }
   void visit(PrecedenceClimbing &ope) override;
+  void visit(Flatten &ope) override {
+    ope.head_->accept(*this);
+    ope.base_->accept(*this);
+  }
   void visit(Recovery &ope) override { ope.ope_->accept(*this); }
 
   std::unordered_map<void *, size_t> ids;
@@ -1852,11 +2928,19 @@ struct TokenChecker : public Ope::Visitor {
   void visit(Capture &ope) override { ope.ope_->accept(*this); }
   void visit(TokenBoundary &) override { has_token_boundary_ = true; }
   void visit(Ignore &ope) override { ope.ope_->accept(*this); }
+  void visit(Native &ope) override {
+    if (ope.is_token_) {
+      has_token_boundary_ = true;
+    } else {
+      has_rule_ = true;
+    }
+  }
   void visit(WeakHolder &) override { has_rule_ = true; }
   void visit(Holder &ope) override { ope.ope_->accept(*this); }
   void visit(Reference &ope) override;
   void visit(Whitespace &ope) override { ope.ope_->accept(*this); }
   void visit(PrecedenceClimbing &ope) override { ope.atom_->accept(*this); }
+  void visit(Flatten &) override { has_rule_ = true; }
   void visit(Recovery &ope) override { ope.ope_->accept(*this); }
 
   static bool is_token(Ope &ope) {
@@ -1940,6 +3024,10 @@ struct DetectLeftRecursion : public Ope::Visitor {
   void visit(Whitespace &ope) override { ope.ope_->accept(*this); }
   void visit(BackReference &) override { done_ = true; }
   void visit(PrecedenceClimbing &ope) override { ope.atom_->accept(*this); }
+  void visit(Flatten &ope) override {
+    ope.head_->accept(*this);
+    if (!error_s) { ope.base_->accept(*this); }
+  }
   void visit(Recovery &ope) override { ope.ope_->accept(*this); }
   void visit(Cut &) override { done_ = true; }
 
@@ -1999,6 +3087,7 @@ struct HasEmptyElement : public Ope::Visitor {
   void visit(Reference &ope) override;
   void visit(Whitespace &ope) override { ope.ope_->accept(*this); }
   void visit(PrecedenceClimbing &ope) override { ope.atom_->accept(*this); }
+  void visit(Flatten &ope) override { ope.base_->accept(*this); }
   void visit(Recovery &ope) override { ope.ope_->accept(*this); }
 
   bool is_empty = false;
@@ -2054,6 +3143,10 @@ struct DetectInfiniteLoop : public Ope::Visitor {
   void visit(Reference &ope) override;
   void visit(Whitespace &ope) override { ope.ope_->accept(*this); }
   void visit(PrecedenceClimbing &ope) override { ope.atom_->accept(*this); }
+  void visit(Flatten &ope) override {
+    ope.head_->accept(*this);
+    if (!has_error) { ope.base_->accept(*this); }
+  }
   void visit(Recovery &ope) override { ope.ope_->accept(*this); }
 
   bool has_error = false;
@@ -2091,6 +3184,10 @@ struct ReferenceChecker : public Ope::Visitor {
   void visit(Reference &ope) override;
   void visit(Whitespace &ope) override { ope.ope_->accept(*this); }
   void visit(PrecedenceClimbing &ope) override { ope.atom_->accept(*this); }
+  void visit(Flatten &ope) override {
+    ope.head_->accept(*this);
+    ope.base_->accept(*this);
+  }
   void visit(Recovery &ope) override { ope.ope_->accept(*this); }
 
   std::unordered_map<std::string, const char *> error_s;
@@ -2128,6 +3225,10 @@ struct LinkReferences : public Ope::Visitor {
   void visit(Reference &ope) override;
   void visit(Whitespace &ope) override { ope.ope_->accept(*this); }
   void visit(PrecedenceClimbing &ope) override { ope.atom_->accept(*this); }
+  void visit(Flatten &ope) override {
+    ope.head_->accept(*this);
+    ope.base_->accept(*this);
+  }
   void visit(Recovery &ope) override { ope.ope_->accept(*this); }
 
 private:
@@ -2219,6 +3320,8 @@ private:
 
 struct IsPrioritizedChoice : public Ope::Visitor {
   void visit(PrioritizedChoice &) override { result_ = true; }
+  void visit(Native &ope) override { result_ = ope.is_choice_; }
+  void visit(Flatten &) override { result_ = true; }
 
   static bool check(Ope &ope) {
     IsPrioritizedChoice vis;
@@ -2230,79 +3333,344 @@ private:
   bool result_ = false;
 };
 
-/*
- * Keywords
- */
-static const char *WHITESPACE_DEFINITION_NAME = "%whitespace";
-static const char *WORD_DEFINITION_NAME = "%word";
-static const char *RECOVER_DEFINITION_NAME = "%recover";
+// If the next input byte is not in `bytes` and `nullable` is false, the
+// operator fails at the current position without consuming any input.
+struct FirstSet {
+  std::bitset<256> bytes;
+  bool nullable = false;
 
-/*
- * Definition
- */
-class Definition {
-public:
-  struct Result {
-    bool ret;
-    bool recovered;
-    size_t len;
-    ErrorInfo error_info;
-  };
+  static FirstSet any() {
+    FirstSet f;
+    f.bytes.set();
+    f.nullable = true;
+    return f;
+  }
+};
 
-  Definition() : holder_(std::make_shared<Holder>(this)) {}
+struct ComputeFirstSet : public Ope::Visitor {
+  using Memo = std::unordered_map<const Definition *, FirstSet>;
 
-  Definition(const Definition &rhs) : name(rhs.name), holder_(rhs.holder_) {
-    holder_->outer_ = this;
-  }
+  ComputeFirstSet(Memo &memo, std::unordered_set<const Definition *> &active)
+      : memo_(memo), active_(active) {}
 
-  Definition(const std::shared_ptr<Ope> &ope)
-      : holder_(std::make_shared<Holder>(this)) {
-    *this <= ope;
+  void visit(Sequence &ope) override {
+    FirstSet f;
+    f.nullable = true;
+    for (auto op : ope.opes_) {
+      auto f2 = get(*op);
+      f.bytes |= f2.bytes;
+      if (!f2.nullable) {
+        f.nullable = false;
+        break;
+      }
+    }
+    result_ = f;
   }
-
-  operator std::shared_ptr<Ope>() {
-    return std::make_shared<WeakHolder>(holder_);
+  void visit(PrioritizedChoice &ope) override {
+    if (ope.for_label_) { return; }
+    FirstSet f;
+    for (auto op : ope.opes_) {
+      auto f2 = get(*op);
+      f.bytes |= f2.bytes;
+      f.nullable |= f2.nullable;
+    }
+    result_ = f;
   }
-
-  Definition &operator<=(const std::shared_ptr<Ope> &ope) {
-    holder_->ope_ = ope;
-    return *this;
+  void visit(Repetition &ope) override {
+    result_ = get(*ope.ope_);
+    if (ope.min_ == 0) { result_.nullable = true; }
+  }
+  void visit(AndPredicate &ope) override { result_ = get(*ope.ope_); }
+  void visit(Dictionary &ope) override {
+    result_ = FirstSet();
+    for (const auto &item : ope.items_) {
+      if (item.empty()) { continue; }
+      auto ch = static_cast<uint8_t>(item[0]);
+      if (ope.ignore_case_) {
+        ch = static_cast<uint8_t>(std::tolower(ch));
+        for (int b = 0; b < 256; b++) {
+          if (std::tolower(b) == ch) { result_.bytes.set(b); }
+        }
+      } else {
+        result_.bytes.set(ch);
+      }
+    }
   }
-
-  Result parse(const char *s, size_t n, const char *path = nullptr,
-               Log log = nullptr) const {
-    SemanticValues vs;
-    std::any dt;
-    return parse_core(s, n, vs, dt, path, log);
+  void visit(LiteralString &ope) override {
+    result_ = FirstSet();
+    if (ope.lit_.empty()) {
+      result_.nullable = true;
+    } else if (ope.ignore_case_) {
+      auto ch = std::tolower(static_cast<uint8_t>(ope.lit_[0]));
+      for (int b = 0; b < 256; b++) {
+        if (std::tolower(b) == ch) { result_.bytes.set(b); }
+      }
+    } else {
+      result_.bytes.set(static_cast<uint8_t>(ope.lit_[0]));
+    }
   }
-
-  Result parse(const char *s, const char *path = nullptr,
-               Log log = nullptr) const {
-    auto n = strlen(s);
-    return parse(s, n, path, log);
+  void visit(CharacterClass &ope) override {
+    result_ = FirstSet();
+    for (size_t b = 0; b < 0x80; b++) {
+      result_.bytes.set(b, ope.ascii_.test(b));
+    }
+    // (multibyte or invalid; not worth decoding here.)
+    for (size_t b = 0x80; b < 256; b++) {
+      result_.bytes.set(b);
+    }
   }
-
-  Result parse(const char *s, size_t n, std::any &dt,
-               const char *path = nullptr, Log log = nullptr) const {
-    SemanticValues vs;
-    return parse_core(s, n, vs, dt, path, log);
+  void visit(Span &ope) override {
+    result_ = FirstSet();
+    for (size_t b = 0; b < 0x80; b++) {
+      result_.bytes.set(b, ope.ascii_.test(b));
+    }
+    for (size_t b = 0x80; b < 256; b++) {
+      result_.bytes.set(b);
+    }
+    // (the literal's first character starts a match unless the whole
+    // literal follows.)
+    if (!ope.lit_.empty()) { result_.bytes.set(); }
+    result_.nullable = ope.min_ == 0;
+  }
+  void visit(Character &ope) override {
+    result_ = FirstSet();
+    result_.bytes.set(static_cast<uint8_t>(ope.ch_));
+  }
+  void visit(AnyCharacter &) override {
+    result_ = FirstSet();
+    result_.bytes.set();
+  }
+  void visit(CaptureScope &ope) override { result_ = get(*ope.ope_); }
+  void visit(Capture &ope) override { result_ = get(*ope.ope_); }
+  void visit(TokenBoundary &ope) override { result_ = get(*ope.ope_); }
+  void visit(Ignore &ope) override { result_ = get(*ope.ope_); }
+  void visit(WeakHolder &ope) override { ope.weak_.lock()->accept(*this); }
+  void visit(Holder &ope) override;
+  void visit(Reference &ope) override;
+  void visit(PrecedenceClimbing &ope) override { result_ = get(*ope.atom_); }
+  void visit(Flatten &ope) override {
+    result_ = get(*ope.base_);
+    result_.bytes |= get(*ope.head_).bytes;
   }
 
-  Result parse(const char *s, std::any &dt, const char *path = nullptr,
-               Log log = nullptr) const {
-    auto n = strlen(s);
-    return parse(s, n, dt, path, log);
+  FirstSet get(Ope &ope) {
+    ComputeFirstSet vis(memo_, active_);
+    ope.accept(vis);
+    return vis.result_;
   }
 
-  template <typename T>
-  Result parse_and_get_value(const char *s, size_t n, T &val,
-                             const char *path = nullptr,
-                             Log log = nullptr) const {
-    SemanticValues vs;
-    std::any dt;
+private:
+  // Operators not handled above (predicates, cuts, back references, macro
+  // parameters...) are assumed to match anything.
+  FirstSet result_ = FirstSet::any();
+  Memo &memo_;
+  std::unordered_set<const Definition *> &active_;
+};
+
+// Replaces `*` and `+` repetitions of character classes (and of `!'lit' .`)
+// with Span operators.
+struct LowerSpans : public Ope::Visitor {
+  // The literal form is only equivalent if literals have no word check.
+  LowerSpans(bool lower_literals) : lower_literals_(lower_literals) {}
+
+  void visit(Sequence &ope) override {
+    for (auto &op : ope.opes_) {
+      lower(op);
+    }
+  }
+  void visit(PrioritizedChoice &ope) override {
+    for (auto &op : ope.opes_) {
+      lower(op);
+    }
+  }
+  void visit(Repetition &ope) override { lower(ope.ope_); }
+  void visit(AndPredicate &ope) override { lower(ope.ope_); }
+  void visit(NotPredicate &ope) override { lower(ope.ope_); }
+  void visit(CaptureScope &ope) override { lower(ope.ope_); }
+  void visit(Capture &ope) override { lower(ope.ope_); }
+  void visit(TokenBoundary &ope) override { lower(ope.ope_); }
+  void visit(Ignore &ope) override { lower(ope.ope_); }
+  void visit(Whitespace &ope) override { lower(ope.ope_); }
+  void visit(Recovery &ope) override { lower(ope.ope_); }
+
+  void lower(std::shared_ptr<Ope> &ope) {
+    if (auto span = to_span(*ope)) {
+      ope = span;
+    } else {
+      ope->accept(*this);
+    }
+  }
+
+private:
+  std::shared_ptr<Ope> to_span(Ope &ope) const {
+    auto rep = dynamic_cast<Repetition *>(&ope);
+    if (!rep || rep->min_ > 1 ||
+        rep->max_ != std::numeric_limits<size_t>::max()) {
+      return nullptr;
+    }
+
+    if (auto cls = std::dynamic_pointer_cast<CharacterClass>(rep->ope_)) {
+      return std::make_shared<Span>(cls, rep->min_);
+    }
+
+    auto seq = dynamic_cast<Sequence *>(rep->ope_.get());
+    if (!lower_literals_ || !seq || seq->opes_.size() != 2 ||
+        !dynamic_cast<AnyCharacter *>(seq->opes_[1].get())) {
+      return nullptr;
+    }
+    auto npd = dynamic_cast<NotPredicate *>(seq->opes_[0].get());
+    if (!npd) { return nullptr; }
+    auto lit = dynamic_cast<LiteralString *>(npd->ope_.get());
+    if (!lit || lit->ignore_case_ || lit->lit_.empty() ||
+        static_cast<uint8_t>(lit->lit_[0]) >= 0x80) {
+      return nullptr;
+    }
+    return std::make_shared<Span>(lit->lit_, rep->min_);
+  }
+
+  bool lower_literals_;
+};
+
+// The class a %word rule starts with, when everything after it can match
+// the empty string (as in `[a-z]+` or `[a-z_] [a-z0-9_]*`.) Whether such a
+// rule matches at some position only depends on that first character.
+inline std::shared_ptr<CharacterClass>
+word_start_class(const std::shared_ptr<Ope> &ope) {
+  if (auto cls = std::dynamic_pointer_cast<CharacterClass>(ope)) { return cls; }
+  if (auto tok = dynamic_cast<TokenBoundary *>(ope.get())) {
+    return word_start_class(tok->ope_);
+  }
+  if (auto span = dynamic_cast<Span *>(ope.get())) {
+    return span->min_ == 1 ? span->cls_ : nullptr;
+  }
+  if (auto rep = dynamic_cast<Repetition *>(ope.get())) {
+    if (rep->min_ != 1 || rep->max_ != std::numeric_limits<size_t>::max()) {
+      return nullptr;
+    }
+    return std::dynamic_pointer_cast<CharacterClass>(rep->ope_);
+  }
+  if (auto seq = dynamic_cast<Sequence *>(ope.get())) {
+    if (seq->opes_.empty()) { return nullptr; }
+    auto cls = std::dynamic_pointer_cast<CharacterClass>(seq->opes_[0]);
+    for (size_t i = 1; cls && i < seq->opes_.size(); i++) {
+      const auto &op = seq->opes_[i];
+      auto span = dynamic_cast<Span *>(op.get());
+      auto rep = dynamic_cast<Repetition *>(op.get());
+      if (!(span && span->min_ == 0) && !(rep && rep->min_ == 0)) {
+        return nullptr;
+      }
+    }
+    return cls;
+  }
+  return nullptr;
+}
+
+// Builds the dispatch tables of every PrioritizedChoice in a rule.
+struct SetupChoiceDispatch : public Ope::Visitor {
+  SetupChoiceDispatch(ComputeFirstSet &first_set) : first_set_(first_set) {}
+
+  void visit(Sequence &ope) override {
+    for (auto op : ope.opes_) {
+      op->accept(*this);
+    }
+  }
+  void visit(PrioritizedChoice &ope) override;
+  void visit(Repetition &ope) override { ope.ope_->accept(*this); }
+  void visit(AndPredicate &ope) override { ope.ope_->accept(*this); }
+  void visit(NotPredicate &ope) override { ope.ope_->accept(*this); }
+  void visit(CaptureScope &ope) override { ope.ope_->accept(*this); }
+  void visit(Capture &ope) override { ope.ope_->accept(*this); }
+  void visit(TokenBoundary &ope) override { ope.ope_->accept(*this); }
+  void visit(Ignore &ope) override { ope.ope_->accept(*this); }
+  void visit(Holder &ope) override { ope.ope_->accept(*this); }
+  void visit(Whitespace &ope) override { ope.ope_->accept(*this); }
+  void visit(PrecedenceClimbing &ope) override {
+    ope.atom_->accept(*this);
+    ope.binop_->accept(*this);
+  }
+  void visit(Flatten &ope) override {
+    ope.head_->accept(*this);
+    ope.base_->accept(*this);
+  }
+  void visit(Recovery &ope) override { ope.ope_->accept(*this); }
+
+private:
+  ComputeFirstSet &first_set_;
+};
+
+/*
+ * Keywords
+ */
+static const char *WHITESPACE_DEFINITION_NAME = "%whitespace";
+static const char *WORD_DEFINITION_NAME = "%word";
+static const char *RECOVER_DEFINITION_NAME = "%recover";
+
+/*
+ * Definition
+ */
+class Definition {
+public:
+  struct Result {
+    bool ret;
+    bool recovered;
+    size_t len;
+    ErrorInfo error_info;
+  };
+
+  Definition() : holder_(std::make_shared<Holder>(this)) {}
+
+  Definition(const Definition &rhs) : name(rhs.name), holder_(rhs.holder_) {
+    holder_->outer_ = this;
+  }
+
+  Definition(const std::shared_ptr<Ope> &ope)
+      : holder_(std::make_shared<Holder>(this)) {
+    *this <= ope;
+  }
+
+  operator std::shared_ptr<Ope>() {
+    return std::make_shared<WeakHolder>(holder_);
+  }
+
+  Definition &operator<=(const std::shared_ptr<Ope> &ope) {
+    holder_->ope_ = ope;
+    return *this;
+  }
+
+  Result parse(const char *s, size_t n, const char *path = nullptr,
+               Log log = nullptr) const {
+    SemanticValues vs;
+    std::any dt;
+    return parse_core(s, n, vs, dt, path, log);
+  }
+
+  Result parse(const char *s, const char *path = nullptr,
+               Log log = nullptr) const {
+    auto n = strlen(s);
+    return parse(s, n, path, log);
+  }
+
+  Result parse(const char *s, size_t n, std::any &dt,
+               const char *path = nullptr, Log log = nullptr) const {
+    SemanticValues vs;
+    return parse_core(s, n, vs, dt, path, log);
+  }
+
+  Result parse(const char *s, std::any &dt, const char *path = nullptr,
+               Log log = nullptr) const {
+    auto n = strlen(s);
+    return parse(s, n, dt, path, log);
+  }
+
+  template <typename T>
+  Result parse_and_get_value(const char *s, size_t n, T &val,
+                             const char *path = nullptr,
+                             Log log = nullptr) const {
+    SemanticValues vs;
+    std::any dt;
     auto r = parse_core(s, n, vs, dt, path, log);
     if (r.ret && !vs.empty() && vs.front().has_value()) {
-      val = std::any_cast<T>(vs[0]);
+      val = vs.get<T>(0);
     }
     return r;
   }
@@ -2321,7 +3689,7 @@ public:
     SemanticValues vs;
     auto r = parse_core(s, n, vs, dt, path, log);
     if (r.ret && !vs.empty() && vs.front().has_value()) {
-      val = std::any_cast<T>(vs[0]);
+      val = vs.get<T>(0);
     }
     return r;
   }
@@ -2334,6 +3702,23 @@ public:
     return parse_and_get_value(s, n, dt, val, path, log);
   }
 
+  // Parses with the rules' flat_ast_action in place of their actions.
+  template <typename T>
+  Result parse_flat_ast(const char *s, size_t n, std::any &dt, T &val,
+                        const char *path = nullptr, Log log = nullptr) const {
+    SemanticValues vs;
+    auto r = parse_core(s, n, vs, dt, path, log, true);
+    if (r.ret && !vs.empty() && vs.front().has_value()) {
+      val = vs.get<T>(0);
+    }
+    return r;
+  }
+
+  // The action a match of the rule calls in a parse.
+  const Action &action_in(const Context &c) const {
+    return c.flat_ast ? flat_ast_action : action;
+  }
+
   void operator=(Action a) { action = a; }
 
   template <typename T> Definition &operator,(T fn) {
@@ -2362,8 +3747,9 @@ public:
 
   size_t id = 0;
   Action action;
+  Action flat_ast_action; // (see parser::enable_flat_ast)
   std::function<void(const char *s, size_t n, std::any &dt)> enter;
-  std::function<void(const char *s, size_t n, size_t matchlen, std::any &value,
+  std::function<void(const char *s, size_t n, size_t matchlen, Value &value,
                      std::any &dt)>
       leave;
   bool ignoreSemanticValue = false;
@@ -2371,9 +3757,17 @@ public:
   std::shared_ptr<Ope> wordOpe;
   bool enablePackratParsing = false;
   bool is_macro = false;
+  bool is_left_recursive = false;
   std::vector<std::string> params;
   TracerEnter tracer_enter;
   TracerLeave tracer_leave;
+  size_t max_depth = 0;
+  StackGuard stack_guard;
+  Memo *memo = nullptr;
+  Instrumentation instrumentation = Instrumentation::off;
+  Profile *profile = nullptr;
+  Trace *trace = nullptr;
+  ParseMemory *memory = nullptr;
   bool disable_action = false;
 
   std::string error_message;
@@ -2382,6 +3776,13 @@ public:
 private:
   friend class Reference;
   friend class ParserGenerator;
+  friend class Flatten;
+  friend class Stream;
+  friend class ParallelParser;
+  friend class ParseCache;
+  friend class parser;
+  friend struct NativeOps;
+  friend struct MeasureOpe;
 
   Definition &operator=(const Definition &rhs);
   Definition &operator=(Definition &&rhs);
@@ -2393,11 +3794,19 @@ private:
       if (whitespaceOpe) { whitespaceOpe->accept(vis); }
       if (wordOpe) { wordOpe->accept(vis); }
       definition_ids_.swap(vis.ids);
+
+      // (the rules reached are the keys of the ids.)
+      uses_captures_ = (whitespaceOpe && HasCapture::check(*whitespaceOpe)) ||
+                       (wordOpe && HasCapture::check(*wordOpe));
+      for (const auto &[rule, id] : definition_ids_) {
+        auto &def = *static_cast<Definition *>(rule);
+        uses_captures_ = uses_captures_ || HasCapture::check(*def.holder_);
+      }
     });
   }
 
   Result parse_core(const char *s, size_t n, SemanticValues &vs, std::any &dt,
-                    const char *path, Log log) const {
+                    const char *path, Log log, bool flat_ast = false) const {
     initialize_definition_ids();
 
     std::shared_ptr<Ope> ope = holder_;
@@ -2405,8 +3814,15 @@ private:
 
     Context cxt(path, s, n, definition_ids_.size(), whitespaceOpe, wordOpe,
                 enablePackratParsing, tracer_enter, tracer_leave, log);
+    cxt.max_depth = max_depth;
+    cxt.stack_guard = stack_guard;
+    cxt.memo = memo;
+    cxt.instrument(instrumentation, profile, trace);
+    cxt.uses_captures = uses_captures_;
+    cxt.flat_ast = flat_ast;
 
     auto len = ope->parse(s, n, vs, cxt, dt);
+    if (memory) { cxt.measure(*memory); }
     return Result{success(len), cxt.recovered, len, cxt.error_info};
   }
 
@@ -2416,48 +3832,48 @@ private:
   mutable std::once_flag assign_id_to_definition_init_;
   mutable std::once_flag definition_ids_init_;
   mutable std::unordered_map<void *, size_t> definition_ids_;
+  // Whether the rules reached have captures or back references: if not, the
+  // parse keeps no capture scopes.
+  mutable bool uses_captures_ = true;
 };
 
 /*
  * Implementations
  */
 
-inline size_t parse_literal(const char *s, size_t n, SemanticValues &vs,
-                            Context &c, std::any &dt, const std::string &lit,
-                            std::once_flag &init_is_word, bool &is_word,
-                            bool ignore_case) {
-  size_t i = 0;
-  for (; i < lit.size(); i++) {
-    if (i >= n || (ignore_case ? (std::tolower(s[i]) != std::tolower(lit[i]))
-                               : (s[i] != lit[i]))) {
-      c.set_error_pos(s, lit.c_str());
-      return static_cast<size_t>(-1);
+inline const std::vector<size_t> &SemanticValues::source_line_index() const {
+  auto &idx = context_->source_line_index;
+  if (idx.empty()) {
+    const auto s = context_->s;
+    const auto l = context_->l;
+    idx.reserve(static_cast<size_t>(std::count(s, s + l, '\n')) + 1);
+    for (size_t pos = 0; pos < l; pos++) {
+      if (s[pos] == '\n') { idx.push_back(pos); }
     }
+    idx.push_back(l);
   }
+  return idx;
+}
+
+inline const std::string &SemanticValues::name() const {
+  static const std::string empty;
+  return rule_ ? rule_->name : empty;
+}
 
+// Word check and whitespace skipping after a literal of length `i` matched.
+inline size_t parse_literal_suffix(const char *s, size_t i, size_t n,
+                                   SemanticValues &vs, Context &c,
+                                   std::any &dt, std::string_view lit,
+                                   std::once_flag &init_is_word,
+                                   bool &is_word) {
   // Word check
   if (c.wordOpe) {
     std::call_once(init_is_word, [&]() {
-      SemanticValues dummy_vs;
-      Context dummy_c(nullptr, c.s, c.l, 0, nullptr, nullptr, false, nullptr,
-                      nullptr, nullptr);
-      std::any dummy_dt;
-
-      auto len =
-          c.wordOpe->parse(lit.data(), lit.size(), dummy_vs, dummy_c, dummy_dt);
-      is_word = success(len);
+      is_word = c.match_word(lit.data(), lit.size());
     });
 
-    if (is_word) {
-      SemanticValues dummy_vs;
-      Context dummy_c(nullptr, c.s, c.l, 0, nullptr, nullptr, false, nullptr,
-                      nullptr, nullptr);
-      std::any dummy_dt;
-
-      NotPredicate ope(c.wordOpe);
-      auto len = ope.parse(s + i, n - i, dummy_vs, dummy_c, dummy_dt);
-      if (fail(len)) { return len; }
-      i += len;
+    if (is_word && c.match_word(s + i, n - i)) {
+      return static_cast<size_t>(-1);
     }
   }
 
@@ -2473,6 +3889,47 @@ inline size_t parse_literal(const char *s, size_t n, SemanticValues &vs,
   return i;
 }
 
+inline size_t parse_literal(const char *s, size_t n, SemanticValues &vs,
+                            Context &c, std::any &dt, const std::string &lit,
+                            std::once_flag &init_is_word, bool &is_word,
+                            bool ignore_case) {
+  c.examine(s + std::min(n + 1, lit.size()));
+  size_t i = 0;
+  for (; i < lit.size(); i++) {
+    if (i >= n || (ignore_case ? (std::tolower(s[i]) != std::tolower(lit[i]))
+                               : (s[i] != lit[i]))) {
+      c.set_error_pos(s, lit.c_str());
+      return static_cast<size_t>(-1);
+    }
+  }
+
+  return parse_literal_suffix(s, i, n, vs, c, dt, lit, init_is_word, is_word);
+}
+
+inline bool Context::match_word(const char *a_s, size_t n) {
+  if (!word_start_init) {
+    word_start = word_start_class(wordOpe);
+    word_start_init = true;
+  }
+  if (word_start) {
+    auto len = word_start->match(a_s, n);
+    examine_codepoint(a_s, n, success(len) ? len : 0);
+    return success(len);
+  }
+
+  // Otherwise, run the rule in a scratch context (reused across calls.)
+  if (!word_context) {
+    word_context = std::make_unique<Context>(nullptr, s, l, 0, nullptr, nullptr,
+                                             false, nullptr, nullptr, nullptr);
+  }
+  SemanticValues dummy_vs;
+  std::any dummy_dt;
+  word_context->examined = a_s;
+  auto len = wordOpe->parse(a_s, n, dummy_vs, *word_context, dummy_dt);
+  examine(word_context->examined);
+  return success(len);
+}
+
 inline void Context::set_error_pos(const char *a_s, const char *literal) {
   if (log) {
     if (error_info.error_pos <= a_s) {
@@ -2510,10 +3967,8 @@ inline void Context::trace_leave(const Ope &ope, const char *a_s, size_t n,
 }
 
 inline bool Context::is_traceable(const Ope &ope) const {
-  if (tracer_enter && tracer_leave) {
-    return !IsReference::check(const_cast<Ope &>(ope));
-  }
-  return false;
+  if (instrumentation == Instrumentation::off) { return false; }
+  return tracing() && !IsReference::check(const_cast<Ope &>(ope));
 }
 
 inline size_t Ope::parse(const char *s, size_t n, SemanticValues &vs,
@@ -2527,9 +3982,66 @@ inline size_t Ope::parse(const char *s, size_t n, SemanticValues &vs,
   return parse_core(s, n, vs, c, dt);
 }
 
+inline size_t Span::parse_core(const char *s, size_t n, SemanticValues & /*vs*/,
+                               Context &c, std::any & /*dt*/) const {
+  size_t i = 0;
+  size_t last = 0; // start of the last character matched
+  while (true) {
+    auto len = scan_ascii(s + i, n - i);
+    if (len > 0) {
+      i += len;
+      last = i - 1;
+    }
+    if (i >= n) { break; }
+
+    auto b = static_cast<uint8_t>(s[i]);
+    if (cls_) {
+      if (b < 0x80) { break; }
+      char32_t cp = 0;
+      len = decode_codepoint(s + i, n - i, cp);
+      if (cls_->contains(cp) == negated_ || len == 0) { break; }
+    } else if (b < 0x80) {
+      // b is the first character of the literal.
+      if (n - i >= lit_.size() &&
+          !memcmp(s + i, lit_.data(), lit_.size())) {
+        break;
+      }
+      len = 1;
+    } else {
+      len = codepoint_length(s + i, n - i);
+      if (len < 1) {
+        c.set_error_pos(s + i, lit_.c_str());
+        break;
+      }
+    }
+    last = i;
+    i += len;
+  }
+
+  // The run's end was looked at, and whatever was read from there.
+  auto stop = !lit_.empty() ? std::max<size_t>(lit_.size(), 4)
+              : (i < n && static_cast<uint8_t>(s[i]) < 0x80) ? 1
+                                                             : 4;
+  c.examine(s + std::min(n + 1, i + stop));
+
+  // Report the same error position as the unoptimized repetition.
+  if (i < n) {
+    c.set_error_pos(s + i);
+  } else if (i > 0 && !lit_.empty()) {
+    c.set_error_pos(s + last, lit_.c_str());
+  } else if (n == 0 && min_ > 0) {
+    if (!lit_.empty()) { c.set_error_pos(s, lit_.c_str()); }
+    c.set_error_pos(s);
+  }
+
+  if (i == 0 && min_ > 0) { return static_cast<size_t>(-1); }
+  return i;
+}
+
 inline size_t Dictionary::parse_core(const char *s, size_t n,
                                      SemanticValues & /*vs*/, Context &c,
                                      std::any & /*dt*/) const {
+  c.examine(s + std::min(n + 1, trie_.max_length()));
   auto len = trie_.match(s, n);
   if (len > 0) { return len; }
   c.set_error_pos(s);
@@ -2573,80 +4085,201 @@ inline size_t Holder::parse_core(const char *s, size_t n, SemanticValues &vs,
     throw std::logic_error("Uninitialized definition ope was used...");
   }
 
+  if (!c.profile && !c.trace) { return parse_definition(s, n, vs, c, dt); }
+
+  auto timed = has(c.instrumentation, Instrumentation::profile);
+  size_t i = 0;
+  std::chrono::steady_clock::time_point start;
+  if (c.profile) {
+    i = c.profile->index(outer_->id, outer_);
+    if (timed) { start = c.profile->enter(); }
+  }
+  int64_t traced = c.trace ? c.trace->enter(outer_->id, outer_) : 0;
+
+  auto len = static_cast<size_t>(-1);
+  auto se = scope_exit([&]() {
+    if (c.trace) {
+      c.trace->leave(outer_->id, static_cast<size_t>(s - c.s), traced, len);
+    }
+    if (c.profile) {
+      if (timed) { c.profile->leave(i, start); }
+      c.profile->count(i, len);
+    }
+  });
+  len = parse_definition(s, n, vs, c, dt);
+  return len;
+}
+
+inline size_t Holder::parse_definition(const char *s, size_t n,
+                                       SemanticValues &vs, Context &c,
+                                       std::any &dt) const {
   // Macro reference
   if (outer_->is_macro) {
     c.rule_stack.push_back(outer_);
-    auto len = ope_->parse(s, n, vs, c, dt);
+    auto len = parse_nested(s, n, vs, c, dt);
     c.rule_stack.pop_back();
     return len;
   }
 
   size_t len;
-  std::any val;
+  Value val;
 
-  c.packrat(s, outer_->id, len, val, [&](std::any &a_val) {
-    if (outer_->enter) { outer_->enter(s, n, dt); }
-
-    auto se2 = scope_exit([&]() {
-      c.pop();
-      if (outer_->leave) { outer_->leave(s, n, len, a_val, dt); }
+  if (!outer_->is_left_recursive) {
+    c.packrat(s, outer_->id, len, val, [&](Value &a_val) {
+      len = parse_rule(s, n, a_val, c, dt);
     });
+  } else if (auto seed = c.find_seed(s, outer_)) {
+    // A left-recursive call while the match at `s` is being grown.
+    len = seed->len;
+    val = seed->val;
+  } else {
+    c.packrat(s, outer_->id, len, val, [&](Value &a_val) {
+      len = grow_seed(s, n, a_val, c, dt);
+    });
+  }
 
-    auto &chldsv = c.push();
+  if (success(len)) {
+    if (!outer_->ignoreSemanticValue) {
+      vs.emplace_back(std::move(val));
+      vs.tags.emplace_back(str2tag(outer_->name));
+    }
+  }
 
-    c.rule_stack.push_back(outer_);
-    len = ope_->parse(s, n, chldsv, c, dt);
-    c.rule_stack.pop_back();
+  return len;
+}
 
-    // Invoke action
-    if (success(len)) {
-      chldsv.sv_ = std::string_view(s, len);
-      chldsv.name_ = outer_->name;
+inline size_t Holder::parse_rule(const char *s, size_t n, Value &val,
+                                 Context &c, std::any &dt) const {
+  if (outer_->enter) { outer_->enter(s, n, dt); }
 
-      if (!IsPrioritizedChoice::check(*ope_)) {
-        chldsv.choice_count_ = 0;
-        chldsv.choice_ = 0;
-      }
+  auto len = static_cast<size_t>(-1);
+  auto se = scope_exit([&]() {
+    c.pop();
+    if (outer_->leave) { outer_->leave(s, n, len, val, dt); }
+  });
 
-      try {
-        a_val = reduce(chldsv, dt);
-      } catch (const parse_error &e) {
-        if (c.log) {
-          if (e.what()) {
-            if (c.error_info.message_pos < s) {
-              c.error_info.message_pos = s;
-              c.error_info.message = e.what();
-            }
+  auto &chldsv = c.push();
+
+  c.rule_stack.push_back(outer_);
+  len = parse_nested(s, n, chldsv, c, dt);
+  c.rule_stack.pop_back();
+
+  // Invoke action
+  if (success(len)) {
+    chldsv.sv_ = std::string_view(s, len);
+    chldsv.rule_ = outer_;
+    if (outer_ == c.binop_rule) { c.binop_token = chldsv.token(); }
+
+    if (!IsPrioritizedChoice::check(*ope_)) {
+      chldsv.choice_count_ = 0;
+      chldsv.choice_ = 0;
+    }
+
+    try {
+      val = reduce(chldsv, dt);
+    } catch (const parse_error &e) {
+      if (c.log) {
+        if (e.what()) {
+          if (c.error_info.message_pos < s) {
+            c.error_info.message_pos = s;
+            c.error_info.message = e.what();
           }
         }
-        len = static_cast<size_t>(-1);
       }
-    }
-  });
-
-  if (success(len)) {
-    if (!outer_->ignoreSemanticValue) {
-      vs.emplace_back(std::move(val));
-      vs.tags.emplace_back(str2tag(outer_->name));
+      len = static_cast<size_t>(-1);
     }
   }
 
   return len;
 }
 
-inline std::any Holder::reduce(SemanticValues &vs, std::any &dt) const {
-  if (outer_->action && !outer_->disable_action) {
-    return outer_->action(vs, dt);
-  } else if (vs.empty()) {
-    return std::any();
-  } else {
-    return std::move(vs.front());
-  }
+// Seed growing (Warth et al.): the rule is matched over and over, its
+// left-recursive calls at `s` returning the previous match, for as long as
+// the match keeps getting longer.
+inline size_t Holder::grow_seed(const char *s, size_t n, Value &val,
+                                Context &c, std::any &dt) const {
+  const auto i = c.seeds.size();
+  c.seeds.push_back(Context::Seed{s, outer_, static_cast<size_t>(-1), Value()});
+  auto se = scope_exit([&]() { c.seeds.pop_back(); });
+
+  while (true) {
+    Value a_val;
+    auto len = parse_rule(s, n, a_val, c, dt);
+    auto &seed = c.seeds[i];
+    if (fail(len) || (success(seed.len) && len <= seed.len)) { break; }
+    seed.len = len;
+    seed.val = std::move(a_val);
+  }
+
+  val = std::move(c.seeds[i].val);
+  return c.seeds[i].len;
 }
 
-inline const char *Holder::trace_name() const {
-  if (trace_name_.empty()) { trace_name_ = "[" + outer_->name + "]"; }
-  return trace_name_.data();
+inline size_t Holder::parse_nested(const char *s, size_t n,
+                                   SemanticValues &vs, Context &c,
+                                   std::any &dt) const {
+  if (c.max_depth && c.depth >= c.max_depth) {
+    if (c.log && c.error_info.message_pos < s) {
+      c.error_info.message_pos = s;
+      c.error_info.message = "nesting depth limit exceeded";
+    }
+    return static_cast<size_t>(-1);
+  }
+
+  c.depth++;
+  auto se = scope_exit([&]() { c.depth--; });
+
+  if (c.stack_guard && c.depth % Context::stack_guard_interval == 0) {
+    size_t len;
+    auto fn = [&]() { len = ope_->parse(s, n, vs, c, dt); };
+    c.stack_guard(std::ref(fn));
+    return len;
+  }
+  return ope_->parse(s, n, vs, c, dt);
+}
+
+inline Value Holder::reduce(SemanticValues &vs, std::any &dt) const {
+  const auto &action =
+      vs.context_ ? outer_->action_in(*vs.context_) : outer_->action;
+  if (action && !outer_->disable_action) {
+    if (vs.context_ && vs.context_->reductions) {
+      return vs.context_->defer_action(*outer_, vs);
+    }
+    return action(vs, dt);
+  } else if (vs.empty()) {
+    return Value();
+  } else {
+    return std::move(vs.front());
+  }
+}
+
+inline const char *Holder::trace_name() const {
+  if (trace_name_.empty()) { trace_name_ = "[" + outer_->name + "]"; }
+  return trace_name_.data();
+}
+
+inline void Trace::write_chrome_json(std::ostream &os) const {
+  // (microseconds, to the nanosecond.)
+  auto us = [&](int64_t ns) {
+    auto frac = std::to_string(1000 + ns % 1000);
+    os << ns / 1000 << '.' << frac.substr(1);
+  };
+
+  os << "{\"traceEvents\":[";
+  for (size_t i = 0; i < size(); i++) {
+    const auto &e = (*this)[i];
+    auto matched = e.len != static_cast<size_t>(-1);
+    os << (i ? ",\n" : "\n") << "{\"name\":\"" << rules_[e.rule]->name
+       << "\",\"cat\":\"" << (matched ? "match" : "fail")
+       << "\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":";
+    us(e.start);
+    os << ",\"dur\":";
+    us(e.duration);
+    os << ",\"args\":{\"pos\":" << e.pos;
+    if (matched) { os << ",\"len\":" << e.len; }
+    os << "}}";
+  }
+  os << "\n],\"displayTimeUnit\":\"ns\"}\n";
 }
 
 inline size_t Reference::parse_core(const char *s, size_t n, SemanticValues &vs,
@@ -2670,7 +4303,7 @@ inline size_t Reference::parse_core(const char *s, size_t n, SemanticValues &vs,
       return ope->parse(s, n, vs, c, dt);
     } else {
       // Definition
-      c.push_args(std::vector<std::shared_ptr<Ope>>());
+      c.push_args(c.no_args);
       auto se = scope_exit([&]() { c.pop_args(); });
       auto ope = get_core_operator();
       return ope->parse(s, n, vs, c, dt);
@@ -2689,21 +4322,18 @@ inline std::shared_ptr<Ope> Reference::get_core_operator() const {
 inline size_t BackReference::parse_core(const char *s, size_t n,
                                         SemanticValues &vs, Context &c,
                                         std::any &dt) const {
-  auto size = static_cast<int>(c.capture_scope_stack_size);
-  for (auto i = size - 1; i >= 0; i--) {
-    auto index = static_cast<size_t>(i);
-    const auto &cs = c.capture_scope_stack[index];
-    if (cs.find(name_) != cs.end()) {
-      const auto &lit = cs.at(name_);
-      std::once_flag init_is_word;
-      auto is_word = false;
-      return parse_literal(s, n, vs, c, dt, lit, init_is_word, is_word, false);
-    }
-  }
-  throw std::runtime_error("Invalid back reference...");
+  auto value = c.find_capture(name_);
+  if (!value) { throw std::runtime_error("Invalid back reference..."); }
+  auto it = c.capture_literals.find(*value);
+  if (it == c.capture_literals.end()) {
+    it = c.capture_literals.emplace(*value).first;
+  }
+  std::once_flag init_is_word;
+  auto is_word = false;
+  return parse_literal(s, n, vs, c, dt, *it, init_is_word, is_word, false);
 }
 
-inline Definition &
+inline const Definition &
 PrecedenceClimbing::get_reference_for_binop(Context &c) const {
   if (rule_.is_macro) {
     // Reference parameter in macro
@@ -2723,31 +4353,34 @@ inline size_t PrecedenceClimbing::parse_expression(const char *s, size_t n,
   auto len = atom_->parse(s, n, vs, c, dt);
   if (fail(len)) { return len; }
 
-  std::string tok;
-  auto &rule = get_reference_for_binop(c);
-  auto action = std::move(rule.action);
-
-  rule.action = [&](SemanticValues &vs2, std::any &dt2) {
-    tok = vs2.token();
-    if (action) {
-      return action(vs2, dt2);
-    } else if (!vs2.empty()) {
-      return vs2[0];
-    }
-    return std::any();
-  };
-  auto action_se = scope_exit([&]() { rule.action = std::move(action); });
+  const auto &rule = get_reference_for_binop(c);
 
   auto i = len;
   while (i < n) {
-    std::vector<std::any> save_values(vs.begin(), vs.end());
-    auto save_tokens = vs.tokens;
+    // Rollback marks, in case the right-hand side fails
+    auto save_values_size = vs.size();
+    auto save_tokens_size = vs.tokens.size();
+
+    // Operator (Holder records its token as it reduces)
+    Value op_val;
+    std::string_view tok;
+    size_t chl;
+    {
+      auto &chv = c.push();
+      auto save_binop_rule = c.binop_rule;
+      c.binop_rule = &rule;
+      c.binop_token = std::string_view();
+      auto se = scope_exit([&]() {
+        c.binop_rule = save_binop_rule;
+        c.pop();
+      });
 
-    auto chv = c.push();
-    auto chl = binop_->parse(s + i, n - i, chv, c, dt);
-    c.pop();
+      chl = binop_->parse(s + i, n - i, chv, c, dt);
+      if (fail(chl)) { break; }
 
-    if (fail(chl)) { break; }
+      tok = c.binop_token.data() ? c.binop_token : find_binop(s + i, chl);
+      if (!chv.empty()) { op_val = std::move(chv[0]); }
+    }
 
     auto it = info_.find(tok);
     if (it == info_.end()) { break; }
@@ -2757,32 +4390,39 @@ inline size_t PrecedenceClimbing::parse_expression(const char *s, size_t n,
 
     if (level < min_prec) { break; }
 
-    vs.emplace_back(std::move(chv[0]));
+    vs.emplace_back(std::move(op_val));
     i += chl;
 
     auto next_min_prec = level;
     if (assoc == 'L') { next_min_prec = level + 1; }
 
-    chv = c.push();
-    chl = parse_expression(s + i, n - i, chv, c, dt, next_min_prec);
-    c.pop();
+    // Right-hand side
+    Value rhs_val;
+    {
+      auto &chv = c.push();
+      auto se = scope_exit([&]() { c.pop(); });
+
+      chl = parse_expression(s + i, n - i, chv, c, dt, next_min_prec);
+      if (success(chl) && !chv.empty()) { rhs_val = std::move(chv[0]); }
+    }
 
     if (fail(chl)) {
-      vs.assign(save_values.begin(), save_values.end());
-      vs.tokens = save_tokens;
+      vs.erase(vs.begin() + static_cast<std::ptrdiff_t>(save_values_size),
+               vs.end());
+      vs.tokens.resize(save_tokens_size);
       i = chl;
       break;
     }
 
-    vs.emplace_back(std::move(chv[0]));
+    vs.emplace_back(std::move(rhs_val));
     i += chl;
 
-    std::any val;
-    if (rule_.action) {
+    Value val;
+    if (const auto &action = rule_.action_in(c)) {
       vs.sv_ = std::string_view(s, i);
-      val = rule_.action(vs, dt);
+      val = c.reductions ? c.defer_action(rule_, vs) : action(vs, dt);
     } else if (!vs.empty()) {
-      val = vs[0];
+      val = std::move(vs[0]);
     }
     vs.clear();
     vs.emplace_back(std::move(val));
@@ -2791,6 +4431,160 @@ inline size_t PrecedenceClimbing::parse_expression(const char *s, size_t n,
   return i;
 }
 
+// The longest operator in info_ that the operator match starts with. Used
+// when the operator rule's result came from the packrat cache, so its
+// token was not recorded.
+inline std::string_view PrecedenceClimbing::find_binop(const char *s,
+                                                       size_t n) const {
+  std::string_view tok;
+  for (const auto &[key, info] : info_) {
+    if (key.size() > tok.size() && key.size() <= n &&
+        std::string_view(s, key.size()) == key) {
+      tok = key;
+    }
+  }
+  return tok;
+}
+
+// Each level of the recursion gets a value frame and capture scope on the
+// context's stacks rather than a native call. P is matched for as many
+// levels as it goes, Q is tried from the innermost level outwards (as the
+// recursive rule backtracks), and the levels are then reduced innermost
+// first. Rule enter/leave hooks and the tracer only see the outermost level.
+inline size_t Flatten::parse_core(const char *s, size_t n, SemanticValues &vs,
+                                  Context &c, std::any &dt) const {
+  const auto first = c.value_stack_size;
+  auto frame = [&](size_t level) -> SemanticValues & {
+    return *c.value_stack[first + level];
+  };
+  auto push_frame = [&]() -> SemanticValues & {
+    auto &sv = c.push();
+    c.push_capture_scope();
+    return sv;
+  };
+  auto pop_frame = [&]() {
+    c.pop();
+    c.pop_capture_scope();
+  };
+  auto se = scope_exit([&]() {
+    while (c.value_stack_size > first) {
+      pop_frame();
+    }
+  });
+  const auto tag = str2tag(rule_.name);
+
+  // A level's frame spans its P match, and its choice_ records whether P
+  // passed a cut (which keeps Q from being tried at that level.)
+  size_t levels = 0;
+  const char *p = s;
+  auto decided = false;
+  while (true) {
+    auto &sv = push_frame();
+    c.cut_stack.push_back(false);
+    auto len = head_->parse(p, n - static_cast<size_t>(p - s), sv, c, dt);
+    auto cut = c.cut_stack.back();
+    c.cut_stack.pop_back();
+    if (fail(len)) {
+      pop_frame();
+      decided = cut;
+      break;
+    }
+    sv.sv_ = std::string_view(p, len);
+    sv.choice_ = cut;
+    p += len;
+    levels++;
+  }
+
+  auto level = levels;
+  while (true) {
+    if (!decided) {
+      auto &sv = push_frame();
+      c.cut_stack.push_back(false);
+      auto len = base_->parse(p, n - static_cast<size_t>(p - s), sv, c, dt);
+      c.cut_stack.pop_back();
+
+      if (success(len)) {
+        sv.sv_ = std::string_view(p, len);
+        sv.choice_ = 1;
+        const auto end = p + len;
+
+        Value val;
+        auto i = level;
+        for (; i > 0; i--) {
+          auto &lv = frame(i);
+          if (i < level) {
+            if (!rule_.ignoreSemanticValue) {
+              lv.emplace_back(std::move(val));
+              lv.tags.emplace_back(tag);
+            }
+            lv.choice_ = 0;
+          }
+          lv.sv_ = std::string_view(lv.sv_.data(),
+                                    static_cast<size_t>(end - lv.sv_.data()));
+          lv.choice_count_ = 2;
+          lv.rule_ = &rule_;
+          if (!reduce(lv, val, c, dt)) { break; }
+          c.shift_capture_values();
+          pop_frame();
+        }
+
+        if (i == 0) {
+          auto &lv = frame(0);
+          if (level > 0) {
+            if (!rule_.ignoreSemanticValue) {
+              lv.emplace_back(std::move(val));
+              lv.tags.emplace_back(tag);
+            }
+            lv.choice_ = 0;
+          }
+          for (size_t j = 0; j < lv.size(); j++) {
+            vs.emplace_back(std::move(lv[j]));
+          }
+          for (size_t j = 0; j < lv.tags.size(); j++) {
+            vs.tags.emplace_back(lv.tags[j]);
+          }
+          for (size_t j = 0; j < lv.tokens.size(); j++) {
+            vs.tokens.emplace_back(lv.tokens[j]);
+          }
+          vs.choice_count_ = 2;
+          vs.choice_ = lv.choice_;
+          c.shift_capture_values();
+          pop_frame();
+          return static_cast<size_t>(end - s);
+        }
+
+        // The action rejected level i, so the level above falls back to Q.
+        level = i;
+      }
+      pop_frame();
+    }
+
+    if (level == 0) { return static_cast<size_t>(-1); }
+    level--;
+    decided = frame(level).choice_ != 0;
+    p = frame(level).sv_.data();
+    pop_frame();
+  }
+}
+
+inline bool Flatten::reduce(SemanticValues &vs, Value &val, Context &c,
+                            std::any &dt) const {
+  try {
+    val = rule_.holder_->reduce(vs, dt);
+  } catch (const parse_error &e) {
+    if (c.log) {
+      if (e.what()) {
+        if (c.error_info.message_pos < vs.sv_.data()) {
+          c.error_info.message_pos = vs.sv_.data();
+          c.error_info.message = e.what();
+        }
+      }
+    }
+    return false;
+  }
+  return true;
+}
+
 inline size_t Recovery::parse_core(const char *s, size_t n,
                                    SemanticValues & /*vs*/, Context &c,
                                    std::any & /*dt*/) const {
@@ -2849,6 +4643,7 @@ inline void NotPredicate::accept(Visitor &v) { v.visit(*this); }
 inline void Dictionary::accept(Visitor &v) { v.visit(*this); }
 inline void LiteralString::accept(Visitor &v) { v.visit(*this); }
 inline void CharacterClass::accept(Visitor &v) { v.visit(*this); }
+inline void Span::accept(Visitor &v) { v.visit(*this); }
 inline void Character::accept(Visitor &v) { v.visit(*this); }
 inline void AnyCharacter::accept(Visitor &v) { v.visit(*this); }
 inline void CaptureScope::accept(Visitor &v) { v.visit(*this); }
@@ -2856,12 +4651,14 @@ inline void Capture::accept(Visitor &v) { v.visit(*this); }
 inline void TokenBoundary::accept(Visitor &v) { v.visit(*this); }
 inline void Ignore::accept(Visitor &v) { v.visit(*this); }
 inline void User::accept(Visitor &v) { v.visit(*this); }
+inline void Native::accept(Visitor &v) { v.visit(*this); }
 inline void WeakHolder::accept(Visitor &v) { v.visit(*this); }
 inline void Holder::accept(Visitor &v) { v.visit(*this); }
 inline void Reference::accept(Visitor &v) { v.visit(*this); }
 inline void Whitespace::accept(Visitor &v) { v.visit(*this); }
 inline void BackReference::accept(Visitor &v) { v.visit(*this); }
 inline void PrecedenceClimbing::accept(Visitor &v) { v.visit(*this); }
+inline void Flatten::accept(Visitor &v) { v.visit(*this); }
 inline void Recovery::accept(Visitor &v) { v.visit(*this); }
 inline void Cut::accept(Visitor &v) { v.visit(*this); }
 
@@ -2888,6 +4685,13 @@ inline void AssignIDToDefinition::visit(PrecedenceClimbing &ope) {
   ope.binop_->accept(*this);
 }
 
+inline void AssignIDToDefinition::visit(Native &ope) {
+  // Generated code may call any rule of its grammar.
+  for (auto rule : *ope.rules_) {
+    rule->accept(*this);
+  }
+}
+
 inline void TokenChecker::visit(Reference &ope) {
   if (ope.is_macro_) {
     for (auto arg : ope.args_) {
@@ -2934,6 +4738,90 @@ inline void HasEmptyElement::visit(Reference &ope) {
   }
 }
 
+inline void ComputeFirstSet::visit(Holder &ope) {
+  auto rule = ope.outer_;
+  // Rules with an error message are always tried, so that the message is
+  // still reported.
+  if (rule->is_macro || !rule->error_message.empty()) { return; }
+  if (auto it = memo_.find(rule); it != memo_.end()) {
+    result_ = it->second;
+    return;
+  }
+  if (active_.count(rule)) { return; }
+  active_.insert(rule);
+  result_ = get(*ope.ope_);
+  active_.erase(rule);
+  memo_[rule] = result_;
+}
+
+inline void ComputeFirstSet::visit(Reference &ope) {
+  if (ope.rule_ && !ope.is_macro_) { ope.rule_->accept(*this); }
+}
+
+inline void SetupChoiceDispatch::visit(PrioritizedChoice &ope) {
+  for (auto op : ope.opes_) {
+    op->accept(*this);
+  }
+
+  ope.dispatch_.clear();
+  ope.candidates_.clear();
+  if (ope.for_label_) { return; }
+
+  std::vector<FirstSet> first_sets;
+  for (auto op : ope.opes_) {
+    first_sets.push_back(first_set_.get(*op));
+  }
+
+  std::vector<size_t> dispatch(257);
+  std::vector<std::vector<size_t>> candidates;
+  auto skips = false;
+  for (size_t b = 0; b < 257; b++) {
+    std::vector<size_t> ids;
+    for (size_t id = 0; id < first_sets.size(); id++) {
+      const auto &f = first_sets[id];
+      if (f.nullable || (b < 256 && f.bytes.test(b))) { ids.push_back(id); }
+    }
+    if (ids.size() < first_sets.size()) { skips = true; }
+
+    auto it = std::find(candidates.begin(), candidates.end(), ids);
+    dispatch[b] = static_cast<size_t>(std::distance(candidates.begin(), it));
+    if (it == candidates.end()) { candidates.push_back(std::move(ids)); }
+  }
+
+  // Not worth it if every alternative has to be tried anyway.
+  if (skips) {
+    ope.dispatch_ = std::move(dispatch);
+    ope.candidates_ = std::move(candidates);
+  }
+}
+
+inline size_t PrioritizedChoice::parse_core(const char *s, size_t n,
+                                            SemanticValues &vs, Context &c,
+                                            std::any &dt) const {
+  size_t len = static_cast<size_t>(-1);
+
+  if (!for_label_) { c.cut_stack.push_back(false); }
+
+  // Skipped alternatives would only fail at `s`, which can be observed through
+  // the error report and the tracer.
+  if (!dispatch_.empty() && !c.tracing() &&
+      (!c.log || c.error_info.error_pos > s)) {
+    auto key = n > 0 ? static_cast<uint8_t>(s[0]) : 256;
+    c.examine(s + 1);
+    for (auto id : candidates_[dispatch_[key]]) {
+      if (parse_alternative(id, len, s, n, vs, c, dt)) { break; }
+    }
+  } else {
+    for (size_t id = 0; id < opes_.size(); id++) {
+      if (parse_alternative(id, len, s, n, vs, c, dt)) { break; }
+    }
+  }
+
+  if (!for_label_) { c.cut_stack.pop_back(); }
+
+  return len;
+}
+
 inline void DetectInfiniteLoop::visit(Reference &ope) {
   auto it = std::find_if(refs_.begin(), refs_.end(),
                          [&](const std::pair<const char *, std::string> &ref) {
@@ -3014,109 +4902,341 @@ inline void FindReference::visit(Reference &ope) {
 }
 
 /*-----------------------------------------------------------------------------
- *  PEG parser generator
+ *  Native grammars
  *---------------------------------------------------------------------------*/
 
-using Rules = std::unordered_map<std::string, std::shared_ptr<Ope>>;
-
-class ParserGenerator {
-public:
-  static std::shared_ptr<Grammar> parse(const char *s, size_t n,
-                                        const Rules &rules, std::string &start,
-                                        bool &enablePackratParsing, Log log) {
-    return get_instance().perform_core(s, n, rules, start, enablePackratParsing,
-                                       log);
-  }
-
-  static std::shared_ptr<Grammar> parse(const char *s, size_t n,
-                                        std::string &start,
-                                        bool &enablePackratParsing, Log log) {
-    Rules dummy;
-    return parse(s, n, dummy, start, enablePackratParsing, log);
+// Building blocks for the code emitted by peggml_codegen. Each one mirrors the
+// parse_core of the corresponding operator, but takes its operands as callables
+// `size_t(const char *s, size_t n, SemanticValues &vs)` so that a whole rule
+// body can be inlined into a single function.
+struct NativeOps {
+  template <typename... F>
+  static size_t sequence(const char *s, size_t n, SemanticValues &vs,
+                         Context &c, F &&... fs) {
+    auto &chldsv = c.push();
+    auto pop_se = scope_exit([&]() { c.pop(); });
+    size_t i = 0;
+    auto step = [&](auto &f) {
+      auto len = f(s + i, n - i, chldsv);
+      if (fail(len)) {
+        i = len;
+        return false;
+      }
+      i += len;
+      return true;
+    };
+    if (!(step(fs) && ...)) { return i; }
+    append(vs, chldsv);
+    return i;
   }
 
-  // For debuging purpose
-  static Grammar &grammar() { return get_instance().g; }
+  template <typename... F>
+  static size_t choice(const char *s, size_t n, SemanticValues &vs,
+                       Context &c, F &&... fs) {
+    size_t len = static_cast<size_t>(-1);
 
-private:
-  static ParserGenerator &get_instance() {
-    static ParserGenerator instance;
-    return instance;
-  }
+    c.cut_stack.push_back(false);
 
-  ParserGenerator() {
-    make_grammar();
-    setup_actions();
-  }
+    size_t id = 0;
+    auto alternative = [&](auto &f) {
+      c.cut_stack.back() = false;
 
-  struct Instruction {
-    std::string type;
-    std::any data;
-  };
+      auto &chldsv = c.push();
+      c.push_capture_scope();
 
-  struct Data {
-    std::shared_ptr<Grammar> grammar;
-    std::string start;
-    const char *start_pos = nullptr;
-    std::vector<std::pair<std::string, const char *>> duplicates;
-    std::map<std::string, Instruction> instructions;
-    std::set<std::string_view> captures;
-    bool enablePackratParsing = true;
+      auto se = scope_exit([&]() {
+        c.pop();
+        c.pop_capture_scope();
+      });
 
-    Data() : grammar(std::make_shared<Grammar>()) {}
-  };
+      len = f(s, n, chldsv);
 
-  void make_grammar() {
-    // Setup PEG syntax parser
-    g["Grammar"] <= seq(g["Spacing"], oom(g["Definition"]), g["EndOfFile"]);
-    g["Definition"] <=
-        cho(seq(g["Ignore"], g["IdentCont"], g["Parameters"], g["LEFTARROW"],
-                g["Expression"], opt(g["Instruction"])),
-            seq(g["Ignore"], g["Identifier"], g["LEFTARROW"], g["Expression"],
-                opt(g["Instruction"])));
-    g["Expression"] <= seq(g["Sequence"], zom(seq(g["SLASH"], g["Sequence"])));
-    g["Sequence"] <= zom(cho(g["CUT"], g["Prefix"]));
-    g["Prefix"] <= seq(opt(cho(g["AND"], g["NOT"])), g["SuffixWithLabel"]);
-    g["SuffixWithLabel"] <=
-        seq(g["Suffix"], opt(seq(g["LABEL"], g["Identifier"])));
-    g["Suffix"] <= seq(g["Primary"], opt(g["Loop"]));
-    g["Loop"] <= cho(g["QUESTION"], g["STAR"], g["PLUS"], g["Repetition"]);
-    g["Primary"] <=
-        cho(seq(g["Ignore"], g["IdentCont"], g["Arguments"],
-                npd(g["LEFTARROW"])),
-            seq(g["Ignore"], g["Identifier"],
-                npd(seq(opt(g["Parameters"]), g["LEFTARROW"]))),
-            seq(g["OPEN"], g["Expression"], g["CLOSE"]),
-            seq(g["BeginTok"], g["Expression"], g["EndTok"]),
-            seq(g["BeginCapScope"], g["Expression"], g["EndCapScope"]),
-            seq(g["BeginCap"], g["Expression"], g["EndCap"]), g["BackRef"],
-            g["LiteralI"], g["Dictionary"], g["Literal"], g["NegatedClass"],
-            g["Class"], g["DOT"]);
+      if (success(len)) {
+        append(vs, chldsv);
+        vs.choice_count_ = sizeof...(F);
+        vs.choice_ = id;
+        c.shift_capture_values();
+        return true;
+      } else if (c.cut_stack.back()) {
+        return true;
+      }
 
-    g["Identifier"] <= seq(g["IdentCont"], g["Spacing"]);
-    g["IdentCont"] <= seq(g["IdentStart"], zom(g["IdentRest"]));
+      id++;
+      return false;
+    };
+    (alternative(fs) || ...);
 
-    const static std::vector<std::pair<char32_t, char32_t>> range = {
-        {0x0080, 0xFFFF}};
-    g["IdentStart"] <= seq(npd(lit(u8(u8"↑"))), npd(lit(u8(u8"⇑"))),
-                           cho(cls("a-zA-Z_%"), cls(range)));
+    c.cut_stack.pop_back();
 
-    g["IdentRest"] <= cho(g["IdentStart"], cls("0-9"));
+    return len;
+  }
 
-    g["Dictionary"] <= seq(g["LiteralD"], oom(seq(g["PIPE"], g["LiteralD"])));
+  template <typename F>
+  static size_t repetition(const char *s, size_t n, SemanticValues &vs,
+                           Context &c, size_t min, size_t max, F &&f) {
+    size_t count = 0;
+    size_t i = 0;
+    while (count < min) {
+      c.push_capture_scope();
+      auto se = scope_exit([&]() { c.pop_capture_scope(); });
+      auto len = f(s + i, n - i, vs);
+      if (success(len)) {
+        c.shift_capture_values();
+      } else {
+        return len;
+      }
+      i += len;
+      count++;
+    }
 
-    auto lit_ope = cho(seq(cls("'"), tok(zom(seq(npd(cls("'")), g["Char"]))),
-                           cls("'"), g["Spacing"]),
-                       seq(cls("\""), tok(zom(seq(npd(cls("\"")), g["Char"]))),
-                           cls("\""), g["Spacing"]));
-    g["Literal"] <= lit_ope;
-    g["LiteralD"] <= lit_ope;
+    while (n - i > 0 && count < max) {
+      c.push_capture_scope();
+      auto se = scope_exit([&]() { c.pop_capture_scope(); });
+      auto save_sv_size = vs.size();
+      auto save_tok_size = vs.tokens.size();
+      auto len = f(s + i, n - i, vs);
+      if (success(len)) {
+        c.shift_capture_values();
+      } else {
+        if (vs.size() != save_sv_size) {
+          vs.erase(vs.begin() + static_cast<std::ptrdiff_t>(save_sv_size));
+          vs.tags.erase(vs.tags.begin() +
+                        static_cast<std::ptrdiff_t>(save_sv_size));
+        }
+        if (vs.tokens.size() != save_tok_size) {
+          vs.tokens.erase(vs.tokens.begin() +
+                          static_cast<std::ptrdiff_t>(save_tok_size));
+        }
+        break;
+      }
+      i += len;
+      count++;
+    }
+    return i;
+  }
 
-    g["LiteralI"] <=
-        cho(seq(cls("'"), tok(zom(seq(npd(cls("'")), g["Char"]))), lit("'i"),
-                g["Spacing"]),
-            seq(cls("\""), tok(zom(seq(npd(cls("\"")), g["Char"]))), lit("\"i"),
-                g["Spacing"]));
+  template <typename F>
+  static size_t and_predicate(const char *s, size_t n, Context &c, F &&f) {
+    auto &chldsv = c.push();
+    c.push_capture_scope();
+    auto se = scope_exit([&]() {
+      c.pop();
+      c.pop_capture_scope();
+    });
+    auto len = f(s, n, chldsv);
+    if (success(len)) {
+      return 0;
+    } else {
+      return len;
+    }
+  }
+
+  template <typename F>
+  static size_t not_predicate(const char *s, size_t n, Context &c, F &&f) {
+    auto &chldsv = c.push();
+    c.push_capture_scope();
+    auto se = scope_exit([&]() {
+      c.pop();
+      c.pop_capture_scope();
+    });
+    auto len = f(s, n, chldsv);
+    if (success(len)) {
+      c.set_error_pos(s);
+      return static_cast<size_t>(-1);
+    } else {
+      return 0;
+    }
+  }
+
+  template <typename F>
+  static size_t capture_scope(const char *s, size_t n, SemanticValues &vs,
+                              Context &c, F &&f) {
+    c.push_capture_scope();
+    auto se = scope_exit([&]() { c.pop_capture_scope(); });
+    return f(s, n, vs);
+  }
+
+  template <typename F>
+  static size_t token_boundary(const char *s, size_t n, SemanticValues &vs,
+                               Context &c, std::any &dt, F &&f) {
+    size_t len;
+    {
+      c.in_token_boundary_count++;
+      auto se = scope_exit([&]() { c.in_token_boundary_count--; });
+      len = f(s, n, vs);
+    }
+
+    if (success(len)) {
+      vs.tokens.emplace_back(std::string_view(s, len));
+
+      if (!c.in_token_boundary_count) {
+        if (c.whitespaceOpe) {
+          auto l = c.whitespaceOpe->parse(s + len, n - len, vs, c, dt);
+          if (fail(l)) { return l; }
+          len += l;
+        }
+      }
+    }
+    return len;
+  }
+
+  template <typename F>
+  static size_t ignore(const char *s, size_t n, Context &c, F &&f) {
+    auto &chldsv = c.push();
+    auto se = scope_exit([&]() { c.pop(); });
+    return f(s, n, chldsv);
+  }
+
+  template <typename F>
+  static size_t whitespace(const char *s, size_t n, SemanticValues &vs,
+                           Context &c, F &&f) {
+    if (c.in_whitespace) { return 0; }
+    c.in_whitespace = true;
+    auto se = scope_exit([&]() { c.in_whitespace = false; });
+    return f(s, n, vs);
+  }
+
+  static size_t cut(Context &c) {
+    c.cut_stack.back() = true;
+    return 0;
+  }
+
+  static size_t reference(const char *s, size_t n, SemanticValues &vs,
+                          Context &c, std::any &dt, Definition *rule) {
+    c.push_args(c.no_args);
+    auto se = scope_exit([&]() { c.pop_args(); });
+    return rule->holder_->parse(s, n, vs, c, dt);
+  }
+
+private:
+  static void append(SemanticValues &vs, SemanticValues &chldsv) {
+    if (!chldsv.empty()) {
+      for (size_t i = 0; i < chldsv.size(); i++) {
+        vs.emplace_back(std::move(chldsv[i]));
+      }
+    }
+    if (!chldsv.tags.empty()) {
+      for (size_t i = 0; i < chldsv.tags.size(); i++) {
+        vs.tags.emplace_back(std::move(chldsv.tags[i]));
+      }
+    }
+    vs.sv_ = chldsv.sv_;
+    if (!chldsv.tokens.empty()) {
+      for (size_t i = 0; i < chldsv.tokens.size(); i++) {
+        vs.tokens.emplace_back(std::move(chldsv.tokens[i]));
+      }
+    }
+  }
+};
+
+/*-----------------------------------------------------------------------------
+ *  PEG parser generator
+ *---------------------------------------------------------------------------*/
+
+using Rules = std::unordered_map<std::string, std::shared_ptr<Ope>>;
+
+class ParserGenerator {
+public:
+  static std::shared_ptr<Grammar> parse(const char *s, size_t n,
+                                        const Rules &rules, std::string &start,
+                                        bool &enablePackratParsing, Log log) {
+    return get_instance().perform_core(s, n, rules, start, enablePackratParsing,
+                                       log);
+  }
+
+  static std::shared_ptr<Grammar> parse(const char *s, size_t n,
+                                        std::string &start,
+                                        bool &enablePackratParsing, Log log) {
+    Rules dummy;
+    return parse(s, n, dummy, start, enablePackratParsing, log);
+  }
+
+  // For debuging purpose
+  static Grammar &grammar() { return get_instance().g; }
+
+private:
+  static ParserGenerator &get_instance() {
+    static ParserGenerator instance;
+    return instance;
+  }
+
+  ParserGenerator() {
+    make_grammar();
+    setup_actions();
+  }
+
+  struct Instruction {
+    std::string type;
+    std::any data;
+  };
+
+  struct Data {
+    std::shared_ptr<Grammar> grammar;
+    std::string start;
+    const char *start_pos = nullptr;
+    std::vector<std::pair<std::string, const char *>> duplicates;
+    std::map<std::string, Instruction> instructions;
+    std::set<std::string_view> captures;
+    bool enablePackratParsing = true;
+
+    Data() : grammar(std::make_shared<Grammar>()) {}
+  };
+
+  void make_grammar() {
+    // Setup PEG syntax parser
+    g["Grammar"] <= seq(g["Spacing"], oom(g["Definition"]), g["EndOfFile"]);
+    g["Definition"] <=
+        cho(seq(g["Ignore"], g["IdentCont"], g["Parameters"], g["LEFTARROW"],
+                g["Expression"], opt(g["Instruction"])),
+            seq(g["Ignore"], g["Identifier"], g["LEFTARROW"], g["Expression"],
+                opt(g["Instruction"])));
+    g["Expression"] <= seq(g["Sequence"], zom(seq(g["SLASH"], g["Sequence"])));
+    g["Sequence"] <= zom(cho(g["CUT"], g["Prefix"]));
+    g["Prefix"] <= seq(opt(cho(g["AND"], g["NOT"])), g["SuffixWithLabel"]);
+    g["SuffixWithLabel"] <=
+        seq(g["Suffix"], opt(seq(g["LABEL"], g["Identifier"])));
+    g["Suffix"] <= seq(g["Primary"], opt(g["Loop"]));
+    g["Loop"] <= cho(g["QUESTION"], g["STAR"], g["PLUS"], g["Repetition"]);
+    g["Primary"] <=
+        cho(seq(g["Ignore"], g["IdentCont"], g["Arguments"],
+                npd(g["LEFTARROW"])),
+            seq(g["Ignore"], g["Identifier"],
+                npd(seq(opt(g["Parameters"]), g["LEFTARROW"]))),
+            seq(g["OPEN"], g["Expression"], g["CLOSE"]),
+            seq(g["BeginTok"], g["Expression"], g["EndTok"]),
+            seq(g["BeginCapScope"], g["Expression"], g["EndCapScope"]),
+            seq(g["BeginCap"], g["Expression"], g["EndCap"]), g["BackRef"],
+            g["DictionaryI"], g["LiteralI"], g["Dictionary"], g["Literal"],
+            g["NegatedClass"], g["Class"], g["DOT"]);
+
+    g["Identifier"] <= seq(g["IdentCont"], g["Spacing"]);
+    g["IdentCont"] <= seq(g["IdentStart"], zom(g["IdentRest"]));
+
+    const static std::vector<std::pair<char32_t, char32_t>> range = {
+        {0x0080, 0xFFFF}};
+    g["IdentStart"] <= seq(npd(lit(u8(u8"↑"))), npd(lit(u8(u8"⇑"))),
+                           cho(cls("a-zA-Z_%"), cls(range)));
+
+    g["IdentRest"] <= cho(g["IdentStart"], cls("0-9"));
+
+    g["Dictionary"] <= seq(g["LiteralD"], oom(seq(g["PIPE"], g["LiteralD"])));
+    g["DictionaryI"] <=
+        seq(g["LiteralDI"], oom(seq(g["PIPE"], g["LiteralDI"])));
+
+    auto lit_ope = cho(seq(cls("'"), tok(zom(seq(npd(cls("'")), g["Char"]))),
+                           cls("'"), g["Spacing"]),
+                       seq(cls("\""), tok(zom(seq(npd(cls("\"")), g["Char"]))),
+                           cls("\""), g["Spacing"]));
+    g["Literal"] <= lit_ope;
+    g["LiteralD"] <= lit_ope;
+
+    auto liti_ope =
+        cho(seq(cls("'"), tok(zom(seq(npd(cls("'")), g["Char"]))), lit("'i"),
+                g["Spacing"]),
+            seq(cls("\""), tok(zom(seq(npd(cls("\"")), g["Char"]))), lit("\"i"),
+                g["Spacing"]));
+    g["LiteralI"] <= liti_ope;
+    g["LiteralDI"] <= liti_ope;
 
     // NOTE: The original Brian Ford's paper uses 'zom' instead of 'oom'.
     g["Class"] <= seq(chr('['), npd(chr('^')),
@@ -3190,7 +5310,8 @@ private:
     // Instruction grammars
     g["Instruction"] <= seq(g["BeginBlacket"],
                             cho(cho(g["PrecedenceClimbing"]),
-                                cho(g["ErrorMessage"]), cho(g["NoAstOpt"])),
+                                cho(g["ErrorMessage"]), cho(g["NoAstOpt"]),
+                                cho(g["Flatten"])),
                             g["EndBlacket"]);
 
     ~g["SpacesZom"] <= zom(g["Space"]);
@@ -3223,6 +5344,9 @@ private:
     // No Ast node optimazation instruction
     g["NoAstOpt"] <= seq(lit("no_ast_opt"), g["SpacesZom"]);
 
+    // Tail recursion flattening instruction
+    g["Flatten"] <= seq(lit("flatten"), g["SpacesZom"]);
+
     // Set definition names
     for (auto &x : g) {
       x.second.name = x.first;
@@ -3234,21 +5358,21 @@ private:
       auto &data = *std::any_cast<Data *>(dt);
 
       auto is_macro = vs.choice() == 0;
-      auto ignore = std::any_cast<bool>(vs[0]);
-      auto name = std::any_cast<std::string>(vs[1]);
+      auto ignore = vs.get<bool>(0);
+      auto name = vs.get<std::string>(1);
 
       std::vector<std::string> params;
       std::shared_ptr<Ope> ope;
       if (is_macro) {
-        params = std::any_cast<std::vector<std::string>>(vs[2]);
-        ope = std::any_cast<std::shared_ptr<Ope>>(vs[4]);
+        params = vs.get<std::vector<std::string>>(2);
+        ope = vs.get<std::shared_ptr<Ope>>(4);
         if (vs.size() == 6) {
-          data.instructions[name] = std::any_cast<Instruction>(vs[5]);
+          data.instructions[name] = vs.get<Instruction>(5);
         }
       } else {
-        ope = std::any_cast<std::shared_ptr<Ope>>(vs[3]);
+        ope = vs.get<std::shared_ptr<Ope>>(3);
         if (vs.size() == 5) {
-          data.instructions[name] = std::any_cast<Instruction>(vs[4]);
+          data.instructions[name] = vs.get<Instruction>(4);
         }
       }
 
@@ -3278,11 +5402,11 @@ private:
 
     g["Expression"] = [&](const SemanticValues &vs) {
       if (vs.size() == 1) {
-        return std::any_cast<std::shared_ptr<Ope>>(vs[0]);
+        return vs.get<std::shared_ptr<Ope>>(0);
       } else {
         std::vector<std::shared_ptr<Ope>> opes;
         for (auto i = 0u; i < vs.size(); i++) {
-          opes.emplace_back(std::any_cast<std::shared_ptr<Ope>>(vs[i]));
+          opes.emplace_back(vs.get<std::shared_ptr<Ope>>(i));
         }
         const std::shared_ptr<Ope> ope =
             std::make_shared<PrioritizedChoice>(opes);
@@ -3294,11 +5418,11 @@ private:
       if (vs.empty()) {
         return npd(lit(""));
       } else if (vs.size() == 1) {
-        return std::any_cast<std::shared_ptr<Ope>>(vs[0]);
+        return vs.get<std::shared_ptr<Ope>>(0);
       } else {
         std::vector<std::shared_ptr<Ope>> opes;
         for (const auto &x : vs) {
-          opes.emplace_back(std::any_cast<std::shared_ptr<Ope>>(x));
+          opes.emplace_back(x.get<std::shared_ptr<Ope>>());
         }
         const std::shared_ptr<Ope> ope = std::make_shared<Sequence>(opes);
         return ope;
@@ -3308,11 +5432,11 @@ private:
     g["Prefix"] = [&](const SemanticValues &vs) {
       std::shared_ptr<Ope> ope;
       if (vs.size() == 1) {
-        ope = std::any_cast<std::shared_ptr<Ope>>(vs[0]);
+        ope = vs.get<std::shared_ptr<Ope>>(0);
       } else {
         assert(vs.size() == 2);
-        auto tok = std::any_cast<char>(vs[0]);
-        ope = std::any_cast<std::shared_ptr<Ope>>(vs[1]);
+        auto tok = vs.get<char>(0);
+        ope = vs.get<std::shared_ptr<Ope>>(1);
         if (tok == '&') {
           ope = apd(ope);
         } else { // '!'
@@ -3323,13 +5447,13 @@ private:
     };
 
     g["SuffixWithLabel"] = [&](const SemanticValues &vs, std::any &dt) {
-      auto ope = std::any_cast<std::shared_ptr<Ope>>(vs[0]);
+      auto ope = vs.get<std::shared_ptr<Ope>>(0);
       if (vs.size() == 1) {
         return ope;
       } else {
         assert(vs.size() == 2);
         auto &data = *std::any_cast<Data *>(dt);
-        const auto &ident = std::any_cast<std::string>(vs[1]);
+        const auto &ident = vs.get<std::string>(1);
         auto label = ref(*data.grammar, ident, vs.sv().data(), false, {});
         auto recovery = rec(ref(*data.grammar, RECOVER_DEFINITION_NAME,
                                 vs.sv().data(), true, {label}));
@@ -3344,12 +5468,12 @@ private:
     };
 
     g["Suffix"] = [&](const SemanticValues &vs) {
-      auto ope = std::any_cast<std::shared_ptr<Ope>>(vs[0]);
+      auto ope = vs.get<std::shared_ptr<Ope>>(0);
       if (vs.size() == 1) {
         return ope;
       } else {
         assert(vs.size() == 2);
-        auto loop = std::any_cast<Loop>(vs[1]);
+        auto loop = vs.get<Loop>(1);
         switch (loop.type) {
         case Loop::Type::opt: return opt(ope);
         case Loop::Type::zom: return zom(ope);
@@ -3370,27 +5494,27 @@ private:
         return Loop{Loop::Type::oom, std::pair<size_t, size_t>()};
       default: // Regex-like repetition
         return Loop{Loop::Type::rep,
-                    std::any_cast<std::pair<size_t, size_t>>(vs[0])};
+                    vs.get<std::pair<size_t, size_t>>(0)};
       }
     };
 
     g["RepetitionRange"] = [&](const SemanticValues &vs) {
       switch (vs.choice()) {
       case 0: { // Number COMMA Number
-        auto min = std::any_cast<size_t>(vs[0]);
-        auto max = std::any_cast<size_t>(vs[1]);
+        auto min = vs.get<size_t>(0);
+        auto max = vs.get<size_t>(1);
         return std::pair(min, max);
       }
       case 1: // Number COMMA
-        return std::pair(std::any_cast<size_t>(vs[0]),
+        return std::pair(vs.get<size_t>(0),
                          std::numeric_limits<size_t>::max());
       case 2: { // Number
-        auto n = std::any_cast<size_t>(vs[0]);
+        auto n = vs.get<size_t>(0);
         return std::pair(n, n);
       }
       default: // COMMA Number
         return std::pair(std::numeric_limits<size_t>::min(),
-                         std::any_cast<size_t>(vs[0]));
+                         vs.get<size_t>(0));
       }
     };
     g["Number"] = [&](const SemanticValues &vs) {
@@ -3404,12 +5528,12 @@ private:
       case 0:   // Macro Reference
       case 1: { // Reference
         auto is_macro = vs.choice() == 0;
-        auto ignore = std::any_cast<bool>(vs[0]);
-        const auto &ident = std::any_cast<std::string>(vs[1]);
+        auto ignore = vs.get<bool>(0);
+        const auto &ident = vs.get<std::string>(1);
 
         std::vector<std::shared_ptr<Ope>> args;
         if (is_macro) {
-          args = std::any_cast<std::vector<std::shared_ptr<Ope>>>(vs[2]);
+          args = vs.get<std::vector<std::shared_ptr<Ope>>>(2);
         }
 
         auto ope = ref(*data.grammar, ident, vs.sv().data(), is_macro, args);
@@ -3422,27 +5546,26 @@ private:
         }
       }
       case 2: { // (Expression)
-        return std::any_cast<std::shared_ptr<Ope>>(vs[0]);
+        return vs.get<std::shared_ptr<Ope>>(0);
       }
       case 3: { // TokenBoundary
-        return tok(std::any_cast<std::shared_ptr<Ope>>(vs[0]));
+        return tok(vs.get<std::shared_ptr<Ope>>(0));
       }
       case 4: { // CaptureScope
-        return csc(std::any_cast<std::shared_ptr<Ope>>(vs[0]));
+        return csc(vs.get<std::shared_ptr<Ope>>(0));
       }
       case 5: { // Capture
-        const auto &name = std::any_cast<std::string_view>(vs[0]);
-        auto ope = std::any_cast<std::shared_ptr<Ope>>(vs[1]);
+        const auto &name = vs.get<std::string_view>(0);
+        auto ope = vs.get<std::shared_ptr<Ope>>(1);
 
         data.captures.insert(name);
 
         return cap(ope, [name](const char *a_s, size_t a_n, Context &c) {
-          auto &cs = c.capture_scope_stack[c.capture_scope_stack_size - 1];
-          cs[name] = std::string(a_s, a_n);
+          c.set_capture(name, std::string_view(a_s, a_n));
         });
       }
       default: {
-        return std::any_cast<std::shared_ptr<Ope>>(vs[0]);
+        return vs.get<std::shared_ptr<Ope>>(0);
       }
       }
     };
@@ -3455,6 +5578,10 @@ private:
       auto items = vs.transform<std::string>();
       return dic(items);
     };
+    g["DictionaryI"] = [](const SemanticValues &vs) {
+      auto items = vs.transform<std::string>();
+      return dici(items);
+    };
 
     g["Literal"] = [](const SemanticValues &vs) {
       const auto &tok = vs.tokens.front();
@@ -3468,6 +5595,10 @@ private:
       auto &tok = vs.tokens.front();
       return resolve_escape_sequence(tok.data(), tok.size());
     };
+    g["LiteralDI"] = [](const SemanticValues &vs) {
+      auto &tok = vs.tokens.front();
+      return resolve_escape_sequence(tok.data(), tok.size());
+    };
 
     g["Class"] = [](const SemanticValues &vs) {
       auto ranges = vs.transform<std::pair<char32_t, char32_t>>();
@@ -3480,14 +5611,14 @@ private:
     g["Range"] = [](const SemanticValues &vs) {
       switch (vs.choice()) {
       case 0: {
-        auto s1 = std::any_cast<std::string>(vs[0]);
-        auto s2 = std::any_cast<std::string>(vs[1]);
+        auto s1 = vs.get<std::string>(0);
+        auto s2 = vs.get<std::string>(1);
         auto cp1 = decode_codepoint(s1.data(), s1.length());
         auto cp2 = decode_codepoint(s2.data(), s2.length());
         return std::pair(cp1, cp2);
       }
       case 1: {
-        auto s = std::any_cast<std::string>(vs[0]);
+        auto s = vs.get<std::string>(0);
         auto cp = decode_codepoint(s.data(), s.length());
         return std::pair(cp, cp);
       }
@@ -3532,7 +5663,7 @@ private:
       PrecedenceClimbing::BinOpeInfo binOpeInfo;
       size_t level = 1;
       for (auto v : vs) {
-        auto tokens = std::any_cast<std::vector<std::string_view>>(v);
+        auto tokens = v.get<std::vector<std::string_view>>();
         auto assoc = tokens[0][0];
         for (size_t i = 1; i < tokens.size(); i++) {
           binOpeInfo[tokens[i]] = std::pair(level, assoc);
@@ -3553,7 +5684,7 @@ private:
     g["ErrorMessage"] = [](const SemanticValues &vs) {
       Instruction instruction;
       instruction.type = "message";
-      instruction.data = std::any_cast<std::string>(vs[0]);
+      instruction.data = vs.get<std::string>(0);
       return instruction;
     };
 
@@ -3562,6 +5693,12 @@ private:
       instruction.type = "no_ast_opt";
       return instruction;
     };
+
+    g["Flatten"] = [](const SemanticValues & /*vs*/) {
+      Instruction instruction;
+      instruction.type = "flatten";
+      return instruction;
+    };
   }
 
   bool apply_precedence_instruction(Definition &rule,
@@ -3603,6 +5740,35 @@ private:
     return true;
   }
 
+  // `A <- P A / Q` becomes flat(P, Q).
+  bool apply_flatten_instruction(Definition &rule, const char *s, Log log) {
+    auto choice =
+        dynamic_cast<PrioritizedChoice *>(rule.get_core_operator().get());
+    auto seq = choice && choice->opes_.size() == 2
+                   ? dynamic_cast<Sequence *>(choice->opes_[0].get())
+                   : nullptr;
+    auto ref = seq && seq->opes_.size() >= 2
+                   ? dynamic_cast<Reference *>(seq->opes_.back().get())
+                   : nullptr;
+
+    if (rule.is_macro || rule.is_left_recursive || !ref || ref->is_macro_ ||
+        ref->name_ != rule.name) {
+      if (log) {
+        auto line = line_info(s, rule.s_);
+        log(line.first, line.second,
+            "'flatten' instruction cannot be applied to '" + rule.name + "'.");
+      }
+      return false;
+    }
+
+    std::vector<std::shared_ptr<Ope>> head(seq->opes_.begin(),
+                                           seq->opes_.end() - 1);
+    rule.holder_->ope_ =
+        flat(head.size() == 1 ? head[0] : std::make_shared<Sequence>(head),
+             choice->opes_[1], rule);
+    return true;
+  }
+
   std::shared_ptr<Grammar> perform_core(const char *s, size_t n,
                                         const Rules &rules, std::string &start,
                                         bool &enablePackratParsing, Log log) {
@@ -3723,13 +5889,17 @@ private:
       rule.accept(vis);
     }
 
-    // Check left recursion
+    // Check left recursion (only macros cannot be grown from a seed)
     ret = true;
 
     for (auto &[name, rule] : grammar) {
       DetectLeftRecursion vis(name);
       rule.accept(vis);
       if (vis.error_s) {
+        if (!rule.is_macro) {
+          rule.is_left_recursive = true;
+          continue;
+        }
         if (log) {
           auto line = line_info(s, vis.error_s);
           log(line.first, line.second, "'" + name + "' is left recursive.");
@@ -3754,6 +5924,15 @@ private:
       }
     }
 
+    // Span lowering
+    for (auto &x : grammar) {
+      auto &rule = x.second;
+      auto ope = rule.get_core_operator();
+      LowerSpans vis(!grammar.count(WORD_DEFINITION_NAME));
+      vis.lower(ope);
+      rule <= ope;
+    }
+
     // Automatic whitespace skipping
     if (grammar.count(WHITESPACE_DEFINITION_NAME)) {
       for (auto &x : grammar) {
@@ -3786,6 +5965,19 @@ private:
         rule.error_message = std::any_cast<std::string>(instruction.data);
       } else if (instruction.type == "no_ast_opt") {
         rule.no_ast_opt = true;
+      } else if (instruction.type == "flatten") {
+        if (!apply_flatten_instruction(rule, s, log)) { return nullptr; }
+      }
+    }
+
+    // FIRST-set dispatch for prioritized choices
+    {
+      ComputeFirstSet::Memo memo;
+      std::unordered_set<const Definition *> active;
+      ComputeFirstSet first_set(memo, active);
+      for (auto &x : grammar) {
+        SetupChoiceDispatch vis(first_set);
+        x.second.get_core_operator()->accept(vis);
       }
     }
 
@@ -3800,57 +5992,942 @@ private:
 };
 
 /*-----------------------------------------------------------------------------
- *  AST
+ *  Grammar analysis
  *---------------------------------------------------------------------------*/
 
-template <typename Annotation> struct AstBase : public Annotation {
-  AstBase(const char *path, size_t line, size_t column, const char *name,
-          const std::vector<std::shared_ptr<AstBase>> &nodes,
-          size_t position = 0, size_t length = 0, size_t choice_count = 0,
-          size_t choice = 0)
-      : path(path ? path : ""), line(line), column(column), name(name),
-        position(position), length(length), choice_count(choice_count),
-        choice(choice), original_name(name),
-        original_choice_count(choice_count), original_choice(choice),
-        tag(str2tag(name)), original_tag(tag), is_token(false), nodes(nodes) {}
-
-  AstBase(const char *path, size_t line, size_t column, const char *name,
-          const std::string_view &token, size_t position = 0, size_t length = 0,
-          size_t choice_count = 0, size_t choice = 0)
-      : path(path ? path : ""), line(line), column(column), name(name),
-        position(position), length(length), choice_count(choice_count),
-        choice(choice), original_name(name),
-        original_choice_count(choice_count), original_choice(choice),
-        tag(str2tag(name)), original_tag(tag), is_token(true), token(token) {}
-
-  AstBase(const AstBase &ast, const char *original_name, size_t position = 0,
-          size_t length = 0, size_t original_choice_count = 0,
-          size_t original_choise = 0)
-      : path(ast.path), line(ast.line), column(ast.column), name(ast.name),
-        position(position), length(length), choice_count(ast.choice_count),
-        choice(ast.choice), original_name(original_name),
-        original_choice_count(original_choice_count),
-        original_choice(original_choise), tag(ast.tag),
-        original_tag(str2tag(original_name)), is_token(ast.is_token),
-        token(ast.token), nodes(ast.nodes), parent(ast.parent) {}
+// A performance hazard found in a grammar by analyze_grammar().
+struct GrammarHazard {
+  enum class Kind {
+    unused_rule,       // not reachable from the start rule
+    needs_memo,        // matched again at one position, nested in itself
+    shared_prefix,     // alternatives of a choice that start the same way
+    nested_repetition, // repetitions that rescan what they repeat
+    overlapping_first, // alternatives of a choice that start with one byte
+  };
 
-  const std::string path;
-  const size_t line = 1;
-  const size_t column = 1;
+  Kind kind;
+  std::string rule;
+  std::string message;
 
-  const std::string name;
-  size_t position;
-  size_t length;
-  const size_t choice_count;
-  const size_t choice;
-  const std::string original_name;
-  const size_t original_choice_count;
-  const size_t original_choice;
-  const unsigned int tag;
-  const unsigned int original_tag;
+  const char *kind_name() const {
+    switch (kind) {
+    case Kind::unused_rule: return "unused rule";
+    case Kind::needs_memo: return "needs memoization";
+    case Kind::shared_prefix: return "shared prefix";
+    case Kind::nested_repetition: return "nested repetition";
+    case Kind::overlapping_first: return "overlapping first sets";
+    }
+    return "";
+  }
+};
 
-  const bool is_token;
-  const std::string_view token;
+// Writes an operator out in (roughly) the syntax of the grammar.
+struct PrintOpe : public Ope::Visitor {
+  // level: 0 for a choice alternative, 1 for a sequence element, 2 for the
+  // operand of a prefix or suffix; it decides which operators need brackets.
+  void print(Ope &ope, int level) {
+    auto seq = dynamic_cast<Sequence *>(&ope);
+    auto cho = dynamic_cast<PrioritizedChoice *>(&ope);
+    auto brackets = (cho && !cho->for_label_ && level >= 1) ||
+                    (seq && seq->opes_.size() > 1 && level >= 2);
+    if (brackets) { out += '('; }
+    ope.accept(*this);
+    if (brackets) { out += ')'; }
+  }
+
+  void visit(Sequence &ope) override {
+    for (size_t i = 0; i < ope.opes_.size(); i++) {
+      if (i) { out += ' '; }
+      print(*ope.opes_[i], 1);
+    }
+  }
+  void visit(PrioritizedChoice &ope) override {
+    // (a labeled operator is a choice of it and its recovery.)
+    if (ope.for_label_) { return print(*ope.opes_[0], 2); }
+    for (size_t i = 0; i < ope.opes_.size(); i++) {
+      if (i) { out += " / "; }
+      print(*ope.opes_[i], 0);
+    }
+  }
+  void visit(Repetition &ope) override {
+    print(*ope.ope_, 2);
+    auto inf = std::numeric_limits<size_t>::max();
+    if (ope.min_ == 0 && ope.max_ == 1) {
+      out += '?';
+    } else if (ope.min_ <= 1 && ope.max_ == inf) {
+      out += ope.min_ ? '+' : '*';
+    } else {
+      out += '{' + std::to_string(ope.min_) + ',';
+      if (ope.max_ != inf) { out += std::to_string(ope.max_); }
+      out += '}';
+    }
+  }
+  void visit(AndPredicate &ope) override {
+    out += '&';
+    print(*ope.ope_, 2);
+  }
+  void visit(NotPredicate &ope) override {
+    out += '!';
+    print(*ope.ope_, 2);
+  }
+  void visit(Dictionary &ope) override {
+    for (size_t i = 0; i < ope.items_.size(); i++) {
+      if (i) { out += " | "; }
+      quote(ope.items_[i], ope.ignore_case_);
+    }
+  }
+  void visit(LiteralString &ope) override {
+    quote(ope.lit_, ope.ignore_case_);
+  }
+  void visit(CharacterClass &ope) override {
+    out += ope.negated_ ? "[^" : "[";
+    for (const auto &[first, last] : ope.ranges_) {
+      class_char(first);
+      if (last != first) {
+        out += '-';
+        class_char(last);
+      }
+    }
+    out += ']';
+  }
+  void visit(Span &ope) override {
+    if (ope.cls_) {
+      visit(*ope.cls_);
+    } else {
+      out += "(!";
+      quote(ope.lit_, false);
+      out += " .)";
+    }
+    out += ope.min_ ? '+' : '*';
+  }
+  void visit(Character &ope) override { quote(std::string(1, ope.ch_), false); }
+  void visit(AnyCharacter &) override { out += '.'; }
+  void visit(CaptureScope &ope) override {
+    out += "$(";
+    print(*ope.ope_, 0);
+    out += ')';
+  }
+  void visit(Capture &ope) override {
+    out += "$<";
+    print(*ope.ope_, 0);
+    out += '>';
+  }
+  void visit(TokenBoundary &ope) override {
+    out += "< ";
+    print(*ope.ope_, 0);
+    out += " >";
+  }
+  void visit(Ignore &ope) override {
+    out += '~';
+    print(*ope.ope_, 2);
+  }
+  void visit(User &) override { out += "<user>"; }
+  void visit(Native &) override { out += "<native>"; }
+  void visit(WeakHolder &ope) override { ope.weak_.lock()->accept(*this); }
+  void visit(Holder &ope) override { out += ope.outer_->name; }
+  void visit(Reference &ope) override {
+    out += ope.name_;
+    if (!ope.args_.empty()) {
+      out += '(';
+      for (size_t i = 0; i < ope.args_.size(); i++) {
+        if (i) { out += ", "; }
+        print(*ope.args_[i], 0);
+      }
+      out += ')';
+    }
+  }
+  void visit(Whitespace &ope) override { ope.ope_->accept(*this); }
+  void visit(BackReference &ope) override { out += '$' + ope.name_; }
+  void visit(PrecedenceClimbing &ope) override {
+    print(*ope.atom_, 1);
+    out += " (";
+    print(*ope.binop_, 1);
+    out += ' ';
+    print(*ope.atom_, 1);
+    out += ")*";
+  }
+  void visit(Flatten &ope) override {
+    print(*ope.head_, 1);
+    out += ' ' + ope.rule_.name + " / ";
+    print(*ope.base_, 1);
+  }
+  void visit(Recovery &ope) override { ope.ope_->accept(*this); }
+  void visit(Cut &) override { out += u8"↑"; }
+
+  // The text of ope, cut short at about max_len bytes.
+  static std::string text(Ope &ope, size_t max_len = 60) {
+    PrintOpe vis;
+    vis.print(ope, 0);
+    auto &out = vis.out;
+    if (out.size() > max_len) {
+      auto len = max_len - 3;
+      while (len && (static_cast<uint8_t>(out[len]) & 0xC0) == 0x80) {
+        len--;
+      }
+      out.replace(len, std::string::npos, "...");
+    }
+    return out;
+  }
+
+  std::string out;
+
+private:
+  void quote(const std::string &s, bool ignore_case) {
+    out += '\'';
+    for (auto c : escape_characters(s)) {
+      if (c == '\'') { out += '\\'; }
+      out += c;
+    }
+    out += '\'';
+    if (ignore_case) { out += 'i'; }
+  }
+
+  void class_char(char32_t cp) {
+    switch (cp) {
+    case '\n': out += "\\n"; break;
+    case '\r': out += "\\r"; break;
+    case '\t': out += "\\t"; break;
+    case '\\':
+    case ']':
+    case '-':
+    case '^':
+      out += '\\';
+      out += static_cast<char>(cp);
+      break;
+    default: out += encode_codepoint(cp); break;
+    }
+  }
+};
+
+// Whether two operators match the same input the same way; false where that
+// would take more than comparing their structure.
+inline bool same_ope(Ope &a, Ope &b) {
+  if (&a == &b) { return true; }
+  auto same_opes = [](const std::vector<std::shared_ptr<Ope>> &x,
+                      const std::vector<std::shared_ptr<Ope>> &y) {
+    if (x.size() != y.size()) { return false; }
+    for (size_t i = 0; i < x.size(); i++) {
+      if (!same_ope(*x[i], *y[i])) { return false; }
+    }
+    return true;
+  };
+
+  if (auto x = dynamic_cast<Sequence *>(&a)) {
+    auto y = dynamic_cast<Sequence *>(&b);
+    return y && same_opes(x->opes_, y->opes_);
+  }
+  if (auto x = dynamic_cast<PrioritizedChoice *>(&a)) {
+    auto y = dynamic_cast<PrioritizedChoice *>(&b);
+    return y && x->for_label_ == y->for_label_ && same_opes(x->opes_, y->opes_);
+  }
+  if (auto x = dynamic_cast<Repetition *>(&a)) {
+    auto y = dynamic_cast<Repetition *>(&b);
+    return y && x->min_ == y->min_ && x->max_ == y->max_ &&
+           same_ope(*x->ope_, *y->ope_);
+  }
+  if (auto x = dynamic_cast<AndPredicate *>(&a)) {
+    auto y = dynamic_cast<AndPredicate *>(&b);
+    return y && same_ope(*x->ope_, *y->ope_);
+  }
+  if (auto x = dynamic_cast<NotPredicate *>(&a)) {
+    auto y = dynamic_cast<NotPredicate *>(&b);
+    return y && same_ope(*x->ope_, *y->ope_);
+  }
+  if (auto x = dynamic_cast<Dictionary *>(&a)) {
+    auto y = dynamic_cast<Dictionary *>(&b);
+    return y && x->items_ == y->items_ && x->ignore_case_ == y->ignore_case_;
+  }
+  if (auto x = dynamic_cast<LiteralString *>(&a)) {
+    auto y = dynamic_cast<LiteralString *>(&b);
+    return y && x->lit_ == y->lit_ && x->ignore_case_ == y->ignore_case_;
+  }
+  if (auto x = dynamic_cast<CharacterClass *>(&a)) {
+    auto y = dynamic_cast<CharacterClass *>(&b);
+    return y && x->ranges_ == y->ranges_ && x->negated_ == y->negated_;
+  }
+  if (auto x = dynamic_cast<Span *>(&a)) {
+    auto y = dynamic_cast<Span *>(&b);
+    return y && x->min_ == y->min_ && x->lit_ == y->lit_ &&
+           !x->cls_ == !y->cls_ && (!x->cls_ || same_ope(*x->cls_, *y->cls_));
+  }
+  if (auto x = dynamic_cast<Character *>(&a)) {
+    auto y = dynamic_cast<Character *>(&b);
+    return y && x->ch_ == y->ch_;
+  }
+  if (dynamic_cast<AnyCharacter *>(&a)) {
+    return dynamic_cast<AnyCharacter *>(&b) != nullptr;
+  }
+  if (auto x = dynamic_cast<TokenBoundary *>(&a)) {
+    auto y = dynamic_cast<TokenBoundary *>(&b);
+    return y && same_ope(*x->ope_, *y->ope_);
+  }
+  if (auto x = dynamic_cast<Ignore *>(&a)) {
+    auto y = dynamic_cast<Ignore *>(&b);
+    return y && same_ope(*x->ope_, *y->ope_);
+  }
+  if (auto x = dynamic_cast<Whitespace *>(&a)) {
+    auto y = dynamic_cast<Whitespace *>(&b);
+    return y && same_ope(*x->ope_, *y->ope_);
+  }
+  if (auto x = dynamic_cast<Reference *>(&a)) {
+    auto y = dynamic_cast<Reference *>(&b);
+    return y && x->name_ == y->name_ && x->rule_ == y->rule_ &&
+           same_opes(x->args_, y->args_);
+  }
+  if (auto x = dynamic_cast<WeakHolder *>(&a)) {
+    auto y = dynamic_cast<WeakHolder *>(&b);
+    return y && x->weak_.lock() == y->weak_.lock();
+  }
+  return false;
+}
+
+// The rules an operator refers to, and the choices and repetitions in it,
+// without looking into the rules.
+struct CollectReferences : public Ope::Visitor {
+  void visit(Sequence &ope) override {
+    for (auto op : ope.opes_) {
+      op->accept(*this);
+    }
+  }
+  void visit(PrioritizedChoice &ope) override {
+    choices.push_back(&ope);
+    for (auto op : ope.opes_) {
+      op->accept(*this);
+    }
+  }
+  void visit(Repetition &ope) override {
+    repetitions.push_back(&ope);
+    ope.ope_->accept(*this);
+  }
+  void visit(AndPredicate &ope) override { ope.ope_->accept(*this); }
+  void visit(NotPredicate &ope) override { ope.ope_->accept(*this); }
+  void visit(CaptureScope &ope) override { ope.ope_->accept(*this); }
+  void visit(Capture &ope) override { ope.ope_->accept(*this); }
+  void visit(TokenBoundary &ope) override { ope.ope_->accept(*this); }
+  void visit(Ignore &ope) override { ope.ope_->accept(*this); }
+  void visit(Native &ope) override {
+    rules.insert(ope.rules_->begin(), ope.rules_->end());
+  }
+  void visit(Reference &ope) override {
+    if (ope.rule_) { rules.insert(ope.rule_); }
+    for (auto arg : ope.args_) {
+      arg->accept(*this);
+    }
+  }
+  void visit(Whitespace &ope) override { ope.ope_->accept(*this); }
+  void visit(PrecedenceClimbing &ope) override {
+    ope.atom_->accept(*this);
+    ope.binop_->accept(*this);
+  }
+  void visit(Flatten &ope) override {
+    ope.head_->accept(*this);
+    ope.base_->accept(*this);
+  }
+  void visit(Recovery &ope) override { ope.ope_->accept(*this); }
+
+  std::set<const Definition *> rules;
+  std::vector<PrioritizedChoice *> choices;
+  std::vector<Repetition *> repetitions;
+};
+
+// The rules an operator can call at the position it starts matching at.
+struct LeadingRules : public Ope::Visitor {
+  using Memo =
+      std::unordered_map<const Definition *, std::set<const Definition *>>;
+
+  LeadingRules(Memo &memo, ComputeFirstSet &first_set)
+      : memo_(memo), first_set_(first_set) {}
+
+  void visit(Sequence &ope) override { visit_elements(ope.opes_, 0); }
+  void visit(PrioritizedChoice &ope) override {
+    for (auto op : ope.opes_) {
+      op->accept(*this);
+    }
+  }
+  void visit(Repetition &ope) override { ope.ope_->accept(*this); }
+  void visit(AndPredicate &ope) override { ope.ope_->accept(*this); }
+  void visit(NotPredicate &ope) override { ope.ope_->accept(*this); }
+  void visit(CaptureScope &ope) override { ope.ope_->accept(*this); }
+  void visit(Capture &ope) override { ope.ope_->accept(*this); }
+  void visit(TokenBoundary &ope) override { ope.ope_->accept(*this); }
+  void visit(Ignore &ope) override { ope.ope_->accept(*this); }
+  void visit(WeakHolder &ope) override { ope.weak_.lock()->accept(*this); }
+  void visit(Holder &ope) override { ope.ope_->accept(*this); }
+  void visit(Reference &ope) override {
+    auto rule = ope.rule_;
+    if (!rule || ope.is_macro_) { return; }
+    rules.insert(rule);
+    if (!memo_.count(rule)) {
+      // (a rule reached again through itself adds nothing new.)
+      memo_[rule];
+      LeadingRules vis(memo_, first_set_);
+      rule->get_core_operator()->accept(vis);
+      memo_[rule] = std::move(vis.rules);
+    }
+    const auto &leading = memo_[rule];
+    rules.insert(leading.begin(), leading.end());
+  }
+  void visit(Whitespace &ope) override { ope.ope_->accept(*this); }
+  void visit(PrecedenceClimbing &ope) override { ope.atom_->accept(*this); }
+  void visit(Flatten &ope) override {
+    ope.head_->accept(*this);
+    ope.base_->accept(*this);
+  }
+  void visit(Recovery &ope) override { ope.ope_->accept(*this); }
+
+  // Those of the elements of a sequence from the first.
+  void visit_elements(const std::vector<std::shared_ptr<Ope>> &opes,
+                      size_t first) {
+    for (auto i = first; i < opes.size(); i++) {
+      opes[i]->accept(*this);
+      if (!first_set_.get(*opes[i]).nullable) { break; }
+    }
+  }
+
+  std::set<const Definition *> rules;
+
+private:
+  Memo &memo_;
+  ComputeFirstSet &first_set_;
+};
+
+// Looks for performance hazards in a grammar: choices whose alternatives
+// start by matching the same thing (matched again whenever one fails), and
+// rules matched again that way that can contain the choice, which makes
+// nested input take exponential time unless results are memoized;
+// repetitions of what is mostly a repetition, and lookaheads that scan
+// unboundedly on every pass of a repetition; choices whose alternatives can
+// start with the same byte, so that dispatching on it cannot pick one; and
+// rules the start rule cannot reach. Hazards are ordered by rule name.
+inline std::vector<GrammarHazard> analyze_grammar(const Grammar &grammar,
+                                                  const std::string &start) {
+  using Kind = GrammarHazard::Kind;
+  std::vector<GrammarHazard> hazards;
+
+  std::vector<const Definition *> rules;
+  for (const auto &[_, rule] : grammar) {
+    rules.push_back(&rule);
+  }
+  std::sort(rules.begin(), rules.end(),
+            [](const Definition *a, const Definition *b) {
+              return a->name < b->name;
+            });
+
+  std::unordered_map<const Definition *, CollectReferences> contents;
+  for (auto rule : rules) {
+    rule->get_core_operator()->accept(contents[rule]);
+  }
+
+  // Rules reachable from rule (itself included only through a cycle.)
+  std::unordered_map<const Definition *, std::set<const Definition *>>
+      reachable_memo;
+  auto reachable = [&](const Definition *rule)
+      -> const std::set<const Definition *> & {
+    auto it = reachable_memo.find(rule);
+    if (it != reachable_memo.end()) { return it->second; }
+    std::set<const Definition *> seen;
+    std::vector<const Definition *> stack(contents[rule].rules.begin(),
+                                          contents[rule].rules.end());
+    while (!stack.empty()) {
+      auto r = stack.back();
+      stack.pop_back();
+      if (!seen.insert(r).second) { continue; }
+      for (auto next : contents[r].rules) {
+        stack.push_back(next);
+      }
+    }
+    return reachable_memo[rule] = std::move(seen);
+  };
+
+  // Unused rules
+  {
+    std::set<const Definition *> used;
+    for (auto name : {start.c_str(), WHITESPACE_DEFINITION_NAME,
+                      WORD_DEFINITION_NAME}) {
+      auto it = grammar.find(name);
+      if (it == grammar.end()) { continue; }
+      used.insert(&it->second);
+      const auto &more = reachable(&it->second);
+      used.insert(more.begin(), more.end());
+    }
+    for (auto rule : rules) {
+      if (!used.count(rule) && rule->name[0] != '%') {
+        hazards.push_back(GrammarHazard{
+            Kind::unused_rule, rule->name,
+            "the start rule '" + start + "' cannot reach it."});
+      }
+    }
+  }
+
+  ComputeFirstSet::Memo first_set_memo;
+  std::unordered_set<const Definition *> active;
+  ComputeFirstSet first_set(first_set_memo, active);
+  LeadingRules::Memo leading_memo;
+
+  auto elements = [](const std::shared_ptr<Ope> &ope) {
+    if (auto seq = dynamic_cast<Sequence *>(ope.get())) { return seq->opes_; }
+    return std::vector<std::shared_ptr<Ope>>{ope};
+  };
+  auto list = [](const std::vector<size_t> &alternatives) {
+    std::string s;
+    for (size_t i = 0; i < alternatives.size(); i++) {
+      if (i) { s += i + 1 < alternatives.size() ? ", " : " and "; }
+      s += std::to_string(alternatives[i] + 1);
+    }
+    return s;
+  };
+  auto bytes_text = [](const std::bitset<256> &bytes) {
+    if (bytes.all()) { return std::string("any character"); }
+    std::string s;
+    auto byte = [&](size_t b) {
+      if (b < 0x20 || b >= 0x7f) {
+        const char *hex = "0123456789abcdef";
+        s += "\\x";
+        s += hex[b >> 4];
+        s += hex[b & 15];
+      } else {
+        if (b == '\\' || b == ']' || b == '-' || b == '^') { s += '\\'; }
+        s += static_cast<char>(b);
+      }
+    };
+    for (size_t b = 0; b < 256; b++) {
+      if (!bytes.test(b)) { continue; }
+      auto last = b;
+      while (last + 1 < 256 && bytes.test(last + 1)) {
+        last++;
+      }
+      byte(b);
+      if (last > b) {
+        if (last > b + 1) { s += '-'; }
+        byte(last);
+      }
+      b = last;
+    }
+    return bytes.count() == 1 && s.size() == 1 ? "'" + s + "'"
+                                               : "[" + s + "]";
+  };
+
+  for (auto rule : rules) {
+    if (rule->is_macro) { continue; }
+    auto &content = contents[rule];
+
+    std::map<const Definition *, std::vector<size_t>> needs_memo;
+    for (auto choice : content.choices) {
+      const auto &alts = choice->opes_;
+      if (choice->for_label_ || alts.size() < 2) { continue; }
+      auto where = "in `" + PrintOpe::text(*choice) + "`: ";
+
+      std::vector<std::vector<std::shared_ptr<Ope>>> seqs;
+      for (const auto &alt : alts) {
+        seqs.push_back(elements(alt));
+      }
+      auto common = [&](size_t i, size_t j) {
+        size_t k = 0;
+        while (k < seqs[i].size() && k < seqs[j].size() &&
+               same_ope(*seqs[i][k], *seqs[j][k])) {
+          k++;
+        }
+        return k;
+      };
+      auto self_reference = [&](const std::shared_ptr<Ope> &ope) {
+        auto ref = dynamic_cast<Reference *>(ope.get());
+        return ref && ref->rule_ == rule;
+      };
+
+      // Alternatives that each start by matching the same thing as some
+      // earlier one, grouped with it.
+      std::vector<size_t> group(alts.size());
+      for (size_t i = 0; i < alts.size(); i++) {
+        group[i] = i;
+      }
+      for (size_t i = 0; i < alts.size(); i++) {
+        if (group[i] != i) { continue; }
+        std::vector<size_t> members{i};
+        auto prefix = seqs[i].size();
+        for (auto j = i + 1; j < alts.size(); j++) {
+          auto k = common(i, j);
+          if (group[j] != j || k == 0) { continue; }
+          group[j] = i;
+          members.push_back(j);
+          prefix = std::min(prefix, k);
+        }
+        if (members.size() < 2) { continue; }
+
+        // (a left-recursive rule's leading self-reference is its seed,
+        // which is not matched again.)
+        size_t first = 0;
+        if (rule->is_left_recursive && self_reference(seqs[i][0])) { first++; }
+        CollectReferences refs;
+        for (auto k = first; k < prefix; k++) {
+          seqs[i][k]->accept(refs);
+        }
+        auto costly = prefix - first >= 2;
+        for (auto r : refs.rules) {
+          costly = costly || !r->is_token();
+          if (r == rule || reachable(r).count(rule)) {
+            needs_memo.emplace(r, members);
+          }
+        }
+        if (!costly) { continue; }
+
+        Sequence shared(std::vector<std::shared_ptr<Ope>>(
+            seqs[i].begin(), seqs[i].begin() + static_cast<long>(prefix)));
+        hazards.push_back(GrammarHazard{
+            Kind::shared_prefix, rule->name,
+            where + "alternatives " + list(members) +
+                (members.size() == 2 ? " both" : " all") + " start with `" +
+                PrintOpe::text(shared) +
+                "`, which is matched again each time one of them fails; "
+                "factor it out of the choice."});
+      }
+
+      // Rules that two alternatives call at the same position, past what
+      // they share; and first bytes shared by alternatives of different
+      // groups (only ASCII ones, as classes are not decoded.)
+      std::bitset<256> ascii;
+      for (size_t b = 0; b < 0x80; b++) {
+        ascii.set(b);
+      }
+      std::vector<FirstSet> firsts;
+      for (const auto &alt : alts) {
+        firsts.push_back(first_set.get(*alt));
+      }
+      // (alternatives of a left-recursive rule that start with the rule
+      // itself are only tried past its seed, so their first sets here are
+      // not known.)
+      std::vector<bool> seeded(alts.size());
+      for (size_t i = 0; rule->is_left_recursive && i < alts.size(); i++) {
+        LeadingRules leading(leading_memo, first_set);
+        leading.visit_elements(seqs[i], 0);
+        seeded[i] = leading.rules.count(rule) > 0;
+      }
+      std::vector<std::string> overlaps;
+      for (size_t i = 0; i < alts.size(); i++) {
+        for (auto j = i + 1; j < alts.size(); j++) {
+          auto k = common(i, j);
+          LeadingRules a(leading_memo, first_set), b(leading_memo, first_set);
+          a.visit_elements(seqs[i], k);
+          b.visit_elements(seqs[j], k);
+          for (auto r : a.rules) {
+            if (!b.rules.count(r)) { continue; }
+            if (r == rule && rule->is_left_recursive && k == 0) { continue; }
+            if (r == rule || reachable(r).count(rule)) {
+              needs_memo.emplace(r, std::vector<size_t>{i, j});
+            }
+          }
+
+          if (group[i] != i || group[j] != j || seeded[i] || seeded[j]) {
+            continue;
+          }
+          auto x = firsts[i].nullable ? ascii : firsts[i].bytes;
+          auto y = firsts[j].nullable ? ascii : firsts[j].bytes;
+          auto both = x & y & ascii;
+          if (both.any()) {
+            overlaps.push_back(list({i, j}) + " can both start with " +
+                               bytes_text(both));
+          }
+        }
+      }
+      if (!overlaps.empty()) {
+        std::string message = where + "alternatives ";
+        for (size_t i = 0; i < overlaps.size() && i < 3; i++) {
+          if (i) { message += "; "; }
+          message += overlaps[i];
+        }
+        if (overlaps.size() > 3) {
+          message += " (and " + std::to_string(overlaps.size() - 3) +
+                     " more pairs)";
+        }
+        hazards.push_back(GrammarHazard{
+            Kind::overlapping_first, rule->name,
+            message + ", so the next byte does not decide between them."});
+      }
+
+      for (const auto &[r, members] : needs_memo) {
+        auto message = "alternatives " + list(members) + " of `" +
+                       PrintOpe::text(*choice) + "`" +
+                       (members.size() == 2 ? " both" : " all") +
+                       " match it at the same position, ";
+        if (r != rule) {
+          message += "and it can contain '" + rule->name + "', ";
+        }
+        hazards.push_back(GrammarHazard{
+            Kind::needs_memo, r->name,
+            message + "so each level of nesting doubles the work; enable "
+                      "packrat parsing or factor the choice."});
+      }
+      needs_memo.clear();
+    }
+
+    for (auto rep : content.repetitions) {
+      if (rep->max_ <= 1) { continue; }
+
+      // The operand, as a list of elements.
+      auto unwrap = [](std::shared_ptr<Ope> ope) {
+        while (true) {
+          if (auto tok = dynamic_cast<TokenBoundary *>(ope.get())) {
+            ope = tok->ope_;
+          } else if (auto ign = dynamic_cast<Ignore *>(ope.get())) {
+            ope = ign->ope_;
+          } else if (auto cap = dynamic_cast<Capture *>(ope.get())) {
+            ope = cap->ope_;
+          } else if (auto csc = dynamic_cast<CaptureScope *>(ope.get())) {
+            ope = csc->ope_;
+          } else {
+            return ope;
+          }
+        }
+      };
+      auto unbounded = [](const std::shared_ptr<Ope> &ope) {
+        if (dynamic_cast<Span *>(ope.get())) { return true; }
+        auto r = dynamic_cast<Repetition *>(ope.get());
+        return r && r->max_ == std::numeric_limits<size_t>::max();
+      };
+      auto opes = elements(unwrap(rep->ope_));
+
+      std::vector<std::shared_ptr<Ope>> required;
+      for (const auto &op : opes) {
+        if (!first_set.get(*op).nullable) { required.push_back(op); }
+      }
+      if (required.size() == 1 && unbounded(unwrap(required[0]))) {
+        hazards.push_back(GrammarHazard{
+            Kind::nested_repetition, rule->name,
+            "`" + PrintOpe::text(*rep) + "` repeats what is mostly the "
+            "repetition `" + PrintOpe::text(*unwrap(required[0])) +
+            "`, so every pass of one loop enters the other again; write it "
+            "as a single repetition where the parts can be told apart."});
+        continue;
+      }
+
+      for (const auto &op : opes) {
+        auto ope = unwrap(op);
+        std::shared_ptr<Ope> look;
+        if (auto p = dynamic_cast<AndPredicate *>(ope.get())) {
+          look = p->ope_;
+        }
+        if (auto p = dynamic_cast<NotPredicate *>(ope.get())) {
+          look = p->ope_;
+        }
+        if (!look) { continue; }
+        CollectReferences inside;
+        look->accept(inside);
+        auto scans = unbounded(unwrap(look));
+        for (auto r : inside.repetitions) {
+          scans = scans || r->max_ == std::numeric_limits<size_t>::max();
+        }
+        if (!scans) { continue; }
+        hazards.push_back(GrammarHazard{
+            Kind::nested_repetition, rule->name,
+            "the lookahead `" + PrintOpe::text(*ope) + "` in `" +
+                PrintOpe::text(*rep) +
+                "` can scan arbitrarily far on every pass, which takes time "
+                "quadratic in the length of the run."});
+      }
+    }
+  }
+
+  std::stable_sort(hazards.begin(), hazards.end(),
+                   [](const GrammarHazard &a, const GrammarHazard &b) {
+                     return a.rule < b.rule;
+                   });
+  return hazards;
+}
+
+/*-----------------------------------------------------------------------------
+ *  Memory usage
+ *---------------------------------------------------------------------------*/
+
+// Bytes held by operators, estimated from their sizes and the capacities of
+// the containers they own. Operators shared by several rules are counted
+// once; the rules a reference calls are not visited.
+struct MeasureOpe : public Ope::Visitor {
+  template <typename T> bool count(T &ope) {
+    if (!seen.insert(&ope).second) { return false; }
+    bytes += sizeof(T);
+    return true;
+  }
+  template <typename T> size_t vector_bytes(const std::vector<T> &v) {
+    return v.capacity() * sizeof(T);
+  }
+
+  void visit(Sequence &ope) override {
+    if (!count(ope)) { return; }
+    bytes += vector_bytes(ope.opes_);
+    for (auto op : ope.opes_) {
+      op->accept(*this);
+    }
+  }
+  void visit(PrioritizedChoice &ope) override {
+    if (!count(ope)) { return; }
+    bytes += vector_bytes(ope.opes_) + vector_bytes(ope.dispatch_) +
+             vector_bytes(ope.candidates_);
+    for (const auto &ids : ope.candidates_) {
+      bytes += vector_bytes(ids);
+    }
+    for (auto op : ope.opes_) {
+      op->accept(*this);
+    }
+  }
+  void visit(Repetition &ope) override {
+    if (count(ope)) { ope.ope_->accept(*this); }
+  }
+  void visit(AndPredicate &ope) override {
+    if (count(ope)) { ope.ope_->accept(*this); }
+  }
+  void visit(NotPredicate &ope) override {
+    if (count(ope)) { ope.ope_->accept(*this); }
+  }
+  void visit(Dictionary &ope) override {
+    if (!count(ope)) { return; }
+    // (the trie holds about as much again as the items.)
+    bytes += vector_bytes(ope.items_);
+    for (const auto &item : ope.items_) {
+      bytes += 2 * item.capacity();
+    }
+  }
+  void visit(LiteralString &ope) override {
+    if (count(ope)) { bytes += ope.lit_.capacity(); }
+  }
+  void visit(CharacterClass &ope) override {
+    if (count(ope)) {
+      bytes += vector_bytes(ope.ranges_) + vector_bytes(ope.merged_ranges_);
+    }
+  }
+  void visit(Span &ope) override {
+    if (!count(ope)) { return; }
+    bytes += ope.lit_.capacity() + vector_bytes(ope.ranges_);
+    if (ope.cls_) { ope.cls_->accept(*this); }
+  }
+  void visit(Character &ope) override { count(ope); }
+  void visit(AnyCharacter &ope) override { count(ope); }
+  void visit(CaptureScope &ope) override {
+    if (count(ope)) { ope.ope_->accept(*this); }
+  }
+  void visit(Capture &ope) override {
+    if (count(ope)) { ope.ope_->accept(*this); }
+  }
+  void visit(TokenBoundary &ope) override {
+    if (count(ope)) { ope.ope_->accept(*this); }
+  }
+  void visit(Ignore &ope) override {
+    if (count(ope)) { ope.ope_->accept(*this); }
+  }
+  void visit(User &ope) override { count(ope); }
+  void visit(Native &ope) override {
+    if (count(ope) && ope.rules_) { bytes += vector_bytes(*ope.rules_); }
+  }
+  void visit(WeakHolder &ope) override { count(ope); }
+  void visit(Holder &ope) override {
+    if (!count(ope)) { return; }
+    bytes += ope.trace_name_.capacity();
+    if (ope.ope_) { ope.ope_->accept(*this); }
+  }
+  void visit(Reference &ope) override {
+    if (!count(ope)) { return; }
+    bytes += ope.name_.capacity() + vector_bytes(ope.args_);
+    for (auto arg : ope.args_) {
+      arg->accept(*this);
+    }
+  }
+  void visit(Whitespace &ope) override {
+    if (count(ope)) { ope.ope_->accept(*this); }
+  }
+  void visit(BackReference &ope) override {
+    if (count(ope)) { bytes += ope.name_.capacity(); }
+  }
+  void visit(PrecedenceClimbing &ope) override {
+    if (!count(ope)) { return; }
+    bytes += ope.info_.size() *
+             (sizeof(*ope.info_.begin()) + 4 * sizeof(void *));
+    ope.atom_->accept(*this);
+    ope.binop_->accept(*this);
+  }
+  void visit(Flatten &ope) override {
+    if (!count(ope)) { return; }
+    ope.head_->accept(*this);
+    ope.base_->accept(*this);
+  }
+  void visit(Recovery &ope) override {
+    if (count(ope)) { ope.ope_->accept(*this); }
+  }
+  void visit(Cut &ope) override { count(ope); }
+
+  // (the rule itself is counted by grammar_bytes.)
+  void visit_rule(const Definition &rule) {
+    bytes += rule.name.capacity() +
+             rule.definition_ids_.size() * (sizeof(void *) + sizeof(size_t));
+    rule.holder_->accept(*this);
+    if (rule.whitespaceOpe) { rule.whitespaceOpe->accept(*this); }
+    if (rule.wordOpe) { rule.wordOpe->accept(*this); }
+  }
+
+  std::unordered_set<const void *> seen;
+  size_t bytes = 0;
+};
+
+// Bytes held by a grammar: its rules, and the operators they are made of.
+inline size_t grammar_bytes(const Grammar &grammar) {
+  MeasureOpe measure;
+  size_t bytes = grammar.bucket_count() * sizeof(void *);
+  for (const auto &[name, rule] : grammar) {
+    bytes += sizeof(Grammar::value_type) + 2 * sizeof(void *) + name.capacity();
+    measure.visit_rule(rule);
+  }
+  return bytes + measure.bytes;
+}
+
+/*-----------------------------------------------------------------------------
+ *  AST
+ *---------------------------------------------------------------------------*/
+
+template <typename Annotation> struct AstBase : public Annotation {
+  AstBase(const char *path, size_t line, size_t column, const char *name,
+          const std::vector<std::shared_ptr<AstBase>> &nodes,
+          size_t position = 0, size_t length = 0, size_t choice_count = 0,
+          size_t choice = 0)
+      : path(path ? path : ""), line(line), column(column), name(name),
+        position(position), length(length), choice_count(choice_count),
+        choice(choice), original_name(name),
+        original_choice_count(choice_count), original_choice(choice),
+        tag(str2tag(name)), original_tag(tag), is_token(false), nodes(nodes) {}
+
+  AstBase(const char *path, size_t line, size_t column, const char *name,
+          const std::string_view &token, size_t position = 0, size_t length = 0,
+          size_t choice_count = 0, size_t choice = 0)
+      : path(path ? path : ""), line(line), column(column), name(name),
+        position(position), length(length), choice_count(choice_count),
+        choice(choice), original_name(name),
+        original_choice_count(choice_count), original_choice(choice),
+        tag(str2tag(name)), original_tag(tag), is_token(true), token(token) {}
+
+  AstBase(const AstBase &ast, const char *original_name, size_t position = 0,
+          size_t length = 0, size_t original_choice_count = 0,
+          size_t original_choise = 0)
+      : path(ast.path), line(ast.line), column(ast.column), name(ast.name),
+        position(position), length(length), choice_count(ast.choice_count),
+        choice(ast.choice), original_name(original_name),
+        original_choice_count(original_choice_count),
+        original_choice(original_choise), tag(ast.tag),
+        original_tag(str2tag(original_name)), is_token(ast.is_token),
+        token(ast.token), nodes(ast.nodes), parent(ast.parent) {}
+
+  const std::string path;
+  const size_t line = 1;
+  const size_t column = 1;
+
+  const std::string name;
+  size_t position;
+  size_t length;
+  const size_t choice_count;
+  const size_t choice;
+  const std::string original_name;
+  const size_t original_choice_count;
+  const size_t original_choice;
+  const unsigned int tag;
+  const unsigned int original_tag;
+
+  const bool is_token;
+  const std::string_view token;
 
   std::vector<std::shared_ptr<AstBase<Annotation>>> nodes;
   std::weak_ptr<AstBase<Annotation>> parent;
@@ -3952,10 +7029,300 @@ template <typename T = Ast> void add_ast_action(Definition &rule) {
                             std::distance(vs.ss, vs.sv().data()),
                             vs.sv().length(), vs.choice_count(), vs.choice());
 
-    for (auto node : ast->nodes) {
-      node->parent = ast;
-    }
-    return ast;
+    for (auto node : ast->nodes) {
+      node->parent = ast;
+    }
+    return ast;
+  };
+}
+
+// A parse tree held in one table (see parser::enable_flat_ast), a column per
+// field of its nodes. Nodes are in document order, each followed by its
+// descendants, so the root is node 0. Links are node indices, or none. A
+// node's rule indexes names, which point to the names of the grammar's
+// rules. A token rule's node spans its token; other nodes span their match.
+// A node that optimize() put in place of its ancestors keeps the rule of the
+// outermost as its original_rule.
+struct FlatAst {
+  static constexpr uint32_t none = static_cast<uint32_t>(-1);
+
+  std::vector<uint32_t> rule;
+  std::vector<uint32_t> original_rule;
+  std::vector<size_t> offset;
+  std::vector<size_t> length;
+  std::vector<uint32_t> first_child;
+  std::vector<uint32_t> next_sibling;
+  std::vector<uint32_t> parent;
+  std::vector<uint32_t> choice;
+
+  std::vector<const std::string *> names;
+
+  size_t size() const { return rule.size(); }
+
+  const std::string &name(size_t i) const { return *names[rule[i]]; }
+
+  const std::string &original_name(size_t i) const {
+    return *names[original_rule[i]];
+  }
+
+  std::string_view text(size_t i, const char *s) const {
+    return std::string_view(s + offset[i], length[i]);
+  }
+
+  void clear() {
+    for (auto column : {&rule, &original_rule, &first_child, &next_sibling,
+                        &parent, &choice}) {
+      column->clear();
+    }
+    offset.clear();
+    length.clear();
+    children_.clear();
+  }
+
+  // The semantic value of a node's rule while the tree is built.
+  struct Ref {
+    uint32_t index;
+  };
+
+  // Adds a node for the match in vs, its children being the values of vs
+  // that are nodes. Matches that are backtracked over leave their nodes in
+  // the table until finish().
+  Ref add(uint32_t rule_index, const SemanticValues &vs, bool is_token) {
+    auto sv = is_token ? vs.token() : vs.sv();
+    rule.push_back(rule_index);
+    original_rule.push_back(rule_index);
+    offset.push_back(static_cast<size_t>(sv.data() - vs.ss));
+    length.push_back(sv.size());
+    choice.push_back(static_cast<uint32_t>(vs.choice()));
+    // (the children, until finish() links them.)
+    first_child.push_back(static_cast<uint32_t>(children_.size()));
+    for (const auto &val : vs) {
+      if (auto ref = val.get_if<Ref>()) { children_.push_back(ref->index); }
+    }
+    next_sibling.push_back(
+        static_cast<uint32_t>(children_.size() - first_child.back()));
+    parent.push_back(none);
+    return Ref{static_cast<uint32_t>(rule.size() - 1)};
+  }
+
+  // Keeps only the tree under root (or nothing, for none), putting its
+  // nodes in document order and linking them.
+  void finish(uint32_t root) {
+    FlatAst built;
+    built.names = std::move(names);
+    std::vector<std::pair<uint32_t, uint32_t>> stack; // (node, new parent)
+    if (root != none) { stack.emplace_back(root, none); }
+    std::vector<uint32_t> last_child;
+    while (!stack.empty()) {
+      auto [i, up] = stack.back();
+      stack.pop_back();
+
+      auto node = static_cast<uint32_t>(built.size());
+      built.rule.push_back(rule[i]);
+      built.original_rule.push_back(original_rule[i]);
+      built.offset.push_back(offset[i]);
+      built.length.push_back(length[i]);
+      built.choice.push_back(choice[i]);
+      built.first_child.push_back(none);
+      built.next_sibling.push_back(none);
+      built.parent.push_back(up);
+      last_child.push_back(none);
+      if (up != none) {
+        if (last_child[up] == none) {
+          built.first_child[up] = node;
+        } else {
+          built.next_sibling[last_child[up]] = node;
+        }
+        last_child[up] = node;
+      }
+
+      for (auto j = first_child[i] + next_sibling[i]; j-- > first_child[i];) {
+        stack.emplace_back(children_[j], node);
+      }
+    }
+    *this = std::move(built);
+  }
+
+  // Replaces each node that has a single child, and whose rule is marked in
+  // collapse, with that child (as AstOptimizer does), relinking the table
+  // in place.
+  void optimize(const std::vector<bool> &collapse) {
+    std::vector<bool> dropped(size());
+    for (size_t i = 0; i < size(); i++) {
+      dropped[i] = collapse[rule[i]] && first_child[i] != none &&
+                   next_sibling[first_child[i]] == none;
+    }
+
+    // Links of the nodes kept, as old indices. A chain of dropped nodes
+    // leads to just one kept node, so this is linear; dropped nodes are
+    // only read, so their links stay intact until compaction.
+    std::vector<uint32_t> index(size());
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < size(); i++) {
+      if (dropped[i]) {
+        index[i] = none;
+        continue;
+      }
+      index[i] = kept++;
+
+      auto top = i;
+      while (parent[top] != none && dropped[parent[top]]) {
+        top = parent[top];
+      }
+      auto replacement = [&](uint32_t j) {
+        while (j != none && dropped[j]) {
+          j = first_child[j];
+        }
+        return j;
+      };
+      original_rule[i] = original_rule[top];
+      parent[i] = parent[top];
+      next_sibling[i] = replacement(next_sibling[top]);
+      first_child[i] = replacement(first_child[i]);
+    }
+
+    auto relink = [&](uint32_t j) { return j == none ? none : index[j]; };
+    for (uint32_t i = 0; i < size(); i++) {
+      auto j = index[i];
+      if (j == none) { continue; }
+      rule[j] = rule[i];
+      original_rule[j] = original_rule[i];
+      offset[j] = offset[i];
+      length[j] = length[i];
+      choice[j] = choice[i];
+      first_child[j] = relink(first_child[i]);
+      next_sibling[j] = relink(next_sibling[i]);
+      parent[j] = relink(parent[i]);
+    }
+    for (auto column : {&rule, &original_rule, &first_child, &next_sibling,
+                        &parent, &choice}) {
+      column->resize(kept);
+    }
+    offset.resize(kept);
+    length.resize(kept);
+  }
+
+  // Writes the table in a binary format that read() takes back, names
+  // included. Offsets and lengths are 64-bit; byte order is the host's.
+  void write(std::ostream &os) const {
+    os.write(magic_, sizeof(magic_));
+    write_value(os, static_cast<uint64_t>(size()));
+    write_value(os, static_cast<uint32_t>(names.size()));
+    for (auto name : names) {
+      write_value(os, static_cast<uint32_t>(name->size()));
+      os.write(name->data(), static_cast<std::streamsize>(name->size()));
+    }
+    for (auto column : {&rule, &original_rule, &first_child, &next_sibling,
+                        &parent, &choice}) {
+      write_column(os, *column);
+    }
+    write_column(os, std::vector<uint64_t>(offset.begin(), offset.end()));
+    write_column(os, std::vector<uint64_t>(length.begin(), length.end()));
+  }
+
+  // Reads a table written by write() for a text of text_size bytes,
+  // pointing its names to those of the grammar's rules. False, leaving the
+  // table empty, if the data is not such a table (truncated, or with links
+  // or spans out of range), or names a rule that the grammar lacks.
+  bool read(std::istream &is, const Grammar &grammar, size_t text_size) {
+    clear();
+    names.clear();
+    if (read_table(is, grammar, text_size)) { return true; }
+    clear();
+    names.clear();
+    return false;
+  }
+
+private:
+  static constexpr char magic_[8] = {'P', 'E', 'G', 'F', 'L', 'A', 'T', 1};
+
+  template <typename T> static void write_value(std::ostream &os, T val) {
+    os.write(reinterpret_cast<const char *>(&val), sizeof(val));
+  }
+
+  template <typename T> static bool read_value(std::istream &is, T &val) {
+    return !!is.read(reinterpret_cast<char *>(&val), sizeof(val));
+  }
+
+  template <typename T>
+  static void write_column(std::ostream &os, const std::vector<T> &column) {
+    os.write(reinterpret_cast<const char *>(column.data()),
+             static_cast<std::streamsize>(column.size() * sizeof(T)));
+  }
+
+  bool read_table(std::istream &is, const Grammar &grammar,
+                  size_t text_size) {
+    char magic[sizeof(magic_)];
+    uint64_t count;
+    uint32_t name_count;
+    if (!is.read(magic, sizeof(magic)) ||
+        std::memcmp(magic, magic_, sizeof(magic)) != 0 ||
+        !read_value(is, count) || !read_value(is, name_count) ||
+        count >= none) {
+      return false;
+    }
+    for (uint32_t i = 0; i < name_count; i++) {
+      uint32_t len;
+      if (!read_value(is, len) || len > remaining(is)) { return false; }
+      std::string name(len, '\0');
+      if (!is.read(&name[0], len)) { return false; }
+      auto it = grammar.find(name);
+      if (it == grammar.end()) { return false; }
+      names.push_back(&it->first);
+    }
+
+    // (the columns are only allocated for as many nodes as the data holds.)
+    const auto node_bytes = 6 * sizeof(uint32_t) + 2 * sizeof(uint64_t);
+    auto n = static_cast<size_t>(count);
+    if (n > remaining(is) / node_bytes) { return false; }
+    for (auto column : {&rule, &original_rule, &first_child, &next_sibling,
+                        &parent, &choice}) {
+      if (!read_column(is, *column, n)) { return false; }
+    }
+    std::vector<uint64_t> offsets, lengths;
+    if (!read_column(is, offsets, n) || !read_column(is, lengths, n)) {
+      return false;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+      auto link = [&](uint32_t j) { return j == none || j < n; };
+      if (rule[i] >= name_count || original_rule[i] >= name_count ||
+          !link(first_child[i]) || !link(next_sibling[i]) ||
+          !link(parent[i]) || offsets[i] > text_size ||
+          lengths[i] > text_size - offsets[i]) {
+        return false;
+      }
+    }
+    offset.assign(offsets.begin(), offsets.end());
+    length.assign(lengths.begin(), lengths.end());
+    return true;
+  }
+
+  // Bytes left to read in the stream (0 if it cannot tell.)
+  static size_t remaining(std::istream &is) {
+    auto pos = is.tellg();
+    if (pos < 0 || !is.seekg(0, std::ios::end)) { return 0; }
+    auto end = is.tellg();
+    is.seekg(pos);
+    return end < pos ? 0 : static_cast<size_t>(end - pos);
+  }
+
+  template <typename T>
+  static bool read_column(std::istream &is, std::vector<T> &column, size_t n) {
+    column.resize(n);
+    return !!is.read(reinterpret_cast<char *>(column.data()),
+                     static_cast<std::streamsize>(n * sizeof(T)));
+  }
+
+  std::vector<uint32_t> children_;
+};
+
+// Builds a FlatAst in dt (a FlatAst *) for matches of the rule, whose index
+// in the AST's names is rule_index.
+inline void add_flat_ast_action(Definition &rule, uint32_t rule_index) {
+  rule.flat_ast_action = [&rule, rule_index](const SemanticValues &vs,
+                                             std::any &dt) {
+    return std::any_cast<FlatAst *>(dt)->add(rule_index, vs, rule.is_token());
   };
 }
 
@@ -4129,6 +7496,16 @@ public:
     return load_grammar(sv.data(), sv.size());
   }
 
+  // Uses an already built grammar (e.g. one emitted by peggml_codegen.)
+  bool load_grammar(const std::shared_ptr<Grammar> &grammar,
+                    const std::string &start,
+                    bool enablePackratParsing = true) {
+    grammar_ = grammar;
+    start_ = start;
+    enablePackratParsing_ = enablePackratParsing;
+    return grammar_ != nullptr;
+  }
+
   bool parse_n(const char *s, size_t n, const char *path = nullptr) const {
     if (grammar_ != nullptr) {
       const auto &rule = (*grammar_)[start_];
@@ -4212,6 +7589,100 @@ public:
       auto &rule = (*grammar_)[start_];
       rule.tracer_enter = tracer_enter;
       rule.tracer_leave = tracer_leave;
+      rule.instrumentation = rule.instrumentation | Instrumentation::trace;
+    }
+  }
+
+  // Chooses what parses record; a parse with Instrumentation::off skips
+  // the tracer callbacks, profile and trace even if they are set.
+  void set_instrumentation(Instrumentation instrumentation) {
+    if (grammar_ != nullptr) {
+      auto &rule = (*grammar_)[start_];
+      rule.instrumentation = instrumentation;
+    }
+  }
+
+  Instrumentation instrumentation() const {
+    if (grammar_ == nullptr) { return Instrumentation::off; }
+    return (*grammar_)[start_].instrumentation;
+  }
+
+  // Limits rule nesting; deeper input fails to parse (0: no limit.)
+  void set_max_depth(size_t max_depth) {
+    if (grammar_ != nullptr) {
+      auto &rule = (*grammar_)[start_];
+      rule.max_depth = max_depth;
+    }
+  }
+
+  void set_stack_guard(StackGuard stack_guard) {
+    if (grammar_ != nullptr) {
+      auto &rule = (*grammar_)[start_];
+      rule.stack_guard = stack_guard;
+    }
+  }
+
+  // Parses reuse (and add to) the results in memo, which the caller keeps
+  // in step with edits to the text (see Memo::edit; nullptr: no memo.)
+  // Refused (false, and no memo) if the grammar has captures or back
+  // references: a result reused at a new position would neither see the
+  // captures made before it nor make its own.
+  bool set_memo(Memo *memo) {
+    if (grammar_ == nullptr) { return false; }
+    auto &rule = (*grammar_)[start_];
+    if (memo && uses_captures()) {
+      rule.memo = nullptr;
+      return false;
+    }
+    rule.memo = memo;
+    return true;
+  }
+
+  // Whether the rules the start rule reaches capture text or refer back to
+  // captures.
+  bool uses_captures() const {
+    if (grammar_ == nullptr) { return false; }
+    const auto &rule = (*grammar_)[start_];
+    rule.initialize_definition_ids();
+    return rule.uses_captures_;
+  }
+
+  // Parses count and time the invocations of each rule in profile (see
+  // Profile; nullptr: no profiling.) Set Instrumentation::counters first
+  // to count them only.
+  void set_profile(Profile *profile) {
+    if (grammar_ != nullptr) {
+      auto &rule = (*grammar_)[start_];
+      rule.profile = profile;
+      auto counted = Instrumentation::profile | Instrumentation::counters;
+      if (!profile) {
+        rule.instrumentation = rule.instrumentation & ~counted;
+      } else if (!has(rule.instrumentation, counted)) {
+        rule.instrumentation = rule.instrumentation | Instrumentation::profile;
+      }
+    }
+  }
+
+  // Parses record their rule invocations in trace (see Trace; nullptr: no
+  // tracing.)
+  void set_trace(Trace *trace) {
+    if (grammar_ != nullptr) {
+      auto &rule = (*grammar_)[start_];
+      rule.trace = trace;
+      if (trace) {
+        rule.instrumentation = rule.instrumentation | Instrumentation::trace;
+      } else if (!rule.tracer_enter) {
+        rule.instrumentation = rule.instrumentation & ~Instrumentation::trace;
+      }
+    }
+  }
+
+  // Parses measure the memory their state held into memory as they end
+  // (see ParseMemory; nullptr: not measured.)
+  void set_parse_memory(ParseMemory *memory) {
+    if (grammar_ != nullptr) {
+      auto &rule = (*grammar_)[start_];
+      rule.memory = memory;
     }
   }
 
@@ -4222,12 +7693,81 @@ public:
     return *this;
   }
 
+  // Makes every rule add nodes to a FlatAst, which parse(sv, FlatAst &)
+  // returns: one table, rather than a node allocation per match. That parse
+  // calls no other actions. Rules are numbered by name.
+  parser &enable_flat_ast() {
+    flat_ast_names_.clear();
+    for (auto &[name, _] : *grammar_) {
+      flat_ast_names_.push_back(&name);
+    }
+    std::sort(
+        flat_ast_names_.begin(), flat_ast_names_.end(),
+        [](const std::string *a, const std::string *b) { return *a < *b; });
+    for (size_t i = 0; i < flat_ast_names_.size(); i++) {
+      auto &rule = (*grammar_)[*flat_ast_names_[i]];
+      add_flat_ast_action(rule, static_cast<uint32_t>(i));
+    }
+    return *this;
+  }
+
+  bool flat_ast_enabled() const { return !flat_ast_names_.empty(); }
+
+  bool parse_n(const char *s, size_t n, FlatAst &ast,
+               const char *path = nullptr) const {
+    ast.clear();
+    ast.names = flat_ast_names_;
+    std::any dt = &ast;
+    FlatAst::Ref root{FlatAst::none};
+    auto ret = false;
+    if (grammar_ != nullptr) {
+      const auto &rule = (*grammar_)[start_];
+      ret = post_process(s, n,
+                         rule.parse_flat_ast(s, n, dt, root, path, log));
+    }
+    ast.finish(ret ? root.index : FlatAst::none);
+    return ret;
+  }
+
+  bool parse(std::string_view sv, FlatAst &ast,
+             const char *path = nullptr) const {
+    return parse_n(sv.data(), sv.size(), ast, path);
+  }
+
   template <typename T>
   std::shared_ptr<T> optimize_ast(std::shared_ptr<T> ast,
                                   bool opt_mode = true) const {
     return AstOptimizer(opt_mode, get_no_ast_opt_rules()).optimize(ast);
   }
 
+  // Performance hazards in the grammar (see analyze_grammar.)
+  std::vector<GrammarHazard> analyze() const {
+    if (grammar_ == nullptr) { return {}; }
+    return analyze_grammar(*grammar_, start_);
+  }
+
+  // Bytes held by the grammar's rules and operators (estimated.)
+  size_t grammar_bytes() const {
+    return grammar_ != nullptr ? peg::grammar_bytes(*grammar_) : 0;
+  }
+
+  // Reads a flat AST written by FlatAst::write() for this grammar, and a
+  // text of text_size bytes.
+  bool read_flat_ast(std::istream &is, FlatAst &ast,
+                     size_t text_size) const {
+    return grammar_ != nullptr && ast.read(is, *grammar_, text_size);
+  }
+
+  // Collapses the single-child nodes of a flat AST in place, with the same
+  // choice of rules as AstOptimizer.
+  void optimize_ast(FlatAst &ast, bool opt_mode = true) const {
+    std::vector<bool> collapse;
+    for (auto name : ast.names) {
+      collapse.push_back(opt_mode != (*grammar_)[*name].no_ast_opt);
+    }
+    ast.optimize(collapse);
+  }
+
   Log log;
 
 private:
@@ -4249,6 +7789,711 @@ private:
   std::shared_ptr<Grammar> grammar_;
   std::string start_;
   bool enablePackratParsing_ = false;
+  std::vector<const std::string *> flat_ast_names_;
+
+  friend class Stream;
+  friend class ParallelParser;
+  friend class ParseCache;
+};
+
+/*-----------------------------------------------------------------------------
+ *  Stream
+ *---------------------------------------------------------------------------*/
+
+// Parses input that arrives in chunks, for a grammar whose start rule is
+// `Element*` (or `Element* !.`). Elements are parsed as data arrives. One
+// that looked at the end of the data so far might still change, so it waits
+// for the next chunk; the others are complete, and go to the handler with
+// their offset in the input. Input before the first incomplete element is
+// released, so only that element is buffered. Packrat parsing is not used.
+class Stream {
+public:
+  using Handler = std::function<void(Value &val, size_t offset, size_t len)>;
+
+  Stream(const parser &p, Handler handler, size_t max_buffer = 1 << 24)
+      : handler_(handler), max_buffer_(max_buffer), log_(p.log) {
+    if (p.grammar_ != nullptr) {
+      start_ = &(*p.grammar_)[p.start_];
+      element_ = element_rule(*p.grammar_, *start_);
+    }
+  }
+
+  // Whether the grammar can be streamed.
+  operator bool() const { return element_ != nullptr; }
+
+  // Adds input and parses the elements it completes (false on an error.)
+  bool feed(const char *s, size_t n) {
+    buffer_.append(s, n);
+    return parse(false);
+  }
+
+  // Parses the rest of the input, which must be whole elements.
+  bool finish() { return parse(true) && buffer_.empty(); }
+
+  // The input not yet parsed, and its offset in the whole input.
+  const std::string &buffer() const { return buffer_; }
+  size_t offset() const { return offset_; }
+
+  // The element rule of a start rule that can be streamed, or nullptr.
+  // Back references are not allowed, as they could see captures made by
+  // earlier elements, whose input is gone.
+  static const Definition *element_rule(const Grammar &grammar,
+                                        const Definition &start) {
+    auto ope = start.get_core_operator();
+    if (auto seq = dynamic_cast<Sequence *>(ope.get())) {
+      if (seq->opes_.size() != 2) { return nullptr; }
+      auto eoi = dynamic_cast<NotPredicate *>(seq->opes_[1].get());
+      if (!eoi || !dynamic_cast<AnyCharacter *>(eoi->ope_.get())) {
+        return nullptr;
+      }
+      ope = seq->opes_[0];
+    }
+
+    auto rep = dynamic_cast<Repetition *>(ope.get());
+    if (!rep || rep->min_ != 0 ||
+        rep->max_ != std::numeric_limits<size_t>::max()) {
+      return nullptr;
+    }
+    auto ref = dynamic_cast<Reference *>(rep->ope_.get());
+    if (!ref || !ref->rule_ || ref->rule_->is_macro) { return nullptr; }
+
+    for (auto &[_, rule] : grammar) {
+      if (HasBackReference::check(*rule.get_core_operator())) {
+        return nullptr;
+      }
+    }
+    return ref->rule_;
+  }
+
+private:
+  bool parse(bool final) {
+    if (failed_) { return false; }
+
+    const auto &start = *start_;
+    start.initialize_definition_ids();
+
+    const auto s = buffer_.data();
+    const auto n = buffer_.size();
+    Context c(nullptr, s, n, start.definition_ids_.size(), start.whitespaceOpe,
+              start.wordOpe, false, start.tracer_enter, start.tracer_leave,
+              log_);
+    c.max_depth = start.max_depth;
+    c.stack_guard = start.stack_guard;
+    c.instrument(start.instrumentation, start.profile, start.trace);
+    c.uses_captures = start.uses_captures_;
+    std::any dt;
+
+    size_t pos = 0;
+    // Parses ope at pos; false if it looked at the end of the data so far.
+    auto complete = [&](const Ope &ope, SemanticValues &vs, size_t &len) {
+      c.examined = s + pos;
+      len = ope.parse(s + pos, n - pos, vs, c, dt);
+      return final || c.examined <= s + n;
+    };
+
+    auto ok = true;
+    if (!started_ && start.whitespaceOpe) {
+      SemanticValues vs;
+      size_t len;
+      if (complete(*start.whitespaceOpe, vs, len)) {
+        if (success(len)) { pos += len; }
+        started_ = true;
+      }
+    } else {
+      started_ = true;
+    }
+
+    while (started_ && pos < n) {
+      SemanticValues vs;
+      size_t len;
+      if (!complete(*element_->holder_, vs, len)) { break; }
+      if (fail(len) || len == 0) {
+        ok = false;
+        break;
+      }
+      Value val;
+      if (!vs.empty()) { val = std::move(vs.front()); }
+      handler_(val, offset_ + pos, len);
+      pos += len;
+    }
+
+    if (!ok && log_) { c.error_info.output_log(log_, s, n); }
+
+    buffer_.erase(0, pos);
+    offset_ += pos;
+
+    if (ok && buffer_.size() > max_buffer_) {
+      if (log_) { log_(1, 1, "element is longer than the stream buffer"); }
+      ok = false;
+    }
+
+    failed_ = !ok;
+    return ok;
+  }
+
+  const Definition *start_ = nullptr;
+  const Definition *element_ = nullptr;
+  Handler handler_;
+  size_t max_buffer_;
+  Log log_;
+
+  std::string buffer_;
+  size_t offset_ = 0;
+  bool started_ = false; // (leading whitespace skipped)
+  bool failed_ = false;
+};
+
+/*-----------------------------------------------------------------------------
+ *  ParallelParser
+ *---------------------------------------------------------------------------*/
+
+// Parses a text on several threads, for a grammar whose start rule is
+// `Record*` (or `Record* !.`), Record being the named split rule. The text
+// is cut into one chunk per thread, each cut just after an occurrence of the
+// resync string found from an evenly spaced offset, and every chunk is parsed
+// record by record with its actions put off (see Reduction); where a record
+// fails to match, the chunk carries on after the next resync string. The
+// chunks are then stitched together on the calling thread: a chunk's records
+// are taken from one that starts where the previous record ended, and if
+// none does (a cut fell inside a record), records are parsed again from
+// there until one lines up. Only then are the actions of the records taken
+// called, in document order, and each record goes to the handler with its
+// offset in the text.
+//
+// The chunks are parsed without packrat parsing, the stack guard, or the
+// tracer, so enter and leave handlers must be safe to call from several
+// threads. Every action the parse of a record made is called, those of
+// matches that were backtracked over included, and an action that rejects
+// its match (with parse_error) fails the parse.
+//
+// The worker threads are started by the first parse and kept, waiting for
+// the next one, until the parser is destroyed.
+class ParallelParser {
+public:
+  using Handler = Stream::Handler;
+
+  ParallelParser(const parser &p, const std::string &split_rule,
+                 std::string resync, Handler handler, size_t threads = 0)
+      : resync_(std::move(resync)), handler_(handler), log_(p.log) {
+    threads_ = threads ? threads
+                       : std::max(1u, std::thread::hardware_concurrency());
+    if (p.grammar_ != nullptr && !resync_.empty()) {
+      start_ = &(*p.grammar_)[p.start_];
+      auto element = Stream::element_rule(*p.grammar_, *start_);
+      if (element && element->name == split_rule) { element_ = element; }
+    }
+  }
+
+  ParallelParser(const ParallelParser &) = delete;
+  ParallelParser &operator=(const ParallelParser &) = delete;
+
+  ~ParallelParser() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    wake_.notify_all();
+    for (auto &worker : workers_) {
+      worker.join();
+    }
+  }
+
+  // Whether the grammar can be parsed in parallel with this split rule.
+  operator bool() const { return element_ != nullptr; }
+
+  bool parse(const char *s, size_t n, const char *path = nullptr);
+
+  bool parse(std::string_view sv, const char *path = nullptr) {
+    return parse(sv.data(), sv.size(), path);
+  }
+
+  // Bytes of records parsed again on the calling thread by the last parse,
+  // because a cut fell inside a record.
+  size_t reparsed() const { return reparsed_; }
+
+private:
+  struct Record {
+    size_t pos;
+    size_t len;
+    Value val;
+    size_t reductions; // (index of its first)
+  };
+
+  struct Chunk {
+    size_t begin;
+    size_t end;
+    size_t stop = 0; // where parsing the chunk ended
+    std::vector<Record> records;
+    std::vector<size_t> failures; // positions where no record matched
+    std::vector<Reduction> reductions;
+  };
+
+  void parse_chunk(Chunk &chunk, const char *s, size_t n) const;
+
+  bool replay(Chunk &chunk, size_t first, size_t last, Context &c,
+              std::any &dt) const;
+
+  void run(size_t count, const std::function<void(size_t)> &task);
+
+  void work();
+
+  size_t skip_whitespace(const char *s, size_t n, size_t pos, Context &c,
+                         std::any &dt) const {
+    if (start_->whitespaceOpe) {
+      SemanticValues vs;
+      auto len = start_->whitespaceOpe->parse(s + pos, n - pos, vs, c, dt);
+      if (success(len)) { pos += len; }
+    }
+    return pos;
+  }
+
+  const Definition *start_ = nullptr;
+  const Definition *element_ = nullptr;
+  std::string resync_;
+  Handler handler_;
+  size_t threads_;
+  Log log_;
+
+  size_t reparsed_ = 0;
+
+  std::vector<std::thread> workers_;
+  std::mutex mutex_;
+  std::condition_variable wake_; // (a task was posted, or stopping_ set)
+  std::condition_variable done_; // (the last task of a run finished)
+  const std::function<void(size_t)> *task_ = nullptr;
+  size_t next_ = 0;  // (the next task to be taken)
+  size_t count_ = 0; // (tasks in the run)
+  size_t left_ = 0;  // (tasks posted to the workers, not finished yet)
+  bool stopping_ = false;
+};
+
+inline bool ParallelParser::parse(const char *s, size_t n, const char *path) {
+  const auto &start = *start_;
+  start.initialize_definition_ids();
+  reparsed_ = 0;
+
+  Context c(path, s, n, start.definition_ids_.size(), start.whitespaceOpe,
+            start.wordOpe, false, start.tracer_enter, start.tracer_leave,
+            log_);
+  c.max_depth = start.max_depth;
+  c.stack_guard = start.stack_guard;
+  // (the chunks are parsed on several threads, so only the tracer callbacks
+  // are called.)
+  c.instrument(start.instrumentation, nullptr, nullptr);
+  c.uses_captures = start.uses_captures_;
+  std::any dt;
+
+  auto pos = skip_whitespace(s, n, 0, c, dt);
+
+  std::vector<Chunk> chunks;
+  const std::string_view text(s, n);
+  for (size_t k = 1, begin = pos; k <= threads_ && begin < n; k++) {
+    auto end = n;
+    if (k < threads_) {
+      auto at = text.find(resync_, std::max(begin, n / threads_ * k));
+      if (at != std::string_view::npos) { end = at + resync_.size(); }
+    }
+    chunks.push_back(Chunk{begin, end, 0, {}, {}, {}});
+    begin = end;
+  }
+
+  run(chunks.size(), [&](size_t k) { parse_chunk(chunks[k], s, n); });
+
+  auto ok = true;
+  size_t k = 0;
+  while (ok && pos < n) {
+    while (k < chunks.size() && chunks[k].stop <= pos) {
+      k++;
+    }
+
+    // A record that starts where the previous one ended is the one the
+    // parse would match there, and so are the records following it.
+    if (k < chunks.size()) {
+      auto &chunk = chunks[k];
+      auto &records = chunk.records;
+      auto it = std::lower_bound(
+          records.begin(), records.end(), pos,
+          [](const Record &record, size_t pos) { return record.pos < pos; });
+      if (it != records.end() && it->pos == pos) {
+        auto first = static_cast<size_t>(it - records.begin());
+        auto last = first;
+        while (last < records.size() && records[last].pos == pos) {
+          pos += records[last++].len;
+        }
+        ok = replay(chunk, first, last, c, dt);
+        if (std::binary_search(chunk.failures.begin(), chunk.failures.end(),
+                               pos)) {
+          break;
+        }
+        continue;
+      }
+    }
+
+    SemanticValues vs;
+    auto len = element_->holder_->parse(s + pos, n - pos, vs, c, dt);
+    if (fail(len) || len == 0) { break; }
+    Value val;
+    if (!vs.empty()) { val = std::move(vs.front()); }
+    handler_(val, pos, len);
+    pos += len;
+    reparsed_ += len;
+  }
+
+  if (ok && pos < n && log_) {
+    // The record at pos failed in a chunk; match it again for the error,
+    // without calling actions.
+    std::vector<Reduction> reductions;
+    c.reductions = &reductions;
+    SemanticValues vs;
+    element_->holder_->parse(s + pos, n - pos, vs, c, dt);
+    c.reductions = nullptr;
+  }
+
+  ok = ok && pos == n;
+  if (!ok && log_) { c.error_info.output_log(log_, s, n); }
+  return ok;
+}
+
+// Calls task(k) for every k in [0, count): task(0) on the calling thread,
+// the others on the workers, starting those that are missing. Returns when
+// all have finished.
+inline void ParallelParser::run(size_t count,
+                                const std::function<void(size_t)> &task) {
+  if (count == 0) { return; }
+  while (workers_.size() + 1 < count) {
+    workers_.emplace_back([this]() { work(); });
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    task_ = &task;
+    next_ = 1;
+    count_ = count;
+    left_ = count - 1;
+  }
+  wake_.notify_all();
+  task(0);
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_.wait(lock, [&]() { return left_ == 0; });
+  task_ = nullptr;
+}
+
+// The loop of a worker thread: takes the tasks of each run until the parser
+// is destroyed.
+inline void ParallelParser::work() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    wake_.wait(lock, [&]() { return stopping_ || next_ < count_; });
+    if (stopping_) { return; }
+    auto k = next_++;
+    lock.unlock();
+    (*task_)(k);
+    lock.lock();
+    if (--left_ == 0) { done_.notify_one(); }
+  }
+}
+
+// Parses the records of a chunk from its start until one ends at or past
+// the chunk's end. A record that fails to match may have been cut, so
+// parsing resumes after the next resync string.
+inline void ParallelParser::parse_chunk(Chunk &chunk, const char *s,
+                                        size_t n) const {
+  const auto &start = *start_;
+  Context c(nullptr, s, n, start.definition_ids_.size(), start.whitespaceOpe,
+            start.wordOpe, false, nullptr, nullptr, nullptr);
+  c.max_depth = start.max_depth;
+  c.uses_captures = start.uses_captures_;
+  c.reductions = &chunk.reductions;
+  std::any dt;
+
+  const std::string_view text(s, n);
+  auto pos = skip_whitespace(s, n, chunk.begin, c, dt);
+  while (pos < chunk.end) {
+    auto first = chunk.reductions.size();
+    SemanticValues vs;
+    auto len = element_->holder_->parse(s + pos, n - pos, vs, c, dt);
+    if (fail(len) || len == 0) {
+      chunk.reductions.resize(first);
+      chunk.failures.push_back(pos);
+      auto at = text.find(resync_, pos);
+      if (at == std::string_view::npos) { break; }
+      pos = skip_whitespace(s, n, at + resync_.size(), c, dt);
+      continue;
+    }
+    Value val;
+    if (!vs.empty()) { val = std::move(vs.front()); }
+    chunk.records.push_back(Record{pos, len, std::move(val), first});
+    pos += len;
+  }
+  chunk.stop = pos;
+}
+
+// Calls every put-off action made while parsing the records of chunk in
+// [first, last), and hands the records to the handler.
+inline bool ParallelParser::replay(Chunk &chunk, size_t first, size_t last,
+                                   Context &c, std::any &dt) const {
+  auto &reductions = chunk.reductions;
+  const auto begin = chunk.records[first].reductions;
+  const auto end = last < chunk.records.size() ? chunk.records[last].reductions
+                                               : reductions.size();
+
+  // Every reduction is called, as the parse would have: those whose values
+  // are dropped (by a rule without an action) too. A value is copied to all
+  // but its last use.
+  std::vector<size_t> uses(end - begin);
+  auto use = [&](const Value &val) {
+    if (auto ref = val.get_if<Reduction::Ref>()) {
+      uses[ref->index - begin]++;
+    }
+  };
+  for (auto i = first; i < last; i++) {
+    use(chunk.records[i].val);
+  }
+  for (auto i = begin; i < end; i++) {
+    for (const auto &val : reductions[i].values) {
+      use(val);
+    }
+  }
+
+  std::vector<Value> results(end - begin);
+  auto resolve = [&](Value &val) {
+    if (auto ref = val.get_if<Reduction::Ref>()) {
+      auto i = ref->index - begin;
+      if (--uses[i]) {
+        val = results[i];
+      } else {
+        val = std::move(results[i]);
+      }
+    }
+  };
+
+  auto next = begin;
+  for (auto i = first; i < last; i++) {
+    auto &record = chunk.records[i];
+    const auto to = i + 1 < chunk.records.size()
+                        ? chunk.records[i + 1].reductions
+                        : reductions.size();
+    for (; next < to; next++) {
+      auto &r = reductions[next];
+      auto &vs = c.push();
+      auto se = scope_exit([&]() { c.pop(); });
+      for (auto &val : r.values) {
+        resolve(val);
+        vs.emplace_back(std::move(val));
+      }
+      vs.tags = std::move(r.tags);
+      vs.tokens = std::move(r.tokens);
+      vs.sv_ = r.sv;
+      vs.choice_count_ = r.choice_count;
+      vs.choice_ = r.choice;
+      vs.rule_ = r.rule;
+      try {
+        results[next - begin] = r.rule->action(vs, dt);
+      } catch (const parse_error &e) {
+        if (e.what() && c.error_info.message_pos < r.sv.data()) {
+          c.error_info.message_pos = r.sv.data();
+          c.error_info.message = e.what();
+        }
+        return false;
+      }
+    }
+    resolve(record.val);
+    handler_(record.val, record.pos, record.len);
+  }
+  return true;
+}
+
+/*-----------------------------------------------------------------------------
+ *  ParseCache
+ *---------------------------------------------------------------------------*/
+
+// Keeps the results of recent successful parses, so that parsing the same
+// text again does not match the grammar. A parse's actions are put off (see
+// Reduction) and kept with a copy of its text; they are called once the
+// text has matched, from the cache or not, in the order the parse would
+// have called them. Results are dropped least recently used first once they
+// take up more than the byte budget, which counts the texts and reductions.
+//
+// Packrat parsing is not used. Every action the parse would call is replayed,
+// those of matches that were backtracked over included, and an action that
+// rejects its match (with parse_error) fails the parse. Results must be
+// cleared when actions are changed.
+class ParseCache {
+public:
+  ParseCache(const parser &p, size_t budget) : budget_(budget), log_(p.log) {
+    if (p.grammar_ != nullptr) { start_ = &(*p.grammar_)[p.start_]; }
+  }
+
+  operator bool() const { return start_ != nullptr; }
+
+  bool parse(std::string_view sv, std::any &dt, Value &val,
+             const char *path = nullptr);
+
+  template <typename T>
+  bool parse(std::string_view sv, T &val, const char *path = nullptr) {
+    std::any dt;
+    Value result;
+    if (!parse(sv, dt, result, path)) { return false; }
+    if (result.has_value()) { val = result.get<T>(); }
+    return true;
+  }
+
+  void clear() {
+    index_.clear();
+    entries_.clear();
+    bytes_ = 0;
+  }
+
+  // Parses whose result was found in the cache, and those whose was not.
+  size_t hits() const { return hits_; }
+  size_t misses() const { return misses_; }
+
+  size_t bytes() const { return bytes_; }
+  size_t size() const { return entries_.size(); }
+
+private:
+  struct Entry {
+    std::string text;
+    std::vector<Reduction> reductions; // (all of the parse's, in order)
+    Value val;
+    size_t bytes;
+  };
+
+  using Entries = std::list<std::unique_ptr<Entry>>;
+
+  bool record(Entry &entry, const char *path) const;
+
+  bool replay(const Entry &entry, std::any &dt, Value &val,
+              const char *path) const;
+
+  const Definition *start_ = nullptr;
+  size_t budget_;
+  Log log_;
+
+  Entries entries_; // most recently used first
+  std::unordered_map<std::string_view, Entries::iterator> index_;
+  size_t bytes_ = 0;
+  size_t hits_ = 0;
+  size_t misses_ = 0;
 };
 
+inline bool ParseCache::parse(std::string_view sv, std::any &dt, Value &val,
+                              const char *path) {
+  if (!start_) { return false; }
+
+  auto it = index_.find(sv);
+  if (it != index_.end()) {
+    hits_++;
+    entries_.splice(entries_.begin(), entries_, it->second);
+    return replay(*entries_.front(), dt, val, path);
+  }
+
+  misses_++;
+  auto entry = std::make_unique<Entry>();
+  entry->text.assign(sv.data(), sv.size());
+  if (!record(*entry, path)) { return false; }
+
+  const auto &e = *entry;
+  if (e.bytes <= budget_) {
+    entries_.push_front(std::move(entry));
+    index_.emplace(e.text, entries_.begin());
+    bytes_ += e.bytes;
+    while (bytes_ > budget_) {
+      auto &last = *entries_.back();
+      bytes_ -= last.bytes;
+      index_.erase(last.text);
+      entries_.pop_back();
+    }
+  }
+  return replay(e, dt, val, path);
+}
+
+// Matches the entry's text, keeping every reduction the parse made.
+inline bool ParseCache::record(Entry &entry, const char *path) const {
+  const auto &start = *start_;
+  start.initialize_definition_ids();
+
+  std::shared_ptr<Ope> ope = start.holder_;
+  if (start.whitespaceOpe) {
+    ope = std::make_shared<Sequence>(start.whitespaceOpe, ope);
+  }
+
+  const auto s = entry.text.data();
+  const auto n = entry.text.size();
+  Context c(path, s, n, start.definition_ids_.size(), start.whitespaceOpe,
+            start.wordOpe, false, start.tracer_enter, start.tracer_leave,
+            log_);
+  c.max_depth = start.max_depth;
+  c.stack_guard = start.stack_guard;
+  c.instrument(start.instrumentation, start.profile, start.trace);
+  c.uses_captures = start.uses_captures_;
+  std::vector<Reduction> reductions;
+  c.reductions = &reductions;
+  std::any dt;
+
+  SemanticValues vs;
+  auto len = ope->parse(s, n, vs, c, dt);
+  auto ret = success(len) && len == n;
+  if (log_ && !ret) { c.error_info.output_log(log_, s, n); }
+  if (!ret || c.recovered) { return false; }
+  if (!vs.empty()) { entry.val = std::move(vs.front()); }
+
+  // Every reduction is kept, as the parse would have called all of their
+  // actions: also those whose values are dropped by a rule without one.
+  auto &kept = entry.reductions;
+  kept = std::move(reductions);
+
+  entry.bytes = sizeof(Entry) + entry.text.size() +
+                kept.size() * sizeof(Reduction);
+  for (const auto &r : kept) {
+    entry.bytes += r.values.size() * sizeof(Value) +
+                   r.tags.size() * sizeof(unsigned int) +
+                   r.tokens.size() * sizeof(std::string_view);
+  }
+  return true;
+}
+
+// Calls the actions of the entry's reductions, leaving it unchanged.
+inline bool ParseCache::replay(const Entry &entry, std::any &dt, Value &val,
+                               const char *path) const {
+  const auto &start = *start_;
+  const auto s = entry.text.data();
+  const auto n = entry.text.size();
+  Context c(path, s, n, start.definition_ids_.size(), start.whitespaceOpe,
+            start.wordOpe, false, nullptr, nullptr, log_);
+
+  std::vector<Value> results(entry.reductions.size());
+  auto resolve = [&](const Value &val) {
+    auto ref = val.get_if<Reduction::Ref>();
+    return ref ? results[ref->index] : val;
+  };
+
+  for (size_t i = 0; i < entry.reductions.size(); i++) {
+    const auto &r = entry.reductions[i];
+    auto &vs = c.push();
+    auto se = scope_exit([&]() { c.pop(); });
+    for (const auto &v : r.values) {
+      vs.emplace_back(resolve(v));
+    }
+    vs.tags = r.tags;
+    vs.tokens = r.tokens;
+    vs.sv_ = r.sv;
+    vs.choice_count_ = r.choice_count;
+    vs.choice_ = r.choice;
+    vs.rule_ = r.rule;
+    try {
+      results[i] = r.rule->action(vs, dt);
+    } catch (const parse_error &e) {
+      if (log_) {
+        c.error_info.message_pos = r.sv.data();
+        c.error_info.message = e.what();
+        c.error_info.output_log(log_, s, n);
+      }
+      return false;
+    }
+  }
+
+  val = resolve(entry.val);
+  return true;
+}
+
 } // namespace peg
@@ -48,11 +48,62 @@ global._peggml_clear_error = external_define(dllName, "peggml_clear_error", call
 global._peggml_set_stack_size = external_define(dllName, "peggml_set_stack_size", callType, ty_real, 1, ty_real);
 global._peggml_stack_current_depth = external_define(dllName, "peggml_stack_current_depth", callType, ty_real, 0);
 global._peggml_estimate_stack_usage = external_define(dllName, "peggml_estimate_stack_usage", callType, ty_real, 0);
+global._peggml_memory_get_callstack_reserved = external_define(dllName, "peggml_memory_get_callstack_reserved", callType, ty_real, 0);
+global._peggml_memory_get_callstack_committed = external_define(dllName, "peggml_memory_get_callstack_committed", callType, ty_real, 0);
+global._peggml_memory_get_packrat_bytes = external_define(dllName, "peggml_memory_get_packrat_bytes", callType, ty_real, 0);
+global._peggml_memory_get_value_stack_frames = external_define(dllName, "peggml_memory_get_value_stack_frames", callType, ty_real, 0);
+global._peggml_memory_get_value_stack_bytes = external_define(dllName, "peggml_memory_get_value_stack_bytes", callType, ty_real, 0);
+global._peggml_memory_get_capture_scope_bytes = external_define(dllName, "peggml_memory_get_capture_scope_bytes", callType, ty_real, 0);
+global._peggml_memory_get_memo_bytes = external_define(dllName, "peggml_memory_get_memo_bytes", callType, ty_real, 0);
+global._peggml_memory_get_parse_cache_bytes = external_define(dllName, "peggml_memory_get_parse_cache_bytes", callType, ty_real, 0);
+global._peggml_memory_get_grammar_bytes = external_define(dllName, "peggml_memory_get_grammar_bytes", callType, ty_real, 1, ty_real);
+global._peggml_memory_get_string_buffer_bytes = external_define(dllName, "peggml_memory_get_string_buffer_bytes", callType, ty_real, 0);
+global._peggml_get_memory_stats = external_define(dllName, "peggml_get_memory_stats", callType, ty_string, 0);
 global._peggml_parser_create = external_define(dllName, "peggml_parser_create", callType, ty_real, 1, ty_string);
+global._peggml_parser_create_static = external_define(dllName, "peggml_parser_create_static", callType, ty_real, 1, ty_string);
 global._peggml_parser_destroy = external_define(dllName, "peggml_parser_destroy", callType, ty_real, 1, ty_real);
 global._peggml_parser_enable_packrat = external_define(dllName, "peggml_parser_enable_packrat", callType, ty_real, 0);
+global._peggml_parser_set_max_depth = external_define(dllName, "peggml_parser_set_max_depth", callType, ty_real, 2, ty_real, ty_real);
+global._peggml_parser_enable_parse_cache = external_define(dllName, "peggml_parser_enable_parse_cache", callType, ty_real, 2, ty_real, ty_real);
+global._peggml_parser_get_cache_hits = external_define(dllName, "peggml_parser_get_cache_hits", callType, ty_real, 1, ty_real);
+global._peggml_parser_get_cache_misses = external_define(dllName, "peggml_parser_get_cache_misses", callType, ty_real, 1, ty_real);
+global._peggml_parser_analyze = external_define(dllName, "peggml_parser_analyze", callType, ty_string, 1, ty_real);
+global._peggml_parser_enable_profile = external_define(dllName, "peggml_parser_enable_profile", callType, ty_real, 2, ty_real, ty_real);
+global._peggml_profile_get_rule_count = external_define(dllName, "peggml_profile_get_rule_count", callType, ty_real, 1, ty_real);
+global._peggml_profile_get_name = external_define(dllName, "peggml_profile_get_name", callType, ty_string, 2, ty_real, ty_real);
+global._peggml_profile_get_invocations = external_define(dllName, "peggml_profile_get_invocations", callType, ty_real, 2, ty_real, ty_real);
+global._peggml_profile_get_successes = external_define(dllName, "peggml_profile_get_successes", callType, ty_real, 2, ty_real, ty_real);
+global._peggml_profile_get_failures = external_define(dllName, "peggml_profile_get_failures", callType, ty_real, 2, ty_real, ty_real);
+global._peggml_profile_get_memo_hits = external_define(dllName, "peggml_profile_get_memo_hits", callType, ty_real, 2, ty_real, ty_real);
+global._peggml_profile_get_memo_misses = external_define(dllName, "peggml_profile_get_memo_misses", callType, ty_real, 2, ty_real, ty_real);
+global._peggml_profile_get_bytes = external_define(dllName, "peggml_profile_get_bytes", callType, ty_real, 2, ty_real, ty_real);
+global._peggml_profile_get_inclusive_time = external_define(dllName, "peggml_profile_get_inclusive_time", callType, ty_real, 2, ty_real, ty_real);
+global._peggml_profile_get_exclusive_time = external_define(dllName, "peggml_profile_get_exclusive_time", callType, ty_real, 2, ty_real, ty_real);
+global._peggml_profile_dump_csv = external_define(dllName, "peggml_profile_dump_csv", callType, ty_string, 1, ty_real);
+global._peggml_profile_dump_json = external_define(dllName, "peggml_profile_dump_json", callType, ty_string, 1, ty_real);
+global._peggml_parser_enable_trace = external_define(dllName, "peggml_parser_enable_trace", callType, ty_real, 2, ty_real, ty_real);
+global._peggml_trace_get_event_count = external_define(dllName, "peggml_trace_get_event_count", callType, ty_real, 1, ty_real);
+global._peggml_trace_get_dropped = external_define(dllName, "peggml_trace_get_dropped", callType, ty_real, 1, ty_real);
+global._peggml_trace_clear = external_define(dllName, "peggml_trace_clear", callType, ty_real, 1, ty_real);
+global._peggml_trace_save = external_define(dllName, "peggml_trace_save", callType, ty_real, 2, ty_real, ty_string);
 global._peggml_parser_set_symbol_id = external_define(dllName, "peggml_parser_set_symbol_id", callType, ty_real, 3, ty_real, ty_string, ty_real);
 global._peggml_parse_begin = external_define(dllName, "peggml_parse_begin", callType, ty_real, 2, ty_real, ty_string);
+global._peggml_session_create = external_define(dllName, "peggml_session_create", callType, ty_real, 1, ty_real);
+global._peggml_session_destroy = external_define(dllName, "peggml_session_destroy", callType, ty_real, 1, ty_real);
+global._peggml_parse_edit = external_define(dllName, "peggml_parse_edit", callType, ty_real, 4, ty_real, ty_real, ty_real, ty_string);
+global._peggml_stream_create = external_define(dllName, "peggml_stream_create", callType, ty_real, 2, ty_real, ty_real);
+global._peggml_stream_destroy = external_define(dllName, "peggml_stream_destroy", callType, ty_real, 1, ty_real);
+global._peggml_stream_feed = external_define(dllName, "peggml_stream_feed", callType, ty_real, 2, ty_real, ty_string);
+global._peggml_stream_finish = external_define(dllName, "peggml_stream_finish", callType, ty_real, 1, ty_real);
+global._peggml_stream_get_element_count = external_define(dllName, "peggml_stream_get_element_count", callType, ty_real, 1, ty_real);
+global._peggml_stream_get_element_uuid = external_define(dllName, "peggml_stream_get_element_uuid", callType, ty_real, 2, ty_real, ty_real);
+global._peggml_stream_get_offset = external_define(dllName, "peggml_stream_get_offset", callType, ty_real, 1, ty_real);
+global._peggml_parallel_create = external_define(dllName, "peggml_parallel_create", callType, ty_real, 4, ty_real, ty_string, ty_string, ty_real);
+global._peggml_parallel_destroy = external_define(dllName, "peggml_parallel_destroy", callType, ty_real, 1, ty_real);
+global._peggml_parallel_parse_begin = external_define(dllName, "peggml_parallel_parse_begin", callType, ty_real, 2, ty_real, ty_string);
+global._peggml_parallel_get_element_count = external_define(dllName, "peggml_parallel_get_element_count", callType, ty_real, 1, ty_real);
+global._peggml_parallel_get_element_uuid = external_define(dllName, "peggml_parallel_get_element_uuid", callType, ty_real, 2, ty_real, ty_real);
+global._peggml_parallel_get_reparsed = external_define(dllName, "peggml_parallel_get_reparsed", callType, ty_real, 1, ty_real);
 global._peggml_parse_next = external_define(dllName, "peggml_parse_next", callType, ty_real, 0);
 global._peggml_parse_elt_get_uuid = external_define(dllName, "peggml_parse_elt_get_uuid", callType, ty_real, 0);
 global._peggml_parse_elt_get_string = external_define(dllName, "peggml_parse_elt_get_string", callType, ty_string, 0);
@@ -67,6 +118,22 @@ global._peggml_parse_elt_get_token_offset = external_define(dllName, "peggml_par
 global._peggml_parse_elt_get_token_string = external_define(dllName, "peggml_parse_elt_get_token_string", callType, ty_string, 1, ty_real);
 global._peggml_parse_elt_get_token_number = external_define(dllName, "peggml_parse_elt_get_token_number", callType, ty_real, 0);
 global._peggml_get_root_uuid = external_define(dllName, "peggml_get_root_uuid", callType, ty_real, 0);
+global._peggml_parser_enable_flat_ast = external_define(dllName, "peggml_parser_enable_flat_ast", callType, ty_real, 1, ty_real);
+global._peggml_parse_flat_ast = external_define(dllName, "peggml_parse_flat_ast", callType, ty_real, 2, ty_real, ty_string);
+global._peggml_ast_cache_set_directory = external_define(dllName, "peggml_ast_cache_set_directory", callType, ty_real, 1, ty_string);
+global._peggml_parse_cached = external_define(dllName, "peggml_parse_cached", callType, ty_real, 2, ty_real, ty_string);
+global._peggml_ast_is_cached = external_define(dllName, "peggml_ast_is_cached", callType, ty_real, 0);
+global._peggml_ast_get_count = external_define(dllName, "peggml_ast_get_count", callType, ty_real, 0);
+global._peggml_ast_get_rule_name = external_define(dllName, "peggml_ast_get_rule_name", callType, ty_string, 1, ty_real);
+global._peggml_ast_get_original_rule_name = external_define(dllName, "peggml_ast_get_original_rule_name", callType, ty_string, 1, ty_real);
+global._peggml_ast_optimize = external_define(dllName, "peggml_ast_optimize", callType, ty_real, 0);
+global._peggml_ast_get_offset = external_define(dllName, "peggml_ast_get_offset", callType, ty_real, 1, ty_real);
+global._peggml_ast_get_length = external_define(dllName, "peggml_ast_get_length", callType, ty_real, 1, ty_real);
+global._peggml_ast_get_string = external_define(dllName, "peggml_ast_get_string", callType, ty_string, 1, ty_real);
+global._peggml_ast_get_choice = external_define(dllName, "peggml_ast_get_choice", callType, ty_real, 1, ty_real);
+global._peggml_ast_get_parent = external_define(dllName, "peggml_ast_get_parent", callType, ty_real, 1, ty_real);
+global._peggml_ast_get_first_child = external_define(dllName, "peggml_ast_get_first_child", callType, ty_real, 1, ty_real);
+global._peggml_ast_get_next_sibling = external_define(dllName, "peggml_ast_get_next_sibling", callType, ty_real, 1, ty_real);
 global._peggml_next_symbol_id = 1
 
 #define peggml_version
@@ -96,6 +163,60 @@ return external_call(global._peggml_stack_current_depth)
 peggml_init()
 return external_call(global._peggml_estimate_stack_usage)
 
+#define peggml_memory_get_callstack_reserved
+/// peggml_memory_get_callstack_reserved()
+/// returns the bytes allocated for the parsing stack and the segments deep recursion spills onto.
+peggml_init()
+return external_call(global._peggml_memory_get_callstack_reserved)
+
+#define peggml_memory_get_callstack_committed
+/// peggml_memory_get_callstack_committed()
+/// returns the bytes of the parsing stack used so far, and of its segments.
+peggml_init()
+return external_call(global._peggml_memory_get_callstack_committed)
+
+#define peggml_memory_get_packrat_bytes
+/// peggml_memory_get_packrat_bytes()
+/// returns the bytes of packrat results held by the last parse.
+peggml_init()
+return external_call(global._peggml_memory_get_packrat_bytes)
+
+#define peggml_memory_get_value_stack_frames
+peggml_init()
+return external_call(global._peggml_memory_get_value_stack_frames)
+
+#define peggml_memory_get_value_stack_bytes
+peggml_init()
+return external_call(global._peggml_memory_get_value_stack_bytes)
+
+#define peggml_memory_get_capture_scope_bytes
+peggml_init()
+return external_call(global._peggml_memory_get_capture_scope_bytes)
+
+#define peggml_memory_get_memo_bytes
+/// peggml_memory_get_memo_bytes()
+/// returns the bytes of rule results kept by all sessions.
+peggml_init()
+return external_call(global._peggml_memory_get_memo_bytes)
+
+#define peggml_memory_get_parse_cache_bytes
+peggml_init()
+return external_call(global._peggml_memory_get_parse_cache_bytes)
+
+#define peggml_memory_get_grammar_bytes
+/// peggml_memory_get_grammar_bytes(parser)
+return external_call(global._peggml_memory_get_grammar_bytes, argument0)
+
+#define peggml_memory_get_string_buffer_bytes
+peggml_init()
+return external_call(global._peggml_memory_get_string_buffer_bytes)
+
+#define peggml_get_memory_stats
+/// peggml_get_memory_stats()
+/// returns the memory held by peggml, in bytes, as a JSON object.
+peggml_init()
+return external_call(global._peggml_get_memory_stats)
+
 #define peggml_parser_create
 peggml_init()
 var handle = external_call(global._peggml_parser_create, argument0)
@@ -105,6 +226,15 @@ if (handle >= 0)
 }
 return handle
 
+#define peggml_parser_create_static
+peggml_init()
+var handle = external_call(global._peggml_parser_create_static, argument0)
+if (handle >= 0)
+{
+    global._peggml_handler_map[handle] = ds_map_create()
+}
+return handle
+
 #define peggml_parser_destroy
 var handle = argument0
 if (handle < 0) return 0
@@ -115,12 +245,174 @@ return external_call(global._peggml_parser_destroy, handle)
 #define peggml_parser_enable_packrat
 return external_call(global._peggml_parser_enable_packrat, argument0)
 
+#define peggml_parser_set_max_depth
+return external_call(global._peggml_parser_set_max_depth, argument0, argument1)
+
+#define peggml_parser_enable_parse_cache
+/// peggml_parser_enable_parse_cache(parser, budget)
+/// keeps the elements of recently parsed strings, up to about budget bytes, so peggml_parse
+/// runs the handlers for a repeated string without parsing it again (0 turns this off.)
+return external_call(global._peggml_parser_enable_parse_cache, argument0, argument1)
+
+#define peggml_parser_get_cache_hits
+return external_call(global._peggml_parser_get_cache_hits, argument0)
+
+#define peggml_parser_get_cache_misses
+return external_call(global._peggml_parser_get_cache_misses, argument0)
+
+#define peggml_parser_analyze
+/// peggml_parser_analyze(parser)
+/// returns the performance hazards in the parser's grammar, one per line as "rule: kind: message".
+return external_call(global._peggml_parser_analyze, argument0)
+
+#define peggml_parser_enable_profile
+/// peggml_parser_enable_profile(parser, mode)
+/// counts and times the invocations of each rule in the parser's parses (mode 1), or only
+/// counts them (mode 2; 0 turns this off.)
+return external_call(global._peggml_parser_enable_profile, argument0, argument1)
+
+#define peggml_profile_get_rule_count
+/// peggml_profile_get_rule_count(parser)
+/// returns the number of rules invoked since profiling was turned on; their indices start at 0.
+return external_call(global._peggml_profile_get_rule_count, argument0)
+
+#define peggml_profile_get_name
+/// peggml_profile_get_name(parser, index)
+return external_call(global._peggml_profile_get_name, argument0, argument1)
+
+#define peggml_profile_get_invocations
+return external_call(global._peggml_profile_get_invocations, argument0, argument1)
+
+#define peggml_profile_get_successes
+return external_call(global._peggml_profile_get_successes, argument0, argument1)
+
+#define peggml_profile_get_failures
+return external_call(global._peggml_profile_get_failures, argument0, argument1)
+
+#define peggml_profile_get_memo_hits
+return external_call(global._peggml_profile_get_memo_hits, argument0, argument1)
+
+#define peggml_profile_get_memo_misses
+return external_call(global._peggml_profile_get_memo_misses, argument0, argument1)
+
+#define peggml_profile_get_bytes
+return external_call(global._peggml_profile_get_bytes, argument0, argument1)
+
+#define peggml_profile_get_inclusive_time
+/// peggml_profile_get_inclusive_time(parser, index)
+/// returns the microseconds spent in the rule, including the rules it invokes.
+return external_call(global._peggml_profile_get_inclusive_time, argument0, argument1)
+
+#define peggml_profile_get_exclusive_time
+/// peggml_profile_get_exclusive_time(parser, index)
+/// returns the microseconds spent in the rule, excluding the rules it invokes.
+return external_call(global._peggml_profile_get_exclusive_time, argument0, argument1)
+
+#define peggml_profile_dump_csv
+return external_call(global._peggml_profile_dump_csv, argument0)
+
+#define peggml_profile_dump_json
+return external_call(global._peggml_profile_dump_json, argument0)
+
+#define peggml_parser_enable_trace
+/// peggml_parser_enable_trace(parser, capacity)
+/// records the latest capacity rule invocations of the parser's parses (0 turns this off.)
+return external_call(global._peggml_parser_enable_trace, argument0, argument1)
+
+#define peggml_trace_get_event_count
+return external_call(global._peggml_trace_get_event_count, argument0)
+
+#define peggml_trace_get_dropped
+return external_call(global._peggml_trace_get_dropped, argument0)
+
+#define peggml_trace_clear
+return external_call(global._peggml_trace_clear, argument0)
+
+#define peggml_trace_save
+/// peggml_trace_save(parser, path)
+/// writes the recorded invocations as a Chrome trace, which can be opened in Perfetto.
+return external_call(global._peggml_trace_save, argument0, argument1)
+
 #define peggml_parser_set_symbol_id
 return external_call(global._peggml_parser_set_symbol_id, argument0, argument1, argument2)
 
 #define peggml_parse_begin
 return external_call(global._peggml_parse_begin, argument0, argument1)
 
+#define peggml_session_create
+/// peggml_session_create(parser)
+/// creates a session for a text that is edited between parses (see peggml_session_update).
+var session = external_call(global._peggml_session_create, argument0)
+if (session >= 0)
+{
+    global._peggml_session_parser[session] = argument0
+    global._peggml_session_sv_map[session] = ds_map_create()
+}
+return session
+
+#define peggml_session_destroy
+var session = argument0
+if (session < 0) return 0
+ds_map_destroy(global._peggml_session_sv_map[session])
+global._peggml_session_sv_map[session] = -1
+return external_call(global._peggml_session_destroy, session)
+
+#define peggml_parse_edit
+return external_call(global._peggml_parse_edit, argument0, argument1, argument2, argument3)
+
+#define peggml_stream_create
+/// peggml_stream_create(parser, max_buffer)
+/// creates a stream, parsing input as it arrives in chunks (see peggml_stream_parse).
+var stream = external_call(global._peggml_stream_create, argument0, argument1)
+if (stream >= 0)
+{
+    global._peggml_stream_parser[stream] = argument0
+}
+return stream
+
+#define peggml_stream_destroy
+return external_call(global._peggml_stream_destroy, argument0)
+
+#define peggml_stream_feed
+return external_call(global._peggml_stream_feed, argument0, argument1)
+
+#define peggml_stream_finish
+return external_call(global._peggml_stream_finish, argument0)
+
+#define peggml_stream_get_element_count
+return external_call(global._peggml_stream_get_element_count, argument0)
+
+#define peggml_stream_get_element_uuid
+return external_call(global._peggml_stream_get_element_uuid, argument0, argument1)
+
+#define peggml_stream_get_offset
+return external_call(global._peggml_stream_get_offset, argument0)
+
+#define peggml_parallel_create
+/// peggml_parallel_create(parser, split_rule, resync, threads)
+/// creates a parser splitting text into records on several threads (see peggml_parallel_parse).
+var parallel = external_call(global._peggml_parallel_create, argument0, argument1, argument2, argument3)
+if (parallel >= 0)
+{
+    global._peggml_parallel_parser[parallel] = argument0
+}
+return parallel
+
+#define peggml_parallel_destroy
+return external_call(global._peggml_parallel_destroy, argument0)
+
+#define peggml_parallel_parse_begin
+return external_call(global._peggml_parallel_parse_begin, argument0, argument1)
+
+#define peggml_parallel_get_element_count
+return external_call(global._peggml_parallel_get_element_count, argument0)
+
+#define peggml_parallel_get_element_uuid
+return external_call(global._peggml_parallel_get_element_uuid, argument0, argument1)
+
+#define peggml_parallel_get_reparsed
+return external_call(global._peggml_parallel_get_reparsed, argument0)
+
 #define peggml_parse_next
 return external_call(global._peggml_parse_next)
 
@@ -174,6 +466,59 @@ return external_call(global._peggml_parse_elt_get_token_number)
 #define peggml_get_root_uuid
 return external_call(global._peggml_get_root_uuid)
 
+#define peggml_parser_enable_flat_ast
+return external_call(global._peggml_parser_enable_flat_ast, argument0)
+
+#define peggml_parse_flat_ast
+/// peggml_parse_flat_ast(parser, string)
+/// parses string into a flat tree, read with the peggml_ast_* scripts (returns 0 on success.)
+return external_call(global._peggml_parse_flat_ast, argument0, argument1)
+
+#define peggml_ast_cache_set_directory
+/// peggml_ast_cache_set_directory(path)
+return external_call(global._peggml_ast_cache_set_directory, argument0)
+
+#define peggml_parse_cached
+/// peggml_parse_cached(parser, path)
+/// as peggml_parse_flat_ast on the file at path, reading the tree from the cache directory if unchanged.
+return external_call(global._peggml_parse_cached, argument0, argument1)
+
+#define peggml_ast_is_cached
+return external_call(global._peggml_ast_is_cached)
+
+#define peggml_ast_get_count
+return external_call(global._peggml_ast_get_count)
+
+#define peggml_ast_get_rule_name
+return external_call(global._peggml_ast_get_rule_name, argument0)
+
+#define peggml_ast_get_original_rule_name
+return external_call(global._peggml_ast_get_original_rule_name, argument0)
+
+#define peggml_ast_optimize
+return external_call(global._peggml_ast_optimize)
+
+#define peggml_ast_get_offset
+return external_call(global._peggml_ast_get_offset, argument0)
+
+#define peggml_ast_get_length
+return external_call(global._peggml_ast_get_length, argument0)
+
+#define peggml_ast_get_string
+return external_call(global._peggml_ast_get_string, argument0)
+
+#define peggml_ast_get_choice
+return external_call(global._peggml_ast_get_choice, argument0)
+
+#define peggml_ast_get_parent
+return external_call(global._peggml_ast_get_parent, argument0)
+
+#define peggml_ast_get_first_child
+return external_call(global._peggml_ast_get_first_child, argument0)
+
+#define peggml_ast_get_next_sibling
+return external_call(global._peggml_ast_get_next_sibling, argument0)
+
 #define peggml_parser_set_handler
 /// peggml_parser_set_handler(parser, symbol:string, script, args...)
 /// sets the given symbol to be handled by the given script.
@@ -204,10 +549,98 @@ handler_map[? symbol_id] = args
 var parser = argument0
 
 global._peggml_sv_map = ds_map_create();
-var handler_map = global._peggml_handler_map[parser]
 
 if (peggml_parse_begin(parser, argument1)) exit
 
+var value = _peggml_parse_run(parser)
+
+ds_map_destroy(global._peggml_sv_map)
+
+return value
+
+#define peggml_session_update
+/// peggml_session_update(session, offset, removed_len, inserted_text)
+/// replaces removed_len bytes at byte offset of the session's text with inserted_text,
+/// then reparses it, returning root's semantic value, or undefined on error.
+/// Only elements touching the edit are passed to their handlers again;
+/// the values of unchanged elements are kept from earlier updates.
+var session = argument0
+
+global._peggml_sv_map = global._peggml_session_sv_map[session]
+
+if (peggml_parse_edit(session, argument1, argument2, argument3)) exit
+
+return _peggml_parse_run(global._peggml_session_parser[session])
+
+#define peggml_stream_parse
+/// peggml_stream_parse(stream, chunk)
+/// feeds chunk to the stream (or ends its input, if chunk is undefined), returning
+/// an array of the semantic values of the elements completed, or undefined on error.
+var stream = argument0
+
+global._peggml_sv_map = ds_map_create();
+
+if (is_undefined(argument1))
+{
+    if (peggml_stream_finish(stream)) exit
+}
+else
+{
+    if (peggml_stream_feed(stream, argument1)) exit
+}
+
+peggml_clear_error()
+_peggml_parse_run(global._peggml_stream_parser[stream])
+
+var values = undefined
+if (peggml_error_str() == "")
+{
+    var count = peggml_stream_get_element_count(stream)
+    values = array_create(count)
+    for (var i = 0; i < count; ++i)
+    {
+        values[i] = global._peggml_sv_map[? peggml_stream_get_element_uuid(stream, i)]
+    }
+}
+
+ds_map_destroy(global._peggml_sv_map)
+
+return values
+
+#define peggml_parallel_parse
+/// peggml_parallel_parse(parallel, string)
+/// parses string as records on several threads, returning an array of the
+/// records' semantic values, or undefined on error.
+var parallel = argument0
+
+global._peggml_sv_map = ds_map_create();
+
+if (peggml_parallel_parse_begin(parallel, argument1)) exit
+
+peggml_clear_error()
+_peggml_parse_run(global._peggml_parallel_parser[parallel])
+
+var values = undefined
+if (peggml_error_str() == "")
+{
+    var count = peggml_parallel_get_element_count(parallel)
+    values = array_create(count)
+    for (var i = 0; i < count; ++i)
+    {
+        values[i] = global._peggml_sv_map[? peggml_parallel_get_element_uuid(parallel, i)]
+    }
+}
+
+ds_map_destroy(global._peggml_sv_map)
+
+return values
+
+#define _peggml_parse_run
+/// _peggml_parse_run(parser)
+/// runs the handlers for the parse in progress, storing values in global._peggml_sv_map.
+var parser = argument0
+var handler_map = global._peggml_handler_map[parser]
+
 var value;
 while (true)
 {
@@ -259,8 +692,4 @@ while (true)
     global._peggml_sv_map[? uuid] = value
 }
 
-value = global._peggml_sv_map[? peggml_get_root_uuid()]
-
-ds_map_destroy(global._peggml_sv_map)
-
-return value
\ No newline at end of file
+return global._peggml_sv_map[? peggml_get_root_uuid()]
\ No newline at end of file
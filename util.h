@@ -2,6 +2,7 @@
 
 #include <string>
 #include <cstdio>
+#include <cstdint>
 #include <stdarg.h>
 
 // defer
@@ -33,15 +34,25 @@ inline std::string strprintf(const char* fmt, ...)
 
     #ifdef __GNUC__
         // note: this line requires GCC or C99.
-        char buff[n];
+        char buff[n + 1];
     #else
-        char* buff = new char[n];
+        char* buff = new char[n + 1];
         defer(delete[] buff);
     #endif
 
         va_start(args, fmt);
-        vsprintf(buff, fmt, args);
+        vsnprintf(buff, n + 1, fmt, args);
         va_end(args);
 
         return buff;
 }
+
+// 64-bit FNV-1a hash, the same on every platform and run (for keys kept on disk.)
+inline uint64_t fnv1a(const char* s, size_t n, uint64_t h = 14695981039346656037ull)
+{
+	for (size_t i = 0; i < n; ++i)
+	{
+		h = (h ^ static_cast<unsigned char>(s[i])) * 1099511628211ull;
+	}
+	return h;
+}